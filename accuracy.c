@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "accuracy.h"
+#include "vmath.h"
+
+#define UNIT_53 1.1102230246251565e-16
+
+/* Errors in units of the last place of 'want', in double and in float */
+static double ulp_error(double got, double want)
+{
+    int exponent;
+
+    frexp(want, &exponent);
+    return fabs(got - want) / ldexp(1.0, exponent - 53);
+}
+
+static double ulp_error_f32(float got, float want)
+{
+    int exponent;
+
+    frexp(want, &exponent);
+    return fabs((double) got - (double) want) / ldexp(1.0, exponent - 24);
+}
+
+bool check_vmath(FILE* out, uint64_t points)
+{
+    struct {
+        char* name;
+        void (*kernel)(double*, double*, uint64_t);
+        void (*kernel_f32)(float*, float*, uint64_t);
+        double (*libm)(double);
+        double range;
+        double bound;
+    } checks[] = {
+        {"sin", vec_sin, NULL, sin, 4.0, 1.0},
+        {"sin", vec_sin, NULL, sin, VMATH_REDUCE_LIMIT, 2.0},
+        {"cos", vec_cos, NULL, cos, 4.0, 1.0},
+        {"cos", vec_cos, NULL, cos, VMATH_REDUCE_LIMIT, 2.0},
+        {"tan", vec_tan, NULL, tan, VMATH_REDUCE_LIMIT, 4.0},
+        {"sin_f32", NULL, vec_sin_f32, sin, VMATH_REDUCE_LIMIT, 2.0},
+        {"cos_f32", NULL, vec_cos_f32, cos, VMATH_REDUCE_LIMIT, 2.0},
+        {"tan_f32", NULL, vec_tan_f32, tan, VMATH_REDUCE_LIMIT, 4.0}
+    };
+    double in[ACCURACY_BLOCK];
+    double got[ACCURACY_BLOCK];
+    float in_f32[ACCURACY_BLOCK];
+    float got_f32[ACCURACY_BLOCK];
+    double error;
+    double worst;
+    double worst_x;
+    uint64_t state;
+    uint64_t done;
+    uint64_t block;
+    uint64_t i;
+    uint32_t c;
+    bool failed;
+
+    failed = false;
+    for (c = 0; c < sizeof(checks) / sizeof(checks[0]); c++) {
+        /* The same points on every run, from a 64 bit LCG */
+        state = 0x9e3779b97f4a7c15UL;
+        worst = 0.0;
+        worst_x = 0.0;
+
+        for (done = 0; done < points; done += block) {
+            block = (points - done < ACCURACY_BLOCK) ? points - done : ACCURACY_BLOCK;
+            for (i = 0; i < block; i++) {
+                state = state * 6364136223846793005UL + 1442695040888963407UL;
+                in[i] = ((double) (state >> 11) * (2.0 * UNIT_53) - 1.0) * checks[c].range;
+                in_f32[i] = (float) in[i];
+            }
+
+            if (checks[c].kernel != NULL) {
+                checks[c].kernel(got, in, block);
+                for (i = 0; i < block; i++) {
+                    error = ulp_error(got[i], checks[c].libm(in[i]));
+                    if (error > worst) {
+                        worst = error;
+                        worst_x = in[i];
+                    }
+                }
+            } else {
+                checks[c].kernel_f32(got_f32, in_f32, block);
+                for (i = 0; i < block; i++) {
+                    error = ulp_error_f32(got_f32[i], (float) checks[c].libm(in_f32[i]));
+                    if (error > worst) {
+                        worst = error;
+                        worst_x = in_f32[i];
+                    }
+                }
+            }
+        }
+
+        fprintf(out, "%-8s [-%.9g, %.9g]  max %.3f ulp at %.17g (bound %g)  %s\n", checks[c].name,
+            checks[c].range, checks[c].range, worst, worst_x, checks[c].bound,
+            (worst <= checks[c].bound) ? "ok" : "FAILED");
+        failed = failed || worst > checks[c].bound;
+    }
+
+    return !failed;
+}
@@ -0,0 +1,441 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "aggregate.h"
+#include "parallel.h"
+#include "array.h"
+#include "fail.h"
+
+typedef struct {
+    uint64_t count;
+
+    /* Type of the values being reduced */
+    TokenType type;
+
+    /* Running sum, min or max, or the running mean for var */
+    int64_t i64;
+    double f64;
+
+    /* Neumaier compensation for sums, sum of squared deviations for var */
+    double extra;
+} Partial;
+
+typedef struct {
+    TokenType agg;
+    ColumnProgram* compiled;
+    Column* inputs;
+    uint32_t n_inputs;
+    uint64_t rows;
+    Partial* partials;
+} Job;
+
+static Token reduce_rows(TokenType agg, TokenStack* operand, Column* inputs, uint32_t n_inputs, uint64_t rows);
+static Token reduce_array(TokenType agg, Array* values);
+static void reduce_block(void* ctx, uint64_t index);
+static void reduce_values(TokenType agg, Column* values, uint64_t count, Partial* p);
+static Token finish(TokenType agg, Partial* total);
+static Partial combine_range(TokenType agg, Partial* partials, uint64_t lo, uint64_t hi);
+static Partial combine(TokenType agg, Partial* a, Partial* b);
+static void two_sum(double a, double b, double* sum, double* err);
+
+TokenStack* resolve_aggregates(TokenStack* program, Column* inputs, uint32_t n_inputs, uint64_t rows)
+{
+    TokenStack* output;
+    TokenStack operand;
+    uint64_t start;
+    uint64_t ip;
+    Token tok;
+
+    output = alloc_token_stack();
+
+    for (ip = 0; ip < program->size; ip++) {
+        tok = copy_token(&program->base[ip]);
+
+        if (!IS_AGGREGATE(tok.type)) {
+            push_token_stack(output, &tok);
+            continue;
+        }
+
+        /* The operand is whatever is on top of the output so far, already resolved */
+        start = find_operand_start(output, output->size - 1);
+
+        operand.base = output->base + start;
+        operand.size = output->size - start;
+        operand.capacity = operand.size;
+
+        tok = reduce_rows(tok.type, &operand, inputs, n_inputs, rows);
+
+        while (output->size > start) {
+            output->size--;
+            scrub_token(&output->base[output->size]);
+        }
+        push_token_stack(output, &tok);
+    }
+
+    return output;
+}
+
+Token aggregate_token(TokenType type, Token* t1)
+{
+    Token output;
+
+    if (t1->type == TOK_ARRAY) {
+        return reduce_array(type, t1->as.array);
+    }
+
+    if (!IS_NUMBER(t1)) {
+        fail(15, "'%s' unimplemented.", type == TOK_AGG_COUNT ? "count" : "aggregate");
+    }
+
+    switch (type) {
+        case TOK_AGG_SUM:
+        case TOK_AGG_MIN:
+        case TOK_AGG_MAX: {
+            output = copy_token(t1);
+            break;
+        }
+        case TOK_AGG_MEAN: {
+            output.type = TOK_DOUBLE;
+            output.as.f64 = token_to_double(t1);
+            break;
+        }
+        case TOK_AGG_COUNT: {
+            output.type = TOK_LONG;
+            output.as.i64 = 1;
+            break;
+        }
+        default: {
+            output.type = TOK_DOUBLE;
+            output.as.f64 = 0.0;
+            break;
+        }
+    }
+
+    return output;
+}
+
+static Token reduce_rows(TokenType agg, TokenStack* operand, Column* inputs, uint32_t n_inputs, uint64_t rows)
+{
+    Job job;
+    Partial total;
+    Token output;
+    uint64_t blocks;
+
+    job.agg = agg;
+    job.compiled = compile_columns(operand, inputs, n_inputs);
+    job.inputs = inputs;
+    job.n_inputs = n_inputs;
+    job.rows = rows;
+
+    blocks = (rows + AGGREGATE_BLOCK_ROWS - 1) / AGGREGATE_BLOCK_ROWS;
+    if ((job.partials = calloc(blocks + 1, sizeof(Partial))) == NULL) {
+        fprintf(stderr, "Failed to allocate partial aggregates.\n");
+        exit(5);
+    }
+
+    parallel_for(blocks, reduce_block, &job);
+
+    if (blocks > 0) {
+        total = combine_range(agg, job.partials, 0, blocks);
+    } else {
+        total = job.partials[0];
+        total.type = job.compiled->results[0];
+    }
+
+    output = finish(agg, &total);
+
+    free(job.partials);
+    free_column_program(job.compiled);
+
+    return output;
+}
+
+/* Like the rows of a column, so 'sum([...])' agrees with --rows to the last bit */
+static Token reduce_array(TokenType agg, Array* values)
+{
+    Partial* partials;
+    Partial total;
+    Column block;
+    uint64_t blocks;
+    uint64_t begin;
+    uint64_t count;
+    uint64_t i;
+
+    blocks = (values->length + AGGREGATE_BLOCK_ROWS - 1) / AGGREGATE_BLOCK_ROWS;
+    if ((partials = calloc(blocks + 1, sizeof(Partial))) == NULL) {
+        fprintf(stderr, "Failed to allocate partial aggregates.\n");
+        exit(5);
+    }
+
+    block.name = NULL;
+    block.type = values->type;
+    for (i = 0; i < blocks; i++) {
+        begin = i * AGGREGATE_BLOCK_ROWS;
+        count = values->length - begin;
+        if (count > AGGREGATE_BLOCK_ROWS) {
+            count = AGGREGATE_BLOCK_ROWS;
+        }
+
+        if (values->type == TOK_LONG) {
+            block.as.i64 = values->as.i64 + begin;
+        } else {
+            block.as.f64 = values->as.f64 + begin;
+        }
+        reduce_values(agg, &block, count, &partials[i]);
+    }
+
+    if (blocks > 0) {
+        total = combine_range(agg, partials, 0, blocks);
+    } else {
+        total = partials[0];
+        total.type = values->type;
+    }
+    free(partials);
+
+    return finish(agg, &total);
+}
+
+/* Evaluates the operand over one block and folds it into that block's partial */
+static void reduce_block(void* ctx, uint64_t index)
+{
+    Job* job;
+    Partial* p;
+    Column* sliced;
+    Column values;
+    uint64_t begin;
+    uint64_t count;
+    uint32_t c;
+
+    job = ctx;
+    p = &job->partials[index];
+
+    begin = index * AGGREGATE_BLOCK_ROWS;
+    count = job->rows - begin;
+    if (count > AGGREGATE_BLOCK_ROWS) {
+        count = AGGREGATE_BLOCK_ROWS;
+    }
+
+    sliced = malloc(sizeof(Column) * (job->n_inputs + 1));
+    values.as.i64 = malloc(sizeof(int64_t) * count);
+    if (sliced == NULL || values.as.i64 == NULL) {
+        fprintf(stderr, "Failed to allocate aggregate block.\n");
+        exit(5);
+    }
+
+    for (c = 0; c < job->n_inputs; c++) {
+        sliced[c] = job->inputs[c];
+        advance_column(&sliced[c], begin);
+    }
+
+    values.name = NULL;
+    values.type = job->compiled->results[0];
+    eval_columns(job->compiled, sliced, begin, count, &values);
+
+    reduce_values(job->agg, &values, count, p);
+
+    free(values.as.i64);
+    free(sliced);
+}
+
+/* Folds 'count' values into a fresh partial */
+static void reduce_values(TokenType agg, Column* values, uint64_t count, Partial* p)
+{
+    uint64_t i;
+    double x;
+    double delta;
+
+    p->count = count;
+    p->type = values->type;
+    p->i64 = 0;
+    p->f64 = 0.0;
+    p->extra = 0.0;
+
+    switch (agg) {
+        case TOK_AGG_SUM:
+        case TOK_AGG_MEAN: {
+            if (values->type == TOK_LONG && agg == TOK_AGG_SUM) {
+                for (i = 0; i < count; i++) {
+                    p->i64 += values->as.i64[i];
+                }
+                break;
+            }
+
+            p->type = TOK_DOUBLE;
+            for (i = 0; i < count; i++) {
+                x = (values->type == TOK_LONG) ? values->as.i64[i] : values->as.f64[i];
+                two_sum(p->f64, x, &p->f64, &delta);
+                p->extra += delta;
+            }
+            break;
+        }
+        case TOK_AGG_MIN: {
+            if (values->type == TOK_LONG) {
+                p->i64 = values->as.i64[0];
+                for (i = 1; i < count; i++) {
+                    p->i64 = (values->as.i64[i] < p->i64) ? values->as.i64[i] : p->i64;
+                }
+            } else {
+                p->f64 = values->as.f64[0];
+                for (i = 1; i < count; i++) {
+                    p->f64 = (values->as.f64[i] < p->f64) ? values->as.f64[i] : p->f64;
+                }
+            }
+            break;
+        }
+        case TOK_AGG_MAX: {
+            if (values->type == TOK_LONG) {
+                p->i64 = values->as.i64[0];
+                for (i = 1; i < count; i++) {
+                    p->i64 = (values->as.i64[i] > p->i64) ? values->as.i64[i] : p->i64;
+                }
+            } else {
+                p->f64 = values->as.f64[0];
+                for (i = 1; i < count; i++) {
+                    p->f64 = (values->as.f64[i] > p->f64) ? values->as.f64[i] : p->f64;
+                }
+            }
+            break;
+        }
+        case TOK_AGG_VAR: {
+            /* Welford, 'f64' is the running mean and 'extra' the squared deviations */
+            p->type = TOK_DOUBLE;
+            for (i = 0; i < count; i++) {
+                x = (values->type == TOK_LONG) ? values->as.i64[i] : values->as.f64[i];
+                delta = x - p->f64;
+                p->f64 += delta / (i + 1);
+                p->extra += delta * (x - p->f64);
+            }
+            break;
+        }
+        default: {
+            /* count only needs the number of rows */
+            break;
+        }
+    }
+}
+
+/* The value of a reduction from the partial of every row */
+static Token finish(TokenType agg, Partial* total)
+{
+    Token output;
+
+    switch (agg) {
+        case TOK_AGG_SUM: {
+            output.type = total->type;
+            if (total->type == TOK_LONG) {
+                output.as.i64 = total->i64;
+            } else {
+                output.as.f64 = total->f64 + total->extra;
+            }
+            break;
+        }
+        case TOK_AGG_MEAN: {
+            output.type = TOK_DOUBLE;
+            output.as.f64 = (total->f64 + total->extra) / total->count;
+            break;
+        }
+        case TOK_AGG_MIN:
+        case TOK_AGG_MAX: {
+            output.type = total->type;
+            if (total->count == 0) {
+                output.type = TOK_DOUBLE;
+                output.as.f64 = 0.0 / 0.0;
+            } else if (total->type == TOK_LONG) {
+                output.as.i64 = total->i64;
+            } else {
+                output.as.f64 = total->f64;
+            }
+            break;
+        }
+        case TOK_AGG_COUNT: {
+            output.type = TOK_LONG;
+            output.as.i64 = total->count;
+            break;
+        }
+        default: {
+            output.type = TOK_DOUBLE;
+            output.as.f64 = total->extra / total->count;
+            break;
+        }
+    }
+
+    return output;
+}
+
+static Partial combine_range(TokenType agg, Partial* partials, uint64_t lo, uint64_t hi)
+{
+    Partial a;
+    Partial b;
+    uint64_t mid;
+
+    if (hi - lo == 1) {
+        return partials[lo];
+    }
+
+    mid = lo + (hi - lo) / 2;
+    a = combine_range(agg, partials, lo, mid);
+    b = combine_range(agg, partials, mid, hi);
+
+    return combine(agg, &a, &b);
+}
+
+static Partial combine(TokenType agg, Partial* a, Partial* b)
+{
+    Partial output;
+    double err;
+    double delta;
+    double n;
+
+    output = *a;
+    output.count = a->count + b->count;
+
+    switch (agg) {
+        case TOK_AGG_SUM:
+        case TOK_AGG_MEAN: {
+            if (a->type == TOK_LONG) {
+                output.i64 = a->i64 + b->i64;
+            } else {
+                two_sum(a->f64, b->f64, &output.f64, &err);
+                output.extra = a->extra + b->extra + err;
+            }
+            break;
+        }
+        case TOK_AGG_MIN: {
+            output.i64 = (b->i64 < a->i64) ? b->i64 : a->i64;
+            output.f64 = (b->f64 < a->f64) ? b->f64 : a->f64;
+            break;
+        }
+        case TOK_AGG_MAX: {
+            output.i64 = (b->i64 > a->i64) ? b->i64 : a->i64;
+            output.f64 = (b->f64 > a->f64) ? b->f64 : a->f64;
+            break;
+        }
+        case TOK_AGG_VAR: {
+            /* Chan et al. */
+            n = output.count;
+            delta = b->f64 - a->f64;
+            output.f64 = a->f64 + delta * (b->count / n);
+            output.extra = a->extra + b->extra + delta * delta * (a->count * (b->count / n));
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+
+    return output;
+}
+
+/* Knuth's TwoSum, 'err' is exactly what got rounded off 'a + b' */
+static void two_sum(double a, double b, double* sum, double* err)
+{
+    double s;
+    double bb;
+
+    s = a + b;
+    bb = s - a;
+    *err = (a - (s - bb)) + (b - bb);
+    *sum = s;
+}
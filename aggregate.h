@@ -0,0 +1,30 @@
+#ifndef CALC_AGGREGATE_H
+#define CALC_AGGREGATE_H
+
+#include <stdint.h>
+
+#include "token.h"
+#include "column.h"
+
+/*
+    Rows are reduced in blocks of AGGREGATE_BLOCK_ROWS, each block into its own
+    partial result, and the partials are then combined pairwise in block order.
+    Blocks do not depend on the thread count, so neither does the result.
+
+    sum of longs is exact, sum/mean of doubles use Neumaier compensated sums,
+    var is the population variance via Welford and Chan's parallel update.
+*/
+
+#define AGGREGATE_BLOCK_ROWS 8192
+
+/*
+    Returns a new program in which every aggregate call has been replaced by the
+    constant it reduces to over 'rows' rows of 'inputs'. Nested aggregates are
+    resolved innermost first, so 'sum(x - mean(x))' works as expected.
+*/
+TokenStack* resolve_aggregates(TokenStack* program, Column* inputs, uint32_t n_inputs, uint64_t rows);
+
+/* An aggregate over a single value, which is what the scalar evaluator sees, or the elements of an array */
+Token aggregate_token(TokenType type, Token* t1);
+
+#endif
@@ -0,0 +1,499 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "array.h"
+#include "bigint.h"
+#include "vmath.h"
+#include "aggregate.h"
+#include "fail.h"
+
+/* One operand of an element-wise operator, looked at a tile at a time */
+typedef struct {
+    Token* tok;
+
+    /* A broadcast scalar, or elements converted to the type of the kernel */
+    union {
+        int64_t i64[ARRAY_TILE];
+        double f64[ARRAY_TILE];
+    } lanes;
+} Operand;
+
+static TokenType element_type(Token* tok);
+static uint64_t common_length(Token** operands, int n);
+static Array* output_for(Token** operands, int n, TokenType type, uint64_t length);
+static void init_operand(Operand* o, Token* tok, TokenType type);
+static void* tile_of(Operand* o, TokenType type, uint64_t begin, uint64_t count);
+static bool has_fraction(Token* base, Token* exponent, uint64_t length);
+static void divide_i64(TokenType op, int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+static Token wrap_array(Array* target);
+
+Array* alloc_array(TokenType type, uint64_t length)
+{
+    Array* output;
+
+    /* One extra, so an empty array still has somewhere to point */
+    if ((output = malloc(sizeof(Array))) == NULL
+        || (output->as.i64 = malloc(sizeof(int64_t) * (length + 1))) == NULL) {
+        fprintf(stderr, "Failed to allocate array.\n");
+        exit(5);
+    }
+
+    output->refs = 1;
+    output->type = type;
+    output->length = length;
+
+    return output;
+}
+
+/* Atomic, the cells of a model share values across threads */
+Array* retain_array(Array* target)
+{
+    __sync_add_and_fetch(&target->refs, 1);
+    return target;
+}
+
+void release_array(Array* target)
+{
+    if (target == NULL) {
+        return;
+    }
+
+    if (__sync_sub_and_fetch(&target->refs, 1) == 0) {
+        free(target->as.i64);
+        free(target);
+    }
+}
+
+Token make_array(Token* items, uint64_t n)
+{
+    Array* output;
+    TokenType type;
+    uint64_t i;
+
+    type = TOK_LONG;
+    for (i = 0; i < n; i++) {
+        if (!IS_NUMBER((&items[i]))) {
+            fail(9, "Arrays can only hold numbers.");
+        }
+        if (items[i].type != TOK_LONG) {
+            type = TOK_DOUBLE;
+        }
+    }
+
+    output = alloc_array(type, n);
+    for (i = 0; i < n; i++) {
+        if (type == TOK_LONG) {
+            output->as.i64[i] = items[i].as.i64;
+        } else {
+            output->as.f64[i] = token_to_double(&items[i]);
+        }
+    }
+
+    return wrap_array(output);
+}
+
+Token array_element(Array* target, uint64_t i)
+{
+    Token output;
+
+    output.type = target->type;
+    if (target->type == TOK_LONG) {
+        output.as.i64 = target->as.i64[i];
+    } else {
+        output.as.f64 = target->as.f64[i];
+    }
+
+    return output;
+}
+
+/* Bit for bit, like constants are compared elsewhere */
+bool array_equal(Array* a, Array* b)
+{
+    if (a == b) {
+        return true;
+    }
+
+    return a->type == b->type && a->length == b->length
+        && memcmp(a->as.i64, b->as.i64, sizeof(int64_t) * a->length) == 0;
+}
+
+char* array_to_string(Array* target)
+{
+    char* output;
+    char* grown;
+    uint64_t size;
+    uint64_t capacity;
+    uint64_t i;
+
+    capacity = 2 * MAX_FORMATTED_NUMBER;
+    if ((output = malloc(capacity)) == NULL) {
+        fprintf(stderr, "Failed to print array.\n");
+        exit(5);
+    }
+
+    size = sprintf(output, "[");
+    for (i = 0; i < target->length; i++) {
+        if (size + MAX_FORMATTED_NUMBER > capacity) {
+            capacity *= 2;
+            if ((grown = realloc(output, capacity)) == NULL) {
+                fprintf(stderr, "Failed to print array.\n");
+                exit(5);
+            }
+            output = grown;
+        }
+
+        if (target->type == TOK_LONG) {
+            size += sprintf(output + size, "%s%ld", (i > 0) ? ", " : "", target->as.i64[i]);
+        } else {
+            size += sprintf(output + size, "%s%f", (i > 0) ? ", " : "", target->as.f64[i]);
+        }
+    }
+    sprintf(output + size, "]");
+
+    return output;
+}
+
+/*
+    Like the scalar versions, '+ - * /' stay integers when both sides are and
+    '%' truncates doubles. '^' only gives doubles when some element has a
+    negative power that isn't of 1 or -1, then all of them are.
+*/
+Token array_binary(TokenType op, Token* t1, Token* t2)
+{
+    Token* operands[2];
+    Operand a;
+    Operand b;
+    Array* output;
+    TokenType type;
+    uint64_t length;
+    uint64_t begin;
+    uint64_t count;
+    void* x;
+    void* y;
+
+    operands[0] = t1;
+    operands[1] = t2;
+    length = common_length(operands, 2);
+
+    type = (element_type(t1) == TOK_LONG && element_type(t2) == TOK_LONG) ? TOK_LONG : TOK_DOUBLE;
+    if (op == TOK_MOD) {
+        type = TOK_LONG;
+    } else if (op == TOK_EXP && type == TOK_LONG && has_fraction(t1, t2, length)) {
+        type = TOK_DOUBLE;
+    }
+
+    output = output_for(operands, 2, type, length);
+    init_operand(&a, t1, type);
+    init_operand(&b, t2, type);
+
+    for (begin = 0; begin < length; begin += ARRAY_TILE) {
+        count = (length - begin < ARRAY_TILE) ? length - begin : ARRAY_TILE;
+        x = tile_of(&a, type, begin, count);
+        y = tile_of(&b, type, begin, count);
+
+        if (type == TOK_LONG) {
+            switch (op) {
+                case TOK_ADD: {
+                    vec_add_i64(output->as.i64 + begin, x, y, count);
+                    break;
+                }
+                case TOK_SUB: {
+                    vec_sub_i64(output->as.i64 + begin, x, y, count);
+                    break;
+                }
+                case TOK_MUL: {
+                    vec_mul_i64(output->as.i64 + begin, x, y, count);
+                    break;
+                }
+                case TOK_EXP: {
+                    vec_pow_i64(output->as.i64 + begin, x, y, count);
+                    break;
+                }
+                default: {
+                    divide_i64(op, output->as.i64 + begin, x, y, count);
+                    break;
+                }
+            }
+        } else {
+            switch (op) {
+                case TOK_ADD: {
+                    vec_add_f64(output->as.f64 + begin, x, y, count);
+                    break;
+                }
+                case TOK_SUB: {
+                    vec_sub_f64(output->as.f64 + begin, x, y, count);
+                    break;
+                }
+                case TOK_MUL: {
+                    vec_mul_f64(output->as.f64 + begin, x, y, count);
+                    break;
+                }
+                case TOK_DIV: {
+                    vec_div_f64(output->as.f64 + begin, x, y, count);
+                    break;
+                }
+                default: {
+                    vec_pow_f64(output->as.f64 + begin, x, y, count);
+                    break;
+                }
+            }
+        }
+    }
+
+    return wrap_array(output);
+}
+
+Token array_unary(TokenType op, Token* t1)
+{
+    Operand a;
+    Array* output;
+    uint64_t length;
+    uint64_t begin;
+    uint64_t count;
+    double* x;
+
+    length = t1->as.array->length;
+    output = output_for(&t1, 1, TOK_DOUBLE, length);
+    init_operand(&a, t1, TOK_DOUBLE);
+
+    for (begin = 0; begin < length; begin += ARRAY_TILE) {
+        count = (length - begin < ARRAY_TILE) ? length - begin : ARRAY_TILE;
+        x = tile_of(&a, TOK_DOUBLE, begin, count);
+
+        switch (op) {
+            case TOK_SIN: {
+                vec_sin(output->as.f64 + begin, x, count);
+                break;
+            }
+            case TOK_COS: {
+                vec_cos(output->as.f64 + begin, x, count);
+                break;
+            }
+            default: {
+                vec_tan(output->as.f64 + begin, x, count);
+                break;
+            }
+        }
+    }
+
+    return wrap_array(output);
+}
+
+Token array_fma(Token* t1, Token* t2, Token* t3)
+{
+    Token* operands[3];
+    Operand a;
+    Operand b;
+    Operand c;
+    Array* output;
+    TokenType type;
+    uint64_t length;
+    uint64_t begin;
+    uint64_t count;
+
+    operands[0] = t1;
+    operands[1] = t2;
+    operands[2] = t3;
+    length = common_length(operands, 3);
+
+    type = (element_type(t1) == TOK_LONG && element_type(t2) == TOK_LONG && element_type(t3) == TOK_LONG)
+        ? TOK_LONG : TOK_DOUBLE;
+
+    output = output_for(operands, 3, type, length);
+    init_operand(&a, t1, type);
+    init_operand(&b, t2, type);
+    init_operand(&c, t3, type);
+
+    for (begin = 0; begin < length; begin += ARRAY_TILE) {
+        count = (length - begin < ARRAY_TILE) ? length - begin : ARRAY_TILE;
+
+        if (type == TOK_LONG) {
+            vec_fma_i64(output->as.i64 + begin, tile_of(&a, type, begin, count),
+                tile_of(&b, type, begin, count), tile_of(&c, type, begin, count), count);
+        } else {
+            vec_fma_f64(output->as.f64 + begin, tile_of(&a, type, begin, count),
+                tile_of(&b, type, begin, count), tile_of(&c, type, begin, count), count);
+        }
+    }
+
+    return wrap_array(output);
+}
+
+/* The product is usually written over one of the operands, so nothing is allocated for it */
+Token dot_tokens(Token* t1, Token* t2)
+{
+    Token output;
+    Token product;
+
+    product = mul_tokens(t1, t2);
+    output = aggregate_token(TOK_AGG_SUM, &product);
+    scrub_token(&product);
+
+    return output;
+}
+
+/* Big integers are only ever elements as doubles */
+static TokenType element_type(Token* tok)
+{
+    switch (tok->type) {
+        case TOK_ARRAY: {
+            return tok->as.array->type;
+        }
+        case TOK_LONG: {
+            return TOK_LONG;
+        }
+        case TOK_DOUBLE:
+        case TOK_BIGINT: {
+            return TOK_DOUBLE;
+        }
+        default: {
+            fail(9, "Not a number.");
+        }
+    }
+}
+
+static uint64_t common_length(Token** operands, int n)
+{
+    Array* seen;
+    int i;
+
+    seen = NULL;
+    for (i = 0; i < n; i++) {
+        if (operands[i]->type != TOK_ARRAY) {
+            element_type(operands[i]);
+            continue;
+        }
+
+        if (seen != NULL && seen->length != operands[i]->as.array->length) {
+            fail(9, "Arrays of length %lu and %lu don't line up.",
+                seen->length, operands[i]->as.array->length);
+        }
+        seen = operands[i]->as.array;
+    }
+
+    return seen->length;
+}
+
+/*
+    An operand the caller holds the only reference to is about to be scrubbed,
+    so the result can go straight over it. Every kernel is fine with that.
+*/
+static Array* output_for(Token** operands, int n, TokenType type, uint64_t length)
+{
+    Array* target;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (operands[i]->type != TOK_ARRAY) {
+            continue;
+        }
+
+        target = operands[i]->as.array;
+        if (target->refs == 1 && target->type == type) {
+            return retain_array(target);
+        }
+    }
+
+    return alloc_array(type, length);
+}
+
+static void init_operand(Operand* o, Token* tok, TokenType type)
+{
+    int64_t integer;
+    double real;
+    uint64_t i;
+
+    o->tok = tok;
+    if (tok->type == TOK_ARRAY) {
+        return;
+    }
+
+    /* Only '%' asks for a double or big integer as a long, which truncates */
+    if (type == TOK_LONG) {
+        if (tok->type == TOK_LONG) {
+            integer = tok->as.i64;
+        } else if (tok->type == TOK_DOUBLE) {
+            integer = (int64_t) tok->as.f64;
+        } else if (!big_to_i64(tok->as.big, &integer)) {
+            fail(9, "Too large for an array element.");
+        }
+        for (i = 0; i < ARRAY_TILE; i++) {
+            o->lanes.i64[i] = integer;
+        }
+    } else {
+        real = token_to_double(tok);
+        for (i = 0; i < ARRAY_TILE; i++) {
+            o->lanes.f64[i] = real;
+        }
+    }
+}
+
+/* 'count' elements from 'begin' on, as 'type' */
+static void* tile_of(Operand* o, TokenType type, uint64_t begin, uint64_t count)
+{
+    Array* target;
+
+    if (o->tok->type != TOK_ARRAY) {
+        return o->lanes.i64;
+    }
+
+    target = o->tok->as.array;
+    if (target->type == type) {
+        return target->as.i64 + begin;
+    }
+
+    if (type == TOK_DOUBLE) {
+        vec_i64_to_f64(o->lanes.f64, target->as.i64 + begin, count);
+    } else {
+        vec_f64_to_i64(o->lanes.i64, target->as.f64 + begin, count);
+    }
+
+    return o->lanes.i64;
+}
+
+/* Whether an integer '^' leaves a fraction anywhere, both sides hold longs */
+static bool has_fraction(Token* base, Token* exponent, uint64_t length)
+{
+    int64_t b;
+    int64_t e;
+    uint64_t i;
+
+    for (i = 0; i < length; i++) {
+        b = (base->type == TOK_ARRAY) ? base->as.array->as.i64[i] : base->as.i64;
+        e = (exponent->type == TOK_ARRAY) ? exponent->as.array->as.i64[i] : exponent->as.i64;
+        if (e < 0 && b != 1 && b != -1) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* '/' and '%' on longs, the two cases that trap in C are checked first */
+static void divide_i64(TokenType op, int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        if (b[i] == 0) {
+            fail(9, "Division by zero.");
+        }
+
+        if (b[i] == -1) {
+            out[i] = (op == TOK_DIV) ? (int64_t) (0 - (uint64_t) a[i]) : 0;
+        } else {
+            out[i] = (op == TOK_DIV) ? a[i] / b[i] : a[i] % b[i];
+        }
+    }
+}
+
+static Token wrap_array(Array* target)
+{
+    Token output;
+
+    output.type = TOK_ARRAY;
+    output.as.array = target;
+
+    return output;
+}
@@ -0,0 +1,63 @@
+#ifndef CALC_ARRAY_H
+#define CALC_ARRAY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "token.h"
+
+/*
+    Arrays of numbers, '[1, 2, 3]', behind TOK_ARRAY. Every element has the
+    same type, TOK_LONG or TOK_DOUBLE, a big integer element is stored as a
+    double.
+
+    Arrays are reference counted and never copied: 'copy_token()' takes a
+    reference and 'scrub_token()' drops it. An operator whose operand holds
+    the only reference writes its result over that operand, so in '2*v + 1'
+    the product is the only array that gets allocated.
+
+    '+ - * / % ^', fma() and the trig builtins apply element-wise through the
+    kernels in vmath.h, ARRAY_TILE elements at a time, and a scalar operand is
+    broadcast to every element. Integer elements wrap on overflow like they do
+    with --rows, the types follow the scalar rules otherwise. Both operands of
+    an element-wise operator must have the same length.
+*/
+
+#define ARRAY_TILE 256
+
+typedef struct Array {
+    uint32_t refs;
+    TokenType type;
+    uint64_t length;
+
+    union {
+        int64_t* i64;
+        double* f64;
+    } as;
+} Array;
+
+/* One reference, elements left uninitialised */
+Array* alloc_array(TokenType type, uint64_t length);
+Array* retain_array(Array* target);
+void release_array(Array* target);
+
+/* The TOK_ARRAY of 'n' numbers, exits if one of them isn't */
+Token make_array(Token* items, uint64_t n);
+
+/* Element 'i', as a TOK_LONG or TOK_DOUBLE */
+Token array_element(Array* target, uint64_t i);
+
+bool array_equal(Array* a, Array* b);
+
+/* '[1, 2, 3]', malloc'd */
+char* array_to_string(Array* target);
+
+/* At least one operand is an array, see 'add_tokens()' and friends */
+Token array_binary(TokenType op, Token* t1, Token* t2);
+Token array_unary(TokenType op, Token* t1);
+Token array_fma(Token* t1, Token* t2, Token* t3);
+
+/* dot(a, b), the same as sum(a*b) */
+Token dot_tokens(Token* t1, Token* t2);
+
+#endif
@@ -0,0 +1,727 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "arrow.h"
+
+#define ARROW_MAGIC "ARROW1"
+#define ARROW_MAGIC_LENGTH 6
+
+/* The footer length and magic at the end of a file */
+#define ARROW_TRAILER_LENGTH 10
+
+#define ARROW_CONTINUATION 0xFFFFFFFF
+#define ARROW_ALIGNMENT 8
+#define ARROW_VERSION_V5 4
+
+/* Members of the 'Type' and 'MessageHeader' unions */
+#define ARROW_TYPE_NULL 1
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_FLOATING_POINT 3
+#define ARROW_TYPE_BINARY 4
+#define ARROW_TYPE_UTF8 5
+#define ARROW_TYPE_LIST 12
+#define ARROW_TYPE_STRUCT 13
+#define ARROW_TYPE_UNION 14
+#define ARROW_TYPE_FIXED_SIZE_LIST 16
+#define ARROW_TYPE_MAP 17
+#define ARROW_TYPE_LARGE_BINARY 19
+#define ARROW_TYPE_LARGE_UTF8 20
+#define ARROW_TYPE_LARGE_LIST 21
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_PRECISION_SINGLE 1
+#define ARROW_PRECISION_DOUBLE 2
+
+/* Sizes of the Block, FieldNode and Buffer structs */
+#define ARROW_BLOCK_SIZE 24
+#define ARROW_NODE_SIZE 16
+#define ARROW_BUFFER_SIZE 16
+
+#define INITIAL_FLAT_SIZE 256
+#define FLAT_GROWTH_FACTOR 2
+
+/* The field slot of a table written by 'flat_table()' */
+#define FLAT_SLOT(table, id) ((table) + 8 + 8 * (uint64_t) (id))
+
+/* A flatbuffer being read, everything it points at has to stay inside it */
+typedef struct {
+    uint8_t* base;
+    uint64_t size;
+} Flat;
+
+typedef struct {
+    uint8_t* bytes;
+    uint64_t size;
+    uint64_t capacity;
+} FlatBuilder;
+
+static void malformed(char* path);
+static uint64_t read_unsigned(uint8_t* at, uint32_t size);
+static int64_t read_signed(uint8_t* at, uint32_t size);
+static uint8_t* flat_check(Flat* flat, uint8_t* at, uint64_t size);
+static uint8_t* flat_root(Flat* flat);
+static uint8_t* flat_field(Flat* flat, uint8_t* table, uint32_t id);
+static int64_t flat_scalar(Flat* flat, uint8_t* table, uint32_t id, uint32_t size, int64_t fallback);
+static uint8_t* flat_follow(Flat* flat, uint8_t* at);
+static uint8_t* flat_table(Flat* flat, uint8_t* table, uint32_t id);
+static uint8_t* flat_vector(Flat* flat, uint8_t* table, uint32_t id, uint32_t element_size, uint32_t* count);
+static uint64_t build_alloc(FlatBuilder* b, uint64_t size, uint64_t align);
+static void build_put(FlatBuilder* b, uint64_t at, int64_t value, uint32_t size);
+static uint64_t build_table(FlatBuilder* b, uint32_t n_fields, uint32_t present);
+static void build_link(FlatBuilder* b, uint64_t from, uint64_t target);
+static uint64_t build_vector(FlatBuilder* b, uint32_t count, uint32_t element_size);
+static uint64_t build_string(FlatBuilder* b, char* text);
+static uint64_t build_schema(FlatBuilder* b, ArrowWriter* writer);
+static uint64_t build_message(FlatBuilder* b, uint8_t header_type);
+static void write_message(ArrowWriter* writer, FlatBuilder* b);
+static void write_padding(ArrowWriter* writer, uint64_t size);
+
+/* Only what 'read_arrow()' needs to know about a field */
+typedef struct {
+    char* name;
+    TokenType type;
+    uint32_t n_buffers;
+
+    /* Index into the table's columns, or -1 when the field is skipped */
+    int64_t column;
+} ArrowField;
+
+static char* current_path = NULL;
+
+void read_arrow(MappedTable* table, char* path)
+{
+    Flat footer;
+    Flat message;
+    ArrowField* fields;
+    Column* column;
+    uint8_t* map;
+    uint8_t* root;
+    uint8_t* schema;
+    uint8_t* vector;
+    uint8_t* field;
+    uint8_t* type;
+    uint8_t* blocks;
+    uint8_t* nodes;
+    uint8_t* buffers;
+    uint8_t* header;
+    uint8_t* body;
+    uint8_t* data;
+    uint8_t* block;
+    uint64_t size;
+    uint64_t rows;
+    uint64_t offset;
+    uint64_t length;
+    uint64_t metadata;
+    uint64_t body_length;
+    uint32_t n_fields;
+    uint32_t n_batches;
+    uint32_t n_nodes;
+    uint32_t n_buffers;
+    uint32_t buffer;
+    uint32_t name_length;
+    uint32_t type_type;
+    uint32_t b;
+    uint32_t i;
+
+    current_path = path;
+    map = (uint8_t*) map_file(table, path, &size);
+    if (size < 2 * ARROW_ALIGNMENT + ARROW_TRAILER_LENGTH || memcmp(map, ARROW_MAGIC, ARROW_MAGIC_LENGTH) != 0
+        || memcmp(map + size - ARROW_MAGIC_LENGTH, ARROW_MAGIC, ARROW_MAGIC_LENGTH) != 0) {
+        fprintf(stderr, "'%s' is not an Arrow IPC file.\n", path);
+        exit(25);
+    }
+
+    length = read_unsigned(map + size - ARROW_TRAILER_LENGTH, 4);
+    if (length > size - ARROW_TRAILER_LENGTH - ARROW_ALIGNMENT) {
+        malformed(path);
+    }
+    footer.base = map + size - ARROW_TRAILER_LENGTH - length;
+    footer.size = length;
+
+    /* Footer: version, schema, dictionaries, recordBatches */
+    root = flat_root(&footer);
+    if ((schema = flat_table(&footer, root, 1)) == NULL) {
+        malformed(path);
+    }
+
+    /* Schema: endianness, fields */
+    if (flat_scalar(&footer, schema, 0, 2, 0) != 0) {
+        fprintf(stderr, "'%s' is big endian.\n", path);
+        exit(25);
+    }
+    if ((vector = flat_vector(&footer, schema, 1, 4, &n_fields)) == NULL) {
+        n_fields = 0;
+    }
+    if ((fields = malloc(sizeof(ArrowField) * (n_fields + 1))) == NULL) {
+        fprintf(stderr, "Failed to allocate Arrow schema.\n");
+        exit(5);
+    }
+
+    table->width = 0;
+    for (i = 0; i < n_fields; i++) {
+        /* Field: name, nullable, type_type, type, dictionary, children */
+        field = flat_follow(&footer, vector + 4 * i);
+        data = flat_vector(&footer, field, 0, 1, &name_length);
+        fields[i].name = keep_name(table, (data != NULL) ? (char*) data : "", (data != NULL) ? name_length : 0);
+        type_type = flat_scalar(&footer, field, 2, 1, 0);
+        type = flat_table(&footer, field, 3);
+
+        if (flat_vector(&footer, field, 5, 4, &n_nodes) != NULL && n_nodes > 0) {
+            type_type = ARROW_TYPE_STRUCT;
+        }
+
+        switch (type_type) {
+            case ARROW_TYPE_NULL: {
+                fields[i].n_buffers = 0;
+                break;
+            }
+            case ARROW_TYPE_BINARY:
+            case ARROW_TYPE_UTF8:
+            case ARROW_TYPE_LARGE_BINARY:
+            case ARROW_TYPE_LARGE_UTF8: {
+                fields[i].n_buffers = 3;
+                break;
+            }
+            case ARROW_TYPE_LIST:
+            case ARROW_TYPE_STRUCT:
+            case ARROW_TYPE_UNION:
+            case ARROW_TYPE_FIXED_SIZE_LIST:
+            case ARROW_TYPE_MAP:
+            case ARROW_TYPE_LARGE_LIST: {
+                fprintf(stderr, "Column '%s' in '%s' is nested, only flat columns can be read.\n", fields[i].name, path);
+                exit(25);
+            }
+            default: {
+                /* Run end encoding and the view types came later, with layouts of their own */
+                if (type_type > ARROW_TYPE_LARGE_LIST) {
+                    fprintf(stderr, "Column '%s' in '%s' has a layout calc can't read.\n", fields[i].name, path);
+                    exit(25);
+                }
+                fields[i].n_buffers = 2;
+                break;
+            }
+        }
+
+        /* A dictionary encoded column holds indices, its buffers are those of an integer column */
+        if (flat_field(&footer, field, 4) != NULL) {
+            fields[i].n_buffers = 2;
+        }
+
+        /* Int: bitWidth, is_signed. FloatingPoint: precision */
+        fields[i].type = TOK_EOF;
+        if (type != NULL && flat_field(&footer, field, 4) == NULL) {
+            if (type_type == ARROW_TYPE_INT && flat_scalar(&footer, type, 0, 4, 0) == 64
+                && flat_scalar(&footer, type, 1, 1, 0) != 0) {
+                fields[i].type = TOK_LONG;
+            } else if (type_type == ARROW_TYPE_FLOATING_POINT
+                && flat_scalar(&footer, type, 0, 2, 0) == ARROW_PRECISION_DOUBLE) {
+                fields[i].type = TOK_DOUBLE;
+            } else if (type_type == ARROW_TYPE_FLOATING_POINT
+                && flat_scalar(&footer, type, 0, 2, 0) == ARROW_PRECISION_SINGLE) {
+                fields[i].type = TOK_FLOAT;
+            }
+        }
+
+        if (fields[i].type == TOK_EOF) {
+            fields[i].column = -1;
+            skip_column(table, fields[i].name);
+        } else {
+            fields[i].column = table->width++;
+        }
+    }
+
+    if ((blocks = flat_vector(&footer, root, 3, ARROW_BLOCK_SIZE, &n_batches)) == NULL) {
+        n_batches = 0;
+    }
+
+    /* With no batches at all the schema still says what the columns are */
+    table->n_batches = n_batches;
+    table->columns = malloc(sizeof(Column) * ((uint64_t) ((n_batches > 0) ? n_batches : 1) * table->width + 1));
+    table->rows = malloc(sizeof(uint64_t) * (n_batches + 1));
+    if (table->columns == NULL || table->rows == NULL) {
+        fprintf(stderr, "Failed to allocate Arrow batches.\n");
+        exit(5);
+    }
+    table->rows[0] = 0;
+    for (i = 0; i < n_fields; i++) {
+        if (fields[i].column >= 0) {
+            table->columns[fields[i].column].name = fields[i].name;
+            table->columns[fields[i].column].type = fields[i].type;
+            table->columns[fields[i].column].as.i64 = NULL;
+        }
+    }
+
+    for (b = 0; b < n_batches; b++) {
+        /* Block: offset, metaDataLength, bodyLength */
+        block = blocks + ARROW_BLOCK_SIZE * b;
+        offset = read_unsigned(block, 8);
+        metadata = read_unsigned(block + 8, 4);
+        body_length = read_unsigned(block + 16, 8);
+        if (offset > size || metadata > size - offset || body_length > size - offset - metadata || metadata < 8) {
+            malformed(path);
+        }
+
+        /* Older writers leave out the continuation marker */
+        message.base = map + offset + 4;
+        message.size = read_unsigned(map + offset, 4);
+        if (message.size == ARROW_CONTINUATION) {
+            message.base += 4;
+            message.size = read_unsigned(map + offset + 4, 4);
+        }
+        if (message.size > metadata || message.base + message.size > map + offset + metadata) {
+            malformed(path);
+        }
+
+        /* Message: version, header_type, header, bodyLength */
+        root = flat_root(&message);
+        if (flat_scalar(&message, root, 1, 1, 0) != ARROW_HEADER_RECORD_BATCH
+            || (header = flat_table(&message, root, 2)) == NULL) {
+            malformed(path);
+        }
+
+        /* RecordBatch: length, nodes, buffers, compression */
+        if (flat_field(&message, header, 3) != NULL) {
+            fprintf(stderr, "'%s' is compressed.\n", path);
+            exit(25);
+        }
+        rows = flat_scalar(&message, header, 0, 8, 0);
+        nodes = flat_vector(&message, header, 1, ARROW_NODE_SIZE, &n_nodes);
+        buffers = flat_vector(&message, header, 2, ARROW_BUFFER_SIZE, &n_buffers);
+        if (n_nodes != n_fields || (n_fields > 0 && (nodes == NULL || buffers == NULL))) {
+            malformed(path);
+        }
+
+        table->rows[b] = rows;
+        body = map + offset + metadata;
+        buffer = 0;
+        for (i = 0; i < n_fields; i++) {
+            if (buffer + fields[i].n_buffers > n_buffers) {
+                malformed(path);
+            }
+
+            if (fields[i].column >= 0) {
+                /* Buffer: offset, length. A validity bitmap, then the values */
+                offset = read_unsigned(buffers + ARROW_BUFFER_SIZE * (buffer + 1), 8);
+                length = read_unsigned(buffers + ARROW_BUFFER_SIZE * (buffer + 1) + 8, 8);
+                data = body + offset;
+                if (offset > body_length || length > body_length - offset || length / COLUMN_WIDTH(fields[i].type) < rows
+                    || (size_t) data % COLUMN_WIDTH(fields[i].type) != 0) {
+                    malformed(path);
+                }
+
+                /* FieldNode: length, null_count. Nulls are only a problem for a program that reads them */
+                if (read_unsigned(nodes + ARROW_NODE_SIZE * i + 8, 8) != 0) {
+                    skip_column(table, fields[i].name);
+                }
+
+                column = &table->columns[(uint64_t) b * table->width + fields[i].column];
+                column->name = fields[i].name;
+                column->type = fields[i].type;
+                column->as.i64 = (int64_t*) data;
+            }
+
+            buffer += fields[i].n_buffers;
+        }
+    }
+
+    free(fields);
+    current_path = NULL;
+}
+
+void begin_arrow(ArrowWriter* writer, FILE* out, char** names, TokenType* types, uint32_t width)
+{
+    FlatBuilder b;
+    uint64_t message;
+
+    writer->out = out;
+    writer->offset = 0;
+    writer->names = names;
+    writer->types = types;
+    writer->width = width;
+    writer->blocks = NULL;
+    writer->n_blocks = 0;
+    writer->capacity = 0;
+
+    fwrite(ARROW_MAGIC, 1, ARROW_MAGIC_LENGTH, out);
+    writer->offset += ARROW_MAGIC_LENGTH;
+    write_padding(writer, ARROW_ALIGNMENT - ARROW_MAGIC_LENGTH);
+
+    b.bytes = NULL;
+    b.size = 0;
+    b.capacity = 0;
+    message = build_message(&b, ARROW_HEADER_SCHEMA);
+    build_link(&b, FLAT_SLOT(message, 2), build_schema(&b, writer));
+    write_message(writer, &b);
+    free(b.bytes);
+}
+
+void write_arrow_batch(ArrowWriter* writer, Column* columns, uint64_t rows)
+{
+    FlatBuilder b;
+    ArrowBlock* block;
+    uint64_t message;
+    uint64_t batch;
+    uint64_t nodes;
+    uint64_t buffers;
+    uint64_t body;
+    uint64_t at;
+    uint64_t length;
+    uint32_t i;
+
+    if (writer->n_blocks == writer->capacity) {
+        writer->capacity = (writer->capacity == 0) ? INITIAL_FLAT_SIZE : writer->capacity * FLAT_GROWTH_FACTOR;
+        if ((writer->blocks = realloc(writer->blocks, sizeof(ArrowBlock) * writer->capacity)) == NULL) {
+            fprintf(stderr, "Failed to allocate Arrow footer.\n");
+            exit(5);
+        }
+    }
+
+    /* Every column is an empty validity bitmap and 'rows' values, floats padded back to 8 byte alignment */
+    body = 0;
+    for (i = 0; i < writer->width; i++) {
+        body += (rows * COLUMN_WIDTH(writer->types[i]) + ARROW_ALIGNMENT - 1) / ARROW_ALIGNMENT * ARROW_ALIGNMENT;
+    }
+
+    b.bytes = NULL;
+    b.size = 0;
+    b.capacity = 0;
+    message = build_message(&b, ARROW_HEADER_RECORD_BATCH);
+    build_put(&b, FLAT_SLOT(message, 3), body, 8);
+
+    batch = build_table(&b, 3, 0x7);
+    build_link(&b, FLAT_SLOT(message, 2), batch);
+    build_put(&b, FLAT_SLOT(batch, 0), rows, 8);
+
+    nodes = build_vector(&b, writer->width, ARROW_NODE_SIZE);
+    build_link(&b, FLAT_SLOT(batch, 1), nodes);
+    for (i = 0; i < writer->width; i++) {
+        build_put(&b, nodes + 4 + ARROW_NODE_SIZE * i, rows, 8);
+    }
+
+    buffers = build_vector(&b, 2 * writer->width, ARROW_BUFFER_SIZE);
+    build_link(&b, FLAT_SLOT(batch, 2), buffers);
+    at = 0;
+    for (i = 0; i < writer->width; i++) {
+        length = rows * COLUMN_WIDTH(writer->types[i]);
+        build_put(&b, buffers + 4 + ARROW_BUFFER_SIZE * (2 * i), at, 8);
+        build_put(&b, buffers + 4 + ARROW_BUFFER_SIZE * (2 * i + 1), at, 8);
+        build_put(&b, buffers + 4 + ARROW_BUFFER_SIZE * (2 * i + 1) + 8, length, 8);
+        at += (length + ARROW_ALIGNMENT - 1) / ARROW_ALIGNMENT * ARROW_ALIGNMENT;
+    }
+
+    block = &writer->blocks[writer->n_blocks++];
+    block->offset = writer->offset;
+    write_message(writer, &b);
+    block->metadata_length = writer->offset - block->offset;
+    block->body_length = body;
+    free(b.bytes);
+
+    for (i = 0; i < writer->width; i++) {
+        length = rows * COLUMN_WIDTH(writer->types[i]);
+        fwrite(columns[i].as.i64, 1, length, writer->out);
+        writer->offset += length;
+        write_padding(writer, (ARROW_ALIGNMENT - length % ARROW_ALIGNMENT) % ARROW_ALIGNMENT);
+    }
+}
+
+void end_arrow(ArrowWriter* writer)
+{
+    FlatBuilder b;
+    uint64_t footer;
+    uint64_t blocks;
+    uint32_t i;
+
+    b.bytes = NULL;
+    b.size = 0;
+    b.capacity = 0;
+    build_alloc(&b, ARROW_ALIGNMENT, ARROW_ALIGNMENT);
+
+    /* Footer: version, schema, dictionaries, recordBatches */
+    footer = build_table(&b, 4, 0xF);
+    build_put(&b, 0, footer, 4);
+    build_put(&b, FLAT_SLOT(footer, 0), ARROW_VERSION_V5, 2);
+    build_link(&b, FLAT_SLOT(footer, 1), build_schema(&b, writer));
+    build_link(&b, FLAT_SLOT(footer, 2), build_vector(&b, 0, ARROW_BLOCK_SIZE));
+
+    blocks = build_vector(&b, writer->n_blocks, ARROW_BLOCK_SIZE);
+    build_link(&b, FLAT_SLOT(footer, 3), blocks);
+    for (i = 0; i < writer->n_blocks; i++) {
+        build_put(&b, blocks + 4 + ARROW_BLOCK_SIZE * i, writer->blocks[i].offset, 8);
+        build_put(&b, blocks + 4 + ARROW_BLOCK_SIZE * i + 8, writer->blocks[i].metadata_length, 4);
+        build_put(&b, blocks + 4 + ARROW_BLOCK_SIZE * i + 16, writer->blocks[i].body_length, 8);
+    }
+
+    fwrite(b.bytes, 1, b.size, writer->out);
+    build_put(&b, 0, b.size, 4);
+    fwrite(b.bytes, 1, 4, writer->out);
+    fwrite(ARROW_MAGIC, 1, ARROW_MAGIC_LENGTH, writer->out);
+
+    free(b.bytes);
+    free(writer->blocks);
+    writer->blocks = NULL;
+}
+
+static void malformed(char* path)
+{
+    fprintf(stderr, "'%s' is not a well formed Arrow IPC file.\n", path);
+    exit(25);
+}
+
+/* Flatbuffers and Arrow are little endian, like every host calc builds on */
+static uint64_t read_unsigned(uint8_t* at, uint32_t size)
+{
+    uint64_t value;
+    uint32_t i;
+
+    value = 0;
+    for (i = size; i > 0; i--) {
+        value = (value << 8) | at[i - 1];
+    }
+
+    return value;
+}
+
+static int64_t read_signed(uint8_t* at, uint32_t size)
+{
+    uint64_t value;
+
+    value = read_unsigned(at, size);
+    if (size < 8 && (value >> (8 * size - 1)) != 0) {
+        value |= ~(uint64_t) 0 << (8 * size);
+    }
+
+    return (int64_t) value;
+}
+
+static uint8_t* flat_check(Flat* flat, uint8_t* at, uint64_t size)
+{
+    if (at < flat->base || at > flat->base + flat->size || size > (uint64_t) (flat->base + flat->size - at)) {
+        malformed(current_path);
+    }
+
+    return at;
+}
+
+static uint8_t* flat_root(Flat* flat)
+{
+    return flat_follow(flat, flat_check(flat, flat->base, 4));
+}
+
+/* Where field 'id' of 'table' is, NULL when it is left at its default */
+static uint8_t* flat_field(Flat* flat, uint8_t* table, uint32_t id)
+{
+    uint8_t* vtable;
+    uint64_t offset;
+
+    vtable = flat_check(flat, table - read_signed(flat_check(flat, table, 4), 4), 4);
+    if (4 + 2 * (uint64_t) id + 2 > read_unsigned(vtable, 2)) {
+        return NULL;
+    }
+
+    offset = read_unsigned(flat_check(flat, vtable + 4 + 2 * id, 2), 2);
+    return (offset == 0) ? NULL : flat_check(flat, table + offset, 1);
+}
+
+static int64_t flat_scalar(Flat* flat, uint8_t* table, uint32_t id, uint32_t size, int64_t fallback)
+{
+    uint8_t* at;
+
+    if ((at = flat_field(flat, table, id)) == NULL) {
+        return fallback;
+    }
+
+    return read_signed(flat_check(flat, at, size), size);
+}
+
+/* The table, vector or string an offset at 'at' points to */
+static uint8_t* flat_follow(Flat* flat, uint8_t* at)
+{
+    return flat_check(flat, at + read_unsigned(flat_check(flat, at, 4), 4), 4);
+}
+
+static uint8_t* flat_table(Flat* flat, uint8_t* table, uint32_t id)
+{
+    uint8_t* at;
+
+    return ((at = flat_field(flat, table, id)) == NULL) ? NULL : flat_follow(flat, at);
+}
+
+/* The elements of a vector, or the bytes of a string */
+static uint8_t* flat_vector(Flat* flat, uint8_t* table, uint32_t id, uint32_t element_size, uint32_t* count)
+{
+    uint8_t* vector;
+
+    if ((vector = flat_table(flat, table, id)) == NULL) {
+        *count = 0;
+        return NULL;
+    }
+
+    *count = read_unsigned(vector, 4);
+    return flat_check(flat, vector + 4, (uint64_t) *count * element_size);
+}
+
+/* 'size' zeroed bytes at a multiple of 'align', returns where */
+static uint64_t build_alloc(FlatBuilder* b, uint64_t size, uint64_t align)
+{
+    uint64_t at;
+
+    at = (b->size + align - 1) / align * align;
+    if (at + size > b->capacity) {
+        b->capacity = (b->capacity == 0) ? INITIAL_FLAT_SIZE : b->capacity;
+        while (at + size > b->capacity) {
+            b->capacity *= FLAT_GROWTH_FACTOR;
+        }
+        if ((b->bytes = realloc(b->bytes, b->capacity)) == NULL) {
+            fprintf(stderr, "Failed to allocate Arrow metadata.\n");
+            exit(5);
+        }
+    }
+
+    memset(b->bytes + b->size, 0, at + size - b->size);
+    b->size = at + size;
+
+    return at;
+}
+
+static void build_put(FlatBuilder* b, uint64_t at, int64_t value, uint32_t size)
+{
+    uint32_t i;
+
+    for (i = 0; i < size; i++) {
+        b->bytes[at + i] = (uint64_t) value >> (8 * i);
+    }
+}
+
+/*
+    A table whose fields are all 8 byte slots, with bit i of 'present' set for
+    each field that is written. The vtable goes right in front of the table,
+    and whatever the table points to comes after it, so all offsets are positive.
+*/
+static uint64_t build_table(FlatBuilder* b, uint32_t n_fields, uint32_t present)
+{
+    uint64_t vtable;
+    uint64_t table;
+    uint32_t i;
+
+    vtable = build_alloc(b, 4 + 2 * n_fields, 2);
+    build_put(b, vtable, 4 + 2 * n_fields, 2);
+    build_put(b, vtable + 2, 8 + 8 * n_fields, 2);
+    for (i = 0; i < n_fields; i++) {
+        build_put(b, vtable + 4 + 2 * i, ((present >> i) & 1) ? 8 + 8 * i : 0, 2);
+    }
+
+    table = build_alloc(b, 8 + 8 * n_fields, 8);
+    build_put(b, table, table - vtable, 4);
+
+    return table;
+}
+
+static void build_link(FlatBuilder* b, uint64_t from, uint64_t target)
+{
+    build_put(b, from, target - from, 4);
+}
+
+/* Room for 'count' elements, 8 byte aligned after the length, returns where the length is */
+static uint64_t build_vector(FlatBuilder* b, uint32_t count, uint32_t element_size)
+{
+    uint64_t at;
+
+    if (build_alloc(b, 0, 4) % 8 == 0) {
+        build_alloc(b, 4, 4);
+    }
+    at = build_alloc(b, 4 + (uint64_t) count * element_size, 4);
+    build_put(b, at, count, 4);
+
+    return at;
+}
+
+static uint64_t build_string(FlatBuilder* b, char* text)
+{
+    uint64_t at;
+    uint64_t length;
+
+    length = strlen(text);
+    at = build_alloc(b, 4 + length + 1, 4);
+    build_put(b, at, length, 4);
+    memcpy(b->bytes + at + 4, text, length);
+
+    return at;
+}
+
+/* Schema: endianness, fields. Every field is a non nullable Int(64, signed) or FloatingPoint(DOUBLE or SINGLE) */
+static uint64_t build_schema(FlatBuilder* b, ArrowWriter* writer)
+{
+    uint64_t schema;
+    uint64_t fields;
+    uint64_t field;
+    uint64_t type;
+    uint32_t i;
+
+    schema = build_table(b, 2, 0x3);
+    fields = build_vector(b, writer->width, 4);
+    build_link(b, FLAT_SLOT(schema, 1), fields);
+
+    for (i = 0; i < writer->width; i++) {
+        /* Field: name, nullable, type_type, type, dictionary, children */
+        field = build_table(b, 6, 0x2F);
+        build_link(b, fields + 4 + 4 * i, field);
+        build_link(b, FLAT_SLOT(field, 0), build_string(b, writer->names[i]));
+        if (writer->types[i] == TOK_LONG) {
+            build_put(b, FLAT_SLOT(field, 2), ARROW_TYPE_INT, 1);
+            type = build_table(b, 2, 0x3);
+            build_put(b, FLAT_SLOT(type, 0), 64, 4);
+            build_put(b, FLAT_SLOT(type, 1), 1, 1);
+        } else {
+            build_put(b, FLAT_SLOT(field, 2), ARROW_TYPE_FLOATING_POINT, 1);
+            type = build_table(b, 1, 0x1);
+            build_put(b, FLAT_SLOT(type, 0), (writer->types[i] == TOK_FLOAT) ? ARROW_PRECISION_SINGLE : ARROW_PRECISION_DOUBLE, 2);
+        }
+        build_link(b, FLAT_SLOT(field, 3), type);
+        build_link(b, FLAT_SLOT(field, 5), build_vector(b, 0, 4));
+    }
+
+    return schema;
+}
+
+/* Message: version, header_type, header, bodyLength. The caller links the header */
+static uint64_t build_message(FlatBuilder* b, uint8_t header_type)
+{
+    uint64_t message;
+
+    build_alloc(b, ARROW_ALIGNMENT, ARROW_ALIGNMENT);
+    message = build_table(b, 4, 0xF);
+    build_put(b, 0, message, 4);
+    build_put(b, FLAT_SLOT(message, 0), ARROW_VERSION_V5, 2);
+    build_put(b, FLAT_SLOT(message, 1), header_type, 1);
+
+    return message;
+}
+
+/* The continuation marker, the padded length, then the flatbuffer */
+static void write_message(ArrowWriter* writer, FlatBuilder* b)
+{
+    uint8_t prefix[8];
+    uint64_t padded;
+
+    padded = (b->size + ARROW_ALIGNMENT - 1) / ARROW_ALIGNMENT * ARROW_ALIGNMENT;
+    memset(prefix, 0xFF, 4);
+    prefix[4] = padded;
+    prefix[5] = padded >> 8;
+    prefix[6] = padded >> 16;
+    prefix[7] = padded >> 24;
+
+    fwrite(prefix, 1, sizeof(prefix), writer->out);
+    fwrite(b->bytes, 1, b->size, writer->out);
+    writer->offset += sizeof(prefix) + b->size;
+    write_padding(writer, padded - b->size);
+}
+
+static void write_padding(ArrowWriter* writer, uint64_t size)
+{
+    static const uint8_t zeros[ARROW_ALIGNMENT] = { 0 };
+
+    fwrite(zeros, 1, size, writer->out);
+    writer->offset += size;
+}
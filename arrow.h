@@ -0,0 +1,51 @@
+#ifndef CALC_ARROW_H
+#define CALC_ARROW_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "token.h"
+#include "column.h"
+#include "columnar.h"
+
+/*
+    The Apache Arrow IPC file format, as far as flat int64, double and float
+    columns go. A file is the magic 'ARROW1', a schema message, record batch
+    messages and a footer locating them. Messages are flatbuffers, read here
+    field by field and bounds checked against the file, and written front to
+    back with every table field in an 8 byte slot.
+*/
+
+typedef struct {
+    int64_t offset;
+    int32_t metadata_length;
+    int64_t body_length;
+} ArrowBlock;
+
+typedef struct {
+    FILE* out;
+
+    /* Bytes written so far */
+    uint64_t offset;
+
+    char** names;
+    TokenType* types;
+    uint32_t width;
+
+    /* Every record batch, for the footer */
+    ArrowBlock* blocks;
+    uint32_t n_blocks;
+    uint32_t capacity;
+} ArrowWriter;
+
+/* Maps 'path' and adds every record batch in it to 'table' */
+void read_arrow(MappedTable* table, char* path);
+
+/* Writes the magic and the schema, 'names' and 'types' must outlive 'writer' */
+void begin_arrow(ArrowWriter* writer, FILE* out, char** names, TokenType* types, uint32_t width);
+void write_arrow_batch(ArrowWriter* writer, Column* columns, uint64_t rows);
+
+/* Writes the footer and frees what 'writer' holds */
+void end_arrow(ArrowWriter* writer);
+
+#endif
@@ -0,0 +1,52 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "ast.h"
+
+void init_ast(Ast* ast)
+{
+    ast->nodes = NULL;
+    ast->size = 0;
+    ast->capacity = 0;
+}
+
+uint32_t add_node(Ast* ast, NodeKind kind, Token* token, uint32_t position, uint32_t first_child, uint32_t n_children)
+{
+    Node* node;
+
+    if (ast->size == ast->capacity) {
+        ast->capacity = (ast->capacity == 0) ? INITIAL_AST_SIZE : ast->capacity * AST_GROWTH_FACTOR;
+        if ((ast->nodes = realloc(ast->nodes, sizeof(Node) * ast->capacity)) == NULL) {
+            fprintf(stderr, "Failed to allocate syntax tree.\n");
+            exit(5);
+        }
+    }
+
+    node = &ast->nodes[ast->size];
+    node->kind = kind;
+    node->token = *token;
+    node->position = position;
+    node->n_children = n_children;
+    node->first_child = first_child;
+    node->next_sibling = NO_NODE;
+    node->jump = TOK_EOF;
+
+    return ast->size++;
+}
+
+void reset_ast(Ast* ast)
+{
+    uint32_t i;
+
+    for (i = 0; i < ast->size; i++) {
+        scrub_token(&ast->nodes[i].token);
+    }
+    ast->size = 0;
+}
+
+void free_ast(Ast* ast)
+{
+    reset_ast(ast);
+    free(ast->nodes);
+    init_ast(ast);
+}
@@ -0,0 +1,77 @@
+#ifndef CALC_AST_H
+#define CALC_AST_H
+
+#include <stdint.h>
+
+#include "token.h"
+
+/*
+    The syntax tree 'parse_expr()' builds, every node in one arena and
+    addressed by index. A node is only added once its children are, so a
+    subtree is a contiguous run of nodes ending in its root, and the arena in
+    index order is the tree in RPN. Children hang off their parent as a list,
+    first child and next sibling, so nodes of any arity are the same size.
+
+    Tokens are owned by their node until whoever takes them, like the parser
+    lowering a tree to RPN, sets the node's token to TOK_EOF. 'reset_ast()'
+    scrubs the rest.
+*/
+
+#define NO_NODE ((uint32_t) -1)
+
+#define INITIAL_AST_SIZE 64
+#define AST_GROWTH_FACTOR 2
+
+typedef enum {
+    /* A number or string */
+    NODE_VALUE,
+    NODE_VARIABLE,
+
+    /* Unary minus, the one child is the operand */
+    NODE_NEGATE,
+
+    /* 'token' is the operator, the children are the operands */
+    NODE_BINARY,
+
+    /* 'token' is the builtin, like TOK_SIN or TOK_IF */
+    NODE_BUILTIN,
+
+    /* 'token' is the identifier in front of the parentheses */
+    NODE_CALL,
+    NODE_ARRAY,
+
+    /* Stands in for whatever failed to parse, see 'syntax_error()' */
+    NODE_ERROR
+} NodeKind;
+
+typedef struct {
+    NodeKind kind;
+    Token token;
+
+    /* Byte offset of the token in the source, for error messages */
+    uint32_t position;
+
+    uint32_t n_children;
+    uint32_t first_child;
+    uint32_t next_sibling;
+
+    /* Emitted right after the node, when it is the condition or a branch of an 'if()', '&&' or '||' */
+    TokenType jump;
+} Node;
+
+typedef struct {
+    Node* nodes;
+    uint32_t size;
+    uint32_t capacity;
+} Ast;
+
+void init_ast(Ast* ast);
+
+/* Takes ownership of 'token', the children are linked to each other already */
+uint32_t add_node(Ast* ast, NodeKind kind, Token* token, uint32_t position, uint32_t first_child, uint32_t n_children);
+
+/* Scrubs whatever tokens are left and empties the arena, keeping its memory */
+void reset_ast(Ast* ast);
+void free_ast(Ast* ast);
+
+#endif
@@ -0,0 +1,664 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "autodiff.h"
+#include "aggregate.h"
+#include "builtin.h"
+#include "fail.h"
+
+/* Operands the tape keeps for each instruction, enough for fma() and any native */
+#define TAPE_OPERANDS MAX_NATIVE_ARITY
+
+static Token apply_token(Token* op, Token* t1, Token* t2);
+static Token apply_fma(Token* op, Token* t1, Token* t2, Token* t3);
+static void local_partials(Token* op, double a, double b, double result, double* da, double* db);
+static void native_partials(Native* native, double* args, double result, double* partials);
+static int64_t find_wrt(char** wrt, uint32_t n_wrt, char* name);
+static Token lookup_bound(Env* env, char* name);
+
+void eval_gradient(TokenStack* program, Env* env, char** wrt, uint32_t n_wrt,
+    Token* value, double* partials)
+{
+    Token* values;
+    double* grads;
+    Token* kept;
+    double* kept_grads;
+    double* ga;
+    double* gb;
+    double* gc;
+    double da;
+    double db;
+    double point[MAX_NATIVE_ARITY];
+    double local[MAX_NATIVE_ARITY];
+    double sum;
+    Token result;
+    Token* op;
+    uint64_t ip;
+    uint64_t sp;
+    int64_t var;
+    uint32_t j;
+    uint32_t k;
+    uint32_t n;
+    Failure failure;
+    bool caught;
+    bool truth;
+
+    /* One value and one gradient row per stack slot */
+    values = malloc(sizeof(Token) * (program->size + 1));
+    grads = calloc((program->size + 1) * (n_wrt + 1), sizeof(double));
+
+    /* The same for every TOK_STORE slot */
+    kept = malloc(sizeof(Token) * (program->size + 1));
+    kept_grads = calloc((program->size + 1) * (n_wrt + 1), sizeof(double));
+    if (values == NULL || grads == NULL || kept == NULL || kept_grads == NULL) {
+        fprintf(stderr, "Failed to allocate gradient stack.\n");
+        exit(5);
+    }
+
+    /* Like 'integrate_lambda()', the stacks are freed when a failure goes past */
+    caught = caught_failure() != NULL;
+    if (caught) {
+        catch_failures(&failure);
+        if (setjmp(failure.jump) != 0) {
+            free(values);
+            free(grads);
+            free(kept);
+            free(kept_grads);
+            pass_failure(&failure);
+        }
+    }
+
+    sp = 0;
+    for (ip = 0; ip < program->size; ip++) {
+        op = &program->base[ip];
+
+        /* Jumps go where 'eval_program()' goes, only the branch taken is differentiated */
+        if (op->type == TOK_IF) {
+            continue;
+        }
+        if (op->type == TOK_ELSE) {
+            ip += op->as.i64;
+            continue;
+        }
+        if (op->type == TOK_THEN) {
+            sp--;
+            if (!token_is_true(&values[sp])) {
+                ip += op->as.i64;
+            }
+            continue;
+        }
+        if (op->type == TOK_STORE) {
+            kept[op->as.i64] = values[sp - 1];
+            memcpy(&kept_grads[op->as.i64 * n_wrt], &grads[(sp - 1) * n_wrt], sizeof(double) * n_wrt);
+            continue;
+        }
+        if (op->type == TOK_LOAD) {
+            values[sp] = kept[op->as.i64];
+            memcpy(&grads[sp * n_wrt], &kept_grads[op->as.i64 * n_wrt], sizeof(double) * n_wrt);
+            sp++;
+            continue;
+        }
+        if (IS_JUMP(op->type) || op->type == TOK_AND || op->type == TOK_OR) {
+            truth = token_is_true(&values[sp - 1]);
+            if (IS_JUMP(op->type) && truth != (op->type == TOK_SHORT_OR)) {
+                sp--;
+                continue;
+            }
+
+            /* A 0 or 1 whatever the inputs, so it has no gradient */
+            values[sp - 1].type = TOK_LONG;
+            values[sp - 1].as.i64 = truth;
+            ga = &grads[(sp - 1) * n_wrt];
+            for (j = 0; j < n_wrt; j++) {
+                ga[j] = 0.0;
+            }
+            if (IS_JUMP(op->type)) {
+                ip += op->as.i64;
+            }
+            continue;
+        }
+
+        /* The chain rule over however many arguments, the result takes the place of the first */
+        if (op->type == TOK_NATIVE) {
+            n = op->as.native->arity;
+            for (k = 0; k < n; k++) {
+                point[k] = token_to_double(&values[sp - n + k]);
+            }
+            result.type = TOK_DOUBLE;
+            result.as.f64 = op->as.native->scalar(point);
+            native_partials(op->as.native, point, result.as.f64, local);
+
+            ga = &grads[(sp - n) * n_wrt];
+            for (j = 0; j < n_wrt; j++) {
+                sum = 0.0;
+                for (k = 0; k < n; k++) {
+                    sum += local[k] * grads[(sp - n + k) * n_wrt + j];
+                }
+                ga[j] = sum;
+            }
+            values[sp - n] = result;
+            sp = sp - n + 1;
+            continue;
+        }
+
+        switch (get_arity(op)) {
+            case 0: {
+                ga = &grads[sp * n_wrt];
+                for (j = 0; j < n_wrt; j++) {
+                    ga[j] = 0.0;
+                }
+
+                if (op->type == TOK_IDENTIFIER) {
+                    values[sp] = lookup_bound(env, op->as.string);
+                    if ((var = find_wrt(wrt, n_wrt, op->as.string)) >= 0) {
+                        ga[var] = 1.0;
+                    }
+                } else if (!IS_NUMBER(op)) {
+                    fail(29, "Cannot differentiate instruction.");
+                } else {
+                    values[sp] = *op;
+                }
+                sp++;
+                break;
+            }
+            case 1: {
+                ga = &grads[(sp - 1) * n_wrt];
+
+                result = apply_token(op, &values[sp - 1], NULL);
+                local_partials(op, token_to_double(&values[sp - 1]), 0.0, token_to_double(&result), &da, &db);
+
+                for (j = 0; j < n_wrt; j++) {
+                    ga[j] *= da;
+                }
+                values[sp - 1] = result;
+                break;
+            }
+            case 3: {
+                ga = &grads[(sp - 3) * n_wrt];
+                gb = &grads[(sp - 2) * n_wrt];
+                gc = &grads[(sp - 1) * n_wrt];
+
+                result = apply_fma(op, &values[sp - 3], &values[sp - 2], &values[sp - 1]);
+                da = token_to_double(&values[sp - 2]);
+                db = token_to_double(&values[sp - 3]);
+
+                for (j = 0; j < n_wrt; j++) {
+                    ga[j] = ga[j] * da + gb[j] * db + gc[j];
+                }
+                values[sp - 3] = result;
+                sp -= 2;
+                break;
+            }
+            default: {
+                ga = &grads[(sp - 2) * n_wrt];
+                gb = &grads[(sp - 1) * n_wrt];
+
+                result = apply_token(op, &values[sp - 2], &values[sp - 1]);
+                local_partials(op, token_to_double(&values[sp - 2]), token_to_double(&values[sp - 1]),
+                    token_to_double(&result), &da, &db);
+
+                for (j = 0; j < n_wrt; j++) {
+                    ga[j] = ga[j] * da + gb[j] * db;
+                }
+                values[sp - 2] = result;
+                sp--;
+                break;
+            }
+        }
+    }
+
+    *value = values[0];
+    for (j = 0; j < n_wrt; j++) {
+        partials[j] = grads[j];
+    }
+
+    if (caught) {
+        release_failures(&failure);
+    }
+    free(values);
+    free(grads);
+    free(kept);
+    free(kept_grads);
+}
+
+void eval_gradient_reverse(TokenStack* program, Env* env, char** wrt, uint32_t n_wrt,
+    Token* value, double* partials)
+{
+    Token* values;
+    uint64_t* stack;
+    uint64_t* args;
+    uint64_t* kept;
+    double* adjoints;
+    double da;
+    double db;
+    double point[MAX_NATIVE_ARITY];
+    double local[MAX_NATIVE_ARITY];
+    Token* op;
+    uint64_t ip;
+    uint64_t sp;
+    int64_t var;
+    uint32_t j;
+    uint32_t k;
+    uint32_t n;
+    Failure failure;
+    bool caught;
+    bool truth;
+
+    /* The tape is the program itself, plus each instruction's value and operands */
+    values = malloc(sizeof(Token) * (program->size + 1));
+    stack = malloc(sizeof(uint64_t) * (program->size + 1));
+    args = malloc(sizeof(uint64_t) * TAPE_OPERANDS * (program->size + 1));
+    adjoints = calloc(program->size + 1, sizeof(double));
+    kept = malloc(sizeof(uint64_t) * (program->size + 1));
+    if (values == NULL || stack == NULL || args == NULL || adjoints == NULL || kept == NULL) {
+        fprintf(stderr, "Failed to allocate gradient tape.\n");
+        exit(5);
+    }
+
+    /* The same for the tape */
+    caught = caught_failure() != NULL;
+    if (caught) {
+        catch_failures(&failure);
+        if (setjmp(failure.jump) != 0) {
+            free(values);
+            free(stack);
+            free(args);
+            free(adjoints);
+            free(kept);
+            pass_failure(&failure);
+        }
+    }
+
+    /* Forward sweep */
+    stack[0] = 0;
+    sp = 0;
+    for (ip = 0; ip < program->size; ip++) {
+        op = &program->base[ip];
+
+        /* Same jumps as in 'eval_gradient()', what is skipped never makes it onto the tape */
+        if (op->type == TOK_IF) {
+            continue;
+        }
+        if (op->type == TOK_ELSE) {
+            ip += op->as.i64;
+            continue;
+        }
+        if (op->type == TOK_THEN) {
+            sp--;
+            if (!token_is_true(&values[stack[sp]])) {
+                ip += op->as.i64;
+            }
+            continue;
+        }
+
+        /* A stored value is the instruction that computed it, its adjoint adds up over every load */
+        if (op->type == TOK_STORE) {
+            kept[op->as.i64] = stack[sp - 1];
+            continue;
+        }
+        if (op->type == TOK_LOAD) {
+            stack[sp++] = kept[op->as.i64];
+            continue;
+        }
+        if (IS_JUMP(op->type) || op->type == TOK_AND || op->type == TOK_OR) {
+            truth = token_is_true(&values[stack[sp - 1]]);
+            if (IS_JUMP(op->type) && truth != (op->type == TOK_SHORT_OR)) {
+                sp--;
+                continue;
+            }
+
+            values[ip].type = TOK_LONG;
+            values[ip].as.i64 = truth;
+            stack[sp - 1] = ip;
+            if (IS_JUMP(op->type)) {
+                ip += op->as.i64;
+            }
+            continue;
+        }
+        if (op->type == TOK_NATIVE) {
+            n = op->as.native->arity;
+            for (k = 0; k < n; k++) {
+                args[TAPE_OPERANDS * ip + k] = stack[sp - n + k];
+                point[k] = token_to_double(&values[stack[sp - n + k]]);
+            }
+            values[ip].type = TOK_DOUBLE;
+            values[ip].as.f64 = op->as.native->scalar(point);
+            sp -= n;
+            stack[sp++] = ip;
+            continue;
+        }
+
+        switch (get_arity(op)) {
+            case 0: {
+                if (op->type == TOK_IDENTIFIER) {
+                    values[ip] = lookup_bound(env, op->as.string);
+                } else if (!IS_NUMBER(op)) {
+                    fail(29, "Cannot differentiate instruction.");
+                } else {
+                    values[ip] = *op;
+                }
+                break;
+            }
+            case 1: {
+                args[TAPE_OPERANDS * ip] = stack[sp - 1];
+                values[ip] = apply_token(op, &values[args[TAPE_OPERANDS * ip]], NULL);
+                sp -= 1;
+                break;
+            }
+            case 3: {
+                args[TAPE_OPERANDS * ip] = stack[sp - 3];
+                args[TAPE_OPERANDS * ip + 1] = stack[sp - 2];
+                args[TAPE_OPERANDS * ip + 2] = stack[sp - 1];
+                values[ip] = apply_fma(op, &values[args[TAPE_OPERANDS * ip]], &values[args[TAPE_OPERANDS * ip + 1]], &values[args[TAPE_OPERANDS * ip + 2]]);
+                sp -= 3;
+                break;
+            }
+            default: {
+                args[TAPE_OPERANDS * ip] = stack[sp - 2];
+                args[TAPE_OPERANDS * ip + 1] = stack[sp - 1];
+                values[ip] = apply_token(op, &values[args[TAPE_OPERANDS * ip]], &values[args[TAPE_OPERANDS * ip + 1]]);
+                sp -= 2;
+                break;
+            }
+        }
+
+        stack[sp++] = ip;
+    }
+
+    /* Reverse sweep, every instruction hands its adjoint down to its operands */
+    for (j = 0; j < n_wrt; j++) {
+        partials[j] = 0.0;
+    }
+
+    /* The last instruction could be an 'if', the result is whatever its branch left */
+    adjoints[stack[0]] = 1.0;
+    for (ip = program->size; ip-- > 0;) {
+        op = &program->base[ip];
+
+        /* Skipped instructions have nothing on the tape and never get an adjoint */
+        if (adjoints[ip] == 0.0 || IS_JUMP(op->type) || op->type == TOK_AND || op->type == TOK_OR) {
+            continue;
+        }
+
+        /* Partials at the arguments the forward sweep called it with, not a second call */
+        if (op->type == TOK_NATIVE) {
+            n = op->as.native->arity;
+            for (k = 0; k < n; k++) {
+                point[k] = token_to_double(&values[args[TAPE_OPERANDS * ip + k]]);
+            }
+            native_partials(op->as.native, point, values[ip].as.f64, local);
+            for (k = 0; k < n; k++) {
+                adjoints[args[TAPE_OPERANDS * ip + k]] += adjoints[ip] * local[k];
+            }
+            continue;
+        }
+
+        switch (get_arity(op)) {
+            case 0: {
+                if (op->type == TOK_IDENTIFIER && (var = find_wrt(wrt, n_wrt, op->as.string)) >= 0) {
+                    partials[var] += adjoints[ip];
+                }
+                break;
+            }
+            case 1: {
+                local_partials(op, token_to_double(&values[args[TAPE_OPERANDS * ip]]), 0.0, token_to_double(&values[ip]), &da, &db);
+                adjoints[args[TAPE_OPERANDS * ip]] += adjoints[ip] * da;
+                break;
+            }
+            case 3: {
+                adjoints[args[TAPE_OPERANDS * ip]] += adjoints[ip] * token_to_double(&values[args[TAPE_OPERANDS * ip + 1]]);
+                adjoints[args[TAPE_OPERANDS * ip + 1]] += adjoints[ip] * token_to_double(&values[args[TAPE_OPERANDS * ip]]);
+                adjoints[args[TAPE_OPERANDS * ip + 2]] += adjoints[ip];
+                break;
+            }
+            default: {
+                local_partials(op, token_to_double(&values[args[TAPE_OPERANDS * ip]]), token_to_double(&values[args[TAPE_OPERANDS * ip + 1]]),
+                    token_to_double(&values[ip]), &da, &db);
+                adjoints[args[TAPE_OPERANDS * ip]] += adjoints[ip] * da;
+                adjoints[args[TAPE_OPERANDS * ip + 1]] += adjoints[ip] * db;
+                break;
+            }
+        }
+    }
+
+    *value = values[stack[0]];
+
+    if (caught) {
+        release_failures(&failure);
+    }
+    free(values);
+    free(stack);
+    free(args);
+    free(adjoints);
+    free(kept);
+}
+
+uint32_t collect_variables(TokenStack* program, Env* env, char** names, uint32_t max_names)
+{
+    uint32_t n;
+    uint64_t ip;
+    char* name;
+
+    n = 0;
+    for (ip = 0; ip < program->size && n < max_names; ip++) {
+        if (program->base[ip].type != TOK_IDENTIFIER) {
+            continue;
+        }
+
+        name = program->base[ip].as.string;
+        if (lookup_variable(env, name) != NULL && find_wrt(names, n, name) < 0) {
+            names[n++] = name;
+        }
+    }
+
+    return n;
+}
+
+bool can_differentiate(TokenStack* program)
+{
+    Token* op;
+    uint64_t ip;
+
+    for (ip = 0; ip < program->size; ip++) {
+        op = &program->base[ip];
+
+        switch (op->type) {
+            case TOK_IF:
+            case TOK_ELSE:
+            case TOK_STORE:
+            case TOK_LOAD:
+            case TOK_AND:
+            case TOK_OR:
+            case TOK_IDENTIFIER:
+            case TOK_LONG:
+            case TOK_DOUBLE:
+            case TOK_BIGINT:
+            case TOK_ADD:
+            case TOK_SUB:
+            case TOK_MUL:
+            case TOK_DIV:
+            case TOK_MOD:
+            case TOK_EXP:
+            case TOK_SIN:
+            case TOK_COS:
+            case TOK_TAN:
+            case TOK_FMA: {
+                break;
+            }
+            case TOK_NATIVE: {
+                if (op->as.native->arity > 0 && op->as.native->derivative == NULL) {
+                    return false;
+                }
+                break;
+            }
+            default: {
+                if (!IS_JUMP(op->type) && !IS_COMPARISON(op->type)) {
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+/* The same Token arithmetic 'eval_program()' uses */
+static Token apply_token(Token* op, Token* t1, Token* t2)
+{
+    switch (op->type) {
+        case TOK_ADD: {
+            return add_tokens(t1, t2);
+        }
+        case TOK_SUB: {
+            return sub_tokens(t1, t2);
+        }
+        case TOK_MUL: {
+            return mul_tokens(t1, t2);
+        }
+        case TOK_DIV: {
+            return div_tokens(t1, t2);
+        }
+        case TOK_MOD: {
+            return mod_tokens(t1, t2);
+        }
+        case TOK_EXP: {
+            return exp_tokens(t1, t2);
+        }
+        case TOK_SIN: {
+            return sin_token(t1);
+        }
+        case TOK_COS: {
+            return cos_token(t1);
+        }
+        case TOK_TAN: {
+            return tan_token(t1);
+        }
+        default: {
+            if (IS_AGGREGATE(op->type)) {
+                return aggregate_token(op->type, t1);
+            }
+            if (IS_COMPARISON(op->type)) {
+                return compare_tokens(op->type, t1, t2);
+            }
+
+            fail(29, "Cannot differentiate instruction.");
+        }
+    }
+}
+
+/* fma() is the only instruction of 3 operands with a gradient, a*b + c */
+static Token apply_fma(Token* op, Token* t1, Token* t2, Token* t3)
+{
+    if (op->type != TOK_FMA) {
+        fail(29, "Cannot differentiate instruction.");
+    }
+
+    return fma_tokens(t1, t2, t3);
+}
+
+/* d(result)/da and d(result)/db of a single instruction */
+static void local_partials(Token* op, double a, double b, double result, double* da, double* db)
+{
+    *da = 0.0;
+    *db = 0.0;
+
+    switch (op->type) {
+        case TOK_ADD: {
+            *da = 1.0;
+            *db = 1.0;
+            break;
+        }
+        case TOK_SUB: {
+            *da = 1.0;
+            *db = -1.0;
+            break;
+        }
+        case TOK_MUL: {
+            *da = b;
+            *db = a;
+            break;
+        }
+        case TOK_DIV: {
+            *da = 1.0 / b;
+            *db = -a / (b * b);
+            break;
+        }
+        case TOK_MOD: {
+            *da = 1.0;
+            *db = -(double) (int64_t) (a / b);
+            break;
+        }
+        case TOK_EXP: {
+            *da = (b == 0.0) ? 0.0 : b * pow(a, b - 1.0);
+
+            /* a^b is only differentiable in b where a > 0 */
+            *db = (a > 0.0) ? pow(a, b) * log(a) : 0.0;
+            break;
+        }
+        case TOK_SIN: {
+            *da = cos(a);
+            break;
+        }
+        case TOK_COS: {
+            *da = -sin(a);
+            break;
+        }
+        case TOK_TAN: {
+            *da = 1.0 + result * result;
+            break;
+        }
+        case TOK_AGG_SUM:
+        case TOK_AGG_MEAN:
+        case TOK_AGG_MIN:
+        case TOK_AGG_MAX: {
+            /* Over a single value these are the identity */
+            *da = 1.0;
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+/* A native without a derivative can still be differentiated when it takes no arguments */
+static void native_partials(Native* native, double* args, double result, double* partials)
+{
+    if (native->arity == 0) {
+        return;
+    }
+    if (native->derivative == NULL) {
+        fail(29, "Cannot differentiate '%s', it has no derivative.", native->name);
+    }
+
+    native->derivative(args, result, partials);
+}
+
+static int64_t find_wrt(char** wrt, uint32_t n_wrt, char* name)
+{
+    uint32_t j;
+
+    for (j = 0; j < n_wrt; j++) {
+        if (strcmp(wrt[j], name) == 0) {
+            return j;
+        }
+    }
+
+    return -1;
+}
+
+static Token lookup_bound(Env* env, char* name)
+{
+    Token* value;
+
+    if ((value = lookup_variable(env, name)) == NULL) {
+        fail(23, "Unbound variable '%s'.", name);
+    }
+    if (!IS_NUMBER(value)) {
+        fail(29, "Cannot differentiate '%s', it is not a number.", name);
+    }
+
+    return *value;
+}
@@ -0,0 +1,42 @@
+#ifndef CALC_AUTODIFF_H
+#define CALC_AUTODIFF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "token.h"
+#include "eval.h"
+
+/*
+    Evaluates a program and its partial derivatives in a single pass.
+
+    The value is computed with the usual Token arithmetic, so it matches
+    'eval_program()' exactly. Derivatives are doubles and treat every operation
+    as its real valued counterpart, e.g. 7/2 differentiates like 7.0/2.0 and
+    a % b like a - trunc(a/b)*b.
+
+    Forward mode carries a gradient of 'n_wrt' partials alongside every value on
+    the stack, which is cheapest for a few variables. Reverse mode records the
+    values on a tape and sweeps it backwards once, which is cheapest for many.
+*/
+
+void eval_gradient(TokenStack* program, Env* env, char** wrt, uint32_t n_wrt,
+    Token* value, double* partials);
+void eval_gradient_reverse(TokenStack* program, Env* env, char** wrt, uint32_t n_wrt,
+    Token* value, double* partials);
+
+/*
+    Whether every instruction of 'program' has a derivative, so that the
+    functions above get through it on numbers. Calls, strings, rand(),
+    powmod(), nested solve() and friends and natives registered without a
+    derivative don't.
+*/
+bool can_differentiate(TokenStack* program);
+
+/*
+    The bound variables of 'program' in order of first appearance. The names
+    point into the program. Returns how many were written to 'names'.
+*/
+uint32_t collect_variables(TokenStack* program, Env* env, char** names, uint32_t max_names);
+
+#endif
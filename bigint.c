@@ -0,0 +1,1045 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "bigint.h"
+#include "fail.h"
+
+/* Largest power of ten in a limb, for converting to and from decimal */
+#define DECIMAL_BASE 1000000000u
+#define DECIMAL_DIGITS 9
+
+static BigInt* alloc_big(uint32_t size);
+static void normalize(BigInt* a);
+static int compare_limbs(uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb);
+static BigInt* add_magnitudes(BigInt* a, BigInt* b);
+static BigInt* sub_magnitudes(BigInt* a, BigInt* b);
+static void mul_limbs(uint32_t* out, uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb);
+static void schoolbook(uint32_t* out, uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb);
+static uint32_t add_limbs(uint32_t* out, uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb);
+static void add_at(uint32_t* out, uint32_t n_out, uint32_t* a, uint32_t na);
+static void sub_at(uint32_t* out, uint32_t n_out, uint32_t* a, uint32_t na);
+static uint32_t div_small(uint32_t* out, uint32_t* a, uint32_t na, uint32_t divisor);
+static void div_knuth(uint32_t* q, uint32_t* r, uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb);
+static void toom3(uint32_t* out, uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb);
+static void toom3_evaluate(BigInt** pieces, BigInt** values);
+static void div_newton(BigInt* a, BigInt* b, BigInt** quotient, BigInt** remainder);
+static BigInt* reciprocal(BigInt* d, uint64_t bits);
+static void settle(BigInt** quotient, BigInt** remainder, BigInt* divisor);
+static BigInt* big_from_limbs(uint32_t* limbs, uint32_t n);
+static BigInt* shift_left(BigInt* a, uint64_t bits);
+static BigInt* shift_right(BigInt* a, uint64_t bits);
+static uint64_t bit_length(BigInt* a);
+static void replace(BigInt** target, BigInt* value);
+static int leading_zeros(uint32_t x);
+
+BigInt* big_from_i64(int64_t value)
+{
+    BigInt* output;
+    uint64_t magnitude;
+
+    output = alloc_big(2);
+    output->negative = value < 0;
+
+    /* Negate as unsigned, so INT64_MIN works */
+    magnitude = (value < 0) ? -(uint64_t) value : (uint64_t) value;
+    output->limbs[0] = (uint32_t) magnitude;
+    output->limbs[1] = (uint32_t) (magnitude >> 32);
+    normalize(output);
+
+    return output;
+}
+
+/* Truncates toward zero, every double at or above 2^53 is an integer anyway */
+BigInt* big_from_double(double value)
+{
+    BigInt* output;
+    double magnitude;
+    double rest;
+    uint32_t size;
+    uint32_t i;
+
+    magnitude = floor(fabs(value));
+    if (magnitude != magnitude || magnitude > 1.0e308) {
+        fail(9, "Cannot make an integer out of %f.", value);
+    }
+
+    size = 0;
+    for (rest = magnitude; rest >= 1.0; rest = floor(rest / 4294967296.0)) {
+        size++;
+    }
+
+    output = alloc_big(size);
+    output->negative = false;
+    for (i = 0; i < size; i++) {
+        output->limbs[i] = (uint32_t) fmod(magnitude, 4294967296.0);
+        magnitude = floor(magnitude / 4294967296.0);
+    }
+    normalize(output);
+    output->negative = (output->size > 0) && value < 0.0;
+
+    return output;
+}
+
+BigInt* big_from_string(char* digits)
+{
+    BigInt* output;
+    uint64_t carry;
+    uint32_t chunk;
+    uint32_t scale;
+    uint32_t length;
+    uint32_t i;
+    uint32_t j;
+    uint32_t k;
+
+    length = strlen(digits);
+
+    /* 9 digits fit in a limb, which is more than 3 bits per digit */
+    output = alloc_big(length / DECIMAL_DIGITS + 2);
+    output->negative = false;
+    output->size = 0;
+
+    for (i = 0; i < length; i += k) {
+        k = (length - i) % DECIMAL_DIGITS;
+        if (i > 0 || k == 0) {
+            k = DECIMAL_DIGITS;
+        }
+
+        chunk = 0;
+        scale = 1;
+        for (j = 0; j < k; j++) {
+            chunk = chunk * 10 + (digits[i + j] - '0');
+            scale *= 10;
+        }
+
+        /* output = output * 10^k + chunk */
+        carry = chunk;
+        for (j = 0; j < output->size; j++) {
+            carry += (uint64_t) output->limbs[j] * scale;
+            output->limbs[j] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        if (carry != 0) {
+            output->limbs[output->size++] = (uint32_t) carry;
+        }
+    }
+
+    return output;
+}
+
+BigInt* big_copy(BigInt* a)
+{
+    BigInt* output;
+
+    output = alloc_big(a->size);
+    output->negative = a->negative;
+    memcpy(output->limbs, a->limbs, sizeof(uint32_t) * a->size);
+
+    return output;
+}
+
+void free_big(BigInt* target)
+{
+    free(target->limbs);
+    free(target);
+}
+
+BigInt* big_add(BigInt* a, BigInt* b)
+{
+    BigInt* output;
+
+    if (a->negative == b->negative) {
+        output = add_magnitudes(a, b);
+        output->negative = a->negative;
+    } else if (compare_limbs(a->limbs, a->size, b->limbs, b->size) >= 0) {
+        output = sub_magnitudes(a, b);
+        output->negative = a->negative;
+    } else {
+        output = sub_magnitudes(b, a);
+        output->negative = b->negative;
+    }
+
+    if (output->size == 0) {
+        output->negative = false;
+    }
+
+    return output;
+}
+
+BigInt* big_sub(BigInt* a, BigInt* b)
+{
+    BigInt* output;
+
+    if (a == b) {
+        return alloc_big(0);
+    }
+
+    /* a - b = a + (-b), without copying b */
+    b->negative = !b->negative;
+    output = big_add(a, b);
+    b->negative = !b->negative;
+
+    return output;
+}
+
+BigInt* big_mul(BigInt* a, BigInt* b)
+{
+    BigInt* output;
+
+    output = alloc_big(a->size + b->size);
+    if (a->size > 0 && b->size > 0) {
+        mul_limbs(output->limbs, a->limbs, a->size, b->limbs, b->size);
+    }
+    output->negative = a->negative != b->negative;
+    normalize(output);
+
+    return output;
+}
+
+void big_divmod(BigInt* a, BigInt* b, BigInt** quotient, BigInt** remainder)
+{
+    BigInt* q;
+    BigInt* r;
+    BigInt* ma;
+    BigInt* mb;
+
+    if (b->size == 0) {
+        fail(9, "Division by zero.");
+    }
+
+    if (compare_limbs(a->limbs, a->size, b->limbs, b->size) < 0) {
+        q = alloc_big(0);
+        r = big_copy(a);
+    } else if (b->size == 1) {
+        q = alloc_big(a->size);
+        r = alloc_big(1);
+        r->limbs[0] = div_small(q->limbs, a->limbs, a->size, b->limbs[0]);
+    } else if (b->size >= NEWTON_THRESHOLD && a->size - b->size >= NEWTON_THRESHOLD) {
+        ma = big_copy(a);
+        mb = big_copy(b);
+        ma->negative = false;
+        mb->negative = false;
+        div_newton(ma, mb, &q, &r);
+        free_big(ma);
+        free_big(mb);
+    } else {
+        q = alloc_big(a->size - b->size + 1);
+        r = alloc_big(b->size);
+        div_knuth(q->limbs, r->limbs, a->limbs, a->size, b->limbs, b->size);
+    }
+
+    /* Quotient rounds toward zero, remainder takes the sign of the dividend */
+    q->negative = a->negative != b->negative;
+    r->negative = a->negative;
+    normalize(q);
+    normalize(r);
+
+    if (quotient != NULL) {
+        *quotient = q;
+    } else {
+        free_big(q);
+    }
+    if (remainder != NULL) {
+        *remainder = r;
+    } else {
+        free_big(r);
+    }
+}
+
+BigInt* big_pow(BigInt* base, uint64_t exponent)
+{
+    BigInt* output;
+    BigInt* square;
+    BigInt* temp;
+
+    output = big_from_i64(1);
+    square = big_copy(base);
+
+    while (exponent > 0) {
+        if (exponent & 1) {
+            temp = big_mul(output, square);
+            free_big(output);
+            output = temp;
+        }
+
+        exponent >>= 1;
+        if (exponent > 0) {
+            temp = big_mul(square, square);
+            free_big(square);
+            square = temp;
+        }
+    }
+
+    free_big(square);
+
+    return output;
+}
+
+/* Left to right over the bits of 'exponent', reducing after every product */
+BigInt* big_powmod(BigInt* base, BigInt* exponent, BigInt* modulus)
+{
+    BigInt* output;
+    BigInt* m;
+    BigInt* b;
+    BigInt* temp;
+    uint32_t limb;
+    int bit;
+
+    if (exponent->negative) {
+        fail(9, "powmod() needs an exponent of at least 0.");
+    }
+
+    m = big_copy(modulus);
+    m->negative = false;
+
+    /* Base into [0, m), which also checks for a zero modulus */
+    big_divmod(base, m, NULL, &b);
+    if (b->negative) {
+        temp = big_add(b, m);
+        free_big(b);
+        b = temp;
+    }
+
+    /* 1 mod 1 is 0 */
+    temp = big_from_i64(1);
+    big_divmod(temp, m, NULL, &output);
+    free_big(temp);
+
+    for (limb = exponent->size; limb-- > 0;) {
+        for (bit = 31; bit >= 0; bit--) {
+            temp = big_mul(output, output);
+            free_big(output);
+            big_divmod(temp, m, NULL, &output);
+            free_big(temp);
+
+            if ((exponent->limbs[limb] >> bit) & 1) {
+                temp = big_mul(output, b);
+                free_big(output);
+                big_divmod(temp, m, NULL, &output);
+                free_big(temp);
+            }
+        }
+    }
+
+    free_big(b);
+    free_big(m);
+
+    return output;
+}
+
+int big_compare(BigInt* a, BigInt* b)
+{
+    int order;
+
+    if (a->negative != b->negative) {
+        return a->negative ? -1 : 1;
+    }
+
+    order = compare_limbs(a->limbs, a->size, b->limbs, b->size);
+
+    return a->negative ? -order : order;
+}
+
+bool big_to_i64(BigInt* a, int64_t* out)
+{
+    uint64_t magnitude;
+
+    if (a->size > 2) {
+        return false;
+    }
+
+    magnitude = 0;
+    if (a->size > 0) {
+        magnitude = a->limbs[0];
+    }
+    if (a->size > 1) {
+        magnitude |= (uint64_t) a->limbs[1] << 32;
+    }
+
+    if (a->negative) {
+        if (magnitude > (uint64_t) 1 << 63) {
+            return false;
+        }
+        *out = (int64_t) (0 - magnitude);
+    } else {
+        if (magnitude > (uint64_t) INT64_MAX) {
+            return false;
+        }
+        *out = (int64_t) magnitude;
+    }
+
+    return true;
+}
+
+double big_to_double(BigInt* a)
+{
+    double output;
+    uint32_t i;
+
+    /* Only the top few limbs can matter */
+    output = 0.0;
+    for (i = a->size; i > 0 && a->size - i < 3; i--) {
+        output = output * 4294967296.0 + a->limbs[i - 1];
+    }
+    output = ldexp(output, 32 * (i));
+
+    return a->negative ? -output : output;
+}
+
+char* big_to_string(BigInt* a)
+{
+    uint32_t* chunks;
+    uint32_t* scratch;
+    uint32_t n_chunks;
+    uint32_t size;
+    char* output;
+    char* pos;
+    uint32_t i;
+
+    /* Peel off 9 digits at a time, least significant first */
+    scratch = malloc(sizeof(uint32_t) * (a->size + 1));
+    chunks = malloc(sizeof(uint32_t) * (a->size * 2 + 2));
+    output = malloc(a->size * 10 + 3);
+    if (scratch == NULL || chunks == NULL || output == NULL) {
+        fprintf(stderr, "Failed to format integer.\n");
+        exit(5);
+    }
+
+    memcpy(scratch, a->limbs, sizeof(uint32_t) * a->size);
+    size = a->size;
+    n_chunks = 0;
+    while (size > 0) {
+        chunks[n_chunks++] = div_small(scratch, scratch, size, DECIMAL_BASE);
+        while (size > 0 && scratch[size - 1] == 0) {
+            size--;
+        }
+    }
+
+    pos = output;
+    if (a->negative) {
+        *pos++ = '-';
+    }
+    if (n_chunks == 0) {
+        *pos++ = '0';
+        *pos = '\0';
+    } else {
+        pos += sprintf(pos, "%u", chunks[n_chunks - 1]);
+        for (i = n_chunks - 1; i > 0; i--) {
+            pos += sprintf(pos, "%09u", chunks[i - 1]);
+        }
+    }
+
+    free(scratch);
+    free(chunks);
+
+    return output;
+}
+
+static BigInt* alloc_big(uint32_t size)
+{
+    BigInt* output;
+
+    if ((output = malloc(sizeof(BigInt))) == NULL
+        || (output->limbs = calloc(size + 1, sizeof(uint32_t))) == NULL) {
+        fprintf(stderr, "Failed to allocate integer.\n");
+        exit(5);
+    }
+    output->size = size;
+    output->negative = false;
+
+    return output;
+}
+
+static void normalize(BigInt* a)
+{
+    while (a->size > 0 && a->limbs[a->size - 1] == 0) {
+        a->size--;
+    }
+    if (a->size == 0) {
+        a->negative = false;
+    }
+}
+
+static int compare_limbs(uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb)
+{
+    uint32_t i;
+
+    while (na > 0 && a[na - 1] == 0) {
+        na--;
+    }
+    while (nb > 0 && b[nb - 1] == 0) {
+        nb--;
+    }
+
+    if (na != nb) {
+        return (na < nb) ? -1 : 1;
+    }
+    for (i = na; i > 0; i--) {
+        if (a[i - 1] != b[i - 1]) {
+            return (a[i - 1] < b[i - 1]) ? -1 : 1;
+        }
+    }
+
+    return 0;
+}
+
+static BigInt* add_magnitudes(BigInt* a, BigInt* b)
+{
+    BigInt* output;
+
+    output = alloc_big(((a->size > b->size) ? a->size : b->size) + 1);
+    output->size = add_limbs(output->limbs, a->limbs, a->size, b->limbs, b->size);
+    normalize(output);
+
+    return output;
+}
+
+/* |a| - |b|, with |a| >= |b| */
+static BigInt* sub_magnitudes(BigInt* a, BigInt* b)
+{
+    BigInt* output;
+
+    output = big_copy(a);
+    sub_at(output->limbs, output->size, b->limbs, b->size);
+    normalize(output);
+
+    return output;
+}
+
+/* out[0, na + nb) = a * b, 'out' must not overlap the inputs */
+static void mul_limbs(uint32_t* out, uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb)
+{
+    uint32_t* temp;
+    uint32_t* sa;
+    uint32_t* sb;
+    uint32_t* swap;
+    uint32_t n_sa;
+    uint32_t n_sb;
+    uint32_t length;
+    uint32_t offset;
+    uint32_t m;
+
+    if (na < nb) {
+        swap = a;
+        a = b;
+        b = swap;
+        m = na;
+        na = nb;
+        nb = m;
+    }
+
+    if (nb < KARATSUBA_THRESHOLD) {
+        schoolbook(out, a, na, b, nb);
+        return;
+    }
+
+    /* Lopsided, multiply b by a in b sized pieces */
+    if (2 * nb <= na) {
+        memset(out, 0, sizeof(uint32_t) * (na + nb));
+        if ((temp = malloc(sizeof(uint32_t) * 2 * nb)) == NULL) {
+            fprintf(stderr, "Failed to allocate product.\n");
+            exit(5);
+        }
+        for (offset = 0; offset < na; offset += nb) {
+            length = (na - offset < nb) ? na - offset : nb;
+            mul_limbs(temp, a + offset, length, b, nb);
+            add_at(out + offset, na + nb - offset, temp, length + nb);
+        }
+        free(temp);
+        return;
+    }
+
+    /* Toom-3 splits both in thirds, b has to reach into the top one */
+    if (nb >= TOOM3_THRESHOLD && nb > 2 * ((na + 2) / 3)) {
+        toom3(out, a, na, b, nb);
+        return;
+    }
+
+    /*
+        a = a1 B^m + a0, b = b1 B^m + b0 and nb > m here.
+        a b = a1 b1 B^2m + ((a0 + a1)(b0 + b1) - a0 b0 - a1 b1) B^m + a0 b0
+    */
+    m = na / 2;
+    sa = malloc(sizeof(uint32_t) * (na - m + 2));
+    sb = malloc(sizeof(uint32_t) * (na - m + 2));
+    temp = malloc(sizeof(uint32_t) * 2 * (na - m + 2));
+    if (sa == NULL || sb == NULL || temp == NULL) {
+        fprintf(stderr, "Failed to allocate product.\n");
+        exit(5);
+    }
+
+    mul_limbs(out, a, m, b, m);
+    mul_limbs(out + 2 * m, a + m, na - m, b + m, nb - m);
+
+    n_sa = add_limbs(sa, a, m, a + m, na - m);
+    n_sb = add_limbs(sb, b, m, b + m, nb - m);
+    mul_limbs(temp, sa, n_sa, sb, n_sb);
+
+    sub_at(temp, n_sa + n_sb, out, 2 * m);
+    sub_at(temp, n_sa + n_sb, out + 2 * m, na + nb - 2 * m);
+    add_at(out + m, na + nb - m, temp, n_sa + n_sb);
+
+    free(sa);
+    free(sb);
+    free(temp);
+}
+
+static void schoolbook(uint32_t* out, uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb)
+{
+    uint64_t carry;
+    uint32_t i;
+    uint32_t j;
+
+    memset(out, 0, sizeof(uint32_t) * (na + nb));
+
+    for (j = 0; j < nb; j++) {
+        carry = 0;
+        for (i = 0; i < na; i++) {
+            carry += (uint64_t) a[i] * b[j] + out[i + j];
+            out[i + j] = (uint32_t) carry;
+            carry >>= 32;
+        }
+        out[na + j] = (uint32_t) carry;
+    }
+}
+
+/* out = a + b, returns max(na, nb) + 1 */
+static uint32_t add_limbs(uint32_t* out, uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb)
+{
+    uint64_t carry;
+    uint32_t n;
+    uint32_t i;
+
+    n = (na > nb) ? na : nb;
+    carry = 0;
+    for (i = 0; i < n; i++) {
+        carry += (uint64_t) ((i < na) ? a[i] : 0) + ((i < nb) ? b[i] : 0);
+        out[i] = (uint32_t) carry;
+        carry >>= 32;
+    }
+    out[n] = (uint32_t) carry;
+
+    return n + 1;
+}
+
+/* out += a, the sum has to fit in 'n_out' limbs */
+static void add_at(uint32_t* out, uint32_t n_out, uint32_t* a, uint32_t na)
+{
+    uint64_t carry;
+    uint32_t i;
+
+    carry = 0;
+    for (i = 0; i < n_out && (i < na || carry != 0); i++) {
+        carry += (uint64_t) out[i] + ((i < na) ? a[i] : 0);
+        out[i] = (uint32_t) carry;
+        carry >>= 32;
+    }
+}
+
+/* out -= a, with out >= a */
+static void sub_at(uint32_t* out, uint32_t n_out, uint32_t* a, uint32_t na)
+{
+    uint64_t borrow;
+    uint64_t diff;
+    uint32_t i;
+
+    borrow = 0;
+    for (i = 0; i < n_out && (i < na || borrow != 0); i++) {
+        diff = (uint64_t) out[i] - ((i < na) ? a[i] : 0) - borrow;
+        out[i] = (uint32_t) diff;
+        borrow = (diff >> 32) & 1;
+    }
+}
+
+/* out = a / divisor, returns the remainder, 'out' may be 'a' */
+static uint32_t div_small(uint32_t* out, uint32_t* a, uint32_t na, uint32_t divisor)
+{
+    uint64_t remainder;
+    uint32_t i;
+
+    remainder = 0;
+    for (i = na; i > 0; i--) {
+        remainder = (remainder << 32) | a[i - 1];
+        out[i - 1] = (uint32_t) (remainder / divisor);
+        remainder %= divisor;
+    }
+
+    return (uint32_t) remainder;
+}
+
+/*
+    Knuth, TAOCP vol. 2, 4.3.1 algorithm D, na >= nb >= 2. 'q' gets na - nb + 1
+    limbs and 'r' gets nb.
+*/
+static void div_knuth(uint32_t* q, uint32_t* r, uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb)
+{
+    uint32_t* un;
+    uint32_t* vn;
+    uint64_t qhat;
+    uint64_t rhat;
+    uint64_t product;
+    int64_t borrow;
+    int64_t t;
+    int shift;
+    uint32_t i;
+    uint32_t j;
+
+    un = malloc(sizeof(uint32_t) * (na + 1));
+    vn = malloc(sizeof(uint32_t) * nb);
+    if (un == NULL || vn == NULL) {
+        fprintf(stderr, "Failed to allocate quotient.\n");
+        exit(5);
+    }
+
+    /* D1, normalize so the top bit of the divisor is set */
+    shift = leading_zeros(b[nb - 1]);
+    for (i = nb - 1; i > 0; i--) {
+        vn[i] = (b[i] << shift) | (shift ? (uint32_t) ((uint64_t) b[i - 1] >> (32 - shift)) : 0);
+    }
+    vn[0] = b[0] << shift;
+
+    un[na] = shift ? (uint32_t) ((uint64_t) a[na - 1] >> (32 - shift)) : 0;
+    for (i = na - 1; i > 0; i--) {
+        un[i] = (a[i] << shift) | (shift ? (uint32_t) ((uint64_t) a[i - 1] >> (32 - shift)) : 0);
+    }
+    un[0] = a[0] << shift;
+
+    for (j = na - nb + 1; j > 0; j--) {
+        /* D3, estimate the quotient digit from the top two limbs */
+        qhat = (((uint64_t) un[j - 1 + nb] << 32) | un[j - 2 + nb]) / vn[nb - 1];
+        rhat = (((uint64_t) un[j - 1 + nb] << 32) | un[j - 2 + nb]) % vn[nb - 1];
+
+        while (qhat >= ((uint64_t) 1 << 32)
+            || qhat * vn[nb - 2] > ((rhat << 32) | un[j - 3 + nb])) {
+            qhat--;
+            rhat += vn[nb - 1];
+            if (rhat >= ((uint64_t) 1 << 32)) {
+                break;
+            }
+        }
+
+        /* D4, multiply and subtract */
+        borrow = 0;
+        for (i = 0; i < nb; i++) {
+            product = qhat * vn[i];
+            t = (int64_t) un[i + j - 1] - borrow - (int64_t) (product & 0xFFFFFFFF);
+            un[i + j - 1] = (uint32_t) t;
+            borrow = (int64_t) (product >> 32) - (t >> 32);
+        }
+        t = (int64_t) un[j - 1 + nb] - borrow;
+        un[j - 1 + nb] = (uint32_t) t;
+
+        /* D5, D6, add back the rare time we took one too many */
+        q[j - 1] = (uint32_t) qhat;
+        if (t < 0) {
+            q[j - 1]--;
+            product = 0;
+            for (i = 0; i < nb; i++) {
+                product += (uint64_t) un[i + j - 1] + vn[i];
+                un[i + j - 1] = (uint32_t) product;
+                product >>= 32;
+            }
+            un[j - 1 + nb] += (uint32_t) product;
+        }
+    }
+
+    /* D8, unnormalize the remainder */
+    for (i = 0; i < nb - 1; i++) {
+        r[i] = (un[i] >> shift) | (shift ? (uint32_t) ((uint64_t) un[i + 1] << (32 - shift)) : 0);
+    }
+    r[nb - 1] = un[nb - 1] >> shift;
+
+    free(un);
+    free(vn);
+}
+
+/*
+    Toom-3: a = a2 x^2 + a1 x + a0 and b alike for x = B^k, so a b is a
+    polynomial of degree 4. It is evaluated at 0, 1, -1, -2 and infinity with
+    five products a third of the size, and interpolated back with Bodrato's
+    sequence, whose divisions by 2 and 3 are exact. Needs nb > 2k.
+*/
+static void toom3(uint32_t* out, uint32_t* a, uint32_t na, uint32_t* b, uint32_t nb)
+{
+    BigInt* pieces[3];
+    BigInt* at_a[5];
+    BigInt* at_b[5];
+    BigInt* r[5];
+    BigInt* r1;
+    BigInt* r2;
+    BigInt* r3;
+    BigInt* t;
+    uint32_t k;
+    uint32_t i;
+
+    k = (na + 2) / 3;
+
+    pieces[0] = big_from_limbs(a, k);
+    pieces[1] = big_from_limbs(a + k, k);
+    pieces[2] = big_from_limbs(a + 2 * k, na - 2 * k);
+    toom3_evaluate(pieces, at_a);
+
+    pieces[0] = big_from_limbs(b, k);
+    pieces[1] = big_from_limbs(b + k, k);
+    pieces[2] = big_from_limbs(b + 2 * k, nb - 2 * k);
+    toom3_evaluate(pieces, at_b);
+
+    /* r(0), r(1), r(-1), r(-2), r(infinity) */
+    for (i = 0; i < 5; i++) {
+        r[i] = big_mul(at_a[i], at_b[i]);
+        free_big(at_a[i]);
+        free_big(at_b[i]);
+    }
+
+    /* r3 = (r(-2) - r(1)) / 3 */
+    r3 = big_sub(r[3], r[1]);
+    div_small(r3->limbs, r3->limbs, r3->size, 3);
+    normalize(r3);
+
+    /* r1 = (r(1) - r(-1)) / 2, r2 = r(-1) - r(0) */
+    r1 = big_sub(r[1], r[2]);
+    div_small(r1->limbs, r1->limbs, r1->size, 2);
+    normalize(r1);
+    r2 = big_sub(r[2], r[0]);
+
+    /* r3 = (r2 - r3) / 2 + 2 r(infinity) */
+    t = big_sub(r2, r3);
+    div_small(t->limbs, t->limbs, t->size, 2);
+    normalize(t);
+    replace(&t, big_add(t, r[4]));
+    replace(&r3, big_add(t, r[4]));
+    free_big(t);
+
+    /* r2 = r2 + r1 - r(infinity), r1 = r1 - r3 */
+    replace(&r2, big_add(r2, r1));
+    replace(&r2, big_sub(r2, r[4]));
+    replace(&r1, big_sub(r1, r3));
+
+    /* Every coefficient of a product of nonnegative polynomials is nonnegative */
+    memset(out, 0, sizeof(uint32_t) * (na + nb));
+    add_at(out, na + nb, r[0]->limbs, r[0]->size);
+    add_at(out + k, na + nb - k, r1->limbs, r1->size);
+    add_at(out + 2 * k, na + nb - 2 * k, r2->limbs, r2->size);
+    add_at(out + 3 * k, na + nb - 3 * k, r3->limbs, r3->size);
+    add_at(out + 4 * k, na + nb - 4 * k, r[4]->limbs, r[4]->size);
+
+    for (i = 0; i < 5; i++) {
+        free_big(r[i]);
+    }
+    free_big(r1);
+    free_big(r2);
+    free_big(r3);
+}
+
+/* p(0), p(1), p(-1), p(-2) and p(infinity) of p = pieces[2] x^2 + pieces[1] x + pieces[0], takes the pieces */
+static void toom3_evaluate(BigInt** pieces, BigInt** values)
+{
+    BigInt* even;
+    BigInt* t;
+
+    even = big_add(pieces[0], pieces[2]);
+    values[0] = pieces[0];
+    values[1] = big_add(even, pieces[1]);
+    values[2] = big_sub(even, pieces[1]);
+
+    /* p(-2) = 2 (p(-1) + p2) - p0 */
+    t = big_add(values[2], pieces[2]);
+    replace(&t, big_add(t, t));
+    values[3] = big_sub(t, pieces[0]);
+    values[4] = pieces[2];
+
+    free_big(t);
+    free_big(even);
+    free_big(pieces[1]);
+}
+
+/*
+    Division by Newton's method, for magnitudes with a quotient and a divisor
+    of at least NEWTON_THRESHOLD limbs. The divisor is cut down to a limb more
+    than the quotient has, its reciprocal found to that precision, and one
+    product with the top of the dividend gives a quotient that is at most a
+    few off. The remainder then puts it right. It all comes down to a handful
+    of multiplications, instead of Knuth's quotient times divisor.
+*/
+static void div_newton(BigInt* a, BigInt* b, BigInt** quotient, BigInt** remainder)
+{
+    BigInt* d;
+    BigInt* top;
+    BigInt* q;
+    BigInt* r;
+    uint64_t nb_bits;
+    uint64_t bits;
+
+    nb_bits = bit_length(b);
+    bits = bit_length(a) - nb_bits + 32;
+    d = (nb_bits >= bits) ? shift_right(b, nb_bits - bits) : shift_left(b, bits - nb_bits);
+
+    /* a / b is about a 2^(bits - nb_bits) / d, and 2^(2 bits) / d is the reciprocal */
+    replace(&d, reciprocal(d, bits));
+    top = shift_right(a, nb_bits - 32);
+    q = big_mul(top, d);
+    replace(&q, shift_right(q, bits + 32));
+    free_big(top);
+    free_big(d);
+
+    d = big_mul(q, b);
+    r = big_sub(a, d);
+    free_big(d);
+
+    settle(&q, &r, b);
+    *quotient = q;
+    *remainder = r;
+}
+
+/*
+    About 2^(2 bits) / d, a few units either way, for a 'd' of exactly 'bits'
+    bits. The reciprocal of the top half (and a limb) of 'd' is right to about
+    half the bits, one Newton step x += x (2^(2 bits) - d x) / 2^(2 bits)
+    doubles that, and only the top half of the error term matters.
+*/
+static BigInt* reciprocal(BigInt* d, uint64_t bits)
+{
+    BigInt* one;
+    BigInt* x;
+    BigInt* e;
+    BigInt* t;
+    uint64_t half;
+    bool below;
+
+    one = big_from_i64(1);
+
+    /* Small enough for Knuth, exact */
+    if (d->size < NEWTON_THRESHOLD) {
+        t = shift_left(one, 2 * bits);
+        big_divmod(t, d, &x, NULL);
+        free_big(t);
+        free_big(one);
+        return x;
+    }
+
+    half = bits / 2 + 32;
+    t = shift_right(d, bits - half);
+    x = reciprocal(t, half);
+    free_big(t);
+
+    /* With x standing for x 2^(bits - half), 2^(2 bits) - d x is 2^(bits - half) e */
+    t = shift_left(one, bits + half);
+    e = big_mul(d, x);
+    replace(&e, big_sub(t, e));
+    free_big(t);
+    free_big(one);
+
+    /* The correction is x e / 2^(2 half), with the bottom of e dropped first */
+    below = e->negative;
+    replace(&e, shift_right(e, half));
+    replace(&e, big_mul(x, e));
+    replace(&e, shift_right(e, half));
+
+    replace(&x, shift_left(x, bits - half));
+    replace(&x, below ? big_sub(x, e) : big_add(x, e));
+    free_big(e);
+
+    return x;
+}
+
+/* Moves 'quotient' a step at a time until 0 <= 'remainder' < 'divisor' */
+static void settle(BigInt** quotient, BigInt** remainder, BigInt* divisor)
+{
+    BigInt* one;
+
+    one = big_from_i64(1);
+    while ((*remainder)->negative) {
+        replace(quotient, big_sub(*quotient, one));
+        replace(remainder, big_add(*remainder, divisor));
+    }
+    while (big_compare(*remainder, divisor) >= 0) {
+        replace(quotient, big_add(*quotient, one));
+        replace(remainder, big_sub(*remainder, divisor));
+    }
+    free_big(one);
+}
+
+/* A magnitude out of 'n' limbs, which may have leading zeros */
+static BigInt* big_from_limbs(uint32_t* limbs, uint32_t n)
+{
+    BigInt* output;
+
+    output = alloc_big(n);
+    memcpy(output->limbs, limbs, sizeof(uint32_t) * n);
+    normalize(output);
+
+    return output;
+}
+
+/* |a| << bits */
+static BigInt* shift_left(BigInt* a, uint64_t bits)
+{
+    BigInt* output;
+    uint32_t limbs;
+    int shift;
+    uint32_t i;
+
+    limbs = (uint32_t) (bits / 32);
+    shift = (int) (bits % 32);
+
+    output = alloc_big(a->size + limbs + 1);
+    for (i = 0; i < a->size; i++) {
+        output->limbs[i + limbs] |= a->limbs[i] << shift;
+        output->limbs[i + limbs + 1] = shift ? (uint32_t) ((uint64_t) a->limbs[i] >> (32 - shift)) : 0;
+    }
+    normalize(output);
+
+    return output;
+}
+
+/* |a| >> bits */
+static BigInt* shift_right(BigInt* a, uint64_t bits)
+{
+    BigInt* output;
+    uint32_t limbs;
+    int shift;
+    uint32_t i;
+
+    if (bits / 32 >= a->size) {
+        return alloc_big(0);
+    }
+    limbs = (uint32_t) (bits / 32);
+    shift = (int) (bits % 32);
+
+    output = alloc_big(a->size - limbs);
+    for (i = 0; i < output->size; i++) {
+        output->limbs[i] = a->limbs[i + limbs] >> shift;
+        if (shift && i + limbs + 1 < a->size) {
+            output->limbs[i] |= a->limbs[i + limbs + 1] << (32 - shift);
+        }
+    }
+    normalize(output);
+
+    return output;
+}
+
+static uint64_t bit_length(BigInt* a)
+{
+    return (a->size == 0) ? 0 : (uint64_t) a->size * 32 - leading_zeros(a->limbs[a->size - 1]);
+}
+
+/* Frees '*target' and puts 'value' in its place, for a chain of operations on one number */
+static void replace(BigInt** target, BigInt* value)
+{
+    free_big(*target);
+    *target = value;
+}
+
+static int leading_zeros(uint32_t x)
+{
+    int n;
+
+    n = 0;
+    while (n < 32 && !(x & 0x80000000u)) {
+        x <<= 1;
+        n++;
+    }
+
+    return n;
+}
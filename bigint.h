@@ -0,0 +1,58 @@
+#ifndef CALC_BIGINT_H
+#define CALC_BIGINT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+    Arbitrary precision integers, sign and magnitude with 32 bit limbs stored
+    least significant first. A magnitude never has leading zero limbs and zero
+    has no limbs at all, and is never negative.
+
+    Multiplication is schoolbook below KARATSUBA_THRESHOLD limbs, Karatsuba
+    above and Toom-3 from TOOM3_THRESHOLD, counted on the shorter side of
+    about balanced operands (lopsided ones are cut into pieces first).
+    Division is Knuth's algorithm D (single limb divisors take a shortcut),
+    or Newton's method once both the divisor and the quotient have
+    NEWTON_THRESHOLD limbs, which costs a few multiplications instead of
+    their product. Powers are computed by repeated squaring.
+
+    Every function returns a fresh BigInt that the caller frees with 'free_big()'.
+*/
+
+#define KARATSUBA_THRESHOLD 32
+#define TOOM3_THRESHOLD 192
+#define NEWTON_THRESHOLD 384
+
+typedef struct BigInt {
+    uint32_t* limbs;
+    uint32_t size;
+    bool negative;
+} BigInt;
+
+BigInt* big_from_i64(int64_t value);
+BigInt* big_from_double(double value);
+BigInt* big_from_string(char* digits);
+BigInt* big_copy(BigInt* a);
+void free_big(BigInt* target);
+
+BigInt* big_add(BigInt* a, BigInt* b);
+BigInt* big_sub(BigInt* a, BigInt* b);
+BigInt* big_mul(BigInt* a, BigInt* b);
+
+/* Truncating division like C's '/' and '%', exits on division by zero */
+void big_divmod(BigInt* a, BigInt* b, BigInt** quotient, BigInt** remainder);
+
+BigInt* big_pow(BigInt* base, uint64_t exponent);
+
+/* base^exponent mod |modulus|, in [0, |modulus|) */
+BigInt* big_powmod(BigInt* base, BigInt* exponent, BigInt* modulus);
+
+int big_compare(BigInt* a, BigInt* b);
+bool big_to_i64(BigInt* a, int64_t* out);
+double big_to_double(BigInt* a);
+
+/* Decimal, malloc'd */
+char* big_to_string(BigInt* a);
+
+#endif
@@ -0,0 +1,143 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "budget.h"
+#include "bigint.h"
+#include "array.h"
+#include "text.h"
+
+LimitConfig limit_config = { 0, 0, 0, 0, 0, 0.0 };
+
+static double now();
+
+void start_budget(Budget* budget)
+{
+    budget->tokens = 0;
+    budget->instructions = 0;
+    budget->next_check = BUDGET_CLOCK_INTERVAL;
+    if (limit_config.max_instructions > 0 && limit_config.max_instructions < budget->next_check) {
+        budget->next_check = limit_config.max_instructions;
+    }
+    budget->deadline = (limit_config.max_seconds > 0.0) ? now() + limit_config.max_seconds : 0.0;
+    budget->exceeded = NULL;
+    budget->failed[0] = '\0';
+}
+
+bool renew_budget(Budget* budget)
+{
+    if (budget->exceeded != NULL) {
+        return false;
+    }
+
+    /* SPEND_INSTRUCTION has counted the instruction about to run already */
+    if (limit_config.max_instructions > 0 && budget->instructions > limit_config.max_instructions) {
+        return exceed_budget(budget, "instructions");
+    }
+    if (limit_config.max_seconds > 0.0 && now() > budget->deadline) {
+        return exceed_budget(budget, "time");
+    }
+
+    budget->next_check = budget->instructions + BUDGET_CLOCK_INTERVAL;
+    if (limit_config.max_instructions > 0 && limit_config.max_instructions < budget->next_check) {
+        budget->next_check = limit_config.max_instructions;
+    }
+
+    return true;
+}
+
+bool exceed_budget(Budget* budget, char* what)
+{
+    if (budget->exceeded == NULL) {
+        budget->exceeded = what;
+    }
+
+    /* Sends every later SPEND_INSTRUCTION to 'renew_budget()' */
+    budget->next_check = 0;
+
+    return false;
+}
+
+void fail_budget(Budget* budget, char* message)
+{
+    if (budget->failed[0] == '\0') {
+        strcpy(budget->failed, message);
+    }
+    exceed_budget(budget, "failure");
+}
+
+bool spend_token(Budget* budget)
+{
+    budget->tokens++;
+    if (limit_config.max_tokens > 0 && budget->tokens > limit_config.max_tokens) {
+        return exceed_budget(budget, "tokens");
+    }
+
+    return budget->exceeded == NULL;
+}
+
+bool check_size(Budget* budget, Token* value)
+{
+    uint64_t bytes;
+
+    if (limit_config.max_bytes == 0) {
+        return true;
+    }
+
+    switch (value->type) {
+        case TOK_BIGINT: {
+            bytes = sizeof(uint32_t) * (uint64_t) value->as.big->size;
+            break;
+        }
+        case TOK_STRING: {
+            bytes = value->as.text->length;
+            break;
+        }
+        case TOK_ARRAY: {
+            bytes = sizeof(int64_t) * value->as.array->length;
+            break;
+        }
+        default: {
+            return true;
+        }
+    }
+
+    return bytes <= limit_config.max_bytes || exceed_budget(budget, "bytes");
+}
+
+/*
+    An integer power has about log2|base| * exponent bits. Anything involving
+    a double or an array stays the same size, and so does a base of -1, 0 or 1.
+*/
+bool affordable_power(Token* base, Token* exponent)
+{
+    double magnitude;
+
+    if (limit_config.max_bytes == 0 || !IS_INTEGER(base) || !IS_INTEGER(exponent)) {
+        return true;
+    }
+
+    magnitude = fabs(token_to_double(base));
+    if (magnitude <= 1.0) {
+        return true;
+    }
+    if (exponent->type == TOK_BIGINT) {
+        return exponent->as.big->negative;
+    }
+
+    return exponent->as.i64 <= 0
+        || log(magnitude) / log(2.0) * (double) exponent->as.i64 <= 8.0 * (double) limit_config.max_bytes;
+}
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
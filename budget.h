@@ -0,0 +1,83 @@
+#ifndef CALC_BUDGET_H
+#define CALC_BUDGET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "token.h"
+#include "fail.h"
+
+/*
+    Limits on what a single evaluation may cost, for expressions that come from
+    someone else. A limit of 0 means no limit, which is the default for all of
+    them.
+
+    The scanner and 'parse_expr()' check the input length, token count and
+    nesting depth as they go. 'eval_program()' counts instructions and call
+    depth, and checks the size of big integers, strings and arrays as they are
+    built, refusing a '^' before it starts when its result would be too big.
+    The clock is only read every BUDGET_CLOCK_INTERVAL instructions, so an
+    unlimited budget costs one compare and increment per instruction.
+
+    Running out is not fatal. The budget remembers what ran out in 'exceeded'
+    and stays exhausted, every evaluation sharing it stops at its next
+    instruction, and the caller decides what to do once it gets control back.
+*/
+
+#define BUDGET_CLOCK_INTERVAL 4096
+
+typedef struct {
+    /* Bytes of source */
+    uint64_t max_input;
+    uint64_t max_tokens;
+
+    /* Nesting of parentheses and operators while parsing, frames while evaluating */
+    uint32_t max_depth;
+    uint64_t max_instructions;
+
+    /* Largest single big integer, string or array */
+    uint64_t max_bytes;
+    double max_seconds;
+} LimitConfig;
+
+extern LimitConfig limit_config;
+
+typedef struct Budget {
+    uint64_t tokens;
+    uint64_t instructions;
+
+    /* Instruction count at which 'renew_budget()' has to look again */
+    uint64_t next_check;
+    double deadline;
+
+    /* What ran out, NULL while there is budget left */
+    char* exceeded;
+
+    /* The message of a caught failure that ended the evaluation, empty if none */
+    char failed[FAILURE_MESSAGE_MAX];
+} Budget;
+
+/* A fresh budget under 'limit_config', the clock starts now */
+void start_budget(Budget* budget);
+
+/* Called by SPEND_INSTRUCTION every so often, false once the budget is gone */
+bool renew_budget(Budget* budget);
+
+/* Marks 'what' as exhausted, always returns false */
+bool exceed_budget(Budget* budget, char* what);
+
+/* Stops the evaluation like 'exceed_budget()', for a failure caught with 'catch_failures()' */
+void fail_budget(Budget* budget, char* message);
+
+/* One more token out of the scanner */
+bool spend_token(Budget* budget);
+
+/* False if a freshly built value is over 'max_bytes' */
+bool check_size(Budget* budget, Token* value);
+
+/* Whether 'base ^ exponent' fits in 'max_bytes', without computing it */
+bool affordable_power(Token* base, Token* exponent);
+
+#define SPEND_INSTRUCTION(b) ((b)->instructions++ < (b)->next_check || renew_budget(b))
+
+#endif
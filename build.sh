@@ -1 +1 @@
-gcc *.c -o calc -ansi -pedantic -Wall -lm
\ No newline at end of file
+gcc *.c -o calc -ansi -pedantic -Wall -O2 -ftree-vectorize -fno-trapping-math -pthread -lm
\ No newline at end of file
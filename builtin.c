@@ -0,0 +1,579 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "builtin.h"
+
+/* Entries per bucket on average, and the most displacements tried before the table grows */
+#define BUCKET_SIZE 4
+#define MAX_DISPLACEMENT 65536
+
+typedef struct {
+    TokenType type;
+    char* name;
+} Keyword;
+
+typedef struct {
+    /* NULL for a free slot */
+    char* name;
+
+    /* TOK_IDENTIFIER when the name is only a native */
+    TokenType keyword;
+    Native* native;
+} Entry;
+
+typedef struct {
+    Entry* slots;
+    uint32_t n_slots;
+
+    /* Per bucket, the seed of the second hash */
+    uint32_t* displacements;
+    uint32_t n_buckets;
+
+    bool stale;
+} NameTable;
+
+static Keyword keywords[] = {
+    {TOK_SIN, "sin"},
+    {TOK_COS, "cos"},
+    {TOK_TAN, "tan"},
+    {TOK_POWMOD, "powmod"},
+    {TOK_FMA, "fma"},
+    {TOK_DOT, "dot"},
+    {TOK_LEN, "len"},
+    {TOK_SUBSTR, "substr"},
+    {TOK_STR, "str"},
+    {TOK_NUM, "num"},
+    {TOK_RAND, "rand"},
+    {TOK_UNIFORM, "uniform"},
+    {TOK_NORMAL, "normal"},
+    {TOK_IF, "if"},
+    {TOK_AGG_SUM, "sum"},
+    {TOK_AGG_MEAN, "mean"},
+    {TOK_AGG_MIN, "min"},
+    {TOK_AGG_MAX, "max"},
+    {TOK_AGG_COUNT, "count"},
+    {TOK_AGG_VAR, "var"},
+    {TOK_SOLVE, "solve"},
+    {TOK_MINIMIZE, "minimize"},
+    {TOK_INTEGRATE, "integrate"},
+};
+
+static double native_sqrt(double* args);
+static double native_exp(double* args);
+static double native_log(double* args);
+static double native_abs(double* args);
+static double native_floor(double* args);
+static double native_ceil(double* args);
+static double native_atan2(double* args);
+static double native_hypot(double* args);
+static double native_min(double* args);
+static double native_max(double* args);
+static void vec_sqrt(double* out, double** args, uint64_t n);
+static void vec_abs(double* out, double** args, uint64_t n);
+static void vec_floor(double* out, double** args, uint64_t n);
+static void vec_ceil(double* out, double** args, uint64_t n);
+static void vec_min(double* out, double** args, uint64_t n);
+static void vec_max(double* out, double** args, uint64_t n);
+static void d_sqrt(double* args, double result, double* partials);
+static void d_exp(double* args, double result, double* partials);
+static void d_log(double* args, double result, double* partials);
+static void d_abs(double* args, double result, double* partials);
+static void d_floor(double* args, double result, double* partials);
+static void d_ceil(double* args, double result, double* partials);
+static void d_atan2(double* args, double result, double* partials);
+static void d_hypot(double* args, double result, double* partials);
+static void d_min(double* args, double result, double* partials);
+static void d_max(double* args, double result, double* partials);
+
+static Native standard[] = {
+    {"sqrt", 1, true, native_sqrt, vec_sqrt, d_sqrt},
+    {"exp", 1, true, native_exp, NULL, d_exp},
+    {"log", 1, true, native_log, NULL, d_log},
+    {"abs", 1, true, native_abs, vec_abs, d_abs},
+    {"floor", 1, true, native_floor, vec_floor, d_floor},
+    {"ceil", 1, true, native_ceil, vec_ceil, d_ceil},
+    {"atan2", 2, true, native_atan2, NULL, d_atan2},
+    {"hypot", 2, true, native_hypot, NULL, d_hypot},
+    {"min", 2, true, native_min, vec_min, d_min},
+    {"max", 2, true, native_max, vec_max, d_max},
+};
+
+/* The standard ones first, then whatever the host registers */
+static Native** natives = NULL;
+static uint32_t n_natives = 0;
+static uint32_t natives_capacity = 0;
+
+static NameTable table = {NULL, 0, NULL, 0, true};
+
+static void add_native(Native* native);
+static void build_table();
+static bool place_names(Entry* entries, uint32_t n_entries);
+static Entry* find_entry(char* name);
+static uint32_t hash_name(char* name, uint32_t seed);
+static int keyword_arity(TokenType type);
+
+void register_native(char* name, uint32_t arity, bool pure, NativeScalar scalar, NativeVector vector)
+{
+    Native* native;
+    uint32_t i;
+
+    if (natives == NULL) {
+        build_table();
+    }
+
+    if (arity > MAX_NATIVE_ARITY) {
+        fprintf(stderr, "Native '%s' takes more than %d arguments.\n", name, MAX_NATIVE_ARITY);
+        exit(22);
+    }
+    for (i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+        if (strcmp(keywords[i].name, name) == 0 && keyword_arity(keywords[i].type) == (int) arity) {
+            fprintf(stderr, "Native '%s' is already a builtin with %u arguments.\n", name, arity);
+            exit(22);
+        }
+    }
+
+    /* Tokens already point at a native of that name, so it is changed where it is */
+    for (i = 0; i < n_natives; i++) {
+        if (strcmp(natives[i]->name, name) == 0) {
+            break;
+        }
+    }
+    if (i < n_natives) {
+        native = natives[i];
+    } else {
+        if ((native = malloc(sizeof(Native))) == NULL) {
+            fprintf(stderr, "Failed to allocate native.\n");
+            exit(5);
+        }
+        native->name = name;
+        add_native(native);
+    }
+
+    native->arity = arity;
+    native->pure = pure;
+    native->scalar = scalar;
+    native->vector = vector;
+    native->derivative = NULL;
+    table.stale = true;
+}
+
+void register_derivative(char* name, NativeDerivative derivative)
+{
+    uint32_t i;
+
+    if (natives == NULL) {
+        build_table();
+    }
+
+    for (i = 0; i < n_natives; i++) {
+        if (strcmp(natives[i]->name, name) == 0) {
+            natives[i]->derivative = derivative;
+            return;
+        }
+    }
+
+    fprintf(stderr, "No native '%s' to give a derivative.\n", name);
+    exit(22);
+}
+
+TokenType lookup_name(char* name, Native** native)
+{
+    Entry* entry;
+
+    if (table.stale) {
+        build_table();
+    }
+
+    entry = find_entry(name);
+    *native = (entry != NULL) ? entry->native : NULL;
+
+    if (entry == NULL) {
+        return TOK_IDENTIFIER;
+    }
+    return (entry->keyword != TOK_IDENTIFIER) ? entry->keyword : TOK_NATIVE;
+}
+
+void free_builtins()
+{
+    uint32_t i;
+    uint32_t n_standard;
+
+    n_standard = sizeof(standard) / sizeof(standard[0]);
+    for (i = n_standard; i < n_natives; i++) {
+        free(natives[i]);
+    }
+    free(natives);
+    free(table.slots);
+    free(table.displacements);
+
+    natives = NULL;
+    n_natives = 0;
+    natives_capacity = 0;
+    table.slots = NULL;
+    table.displacements = NULL;
+    table.n_slots = 0;
+    table.n_buckets = 0;
+    table.stale = true;
+}
+
+static void add_native(Native* native)
+{
+    if (n_natives == natives_capacity) {
+        natives_capacity = (natives_capacity == 0) ? 16 : natives_capacity * 2;
+        if ((natives = realloc(natives, sizeof(Native*) * natives_capacity)) == NULL) {
+            fprintf(stderr, "Failed to allocate natives.\n");
+            exit(5);
+        }
+    }
+    natives[n_natives++] = native;
+}
+
+/* One entry per distinct name, placed so that every name gets a slot of its own */
+static void build_table()
+{
+    Entry* entries;
+    uint32_t n_keywords;
+    uint32_t n_entries;
+    uint32_t i;
+    uint32_t j;
+
+    n_keywords = sizeof(keywords) / sizeof(keywords[0]);
+    if (natives == NULL) {
+        for (i = 0; i < sizeof(standard) / sizeof(standard[0]); i++) {
+            add_native(&standard[i]);
+        }
+    }
+
+    if ((entries = malloc(sizeof(Entry) * (n_keywords + n_natives))) == NULL) {
+        fprintf(stderr, "Failed to allocate name table.\n");
+        exit(5);
+    }
+
+    n_entries = 0;
+    for (i = 0; i < n_keywords; i++) {
+        entries[n_entries].name = keywords[i].name;
+        entries[n_entries].keyword = keywords[i].type;
+        entries[n_entries].native = NULL;
+        n_entries++;
+    }
+    for (i = 0; i < n_natives; i++) {
+        for (j = 0; j < n_entries; j++) {
+            if (strcmp(entries[j].name, natives[i]->name) == 0) {
+                break;
+            }
+        }
+        if (j == n_entries) {
+            entries[j].name = natives[i]->name;
+            entries[j].keyword = TOK_IDENTIFIER;
+            n_entries++;
+        }
+        entries[j].native = natives[i];
+    }
+
+    /* At most a quarter full, which keeps the displacements short */
+    table.n_slots = 16;
+    while (table.n_slots < 4 * n_entries) {
+        table.n_slots *= 2;
+    }
+    while (!place_names(entries, n_entries)) {
+        table.n_slots *= 2;
+    }
+    table.stale = false;
+
+    free(entries);
+}
+
+/* False if some bucket can't be placed in 'table.n_slots' slots */
+static bool place_names(Entry* entries, uint32_t n_entries)
+{
+    uint32_t* bucket_of;
+    uint32_t* order;
+    uint32_t* sizes;
+    uint32_t* slots;
+    uint32_t n_order;
+    uint32_t size;
+    uint32_t b;
+    uint32_t d;
+    uint32_t i;
+    uint32_t k;
+    bool placed;
+
+    free(table.slots);
+    free(table.displacements);
+    table.n_buckets = (n_entries + BUCKET_SIZE - 1) / BUCKET_SIZE;
+    table.slots = calloc(table.n_slots, sizeof(Entry));
+    table.displacements = calloc(table.n_buckets, sizeof(uint32_t));
+    bucket_of = malloc(sizeof(uint32_t) * (n_entries + 1));
+    order = malloc(sizeof(uint32_t) * (n_entries + 1));
+    sizes = calloc(table.n_buckets, sizeof(uint32_t));
+    slots = malloc(sizeof(uint32_t) * (n_entries + 1));
+    if (table.slots == NULL || table.displacements == NULL || bucket_of == NULL || order == NULL
+        || sizes == NULL || slots == NULL) {
+        fprintf(stderr, "Failed to allocate name table.\n");
+        exit(5);
+    }
+
+    for (i = 0; i < n_entries; i++) {
+        bucket_of[i] = hash_name(entries[i].name, 0) % table.n_buckets;
+        sizes[bucket_of[i]]++;
+    }
+
+    /* The fullest buckets go first, while there is the most room */
+    placed = true;
+    for (size = n_entries; size > 0 && placed; size--) {
+        for (b = 0; b < table.n_buckets && placed; b++) {
+            if (sizes[b] != size) {
+                continue;
+            }
+
+            n_order = 0;
+            for (i = 0; i < n_entries; i++) {
+                if (bucket_of[i] == b) {
+                    order[n_order++] = i;
+                }
+            }
+
+            placed = false;
+            for (d = 1; d < MAX_DISPLACEMENT && !placed; d++) {
+                placed = true;
+                for (i = 0; i < n_order && placed; i++) {
+                    slots[i] = hash_name(entries[order[i]].name, d) % table.n_slots;
+                    placed = table.slots[slots[i]].name == NULL;
+                    for (k = 0; k < i && placed; k++) {
+                        placed = slots[k] != slots[i];
+                    }
+                }
+            }
+
+            if (placed) {
+                table.displacements[b] = d - 1;
+                for (i = 0; i < n_order; i++) {
+                    table.slots[slots[i]] = entries[order[i]];
+                }
+            }
+        }
+    }
+
+    free(bucket_of);
+    free(order);
+    free(sizes);
+    free(slots);
+
+    return placed;
+}
+
+static Entry* find_entry(char* name)
+{
+    Entry* entry;
+    uint32_t d;
+
+    d = table.displacements[hash_name(name, 0) % table.n_buckets];
+    entry = &table.slots[hash_name(name, d) % table.n_slots];
+
+    return (entry->name != NULL && strcmp(entry->name, name) == 0) ? entry : NULL;
+}
+
+/* FNV-1a from a seeded basis, with a final mix so that nearby seeds differ in every bit */
+static uint32_t hash_name(char* name, uint32_t seed)
+{
+    uint32_t hash;
+
+    hash = 2166136261UL ^ (seed * 0x9E3779B9UL);
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char) *name) * 16777619UL;
+    }
+
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6BUL;
+    hash ^= hash >> 13;
+
+    return hash;
+}
+
+static int keyword_arity(TokenType type)
+{
+    Token tok;
+
+    tok.type = type;
+    tok.as.lambda = NULL;
+
+    /* solve() and friends take the expression and variable on top of their plain arguments */
+    return get_arity(&tok) + (IS_HIGHER_ORDER(type) ? 2 : 0);
+}
+
+static double native_sqrt(double* args)
+{
+    return sqrt(args[0]);
+}
+
+static double native_exp(double* args)
+{
+    return exp(args[0]);
+}
+
+static double native_log(double* args)
+{
+    return log(args[0]);
+}
+
+static double native_abs(double* args)
+{
+    return fabs(args[0]);
+}
+
+static double native_floor(double* args)
+{
+    return floor(args[0]);
+}
+
+static double native_ceil(double* args)
+{
+    return ceil(args[0]);
+}
+
+static double native_atan2(double* args)
+{
+    return atan2(args[0], args[1]);
+}
+
+/* Scaled by the larger side, so the squares can't overflow */
+static double native_hypot(double* args)
+{
+    double a;
+    double b;
+    double m;
+
+    a = fabs(args[0]);
+    b = fabs(args[1]);
+    m = (a > b) ? a : b;
+    if (m == 0.0 || m != m || m == HUGE_VAL) {
+        return (a == HUGE_VAL || b == HUGE_VAL) ? HUGE_VAL : m;
+    }
+
+    return m * sqrt((a / m) * (a / m) + (b / m) * (b / m));
+}
+
+static double native_min(double* args)
+{
+    return (args[1] < args[0]) ? args[1] : args[0];
+}
+
+static double native_max(double* args)
+{
+    return (args[1] > args[0]) ? args[1] : args[0];
+}
+
+static void vec_sqrt(double* out, double** args, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = sqrt(args[0][i]);
+    }
+}
+
+static void vec_abs(double* out, double** args, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = fabs(args[0][i]);
+    }
+}
+
+static void vec_floor(double* out, double** args, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = floor(args[0][i]);
+    }
+}
+
+static void vec_ceil(double* out, double** args, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = ceil(args[0][i]);
+    }
+}
+
+static void vec_min(double* out, double** args, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (args[1][i] < args[0][i]) ? args[1][i] : args[0][i];
+    }
+}
+
+static void vec_max(double* out, double** args, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (args[1][i] > args[0][i]) ? args[1][i] : args[0][i];
+    }
+}
+
+/* Derivatives of the standard natives, 0 at a kink or a jump */
+static void d_sqrt(double* args, double result, double* partials)
+{
+    partials[0] = 0.5 / result;
+}
+
+static void d_exp(double* args, double result, double* partials)
+{
+    partials[0] = result;
+}
+
+static void d_log(double* args, double result, double* partials)
+{
+    partials[0] = 1.0 / args[0];
+}
+
+static void d_abs(double* args, double result, double* partials)
+{
+    partials[0] = (args[0] > 0.0) ? 1.0 : (args[0] < 0.0) ? -1.0 : 0.0;
+}
+
+static void d_floor(double* args, double result, double* partials)
+{
+    partials[0] = 0.0;
+}
+
+static void d_ceil(double* args, double result, double* partials)
+{
+    partials[0] = 0.0;
+}
+
+static void d_atan2(double* args, double result, double* partials)
+{
+    double r2;
+
+    r2 = args[0] * args[0] + args[1] * args[1];
+    partials[0] = (r2 == 0.0) ? 0.0 : args[1] / r2;
+    partials[1] = (r2 == 0.0) ? 0.0 : -args[0] / r2;
+}
+
+static void d_hypot(double* args, double result, double* partials)
+{
+    partials[0] = (result == 0.0) ? 0.0 : args[0] / result;
+    partials[1] = (result == 0.0) ? 0.0 : args[1] / result;
+}
+
+/* Whichever argument 'native_min()' and 'native_max()' returned */
+static void d_min(double* args, double result, double* partials)
+{
+    partials[0] = (args[1] < args[0]) ? 0.0 : 1.0;
+    partials[1] = 1.0 - partials[0];
+}
+
+static void d_max(double* args, double result, double* partials)
+{
+    partials[0] = (args[1] > args[0]) ? 0.0 : 1.0;
+    partials[1] = 1.0 - partials[0];
+}
@@ -0,0 +1,75 @@
+#ifndef CALC_BUILTIN_H
+#define CALC_BUILTIN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "token.h"
+
+/*
+    Every name the scanner treats as more than a variable: the keywords that
+    have a token type of their own, like 'sin' or 'solve', and the native
+    functions that all share TOK_NATIVE and carry a pointer to their entry.
+
+    Natives are plain C functions of doubles. 'sqrt', 'exp', 'log', 'abs',
+    'floor', 'ceil', 'atan2', 'hypot', 'min' and 'max' are registered from the
+    start and a host program can add its own with 'register_native()'. Pure
+    natives are folded on constant arguments and shared between outputs like
+    any operator. The column evaluator hands a whole tile to 'vector' when
+    there is one, or calls 'scalar' for each row. '--grad' and 'solve()' go
+    through 'derivative', which every standard native has and a host adds
+    with 'register_derivative()'.
+
+    Names are looked up through a perfect hash (hash and displace: the first
+    hash picks a bucket, the bucket's displacement picks a slot no other name
+    has), so the scanner compares at most one string per identifier. The table
+    is rebuilt on the first lookup after a registration.
+
+    A keyword and a native can share a name if their arities differ, the
+    parser goes by the number of arguments: 'min(x)' is the aggregate and
+    'min(a, b)' the native.
+*/
+
+#define MAX_NATIVE_ARITY 8
+
+/* 'args' has one value per parameter */
+typedef double (*NativeScalar)(double* args);
+
+/* out[i] = f(args[0][i], args[1][i], ...), 'out' may alias an argument */
+typedef void (*NativeVector)(double* out, double** args, uint64_t n);
+
+/* partials[i] = d(result)/d(args[i]), 'result' is what 'scalar' gave for 'args' */
+typedef void (*NativeDerivative)(double* args, double result, double* partials);
+
+typedef struct Native {
+    char* name;
+    uint32_t arity;
+
+    /* The same arguments always give the same result, and nothing else happens */
+    bool pure;
+
+    NativeScalar scalar;
+
+    /* NULL to go through 'scalar' row by row */
+    NativeVector vector;
+
+    /* NULL if it can't be differentiated */
+    NativeDerivative derivative;
+} Native;
+
+/*
+    Makes 'name(...)' callable in whatever is parsed from now on. 'name' must
+    outlive the registry. Registering a native name again replaces it, names
+    of keywords can only be reused with another arity.
+*/
+void register_native(char* name, uint32_t arity, bool pure, NativeScalar scalar, NativeVector vector);
+
+/* Lets '--grad' and 'solve()' see through the native 'name', registering it again takes it away */
+void register_derivative(char* name, NativeDerivative derivative);
+
+/* The keyword type of 'name', TOK_NATIVE or TOK_IDENTIFIER. '*native' is the native of that name or NULL. */
+TokenType lookup_name(char* name, Native** native);
+
+void free_builtins();
+
+#endif
@@ -0,0 +1,1106 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "column.h"
+#include "vmath.h"
+#include "eval.h"
+#include "rng.h"
+#include "builtin.h"
+#include "profile.h"
+#include "fail.h"
+
+/* One stack entry, either pointing at an input column or at its own tile */
+typedef struct {
+    TokenType type;
+
+    union {
+        int64_t* i64;
+        double* f64;
+        float* f32;
+    } as;
+} Slot;
+
+typedef union {
+    int64_t i64[COLUMN_TILE_ROWS];
+    double f64[COLUMN_TILE_ROWS];
+    float f32[COLUMN_TILE_ROWS];
+} Tile;
+
+static ColumnProgram* compile_typed(TokenStack* program, Column* inputs, uint32_t n_inputs, TokenType real);
+static TokenType binary_type(TokenType op, TokenType t1, TokenType t2);
+static void eval_tile(ColumnProgram* program, Column* inputs, uint64_t offset, uint64_t count,
+    uint64_t stream, Slot* slots, Tile* tiles, ProfileRun* run);
+static void eval_binary(TokenType op, TokenType type, Slot* a, Slot* b, Tile* dest, Tile* spare, Tile* wide,
+    uint64_t count);
+static void eval_compare(TokenType op, Slot* a, Slot* b, Tile* dest, Tile* spare, Tile* wide, uint64_t count);
+static void eval_select(Slot* cond, Slot* a, Slot* b, Tile* dest, Tile* spare, Tile* wide, uint64_t count);
+static double* as_f64(Slot* s, Tile* scratch, uint64_t count);
+static float* as_f32(Slot* s, Tile* scratch, uint64_t count);
+static void eval_per_row(ColumnProgram* program, Column* inputs, uint64_t first_row, uint64_t rows, Column* outputs);
+
+ColumnProgram* compile_columns(TokenStack* program, Column* inputs, uint32_t n_inputs)
+{
+    return compile_typed(program, inputs, n_inputs, TOK_DOUBLE);
+}
+
+ColumnProgram* compile_columns_f32(TokenStack* program, Column* inputs, uint32_t n_inputs)
+{
+    return compile_typed(program, inputs, n_inputs, TOK_FLOAT);
+}
+
+void free_column_program(ColumnProgram* target)
+{
+    free(target->operands);
+    free(target->types);
+    free(target->results);
+    free(target);
+}
+
+static ColumnProgram* compile_typed(TokenStack* program, Column* inputs, uint32_t n_inputs, TokenType real)
+{
+    ColumnProgram* output;
+    TokenType* stack;
+    TokenType* stored;
+    uint32_t sp;
+    uint32_t branches;
+    uint32_t draws;
+    uint64_t ip;
+    uint32_t i;
+    Token* tok;
+
+    if ((output = malloc(sizeof(ColumnProgram))) == NULL) {
+        fprintf(stderr, "Failed to allocate column program.\n");
+        exit(5);
+    }
+
+    output->program = program;
+    output->n_inputs = n_inputs;
+    output->real = real;
+    output->per_row = false;
+    output->n_outputs = count_outputs(program);
+    output->n_stored = 0;
+    output->operands = calloc(program->size + 1, sizeof(uint32_t));
+    output->types = calloc(program->size + 1, sizeof(TokenType));
+    output->results = calloc(output->n_outputs, sizeof(TokenType));
+    stack = calloc(program->size + 1, sizeof(TokenType));
+    stored = calloc(program->size + 1, sizeof(TokenType));
+
+    if (output->operands == NULL || output->types == NULL || output->results == NULL
+        || stack == NULL || stored == NULL) {
+        fprintf(stderr, "Failed to allocate column program.\n");
+        exit(5);
+    }
+
+    /* Type check the program once, so that the tile loop never has to */
+    sp = 0;
+    branches = 0;
+    draws = 0;
+    output->depth = 0;
+    for (ip = 0; ip < program->size; ip++) {
+        tok = &program->base[ip];
+
+        switch (tok->type) {
+            case TOK_LONG: {
+                stack[sp++] = TOK_LONG;
+                break;
+            }
+            case TOK_DOUBLE: {
+                stack[sp++] = real;
+                break;
+            }
+            case TOK_IDENTIFIER: {
+                for (i = 0; i < n_inputs; i++) {
+                    if (strcmp(inputs[i].name, tok->as.string) == 0) {
+                        break;
+                    }
+                }
+                if (i == n_inputs) {
+                    fprintf(stderr, "Unknown column '%s'.\n", tok->as.string);
+                    exit(23);
+                }
+
+                output->operands[ip] = i;
+                stack[sp++] = (inputs[i].type == TOK_LONG) ? TOK_LONG : real;
+                break;
+            }
+            case TOK_SIN:
+            case TOK_COS:
+            case TOK_TAN: {
+                if (sp < 1) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                stack[sp - 1] = real;
+                break;
+            }
+            case TOK_RAND: {
+                output->operands[ip] = draws++;
+                stack[sp++] = real;
+                break;
+            }
+            case TOK_UNIFORM:
+            case TOK_NORMAL: {
+                if (sp < 2) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                output->operands[ip] = draws++;
+                sp -= 1;
+                stack[sp - 1] = real;
+                break;
+            }
+            case TOK_NATIVE: {
+                if (sp < tok->as.native->arity) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                sp -= tok->as.native->arity;
+                stack[sp++] = real;
+                break;
+            }
+            case TOK_POWMOD: {
+                if (sp < 3) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                sp -= 2;
+                stack[sp - 1] = TOK_LONG;
+
+                /* A zero modulus exits, even in a row the branch doesn't pick */
+                if (branches > 0) {
+                    output->per_row = true;
+                }
+                break;
+            }
+            case TOK_FMA: {
+                if (sp < 3) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                sp -= 2;
+                stack[sp - 1] = (stack[sp - 1] == TOK_LONG && stack[sp] == TOK_LONG && stack[sp + 1] == TOK_LONG)
+                    ? TOK_LONG : real;
+                break;
+            }
+            case TOK_THEN:
+            case TOK_ELSE:
+            case TOK_SHORT_AND:
+            case TOK_SHORT_OR: {
+                if (sp < 1) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                if (tok->type != TOK_ELSE) {
+                    branches++;
+                }
+                break;
+            }
+            case TOK_IF: {
+                if (sp < 3 || branches == 0) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                sp -= 2;
+                stack[sp - 1] = (stack[sp] == TOK_LONG && stack[sp + 1] == TOK_LONG) ? TOK_LONG : real;
+                branches--;
+                break;
+            }
+            case TOK_STORE: {
+                if (sp < 1 || (uint64_t) tok->as.i64 >= program->size) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                stored[tok->as.i64] = stack[sp - 1];
+                if ((uint32_t) tok->as.i64 >= output->n_stored) {
+                    output->n_stored = tok->as.i64 + 1;
+                }
+                break;
+            }
+            case TOK_LOAD: {
+                if ((uint32_t) tok->as.i64 >= output->n_stored) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                stack[sp++] = stored[tok->as.i64];
+                break;
+            }
+            case TOK_TUPLE: {
+                /* The outputs stay where they are, one per stack level */
+                if (sp != (uint64_t) tok->as.i64 || branches > 0) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                break;
+            }
+            case TOK_ARRAY:
+            case TOK_MAKE_ARRAY:
+            case TOK_DOT:
+            case TOK_STRING:
+            case TOK_SHORT_STRING:
+            case TOK_LEN:
+            case TOK_SUBSTR:
+            case TOK_STR:
+            case TOK_NUM: {
+                fprintf(stderr, "Only numbers are supported with --rows, --sweep or integrate().\n");
+                exit(24);
+            }
+            case TOK_SOLVE:
+            case TOK_MINIMIZE:
+            case TOK_BIGINT: {
+                /* Columns are 64 bits wide, a big constant leaves it to 'eval_program()' */
+                stack[sp++] = real;
+                output->per_row = true;
+                break;
+            }
+            case TOK_INTEGRATE:
+            case TOK_CALL: {
+                if (sp < (uint32_t) get_arity(tok)) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                sp -= get_arity(tok) - 1;
+                stack[sp - 1] = real;
+                output->per_row = true;
+                break;
+            }
+            default: {
+                if (!IS_OPERATOR(tok->type) || sp < 2) {
+                    fprintf(stderr, "Malformed program.\n");
+                    exit(24);
+                }
+                sp -= 1;
+
+                /* Integer division by zero traps, '%' always ends up as one */
+                if (branches > 0 && (tok->type == TOK_MOD
+                    || (tok->type == TOK_DIV && stack[sp - 1] == TOK_LONG && stack[sp] == TOK_LONG))) {
+                    output->per_row = true;
+                }
+                if (tok->type == TOK_AND || tok->type == TOK_OR) {
+                    branches--;
+                }
+
+                /* A negative exponent leaves a fraction, only a constant one that isn't keeps int ^ int an integer */
+                if (tok->type == TOK_EXP && stack[sp - 1] == TOK_LONG && stack[sp] == TOK_LONG
+                    && !(program->base[ip - 1].type == TOK_LONG && program->base[ip - 1].as.i64 >= 0)) {
+                    stack[sp - 1] = real;
+                } else {
+                    stack[sp - 1] = binary_type(tok->type, stack[sp - 1], stack[sp]);
+                }
+                break;
+            }
+        }
+
+        output->types[ip] = stack[sp - 1];
+        if (sp > output->depth) {
+            output->depth = sp;
+        }
+    }
+
+    if (sp != output->n_outputs) {
+        fprintf(stderr, "Malformed program.\n");
+        exit(24);
+    }
+
+    for (i = 0; i < output->n_outputs; i++) {
+        output->results[i] = stack[i];
+    }
+    free(stack);
+    free(stored);
+
+    return output;
+}
+
+void eval_columns(ColumnProgram* program, Column* inputs, uint64_t first_row, uint64_t rows, Column* outputs)
+{
+    Slot* slots;
+    Tile* tiles;
+    ProfileRun run;
+    Failure failure;
+    bool caught;
+    uint64_t offset;
+    uint64_t count;
+    uint32_t k;
+
+    if (program->per_row) {
+        eval_per_row(program, inputs, first_row, rows, outputs);
+        return;
+    }
+
+    /*
+        One tile per stack level plus a spare for int -> double conversions,
+        then a slot and a tile for each stored value. Floats need tiles of
+        their own to widen into for natives, comparisons and friends.
+    */
+    slots = malloc(sizeof(Slot) * (program->depth + program->n_stored));
+    tiles = malloc(sizeof(Tile) * (program->depth + 1 + program->n_stored
+        + ((program->real == TOK_FLOAT) ? MAX_NATIVE_ARITY : 0)));
+    if (slots == NULL || tiles == NULL) {
+        fprintf(stderr, "Failed to allocate column tiles.\n");
+        exit(5);
+    }
+
+    start_profile_run(&run, program->program);
+
+    /* Like 'integrate_lambda()', the tiles are freed when a failure goes past */
+    caught = caught_failure() != NULL;
+    if (caught) {
+        catch_failures(&failure);
+        if (setjmp(failure.jump) != 0) {
+            free(slots);
+            free(tiles);
+            pass_failure(&failure);
+        }
+    }
+
+    for (offset = 0; offset < rows; offset += COLUMN_TILE_ROWS) {
+        count = rows - offset;
+        if (count > COLUMN_TILE_ROWS) {
+            count = COLUMN_TILE_ROWS;
+        }
+
+        eval_tile(program, inputs, offset, count, first_row + offset, slots, tiles, &run);
+
+        for (k = 0; k < program->n_outputs; k++) {
+            if (program->results[k] == TOK_LONG) {
+                memcpy(outputs[k].as.i64 + offset, slots[k].as.i64, count * sizeof(int64_t));
+            } else if (program->results[k] == TOK_FLOAT) {
+                memcpy(outputs[k].as.f32 + offset, slots[k].as.f32, count * sizeof(float));
+            } else {
+                memcpy(outputs[k].as.f64 + offset, slots[k].as.f64, count * sizeof(double));
+            }
+        }
+    }
+
+    if (caught) {
+        release_failures(&failure);
+    }
+    finish_profile_run(&run, program->program);
+
+    free(slots);
+    free(tiles);
+}
+
+void advance_column(Column* column, uint64_t rows)
+{
+    if (column->type == TOK_FLOAT) {
+        column->as.f32 += rows;
+    } else {
+        column->as.i64 += rows;
+    }
+}
+
+/*
+    'stream' is the row the tile starts at, for rand() and friends. With a
+    profile every instruction is timed, the clock costs little next to a tile.
+*/
+static void eval_tile(ColumnProgram* program, Column* inputs, uint64_t offset, uint64_t count,
+    uint64_t stream, Slot* slots, Tile* tiles, ProfileRun* run)
+{
+    Tile* spare;
+    Tile* wide;
+    Native* native;
+    double* args[MAX_NATIVE_ARITY];
+    double row[MAX_NATIVE_ARITY];
+    double* lo;
+    double* hi;
+    float* lo32;
+    float* hi32;
+    float* x32;
+    Column* col;
+    Token* tok;
+    Slot* top;
+    double started;
+    uint64_t ip;
+    uint64_t i;
+    uint32_t sp;
+    uint32_t base;
+    uint32_t k;
+
+    spare = &tiles[program->depth];
+    wide = (program->real == TOK_FLOAT) ? &tiles[program->depth + 1 + program->n_stored] : NULL;
+    sp = 0;
+    started = 0.0;
+
+    for (ip = 0; ip < program->program->size; ip++) {
+        tok = &program->program->base[ip];
+        if (run->counts != NULL) {
+            started = profile_clock();
+        }
+
+        switch (tok->type) {
+            case TOK_LONG: {
+                top = &slots[sp];
+                top->type = TOK_LONG;
+                top->as.i64 = tiles[sp].i64;
+                for (i = 0; i < count; i++) {
+                    top->as.i64[i] = tok->as.i64;
+                }
+                sp++;
+                break;
+            }
+            case TOK_DOUBLE: {
+                top = &slots[sp];
+                top->type = program->real;
+                if (program->real == TOK_FLOAT) {
+                    top->as.f32 = tiles[sp].f32;
+                    for (i = 0; i < count; i++) {
+                        top->as.f32[i] = tok->as.f64;
+                    }
+                } else {
+                    top->as.f64 = tiles[sp].f64;
+                    for (i = 0; i < count; i++) {
+                        top->as.f64[i] = tok->as.f64;
+                    }
+                }
+                sp++;
+                break;
+            }
+            case TOK_IDENTIFIER: {
+                /* No copy, the slot just points into the input, unless it has the other precision */
+                col = &inputs[program->operands[ip]];
+                top = &slots[sp];
+                top->type = (col->type == TOK_LONG) ? TOK_LONG : program->real;
+                if (col->type == TOK_LONG) {
+                    top->as.i64 = col->as.i64 + offset;
+                } else if (col->type == TOK_DOUBLE && program->real == TOK_DOUBLE) {
+                    top->as.f64 = col->as.f64 + offset;
+                } else if (col->type == TOK_FLOAT && program->real == TOK_FLOAT) {
+                    top->as.f32 = col->as.f32 + offset;
+                } else if (col->type == TOK_FLOAT) {
+                    vec_f32_to_f64(tiles[sp].f64, col->as.f32 + offset, count);
+                    top->as.f64 = tiles[sp].f64;
+                } else {
+                    vec_f64_to_f32(tiles[sp].f32, col->as.f64 + offset, count);
+                    top->as.f32 = tiles[sp].f32;
+                }
+                sp++;
+                break;
+            }
+            case TOK_SIN:
+            case TOK_COS:
+            case TOK_TAN: {
+                top = &slots[sp - 1];
+                if (program->real == TOK_FLOAT) {
+                    x32 = as_f32(top, spare, count);
+                    if (tok->type == TOK_SIN) {
+                        vec_sin_f32(tiles[sp - 1].f32, x32, count);
+                    } else if (tok->type == TOK_COS) {
+                        vec_cos_f32(tiles[sp - 1].f32, x32, count);
+                    } else {
+                        vec_tan_f32(tiles[sp - 1].f32, x32, count);
+                    }
+                    top->type = TOK_FLOAT;
+                    top->as.f32 = tiles[sp - 1].f32;
+                    break;
+                }
+
+                top->as.f64 = as_f64(top, &tiles[sp - 1], count);
+                top->type = TOK_DOUBLE;
+
+                if (tok->type == TOK_SIN) {
+                    vec_sin(tiles[sp - 1].f64, top->as.f64, count);
+                } else if (tok->type == TOK_COS) {
+                    vec_cos(tiles[sp - 1].f64, top->as.f64, count);
+                } else {
+                    vec_tan(tiles[sp - 1].f64, top->as.f64, count);
+                }
+                top->as.f64 = tiles[sp - 1].f64;
+                break;
+            }
+            case TOK_RAND: {
+                top = &slots[sp];
+                top->type = program->real;
+                if (program->real == TOK_FLOAT) {
+                    /* Drawn in double, so a row gets the same numbers in either precision */
+                    vec_uniform(spare->f64, stream, program->operands[ip], count);
+                    vec_f64_to_f32(tiles[sp].f32, spare->f64, count);
+                    top->as.f32 = tiles[sp].f32;
+                } else {
+                    top->as.f64 = tiles[sp].f64;
+                    vec_uniform(top->as.f64, stream, program->operands[ip], count);
+                }
+                sp++;
+                break;
+            }
+            case TOK_UNIFORM:
+            case TOK_NORMAL: {
+                /* 'uniform(lo, hi)' is 'lo + (hi - lo)*u', 'normal(mu, sigma)' is 'mu + sigma*z' */
+                if (program->real == TOK_FLOAT) {
+                    lo32 = as_f32(&slots[sp - 2], &wide[0], count);
+                    hi32 = as_f32(&slots[sp - 1], &wide[1], count);
+                    if (tok->type == TOK_UNIFORM) {
+                        vec_uniform(spare->f64, stream, program->operands[ip], count);
+                        for (i = 0; i < count; i++) {
+                            tiles[sp - 2].f32[i] = lo32[i] + (hi32[i] - lo32[i]) * (float) spare->f64[i];
+                        }
+                    } else {
+                        vec_normal(spare->f64, stream, program->operands[ip], count);
+                        for (i = 0; i < count; i++) {
+                            tiles[sp - 2].f32[i] = lo32[i] + hi32[i] * (float) spare->f64[i];
+                        }
+                    }
+
+                    top = &slots[sp - 2];
+                    top->type = TOK_FLOAT;
+                    top->as.f32 = tiles[sp - 2].f32;
+                    sp -= 1;
+                    break;
+                }
+
+                lo = as_f64(&slots[sp - 2], &tiles[sp - 2], count);
+                hi = as_f64(&slots[sp - 1], &tiles[sp - 1], count);
+                if (tok->type == TOK_UNIFORM) {
+                    vec_uniform(spare->f64, stream, program->operands[ip], count);
+                    for (i = 0; i < count; i++) {
+                        tiles[sp - 2].f64[i] = lo[i] + (hi[i] - lo[i]) * spare->f64[i];
+                    }
+                } else {
+                    vec_normal(spare->f64, stream, program->operands[ip], count);
+                    for (i = 0; i < count; i++) {
+                        tiles[sp - 2].f64[i] = lo[i] + hi[i] * spare->f64[i];
+                    }
+                }
+
+                top = &slots[sp - 2];
+                top->type = TOK_DOUBLE;
+                top->as.f64 = tiles[sp - 2].f64;
+                sp -= 1;
+                break;
+            }
+            case TOK_NATIVE: {
+                /* The arguments as doubles, the result goes to the tile of the first one */
+                native = tok->as.native;
+                base = sp - native->arity;
+                for (k = 0; k < native->arity; k++) {
+                    if (slots[base + k].type == TOK_FLOAT) {
+                        vec_f32_to_f64(wide[k].f64, slots[base + k].as.f32, count);
+                        args[k] = wide[k].f64;
+                    } else {
+                        args[k] = as_f64(&slots[base + k], (wide != NULL) ? &wide[k] : &tiles[base + k], count);
+                    }
+                }
+
+                /* Floats are widened for the call and narrowed again */
+                lo = (program->real == TOK_FLOAT) ? wide[0].f64 : tiles[base].f64;
+                if (native->vector != NULL) {
+                    native->vector(lo, args, count);
+                } else {
+                    for (i = 0; i < count; i++) {
+                        for (k = 0; k < native->arity; k++) {
+                            row[k] = args[k][i];
+                        }
+                        lo[i] = native->scalar(row);
+                    }
+                }
+
+                top = &slots[base];
+                top->type = program->real;
+                if (program->real == TOK_FLOAT) {
+                    vec_f64_to_f32(tiles[base].f32, lo, count);
+                    top->as.f32 = tiles[base].f32;
+                } else {
+                    top->as.f64 = tiles[base].f64;
+                }
+                sp = base + 1;
+                break;
+            }
+            case TOK_THEN:
+            case TOK_ELSE:
+            case TOK_SHORT_AND:
+            case TOK_SHORT_OR:
+            case TOK_TUPLE: {
+                /* Everything runs, the 'if', '&&' or '||' picks afterwards */
+                break;
+            }
+            case TOK_STORE: {
+                /* An input column stays put, anything else is in a tile the next instruction may reuse */
+                top = &slots[program->depth + tok->as.i64];
+                *top = slots[sp - 1];
+                if (program->program->base[ip - 1].type != TOK_IDENTIFIER
+                    || inputs[program->operands[ip - 1]].type != top->type) {
+                    memcpy(tiles[program->depth + 1 + tok->as.i64].i64, top->as.i64, count * sizeof(int64_t));
+                    top->as.i64 = tiles[program->depth + 1 + tok->as.i64].i64;
+                }
+                break;
+            }
+            case TOK_LOAD: {
+                /* Kernels only ever write to the tile of their own level, never through a slot */
+                slots[sp++] = slots[program->depth + tok->as.i64];
+                break;
+            }
+            case TOK_IF: {
+                eval_select(&slots[sp - 3], &slots[sp - 2], &slots[sp - 1], &tiles[sp - 3], spare, wide, count);
+                sp -= 2;
+                break;
+            }
+            case TOK_POWMOD: {
+                /* Like 'powmod_tokens()', doubles are truncated */
+                for (i = sp - 3; i < sp; i++) {
+                    if (slots[i].type == TOK_FLOAT) {
+                        vec_f32_to_f64(spare->f64, slots[i].as.f32, count);
+                        slots[i].as.f64 = spare->f64;
+                        slots[i].type = TOK_DOUBLE;
+                    }
+                    if (slots[i].type == TOK_DOUBLE) {
+                        vec_f64_to_i64(tiles[i].i64, slots[i].as.f64, count);
+                        slots[i].as.i64 = tiles[i].i64;
+                        slots[i].type = TOK_LONG;
+                    }
+                }
+
+                top = &slots[sp - 3];
+                vec_powmod_i64(tiles[sp - 3].i64, top->as.i64, slots[sp - 2].as.i64, slots[sp - 1].as.i64, count);
+                top->as.i64 = tiles[sp - 3].i64;
+                sp -= 2;
+                break;
+            }
+            case TOK_FMA: {
+                top = &slots[sp - 3];
+                if (top->type == TOK_LONG && slots[sp - 2].type == TOK_LONG && slots[sp - 1].type == TOK_LONG) {
+                    vec_fma_i64(tiles[sp - 3].i64, top->as.i64, slots[sp - 2].as.i64, slots[sp - 1].as.i64, count);
+                    top->as.i64 = tiles[sp - 3].i64;
+                    sp -= 2;
+                    break;
+                }
+
+                /* Longs become floats in the wide tiles, they can't be narrowed in place */
+                if (program->real == TOK_FLOAT) {
+                    for (i = sp - 3; i < sp; i++) {
+                        if (slots[i].type == TOK_LONG) {
+                            vec_i64_to_f32(wide[i - (sp - 3)].f32, slots[i].as.i64, count);
+                            slots[i].as.f32 = wide[i - (sp - 3)].f32;
+                            slots[i].type = TOK_FLOAT;
+                        }
+                    }
+
+                    vec_fma_f32(tiles[sp - 3].f32, top->as.f32, slots[sp - 2].as.f32, slots[sp - 1].as.f32, count);
+                    top->as.f32 = tiles[sp - 3].f32;
+                    sp -= 2;
+                    break;
+                }
+
+                /* Longs get converted in their own tiles, the spare can only hold one */
+                for (i = sp - 3; i < sp; i++) {
+                    if (slots[i].type == TOK_LONG) {
+                        vec_i64_to_f64(tiles[i].f64, slots[i].as.i64, count);
+                        slots[i].as.f64 = tiles[i].f64;
+                        slots[i].type = TOK_DOUBLE;
+                    }
+                }
+
+                vec_fma_f64(tiles[sp - 3].f64, top->as.f64, slots[sp - 2].as.f64, slots[sp - 1].as.f64, count);
+                top->as.f64 = tiles[sp - 3].f64;
+                sp -= 2;
+                break;
+            }
+            default: {
+                eval_binary(tok->type, program->types[ip], &slots[sp - 2], &slots[sp - 1], &tiles[sp - 2], spare, wide,
+                    count);
+                sp--;
+                break;
+            }
+        }
+
+        if (run->counts != NULL) {
+            run->seconds[ip] += profile_clock() - started;
+            run->counts[ip] += count;
+            run->samples[ip] += count;
+        }
+    }
+}
+
+/*
+    'type' is the result's, from 'compile_columns()'. 'wide' is NULL unless the
+    program is in floats, then it has MAX_NATIVE_ARITY tiles.
+*/
+static void eval_binary(TokenType op, TokenType type, Slot* a, Slot* b, Tile* dest, Tile* spare, Tile* wide,
+    uint64_t count)
+{
+    double* x;
+    double* y;
+    float* x32;
+    float* y32;
+
+    if (IS_COMPARISON(op) || op == TOK_AND || op == TOK_OR) {
+        eval_compare(op, a, b, dest, spare, wide, count);
+        return;
+    }
+
+    if (type == TOK_LONG && a->type == TOK_LONG && b->type == TOK_LONG) {
+        switch (op) {
+            case TOK_ADD: {
+                vec_add_i64(dest->i64, a->as.i64, b->as.i64, count);
+                break;
+            }
+            case TOK_SUB: {
+                vec_sub_i64(dest->i64, a->as.i64, b->as.i64, count);
+                break;
+            }
+            case TOK_MUL: {
+                vec_mul_i64(dest->i64, a->as.i64, b->as.i64, count);
+                break;
+            }
+            case TOK_DIV: {
+                vec_div_i64(dest->i64, a->as.i64, b->as.i64, count);
+                break;
+            }
+            case TOK_MOD: {
+                vec_mod_i64(dest->i64, a->as.i64, b->as.i64, count);
+                break;
+            }
+            case TOK_EXP: {
+                vec_pow_i64(dest->i64, a->as.i64, b->as.i64, count);
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    } else if (op == TOK_MOD) {
+        /* Like 'mod_tokens()', doubles are truncated and the result is a long. Floats go through the spare. */
+        if (a->type == TOK_FLOAT) {
+            vec_f32_to_f64(spare->f64, a->as.f32, count);
+            vec_f64_to_i64(dest->i64, spare->f64, count);
+            a->as.i64 = dest->i64;
+        }
+        if (b->type == TOK_FLOAT) {
+            vec_f32_to_f64(spare->f64, b->as.f32, count);
+            b->as.f64 = spare->f64;
+            b->type = TOK_DOUBLE;
+        }
+        if (a->type == TOK_DOUBLE) {
+            vec_f64_to_i64(dest->i64, a->as.f64, count);
+            a->as.i64 = dest->i64;
+        }
+        if (b->type == TOK_DOUBLE) {
+            vec_f64_to_i64(spare->i64, b->as.f64, count);
+            b->as.i64 = spare->i64;
+        }
+        vec_mod_i64(dest->i64, a->as.i64, b->as.i64, count);
+    } else if (type == TOK_FLOAT) {
+        /* Both sides are longs only for an int ^ int, then the first is widened into 'dest' */
+        x32 = as_f32(a, (b->type == TOK_LONG) ? dest : spare, count);
+        y32 = as_f32(b, spare, count);
+
+        switch (op) {
+            case TOK_ADD: {
+                vec_add_f32(dest->f32, x32, y32, count);
+                break;
+            }
+            case TOK_SUB: {
+                vec_sub_f32(dest->f32, x32, y32, count);
+                break;
+            }
+            case TOK_MUL: {
+                vec_mul_f32(dest->f32, x32, y32, count);
+                break;
+            }
+            case TOK_DIV: {
+                vec_div_f32(dest->f32, x32, y32, count);
+                break;
+            }
+            case TOK_EXP: {
+                vec_pow_f32(dest->f32, x32, y32, count);
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    } else {
+        /* The same goes for doubles */
+        x = (a->type == TOK_LONG) ? as_f64(a, (b->type == TOK_LONG) ? dest : spare, count) : a->as.f64;
+        y = (b->type == TOK_LONG) ? as_f64(b, spare, count) : b->as.f64;
+
+        switch (op) {
+            case TOK_ADD: {
+                vec_add_f64(dest->f64, x, y, count);
+                break;
+            }
+            case TOK_SUB: {
+                vec_sub_f64(dest->f64, x, y, count);
+                break;
+            }
+            case TOK_MUL: {
+                vec_mul_f64(dest->f64, x, y, count);
+                break;
+            }
+            case TOK_DIV: {
+                vec_div_f64(dest->f64, x, y, count);
+                break;
+            }
+            case TOK_EXP: {
+                vec_pow_f64(dest->f64, x, y, count);
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+
+    a->type = type;
+    if (type == TOK_LONG) {
+        a->as.i64 = dest->i64;
+    } else if (type == TOK_FLOAT) {
+        a->as.f32 = dest->f32;
+    } else {
+        a->as.f64 = dest->f64;
+    }
+}
+
+/* Comparisons, '&&' and '||', the result is always a TOK_LONG of 0 or 1 */
+static void eval_compare(TokenType op, Slot* a, Slot* b, Tile* dest, Tile* spare, Tile* wide, uint64_t count)
+{
+    double* x;
+    double* y;
+    float* x32;
+    float* y32;
+
+    if (op == TOK_AND || op == TOK_OR) {
+        /* A float can't turn into a long in place, once 'a' is in the spare its own tile is free for 'b' */
+        if (a->type == TOK_FLOAT) {
+            vec_truth_f32(spare->i64, a->as.f32, count);
+            a->as.i64 = spare->i64;
+            if (b->type == TOK_FLOAT) {
+                vec_truth_f32(dest->i64, b->as.f32, count);
+                b->as.i64 = dest->i64;
+            }
+        } else if (b->type == TOK_FLOAT) {
+            vec_truth_f32(spare->i64, b->as.f32, count);
+            b->as.i64 = spare->i64;
+        }
+        if (a->type == TOK_DOUBLE) {
+            vec_truth_f64(dest->i64, a->as.f64, count);
+            a->as.i64 = dest->i64;
+        }
+        if (b->type == TOK_DOUBLE) {
+            vec_truth_f64(spare->i64, b->as.f64, count);
+            b->as.i64 = spare->i64;
+        }
+
+        if (op == TOK_AND) {
+            vec_and_i64(dest->i64, a->as.i64, b->as.i64, count);
+        } else {
+            vec_or_i64(dest->i64, a->as.i64, b->as.i64, count);
+        }
+    } else if (a->type == TOK_FLOAT || b->type == TOK_FLOAT) {
+        /* Into a wide tile first, the result is twice the size of the operand in 'dest' */
+        x32 = as_f32(a, spare, count);
+        y32 = as_f32(b, spare, count);
+
+        switch (op) {
+            case TOK_LT: {
+                vec_lt_f32(wide->i64, x32, y32, count);
+                break;
+            }
+            case TOK_LE: {
+                vec_le_f32(wide->i64, x32, y32, count);
+                break;
+            }
+            case TOK_GT: {
+                vec_lt_f32(wide->i64, y32, x32, count);
+                break;
+            }
+            case TOK_GE: {
+                vec_le_f32(wide->i64, y32, x32, count);
+                break;
+            }
+            case TOK_EQ: {
+                vec_eq_f32(wide->i64, x32, y32, count);
+                break;
+            }
+            default: {
+                vec_ne_f32(wide->i64, x32, y32, count);
+                break;
+            }
+        }
+        memcpy(dest->i64, wide->i64, count * sizeof(int64_t));
+    } else if (a->type == TOK_LONG && b->type == TOK_LONG) {
+        switch (op) {
+            case TOK_LT: {
+                vec_lt_i64(dest->i64, a->as.i64, b->as.i64, count);
+                break;
+            }
+            case TOK_LE: {
+                vec_le_i64(dest->i64, a->as.i64, b->as.i64, count);
+                break;
+            }
+            case TOK_GT: {
+                vec_lt_i64(dest->i64, b->as.i64, a->as.i64, count);
+                break;
+            }
+            case TOK_GE: {
+                vec_le_i64(dest->i64, b->as.i64, a->as.i64, count);
+                break;
+            }
+            case TOK_EQ: {
+                vec_eq_i64(dest->i64, a->as.i64, b->as.i64, count);
+                break;
+            }
+            default: {
+                vec_ne_i64(dest->i64, a->as.i64, b->as.i64, count);
+                break;
+            }
+        }
+    } else {
+        x = (a->type == TOK_LONG) ? as_f64(a, spare, count) : a->as.f64;
+        y = (b->type == TOK_LONG) ? as_f64(b, spare, count) : b->as.f64;
+
+        switch (op) {
+            case TOK_LT: {
+                vec_lt_f64(dest->i64, x, y, count);
+                break;
+            }
+            case TOK_LE: {
+                vec_le_f64(dest->i64, x, y, count);
+                break;
+            }
+            case TOK_GT: {
+                vec_lt_f64(dest->i64, y, x, count);
+                break;
+            }
+            case TOK_GE: {
+                vec_le_f64(dest->i64, y, x, count);
+                break;
+            }
+            case TOK_EQ: {
+                vec_eq_f64(dest->i64, x, y, count);
+                break;
+            }
+            default: {
+                vec_ne_f64(dest->i64, x, y, count);
+                break;
+            }
+        }
+    }
+
+    a->type = TOK_LONG;
+    a->as.i64 = dest->i64;
+}
+
+/* Blends the two branches of an 'if()' that were both computed */
+static void eval_select(Slot* cond, Slot* a, Slot* b, Tile* dest, Tile* spare, Tile* wide, uint64_t count)
+{
+    double* x;
+    double* y;
+    float* x32;
+    float* y32;
+
+    if (cond->type == TOK_DOUBLE) {
+        vec_truth_f64(dest->i64, cond->as.f64, count);
+        cond->as.i64 = dest->i64;
+    } else if (cond->type == TOK_FLOAT) {
+        vec_truth_f32(wide->i64, cond->as.f32, count);
+        cond->as.i64 = wide->i64;
+    }
+
+    if (a->type == TOK_LONG && b->type == TOK_LONG) {
+        vec_select_i64(dest->i64, cond->as.i64, a->as.i64, b->as.i64, count);
+        cond->type = TOK_LONG;
+        cond->as.i64 = dest->i64;
+    } else if (a->type == TOK_FLOAT || b->type == TOK_FLOAT) {
+        x32 = as_f32(a, spare, count);
+        y32 = as_f32(b, spare, count);
+
+        vec_select_f32(dest->f32, cond->as.i64, x32, y32, count);
+        cond->type = TOK_FLOAT;
+        cond->as.f32 = dest->f32;
+    } else {
+        /* At most one side is a long here, so the spare tile is enough */
+        x = (a->type == TOK_LONG) ? as_f64(a, spare, count) : a->as.f64;
+        y = (b->type == TOK_LONG) ? as_f64(b, spare, count) : b->as.f64;
+
+        vec_select_f64(dest->f64, cond->as.i64, x, y, count);
+        cond->type = TOK_DOUBLE;
+        cond->as.f64 = dest->f64;
+    }
+}
+
+/* The slow path, one 'eval_outputs()' per row with every input column bound */
+static void eval_per_row(ColumnProgram* program, Column* inputs, uint64_t first_row, uint64_t rows, Column* outputs)
+{
+    Env* env;
+    RngStream rng;
+    Token* values;
+    Token value;
+    uint64_t row;
+    uint32_t i;
+
+    env = alloc_env(NULL);
+    env->rng = &rng;
+    if ((values = malloc(sizeof(Token) * program->n_outputs)) == NULL) {
+        fprintf(stderr, "Failed to allocate row outputs.\n");
+        exit(5);
+    }
+
+    value.type = TOK_LONG;
+    value.as.i64 = 0;
+    for (i = 0; i < program->n_inputs; i++) {
+        bind_variable(env, inputs[i].name, &value);
+    }
+
+    for (row = 0; row < rows; row++) {
+        /* Fresh scope, so binding i is input i */
+        for (i = 0; i < program->n_inputs; i++) {
+            env->bindings[i].value.type = (inputs[i].type == TOK_LONG) ? TOK_LONG : TOK_DOUBLE;
+            if (inputs[i].type == TOK_LONG) {
+                env->bindings[i].value.as.i64 = inputs[i].as.i64[row];
+            } else if (inputs[i].type == TOK_FLOAT) {
+                env->bindings[i].value.as.f64 = inputs[i].as.f32[row];
+            } else {
+                env->bindings[i].value.as.f64 = inputs[i].as.f64[row];
+            }
+        }
+
+        /* Each row draws from a stream of its own */
+        rng.stream = first_row + row;
+        rng.draws = 0;
+        eval_outputs(program->program, env, values);
+
+        for (i = 0; i < program->n_outputs; i++) {
+            if (outputs[i].type == TOK_LONG) {
+                outputs[i].as.i64[row] = (values[i].type == TOK_LONG) ? values[i].as.i64 : token_to_double(&values[i]);
+            } else if (outputs[i].type == TOK_FLOAT) {
+                outputs[i].as.f32[row] = token_to_double(&values[i]);
+            } else {
+                outputs[i].as.f64[row] = token_to_double(&values[i]);
+            }
+            scrub_token(&values[i]);
+        }
+    }
+
+    free(values);
+    free_env(env);
+}
+
+/* Anything that isn't a long is the program's 'real' type */
+static TokenType binary_type(TokenType op, TokenType t1, TokenType t2)
+{
+    if (op == TOK_MOD || IS_COMPARISON(op) || op == TOK_AND || op == TOK_OR) {
+        return TOK_LONG;
+    }
+
+    return (t1 == TOK_LONG) ? t2 : t1;
+}
+
+static float* as_f32(Slot* s, Tile* scratch, uint64_t count)
+{
+    if (s->type == TOK_FLOAT) {
+        return s->as.f32;
+    }
+
+    vec_i64_to_f32(scratch->f32, s->as.i64, count);
+    return scratch->f32;
+}
+
+static double* as_f64(Slot* s, Tile* scratch, uint64_t count)
+{
+    if (s->type == TOK_DOUBLE) {
+        return s->as.f64;
+    }
+
+    vec_i64_to_f64(scratch->f64, s->as.i64, count);
+    return scratch->f64;
+}
@@ -0,0 +1,83 @@
+#ifndef CALC_COLUMN_H
+#define CALC_COLUMN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "token.h"
+
+/*
+    Evaluates an RPN program over whole columns instead of one Token at a time.
+    Identifiers in the program are bound to input columns by name, and every
+    operator runs over a tile of COLUMN_TILE_ROWS rows with the vmath kernels.
+    Integer/double promotion follows the same rules as add_tokens() and friends.
+
+    Tiles can't jump, so both branches of an 'if()' and both sides of '&&' and
+    '||' are computed for every row and the result is picked lane by lane. A
+    branch that could stop the program, like an integer division by zero,
+    makes the whole program go row by row instead.
+
+    'compile_columns_f32()' makes every value that isn't an integer a single
+    precision float instead of a double, constants, functions and double
+    inputs included, so twice as many rows fit in a cache line and in a
+    vector. Integers stay 64 bit. A program that goes row by row is
+    evaluated in double and rounded at the end.
+*/
+
+#define COLUMN_TILE_ROWS 256
+
+typedef struct {
+    char* name;
+
+    /* Only TOK_LONG, TOK_DOUBLE and TOK_FLOAT */
+    TokenType type;
+
+    union {
+        int64_t* i64;
+        double* f64;
+        float* f32;
+    } as;
+} Column;
+
+/* Bytes per value */
+#define COLUMN_WIDTH(type) ((type) == TOK_FLOAT ? sizeof(float) : sizeof(int64_t))
+
+typedef struct {
+    TokenStack* program;
+
+    /* Input column index for each TOK_IDENTIFIER or draw number for rand() and friends, type of every intermediate */
+    uint32_t* operands;
+    TokenType* types;
+
+    uint32_t depth;
+    uint32_t n_inputs;
+
+    /* What every value that isn't an integer is, TOK_DOUBLE or TOK_FLOAT */
+    TokenType real;
+
+    /* Type of every output of a tuple, 'eval_columns()' fills one column each */
+    uint32_t n_outputs;
+    TokenType* results;
+
+    /* Values kept by TOK_STORE, each gets a tile of its own */
+    uint32_t n_stored;
+
+    /* Some instruction has no column kernel, so rows go through 'eval_program()' */
+    bool per_row;
+} ColumnProgram;
+
+ColumnProgram* compile_columns(TokenStack* program, Column* inputs, uint32_t n_inputs);
+ColumnProgram* compile_columns_f32(TokenStack* program, Column* inputs, uint32_t n_inputs);
+void free_column_program(ColumnProgram* target);
+
+/*
+    'outputs' has 'program->n_outputs' columns, 'outputs[k].type' must be
+    'program->results[k]' and 'outputs[k].as' must hold 'rows' values.
+    Row i draws its random numbers from stream 'first_row + i', see rng.h.
+*/
+void eval_columns(ColumnProgram* program, Column* inputs, uint64_t first_row, uint64_t rows, Column* outputs);
+
+/* Moves 'column' on by 'rows' values, whatever their type */
+void advance_column(Column* column, uint64_t rows);
+
+#endif
@@ -0,0 +1,464 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "columnar.h"
+#include "arrow.h"
+#include "aggregate.h"
+#include "parser.h"
+#include "parallel.h"
+
+typedef struct {
+    uint32_t batch;
+    uint64_t first;
+    uint64_t rows;
+
+    /* Of the first row, counting every batch before, for rand() */
+    uint64_t offset;
+} ColumnarSpan;
+
+typedef struct {
+    /* One block of COLUMNAR_CHUNK_ROWS values per output, then the interleaved rows for raw output */
+    int64_t* buffer;
+    Column* results;
+    Column* inputs;
+    char* packed;
+    uint64_t rows;
+} ColumnarChunk;
+
+typedef struct {
+    MappedTable* table;
+    ColumnProgram* compiled;
+
+    /* Bytes per row of raw output */
+    uint32_t row_bytes;
+
+    ColumnarSpan* spans;
+    uint64_t first_chunk;
+    ColumnarChunk* chunks;
+} ColumnarJob;
+
+static void eval_chunk(void* ctx, uint64_t index);
+static void add_map(MappedTable* table, void* map, uint64_t size);
+
+MappedTable* alloc_mapped_table(ColumnFormat format)
+{
+    MappedTable* table;
+    uint32_t probe;
+
+    /* Both formats store little endian values, and they are read as they lie */
+    probe = 1;
+    if (*(uint8_t*) &probe != 1) {
+        fprintf(stderr, "Raw and Arrow columns need a little endian host.\n");
+        exit(25);
+    }
+
+    if ((table = calloc(1, sizeof(MappedTable))) == NULL) {
+        fprintf(stderr, "Failed to allocate mapped table.\n");
+        exit(5);
+    }
+    table->format = format;
+
+    return table;
+}
+
+void free_mapped_table(MappedTable* target)
+{
+    uint32_t i;
+
+    for (i = 0; i < target->n_maps; i++) {
+        munmap(target->maps[i], target->map_sizes[i]);
+    }
+    for (i = 0; i < target->n_names; i++) {
+        free(target->names[i]);
+    }
+
+    free(target->maps);
+    free(target->map_sizes);
+    free(target->names);
+    free(target->skipped);
+    free(target->columns);
+    free(target->rows);
+    free(target);
+}
+
+char* map_file(MappedTable* table, char* path, uint64_t* size)
+{
+    struct stat info;
+    void* map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Failed to open '%s'.\n", path);
+        exit(25);
+    }
+
+    *size = info.st_size;
+    if (*size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    if ((map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Failed to map '%s'.\n", path);
+        exit(25);
+    }
+    close(fd);
+    posix_madvise(map, *size, POSIX_MADV_SEQUENTIAL);
+
+    add_map(table, map, *size);
+    return map;
+}
+
+void map_raw_column(MappedTable* table, char* spec)
+{
+    Column* column;
+    char* colon;
+    char* eq;
+    uint64_t size;
+    uint64_t width;
+    TokenType type;
+
+    colon = strchr(spec, ':');
+    eq = strchr(spec, '=');
+    if (colon == NULL || eq == NULL || eq < colon) {
+        fprintf(stderr, "Bad raw column '%s', expected name:i64=path, name:f64=path or name:f32=path.\n", spec);
+        exit(25);
+    }
+
+    if (eq - colon == 4 && strncmp(colon, ":i64", 4) == 0) {
+        type = TOK_LONG;
+    } else if (eq - colon == 4 && strncmp(colon, ":f64", 4) == 0) {
+        type = TOK_DOUBLE;
+    } else if (eq - colon == 4 && strncmp(colon, ":f32", 4) == 0) {
+        type = TOK_FLOAT;
+    } else {
+        fprintf(stderr, "Bad raw column '%s', the type is i64, f64 or f32.\n", spec);
+        exit(25);
+    }
+
+    /* A raw table is a single batch */
+    if (table->rows == NULL) {
+        if ((table->rows = malloc(sizeof(uint64_t))) == NULL) {
+            fprintf(stderr, "Failed to allocate mapped table.\n");
+            exit(5);
+        }
+        table->n_batches = 1;
+    }
+    if ((table->columns = realloc(table->columns, sizeof(Column) * (table->width + 1))) == NULL) {
+        fprintf(stderr, "Failed to allocate mapped table.\n");
+        exit(5);
+    }
+
+    column = &table->columns[table->width];
+    column->name = keep_name(table, spec, colon - spec);
+    column->type = type;
+    column->as.i64 = (int64_t*) map_file(table, eq + 1, &size);
+
+    width = COLUMN_WIDTH(type);
+    if (size % width != 0) {
+        fprintf(stderr, "'%s' is not a whole number of %lu byte values.\n", eq + 1, (unsigned long) width);
+        exit(25);
+    }
+    if (table->width > 0 && size / width != table->rows[0]) {
+        fprintf(stderr, "Raw column '%s' has %lu values, '%s' has %lu.\n", column->name,
+            (unsigned long) (size / width), table->columns[0].name, (unsigned long) table->rows[0]);
+        exit(25);
+    }
+
+    table->rows[0] = size / width;
+    table->width++;
+}
+
+char* identifier_name(char* name, uint64_t length)
+{
+    char* output;
+    uint64_t i;
+    uint64_t j;
+
+    if ((output = malloc(length + 2)) == NULL) {
+        fprintf(stderr, "Failed to allocate column name.\n");
+        exit(5);
+    }
+
+    j = 0;
+    if (length == 0 || isdigit((unsigned char) name[0])) {
+        output[j++] = '_';
+    }
+    for (i = 0; i < length; i++) {
+        output[j++] = (isalnum((unsigned char) name[i]) || name[i] == '_') ? name[i] : '_';
+    }
+    output[j] = '\0';
+
+    return output;
+}
+
+char* keep_name(MappedTable* table, char* name, uint64_t length)
+{
+    if ((table->names = realloc(table->names, sizeof(char*) * (table->n_names + 1))) == NULL) {
+        fprintf(stderr, "Failed to allocate column name.\n");
+        exit(5);
+    }
+
+    table->names[table->n_names] = identifier_name(name, length);
+    return table->names[table->n_names++];
+}
+
+void skip_column(MappedTable* table, char* name)
+{
+    uint32_t i;
+
+    for (i = 0; i < table->n_skipped; i++) {
+        if (strcmp(table->skipped[i], name) == 0) {
+            return;
+        }
+    }
+
+    if ((table->skipped = realloc(table->skipped, sizeof(char*) * (table->n_skipped + 1))) == NULL) {
+        fprintf(stderr, "Failed to allocate mapped table.\n");
+        exit(5);
+    }
+    table->skipped[table->n_skipped++] = name;
+}
+
+void run_columnar(TokenStack* program, char* source, MappedTable* table, bool f32, FILE* out)
+{
+    ColumnarJob job;
+    ColumnarSpan single;
+    ArrowWriter writer;
+    TokenStack* resolved;
+    char** names;
+    uint64_t chunk_count;
+    uint64_t batch;
+    uint64_t first;
+    uint64_t row;
+    uint64_t offset;
+    uint64_t ip;
+    uint64_t i;
+    uint32_t n_outputs;
+    uint32_t b;
+    uint32_t k;
+    bool aggregates;
+
+    aggregates = false;
+    for (ip = 0; ip < program->size; ip++) {
+        if (program->base[ip].type == TOK_IDENTIFIER) {
+            for (i = 0; i < table->n_skipped; i++) {
+                if (strcmp(table->skipped[i], program->base[ip].as.string) == 0) {
+                    fprintf(stderr, "Column '%s' is not an int64, float or double column without nulls.\n",
+                        table->skipped[i]);
+                    exit(25);
+                }
+            }
+        }
+        if (f32 && program->base[ip].type == TOK_DOUBLE
+            && (float) program->base[ip].as.f64 != program->base[ip].as.f64) {
+            fprintf(stderr, "Warning: %.15g is %.9g as a float.\n",
+                program->base[ip].as.f64, (float) program->base[ip].as.f64);
+        }
+        aggregates = aggregates || IS_AGGREGATE(program->base[ip].type);
+    }
+
+    /* Batch 0 always has the names and types, even when there is no data */
+    if (aggregates && table->n_batches > 1) {
+        fprintf(stderr, "Aggregates need a single record batch.\n");
+        exit(25);
+    }
+    resolved = aggregates ? resolve_aggregates(program, table->columns, table->width, table->rows[0]) : program;
+
+    job.table = table;
+    if (has_free_variables(resolved, NULL, 0) || has_impure(resolved)) {
+        job.compiled = f32 ? compile_columns_f32(resolved, table->columns, table->width)
+            : compile_columns(resolved, table->columns, table->width);
+
+        chunk_count = 0;
+        for (b = 0; b < table->n_batches; b++) {
+            chunk_count += (table->rows[b] + COLUMNAR_CHUNK_ROWS - 1) / COLUMNAR_CHUNK_ROWS;
+        }
+        if ((job.spans = malloc(sizeof(ColumnarSpan) * (chunk_count + 1))) == NULL) {
+            fprintf(stderr, "Failed to allocate chunks.\n");
+            exit(5);
+        }
+
+        i = 0;
+        offset = 0;
+        for (b = 0; b < table->n_batches; b++) {
+            for (row = 0; row < table->rows[b]; row += COLUMNAR_CHUNK_ROWS) {
+                job.spans[i].batch = b;
+                job.spans[i].first = row;
+                job.spans[i].offset = offset + row;
+                job.spans[i].rows = table->rows[b] - row;
+                if (job.spans[i].rows > COLUMNAR_CHUNK_ROWS) {
+                    job.spans[i].rows = COLUMNAR_CHUNK_ROWS;
+                }
+                i++;
+            }
+            offset += table->rows[b];
+        }
+    } else {
+        /* Nothing but aggregates and constants, a single value and no columns to bind */
+        job.compiled = f32 ? compile_columns_f32(resolved, NULL, 0) : compile_columns(resolved, NULL, 0);
+        single.batch = 0;
+        single.first = 0;
+        single.rows = 1;
+        single.offset = 0;
+        job.spans = &single;
+        chunk_count = 1;
+    }
+    n_outputs = job.compiled->n_outputs;
+    job.row_bytes = 0;
+    for (k = 0; k < n_outputs; k++) {
+        job.row_bytes += COLUMN_WIDTH(job.compiled->results[k]);
+    }
+
+    names = NULL;
+    if (table->format == FORMAT_ARROW) {
+        names = split_outputs(source, n_outputs);
+        begin_arrow(&writer, out, names, job.compiled->results, n_outputs);
+    }
+
+    batch = get_thread_count() * COLUMNAR_BATCH_CHUNKS;
+    if ((job.chunks = calloc(batch, sizeof(ColumnarChunk))) == NULL) {
+        fprintf(stderr, "Failed to allocate chunks.\n");
+        exit(5);
+    }
+
+    for (first = 0; first < chunk_count; first += batch) {
+        if (first + batch > chunk_count) {
+            batch = chunk_count - first;
+        }
+
+        job.first_chunk = first;
+        parallel_for(batch, eval_chunk, &job);
+
+        /* Writing stays on this thread so the rows come out in order */
+        for (i = 0; i < batch; i++) {
+            if (table->format == FORMAT_ARROW) {
+                write_arrow_batch(&writer, job.chunks[i].results, job.chunks[i].rows);
+            } else {
+                fwrite(job.chunks[i].packed, job.row_bytes, job.chunks[i].rows, out);
+            }
+        }
+    }
+
+    if (table->format == FORMAT_ARROW) {
+        end_arrow(&writer);
+        for (k = 0; k < n_outputs; k++) {
+            free(names[k]);
+        }
+        free(names);
+    }
+
+    batch = get_thread_count() * COLUMNAR_BATCH_CHUNKS;
+    for (i = 0; i < batch; i++) {
+        free(job.chunks[i].buffer);
+        free(job.chunks[i].results);
+        free(job.chunks[i].inputs);
+    }
+    free(job.chunks);
+    if (job.spans != &single) {
+        free(job.spans);
+    }
+    free_column_program(job.compiled);
+    if (resolved != program) {
+        free_token_stack(resolved);
+    }
+}
+
+static void eval_chunk(void* ctx, uint64_t index)
+{
+    ColumnarJob* job;
+    ColumnarChunk* chunk;
+    ColumnarSpan* span;
+    Column* columns;
+    int64_t* packed;
+    char* at;
+    uint64_t i;
+    uint32_t n_outputs;
+    uint32_t n_inputs;
+    uint32_t blocks;
+    uint32_t k;
+
+    job = ctx;
+    chunk = &job->chunks[index];
+    span = &job->spans[job->first_chunk + index];
+    n_outputs = job->compiled->n_outputs;
+    n_inputs = job->compiled->n_inputs;
+
+    /* Buffers are kept between batches */
+    blocks = n_outputs + ((job->table->format == FORMAT_RAW && n_outputs > 1) ? n_outputs : 0);
+    if (chunk->buffer == NULL) {
+        chunk->buffer = malloc(sizeof(int64_t) * COLUMNAR_CHUNK_ROWS * blocks);
+        chunk->results = malloc(sizeof(Column) * (n_outputs + 1));
+        chunk->inputs = malloc(sizeof(Column) * (n_inputs + 1));
+        if (chunk->buffer == NULL || chunk->results == NULL || chunk->inputs == NULL) {
+            fprintf(stderr, "Failed to allocate chunk.\n");
+            exit(5);
+        }
+    }
+    for (k = 0; k < n_outputs; k++) {
+        chunk->results[k].name = NULL;
+        chunk->results[k].type = job->compiled->results[k];
+        chunk->results[k].as.i64 = chunk->buffer + COLUMNAR_CHUNK_ROWS * k;
+    }
+
+    /* The inputs are views into the maps, nothing is copied */
+    columns = &job->table->columns[(uint64_t) span->batch * job->table->width];
+    for (k = 0; k < n_inputs; k++) {
+        chunk->inputs[k] = columns[k];
+        advance_column(&chunk->inputs[k], span->first);
+    }
+
+    eval_columns(job->compiled, chunk->inputs, span->offset, span->rows, chunk->results);
+    chunk->rows = span->rows;
+
+    /* Row by row for raw output, the outputs of a row next to each other */
+    chunk->packed = (char*) chunk->buffer;
+    if (job->table->format == FORMAT_RAW && n_outputs > 1) {
+        packed = chunk->buffer + COLUMNAR_CHUNK_ROWS * n_outputs;
+        chunk->packed = (char*) packed;
+        if (job->row_bytes == n_outputs * sizeof(int64_t)) {
+            for (i = 0; i < span->rows; i++) {
+                for (k = 0; k < n_outputs; k++) {
+                    packed[i * n_outputs + k] = chunk->results[k].as.i64[i];
+                }
+            }
+        } else {
+            /* Floats are half as wide */
+            at = chunk->packed;
+            for (i = 0; i < span->rows; i++) {
+                for (k = 0; k < n_outputs; k++) {
+                    if (chunk->results[k].type == TOK_FLOAT) {
+                        memcpy(at, &chunk->results[k].as.f32[i], sizeof(float));
+                        at += sizeof(float);
+                    } else {
+                        memcpy(at, &chunk->results[k].as.i64[i], sizeof(int64_t));
+                        at += sizeof(int64_t);
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void add_map(MappedTable* table, void* map, uint64_t size)
+{
+    table->maps = realloc(table->maps, sizeof(void*) * (table->n_maps + 1));
+    table->map_sizes = realloc(table->map_sizes, sizeof(uint64_t) * (table->n_maps + 1));
+    if (table->maps == NULL || table->map_sizes == NULL) {
+        fprintf(stderr, "Failed to allocate mapped table.\n");
+        exit(5);
+    }
+
+    table->maps[table->n_maps] = map;
+    table->map_sizes[table->n_maps] = size;
+    table->n_maps++;
+}
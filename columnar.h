@@ -0,0 +1,89 @@
+#ifndef CALC_COLUMNAR_H
+#define CALC_COLUMNAR_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "token.h"
+#include "column.h"
+
+/*
+    Columns that are already in binary, evaluated where they lie. Files are
+    mapped and the column evaluator reads their values in place, there is no
+    parsing and no copy.
+
+    A raw column is a file of native values, little endian on anything calc
+    runs on, named and typed on the command line as 'name:i64=path',
+    'name:f64=path' or 'name:f32=path'. All raw columns must hold the same
+    number of values.
+
+    An Arrow IPC file brings its own names and types, one set of columns per
+    record batch. Signed 64 bit integers, floats and doubles without nulls can
+    be read, other flat columns are skipped and only an error if the program
+    reads them, nested ones are refused.
+
+    Float columns are widened to double as they are read, unless the program
+    is evaluated in single precision ('f32', see 'compile_columns_f32()'),
+    which also makes every result that isn't an integer a float. Constants
+    a float can't hold exactly get a warning on stderr.
+
+    Results are written in the input's format. Raw output is like '--binary',
+    the outputs of a row next to each other, Arrow output is a file with one
+    column per output named after its expression. Rows are cut into chunks of
+    COLUMNAR_CHUNK_ROWS, evaluated on the worker threads and written in order,
+    each chunk becoming a record batch of its own in Arrow output.
+*/
+
+#define COLUMNAR_CHUNK_ROWS 65536
+#define COLUMNAR_BATCH_CHUNKS 2
+
+typedef enum {
+    FORMAT_RAW,
+    FORMAT_ARROW
+} ColumnFormat;
+
+typedef struct {
+    ColumnFormat format;
+
+    /* Column i of batch b is 'columns[b * width + i]', pointing into a map */
+    Column* columns;
+    uint32_t width;
+    uint64_t* rows;
+    uint32_t n_batches;
+
+    /* Columns that can't be read, by name */
+    char** skipped;
+    uint32_t n_skipped;
+
+    /* Every name the columns point at */
+    char** names;
+    uint32_t n_names;
+
+    void** maps;
+    uint64_t* map_sizes;
+    uint32_t n_maps;
+} MappedTable;
+
+MappedTable* alloc_mapped_table(ColumnFormat format);
+void free_mapped_table(MappedTable* target);
+
+/* Maps 'path' for as long as 'table' lives, NULL for an empty file */
+char* map_file(MappedTable* table, char* path, uint64_t* size);
+
+/* Adds a raw column from a 'name:i64=path', 'name:f64=path' or 'name:f32=path' spec */
+void map_raw_column(MappedTable* table, char* spec);
+
+/* The first 'length' bytes of 'name' as an identifier, anything else becomes '_', malloc'd */
+char* identifier_name(char* name, uint64_t length);
+
+/* A name the table frees, see 'identifier_name()' */
+char* keep_name(MappedTable* table, char* name, uint64_t length);
+
+/* Marks a column the program must not read */
+void skip_column(MappedTable* table, char* name);
+
+/* 'source' is the expression text, its outputs name Arrow's result columns */
+void run_columnar(TokenStack* program, char* source, MappedTable* table, bool f32, FILE* out);
+
+#endif
@@ -0,0 +1,308 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "cse.h"
+#include "bigint.h"
+#include "array.h"
+#include "text.h"
+#include "function.h"
+#include "builtin.h"
+
+/* One per instruction, for the subexpression it ends, whose span is in 'Pass.spans' */
+typedef struct {
+    uint64_t hash;
+
+    /* Has something impure somewhere, see 'is_impure()', so no two copies are the same value */
+    bool impure;
+
+    /* The earlier copy this one repeats, or -1 */
+    int64_t first;
+
+    /* Later copies of this one, and the slot they load once there are any */
+    uint32_t uses;
+    int64_t slot;
+} CseNode;
+
+typedef struct {
+    TokenStack* program;
+    OperandSpan* spans;
+    CseNode* nodes;
+
+    /* Open addressing on the hash, 'ip + 1' of each first copy or 0 */
+    uint64_t* table;
+    uint64_t table_size;
+
+    int64_t n_slots;
+} Pass;
+
+static bool is_candidate(Pass* p, uint64_t ip);
+static void visit(Pass* p, uint64_t ip, bool conditional);
+static int64_t find_copy(Pass* p, uint64_t ip, bool insert);
+static void emit(Pass* p, TokenStack* out, uint64_t ip);
+static bool same_range(Pass* p, uint64_t a, uint64_t b);
+static bool same_program(TokenStack* a, TokenStack* b);
+static bool same_token(Token* a, Token* b);
+static uint64_t hash_token(Token* tok);
+
+TokenStack* share_subexpressions(TokenStack* program)
+{
+    TokenStack* output;
+    Pass p;
+    uint64_t left;
+    uint64_t ip;
+    uint64_t end;
+    int k;
+
+    p.program = program;
+    p.n_slots = 0;
+    p.table_size = 16;
+    while (p.table_size < 2 * program->size) {
+        p.table_size *= 2;
+    }
+
+    /* Nothing this pass understands, leave it to whoever reports the error */
+    if ((p.spans = find_operand_spans(program, &left)) == NULL || left != 1) {
+        free(p.spans);
+        return copy_token_stack(program);
+    }
+
+    p.nodes = calloc(program->size + 1, sizeof(CseNode));
+    p.table = calloc(p.table_size, sizeof(uint64_t));
+    if (p.nodes == NULL || p.table == NULL) {
+        fprintf(stderr, "Failed to allocate subexpression table.\n");
+        exit(5);
+    }
+
+    /* A hash of the whole subexpression makes copies easy to find, operands last to first */
+    for (ip = 0; ip < program->size; ip++) {
+        p.nodes[ip].first = -1;
+        p.nodes[ip].slot = -1;
+
+        p.nodes[ip].hash = hash_token(&program->base[ip]);
+        p.nodes[ip].impure = is_impure(&program->base[ip]);
+        end = ip - 1;
+        for (k = p.spans[ip].arity - 1; k >= 0; k--) {
+            p.nodes[ip].hash = p.nodes[ip].hash * 1000003 ^ p.nodes[end].hash;
+            p.nodes[ip].impure = p.nodes[ip].impure || p.nodes[end].impure;
+            end = p.spans[end].start - 1;
+        }
+    }
+
+    visit(&p, program->size - 1, false);
+
+    output = alloc_token_stack();
+    emit(&p, output, program->size - 1);
+    link_jumps(output);
+
+    free(p.spans);
+    free(p.nodes);
+    free(p.table);
+
+    return output;
+}
+
+/* Constants are as cheap to push as a load, jumps are only half of something and impure values differ */
+static bool is_candidate(Pass* p, uint64_t ip)
+{
+    Token* tok;
+
+    tok = &p->program->base[ip];
+
+    return !p->nodes[ip].impure && !IS_NUMBER(tok) && !IS_STRING(tok) && tok->type != TOK_ARRAY && !IS_JUMP(tok->type)
+        && tok->type != TOK_TUPLE && tok->type != TOK_STORE && tok->type != TOK_LOAD;
+}
+
+/* Top down and front to back, so the first copy found is the first to run */
+static void visit(Pass* p, uint64_t ip, bool conditional)
+{
+    TokenType type;
+    int64_t first;
+    int k;
+
+    if (is_candidate(p, ip)) {
+        first = find_copy(p, ip, !conditional);
+        if (first >= 0) {
+            p->nodes[ip].first = first;
+            p->nodes[first].uses++;
+            return;
+        }
+    }
+
+    type = p->program->base[ip].type;
+    if (IS_AGGREGATE(type)) {
+        return;
+    }
+
+    for (k = 0; k < p->spans[ip].arity; k++) {
+        /* Only the condition of an 'if()' and the left of '&&' and '||' always run */
+        visit(p, find_operand_end(p->spans, ip, k), conditional || (k > 0 && (type == TOK_IF || type == TOK_AND || type == TOK_OR)));
+    }
+}
+
+/* The first copy of the subexpression at 'ip', if there is none it becomes one when 'insert' is set */
+static int64_t find_copy(Pass* p, uint64_t ip, bool insert)
+{
+    uint64_t mask;
+    uint64_t i;
+    uint64_t entry;
+
+    mask = p->table_size - 1;
+    for (i = p->nodes[ip].hash & mask; (entry = p->table[i]) != 0; i = (i + 1) & mask) {
+        if (p->nodes[entry - 1].hash == p->nodes[ip].hash && same_range(p, entry - 1, ip)) {
+            return entry - 1;
+        }
+    }
+
+    if (insert) {
+        p->table[i] = ip + 1;
+    }
+
+    return -1;
+}
+
+static void emit(Pass* p, TokenStack* out, uint64_t ip)
+{
+    CseNode* node;
+    Token tok;
+    int k;
+
+    node = &p->nodes[ip];
+
+    if (node->first >= 0) {
+        tok.type = TOK_LOAD;
+        tok.as.i64 = p->nodes[node->first].slot;
+        push_token_stack(out, &tok);
+        return;
+    }
+
+    for (k = 0; k < p->spans[ip].arity; k++) {
+        emit(p, out, find_operand_end(p->spans, ip, k));
+    }
+    tok = copy_token(&p->program->base[ip]);
+    push_token_stack(out, &tok);
+
+    /* Slots are handed out in the order they are stored */
+    if (node->uses > 0) {
+        node->slot = p->n_slots++;
+        tok.type = TOK_STORE;
+        tok.as.i64 = node->slot;
+        push_token_stack(out, &tok);
+    }
+}
+
+static bool same_range(Pass* p, uint64_t a, uint64_t b)
+{
+    uint64_t length;
+    uint64_t i;
+
+    length = a - p->spans[a].start;
+    if (length != b - p->spans[b].start) {
+        return false;
+    }
+
+    for (i = 0; i <= length; i++) {
+        if (!same_token(&p->program->base[a - i], &p->program->base[b - i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Two lambda bodies, written the same way */
+static bool same_program(TokenStack* a, TokenStack* b)
+{
+    uint64_t i;
+
+    if (a->size != b->size) {
+        return false;
+    }
+
+    for (i = 0; i < a->size; i++) {
+        if (!same_token(&a->base[i], &b->base[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool same_token(Token* a, Token* b)
+{
+    if (a->type != b->type) {
+        return false;
+    }
+
+    switch (a->type) {
+        case TOK_DOUBLE: {
+            return memcmp(&a->as.f64, &b->as.f64, sizeof(double)) == 0;
+        }
+        case TOK_BIGINT: {
+            return big_compare(a->as.big, b->as.big) == 0;
+        }
+        case TOK_ARRAY: {
+            return array_equal(a->as.array, b->as.array);
+        }
+        case TOK_IDENTIFIER: {
+            return strcmp(a->as.string, b->as.string) == 0;
+        }
+        case TOK_STRING:
+        case TOK_SHORT_STRING: {
+            return compare_strings(a, b) == 0;
+        }
+        case TOK_CALL: {
+            return a->as.call->target == b->as.call->target && a->as.call->arity == b->as.call->arity;
+        }
+        case TOK_NATIVE: {
+            return a->as.native == b->as.native;
+        }
+        case TOK_SOLVE:
+        case TOK_MINIMIZE:
+        case TOK_INTEGRATE: {
+            return strcmp(a->as.lambda->param, b->as.lambda->param) == 0
+                && same_program(a->as.lambda->body, b->as.lambda->body);
+        }
+        default: {
+            /* Jumps are relative, so copies of an 'if()' match too */
+            return (IS_JUMP(a->type) || a->type == TOK_LONG || a->type == TOK_TUPLE || a->type == TOK_MAKE_ARRAY
+                || a->type == TOK_STORE || a->type == TOK_LOAD) ? a->as.i64 == b->as.i64 : true;
+        }
+    }
+}
+
+/* FNV-1a over whatever tells two tokens of a type apart */
+static uint64_t hash_token(Token* tok)
+{
+    uint64_t hash;
+    unsigned char* bytes;
+    size_t length;
+    size_t i;
+
+    hash = 14695981039346656037UL ^ tok->type;
+    bytes = NULL;
+    length = 0;
+
+    if (tok->type == TOK_IDENTIFIER) {
+        bytes = (unsigned char*) tok->as.string;
+        length = strlen(tok->as.string);
+    } else if (IS_STRING(tok)) {
+        bytes = (unsigned char*) string_bytes(tok);
+        length = string_length(tok);
+    } else if (IS_HIGHER_ORDER(tok->type)) {
+        bytes = (unsigned char*) tok->as.lambda->param;
+        length = strlen(tok->as.lambda->param);
+    } else if (tok->type == TOK_NATIVE) {
+        bytes = (unsigned char*) tok->as.native->name;
+        length = strlen(tok->as.native->name);
+    } else if (tok->type == TOK_LONG || tok->type == TOK_DOUBLE || IS_JUMP(tok->type)) {
+        bytes = (unsigned char*) &tok->as;
+        length = sizeof(int64_t);
+    }
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211UL;
+    }
+
+    return hash;
+}
@@ -0,0 +1,23 @@
+#ifndef CALC_CSE_H
+#define CALC_CSE_H
+
+#include "token.h"
+
+/*
+    Common subexpression elimination. A subexpression that shows up more than
+    once, within one output or across the outputs of a tuple, is computed
+    where it first appears and kept with a TOK_STORE; the later copies become
+    a TOK_LOAD of that slot. Variables count as well, so an input that several
+    outputs read is only looked up once.
+
+    The first copy has to run whenever a later one does, so it can't be in a
+    branch of an 'if()' or on the right of '&&' and '||', the later ones can.
+    Aggregates are shared whole but never looked into, their operand runs over
+    every row. The same goes for solve(), minimize() and integrate() with the
+    same body, which is left to its own scope.
+*/
+
+/* A copy of 'program' with every repeated subexpression computed once */
+TokenStack* share_subexpressions(TokenStack* program);
+
+#endif
@@ -0,0 +1,712 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "csv.h"
+#include "column.h"
+#include "columnar.h"
+#include "parser.h"
+#include "parallel.h"
+
+/* Longest field handed to 'strtod()' when the fast path gives up */
+#define MAX_NUMBER_LENGTH 128
+
+#define INITIAL_CHUNK_ROWS 4096
+#define CSV_GROWTH_FACTOR 2
+
+/* Largest mantissa and power of ten that are both exact in a double */
+#define EXACT_MANTISSA ((uint64_t) 1 << 53)
+#define EXACT_POWER 22
+
+typedef struct {
+    /* Formatted rows, ready to be written */
+    char* text;
+    uint64_t size;
+    uint64_t capacity;
+
+    /* One per header column, only the ones the program reads hold values */
+    Column* fields;
+    Column* results;
+    uint64_t rows;
+    uint64_t row_capacity;
+} CsvChunk;
+
+typedef struct {
+    char* map;
+    uint64_t length;
+
+    /* First byte after the header line */
+    uint64_t data_start;
+
+    TokenStack* program;
+    ColumnProgram* compiled;
+    char** names;
+    bool* used;
+    uint32_t width;
+    uint32_t n_outputs;
+
+    /* Type of every column over the whole file, and which ones each chunk found a real in */
+    TokenType* types;
+    bool* reals;
+
+    uint64_t first_chunk;
+    CsvChunk* chunks;
+} CsvJob;
+
+static const double powers_of_ten[EXACT_POWER + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static void scan_chunk(void* ctx, uint64_t index);
+static void eval_chunk(void* ctx, uint64_t index);
+static char* row_start(CsvJob* job, uint64_t offset);
+static char* line_end(char* pos, char* stop);
+static bool is_blank(char* pos, char* end);
+static char* field_end(CsvJob* job, char* pos, char* end);
+static void parse_row(CsvJob* job, CsvChunk* chunk, char* pos, char* end);
+static void store_field(CsvJob* job, CsvChunk* chunk, uint32_t col, char* pos, char* end);
+static Token field_value(CsvJob* job, uint32_t col, char* pos, char* end);
+static bool parse_number(char* pos, char* end, Token* target);
+static void grow_chunk(CsvJob* job, CsvChunk* chunk);
+static void reserve_text(CsvChunk* chunk, uint64_t extra);
+static char* column_name(char* pos, char* end);
+static void write_names(char* source, uint32_t n_outputs, FILE* out);
+static uint64_t line_number(CsvJob* job, char* pos);
+
+void run_csv(TokenStack* program, char* source, char* path, FILE* out)
+{
+    CsvJob job;
+    ColumnProgram* compiled;
+    Column* columns;
+    struct stat info;
+    char* header_end;
+    char* pos;
+    char* end;
+    uint64_t chunk_count;
+    uint64_t batch;
+    uint64_t first;
+    uint64_t ip;
+    uint64_t i;
+    uint32_t col;
+    int fd;
+
+    for (ip = 0; ip < program->size; ip++) {
+        if (IS_AGGREGATE(program->base[ip].type)) {
+            fprintf(stderr, "Aggregates are not supported with --csv.\n");
+            exit(25);
+        }
+    }
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &info) != 0) {
+        fprintf(stderr, "Failed to open '%s'.\n", path);
+        exit(25);
+    }
+    if (info.st_size == 0) {
+        fprintf(stderr, "Table has no header.\n");
+        exit(25);
+    }
+
+    job.length = info.st_size;
+    if ((job.map = mmap(NULL, job.length, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "Failed to map '%s'.\n", path);
+        exit(25);
+    }
+    close(fd);
+    posix_madvise(job.map, job.length, POSIX_MADV_SEQUENTIAL);
+
+    /* Header, the names become identifiers */
+    end = job.map + job.length;
+    header_end = line_end(job.map, end);
+    job.data_start = (header_end < end) ? header_end - job.map + 1 : job.length;
+    if (header_end > job.map && header_end[-1] == '\r') {
+        header_end--;
+    }
+
+    job.names = NULL;
+    job.width = 0;
+    pos = is_blank(job.map, header_end) ? header_end + 1 : job.map;
+    while (pos <= header_end) {
+        end = field_end(&job, pos, header_end);
+        if ((job.names = realloc(job.names, sizeof(char*) * (job.width + 1))) == NULL) {
+            fprintf(stderr, "Failed to allocate table header.\n");
+            exit(5);
+        }
+        job.names[job.width++] = column_name(pos, end);
+        pos = end + 1;
+    }
+    if (job.width == 0) {
+        fprintf(stderr, "Table has no header.\n");
+        exit(25);
+    }
+
+    /* Unknown names and the like come up here rather than on some worker */
+    if ((columns = malloc(sizeof(Column) * job.width)) == NULL
+        || (job.used = calloc(job.width, sizeof(bool))) == NULL) {
+        fprintf(stderr, "Failed to allocate columns.\n");
+        exit(5);
+    }
+    for (col = 0; col < job.width; col++) {
+        columns[col].name = job.names[col];
+        columns[col].type = TOK_LONG;
+        columns[col].as.i64 = NULL;
+    }
+    compiled = compile_columns(program, columns, job.width);
+    for (ip = 0; ip < program->size; ip++) {
+        if (program->base[ip].type == TOK_IDENTIFIER) {
+            job.used[compiled->operands[ip]] = true;
+        }
+    }
+
+    /*
+        Row by row, every column gets bound, see 'eval_columns()'. With every
+        column an integer as many rows need it as ever will.
+    */
+    for (col = 0; col < job.width && compiled->per_row; col++) {
+        job.used[col] = true;
+    }
+    free_column_program(compiled);
+
+    /* A column that has a real anywhere is TOK_DOUBLE in every chunk, so the program is compiled once */
+    chunk_count = (job.length - job.data_start + CSV_CHUNK_BYTES - 1) / CSV_CHUNK_BYTES;
+    if ((job.types = malloc(sizeof(TokenType) * job.width)) == NULL
+        || (job.reals = calloc(chunk_count * job.width + 1, sizeof(bool))) == NULL) {
+        fprintf(stderr, "Failed to allocate columns.\n");
+        exit(5);
+    }
+    parallel_for(chunk_count, scan_chunk, &job);
+
+    for (col = 0; col < job.width; col++) {
+        job.types[col] = TOK_LONG;
+        for (i = 0; i < chunk_count; i++) {
+            if (job.reals[i * job.width + col]) {
+                job.types[col] = TOK_DOUBLE;
+                break;
+            }
+        }
+        columns[col].type = job.types[col];
+    }
+    free(job.reals);
+
+    job.program = program;
+    job.compiled = compile_columns(program, columns, job.width);
+    job.n_outputs = job.compiled->n_outputs;
+    free(columns);
+
+    fwrite(job.map, 1, header_end - job.map, out);
+    write_names(source, job.n_outputs, out);
+
+    batch = get_thread_count() * CSV_BATCH_CHUNKS;
+
+    if ((job.chunks = calloc(batch, sizeof(CsvChunk))) == NULL) {
+        fprintf(stderr, "Failed to allocate CSV chunks.\n");
+        exit(5);
+    }
+
+    for (first = 0; first < chunk_count; first += batch) {
+        if (first + batch > chunk_count) {
+            batch = chunk_count - first;
+        }
+
+        job.first_chunk = first;
+        parallel_for(batch, eval_chunk, &job);
+
+        /* Writing stays on this thread so the rows come out in file order */
+        for (i = 0; i < batch; i++) {
+            fwrite(job.chunks[i].text, 1, job.chunks[i].size, out);
+        }
+    }
+
+    batch = get_thread_count() * CSV_BATCH_CHUNKS;
+    for (i = 0; i < batch; i++) {
+        if (job.chunks[i].fields != NULL) {
+            for (col = 0; col < job.width; col++) {
+                free(job.chunks[i].fields[col].as.i64);
+            }
+            for (col = 0; col < job.n_outputs; col++) {
+                free(job.chunks[i].results[col].as.i64);
+            }
+        }
+        free(job.chunks[i].fields);
+        free(job.chunks[i].results);
+        free(job.chunks[i].text);
+    }
+    for (col = 0; col < job.width; col++) {
+        free(job.names[col]);
+    }
+    free(job.names);
+    free(job.used);
+    free(job.types);
+    free(job.chunks);
+    free_column_program(job.compiled);
+    munmap(job.map, job.length);
+}
+
+/* Only finds out which columns have a real in the chunk, 'index' counts from the first chunk */
+static void scan_chunk(void* ctx, uint64_t index)
+{
+    CsvJob* job;
+    bool* reals;
+    char* pos;
+    char* stop;
+    char* end;
+    char* last;
+    char* field;
+    char* next;
+    uint64_t begin;
+    uint32_t col;
+
+    job = ctx;
+    reals = &job->reals[index * job->width];
+
+    begin = job->data_start + index * CSV_CHUNK_BYTES;
+    pos = row_start(job, begin);
+    stop = (begin + CSV_CHUNK_BYTES < job->length) ? row_start(job, begin + CSV_CHUNK_BYTES) : job->map + job->length;
+
+    /* A row with too few or too many values is left for 'parse_row()' to report */
+    for (; pos < stop; pos = end + 1) {
+        end = line_end(pos, stop);
+        if (is_blank(pos, end)) {
+            continue;
+        }
+        last = (end > pos && end[-1] == '\r') ? end - 1 : end;
+
+        field = pos;
+        for (col = 0; col < job->width; col++) {
+            next = field_end(job, field, last);
+            if (job->used[col] && !reals[col] && field_value(job, col, field, next).type == TOK_DOUBLE) {
+                reals[col] = true;
+            }
+            if (next == last) {
+                break;
+            }
+            field = next + 1;
+        }
+    }
+}
+
+static void eval_chunk(void* ctx, uint64_t index)
+{
+    CsvJob* job;
+    CsvChunk* chunk;
+    char* pos;
+    char* stop;
+    char* end;
+    char* last;
+    uint64_t begin;
+    uint64_t row;
+    uint32_t col;
+    uint32_t k;
+    int written;
+
+    job = ctx;
+    chunk = &job->chunks[index];
+
+    /* Buffers are kept between batches */
+    if (chunk->fields == NULL) {
+        chunk->fields = calloc(job->width, sizeof(Column));
+        chunk->results = calloc(job->n_outputs, sizeof(Column));
+        if (chunk->fields == NULL || chunk->results == NULL) {
+            fprintf(stderr, "Failed to allocate CSV chunk.\n");
+            exit(5);
+        }
+        for (col = 0; col < job->width; col++) {
+            chunk->fields[col].name = job->names[col];
+        }
+        chunk->row_capacity = 0;
+        grow_chunk(job, chunk);
+    }
+    for (col = 0; col < job->width; col++) {
+        chunk->fields[col].type = job->types[col];
+    }
+
+    /* The rows that start in this chunk's bytes */
+    begin = job->data_start + (job->first_chunk + index) * CSV_CHUNK_BYTES;
+    pos = row_start(job, begin);
+    stop = (begin + CSV_CHUNK_BYTES < job->length) ? row_start(job, begin + CSV_CHUNK_BYTES) : job->map + job->length;
+
+    chunk->rows = 0;
+    for (; pos < stop; pos = end + 1) {
+        end = line_end(pos, stop);
+        if (!is_blank(pos, end)) {
+            parse_row(job, chunk, pos, (end > pos && end[-1] == '\r') ? end - 1 : end);
+        }
+    }
+
+    for (k = 0; k < job->n_outputs; k++) {
+        chunk->results[k].type = job->compiled->results[k];
+    }
+    /* Rows aren't numbered until they are written, so each chunk numbers its own for rand() */
+    eval_columns(job->compiled, chunk->fields, (job->first_chunk + index) << 32, chunk->rows, chunk->results);
+
+    /* Every row as it was, plus the outputs */
+    chunk->size = 0;
+    row = 0;
+    for (pos = row_start(job, begin); pos < stop; pos = end + 1) {
+        end = line_end(pos, stop);
+        if (is_blank(pos, end)) {
+            continue;
+        }
+        last = (end > pos && end[-1] == '\r') ? end - 1 : end;
+
+        reserve_text(chunk, (last - pos) + job->n_outputs * MAX_FORMATTED_NUMBER + 1);
+        memcpy(chunk->text + chunk->size, pos, last - pos);
+        chunk->size += last - pos;
+
+        /* Same formats as 'print_token()' */
+        for (k = 0; k < job->n_outputs; k++) {
+            if (chunk->results[k].type == TOK_LONG) {
+                written = sprintf(chunk->text + chunk->size, ",%ld", chunk->results[k].as.i64[row]);
+            } else {
+                written = sprintf(chunk->text + chunk->size, ",%f", chunk->results[k].as.f64[row]);
+            }
+            chunk->size += written;
+        }
+        chunk->text[chunk->size++] = '\n';
+        row++;
+    }
+}
+
+/* First row starting at or after 'offset', every row but the first follows a newline */
+static char* row_start(CsvJob* job, uint64_t offset)
+{
+    char* newline;
+
+    if (offset >= job->length) {
+        return job->map + job->length;
+    }
+    if (offset == job->data_start || job->map[offset - 1] == '\n') {
+        return job->map + offset;
+    }
+
+    newline = memchr(job->map + offset, '\n', job->length - offset);
+    return (newline != NULL) ? newline + 1 : job->map + job->length;
+}
+
+/* The newline ending the line at 'pos', or 'stop' for a last line without one */
+static char* line_end(char* pos, char* stop)
+{
+    char* newline;
+
+    newline = memchr(pos, '\n', stop - pos);
+    return (newline != NULL) ? newline : stop;
+}
+
+static bool is_blank(char* pos, char* end)
+{
+    while (pos < end && isspace((unsigned char) *pos)) {
+        pos++;
+    }
+
+    return pos == end;
+}
+
+/* The ',' after the field at 'pos', or 'end', skipping over a quoted field */
+static char* field_end(CsvJob* job, char* pos, char* end)
+{
+    char* comma;
+
+    while (pos < end && *pos == ' ') {
+        pos++;
+    }
+
+    if (pos < end && *pos == '"') {
+        for (pos++; pos < end; pos++) {
+            if (*pos == '"') {
+                /* A doubled quote is one quote in the text */
+                if (pos + 1 < end && pos[1] == '"') {
+                    pos++;
+                } else {
+                    break;
+                }
+            }
+        }
+        if (pos == end) {
+            fprintf(stderr, "Line %lu has an unterminated quote.\n", line_number(job, pos));
+            exit(25);
+        }
+    }
+
+    comma = memchr(pos, ',', end - pos);
+    return (comma != NULL) ? comma : end;
+}
+
+static void parse_row(CsvJob* job, CsvChunk* chunk, char* pos, char* end)
+{
+    char* stop;
+    uint32_t col;
+
+    if (chunk->rows == chunk->row_capacity) {
+        grow_chunk(job, chunk);
+    }
+
+    for (col = 0; col < job->width; col++) {
+        stop = field_end(job, pos, end);
+        if (job->used[col]) {
+            store_field(job, chunk, col, pos, stop);
+        }
+
+        if (col + 1 < job->width) {
+            if (stop == end) {
+                fprintf(stderr, "Line %lu is missing values.\n", line_number(job, pos));
+                exit(25);
+            }
+            pos = stop + 1;
+        } else if (stop != end) {
+            fprintf(stderr, "Line %lu has too many values.\n", line_number(job, pos));
+            exit(25);
+        }
+    }
+
+    chunk->rows += 1;
+}
+
+/* 'scan_chunk()' has already made a column with any real in it TOK_DOUBLE */
+static void store_field(CsvJob* job, CsvChunk* chunk, uint32_t col, char* pos, char* end)
+{
+    Column* field;
+    Token value;
+
+    value = field_value(job, col, pos, end);
+    field = &chunk->fields[col];
+    if (field->type == TOK_LONG) {
+        field->as.i64[chunk->rows] = value.as.i64;
+    } else {
+        field->as.f64[chunk->rows] = (value.type == TOK_LONG) ? value.as.i64 : value.as.f64;
+    }
+}
+
+static Token field_value(CsvJob* job, uint32_t col, char* pos, char* end)
+{
+    Token value;
+
+    /* Surrounding blanks and quotes don't count */
+    while (pos < end && isspace((unsigned char) *pos)) {
+        pos++;
+    }
+    while (end > pos && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    if (end - pos >= 2 && *pos == '"' && end[-1] == '"') {
+        pos++;
+        end--;
+    }
+
+    if (!parse_number(pos, end, &value)) {
+        fprintf(stderr, "Bad value on line %lu, column '%s'.\n", line_number(job, pos), job->names[col]);
+        exit(25);
+    }
+
+    return value;
+}
+
+/*
+    Integers of up to 18 digits, and decimals whose digits fit in 53 bits with a
+    power of ten of at most 22, are exact with one multiply or divide. Anything
+    else goes through 'strtol()' and 'strtod()' like a table does.
+*/
+static bool parse_number(char* pos, char* end, Token* target)
+{
+    char buffer[MAX_NUMBER_LENGTH];
+    char* start;
+    char* stop;
+    uint64_t mantissa;
+    int64_t exponent;
+    int64_t scale;
+    uint32_t digits;
+    bool negative;
+    bool real;
+    bool dropped;
+    bool exponent_negative;
+
+    start = pos;
+    negative = false;
+    if (pos < end && (*pos == '-' || *pos == '+')) {
+        negative = *pos == '-';
+        pos++;
+    }
+
+    mantissa = 0;
+    digits = 0;
+    exponent = 0;
+    dropped = false;
+    real = false;
+    for (; pos < end && isdigit((unsigned char) *pos); pos++) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*pos - '0');
+            digits++;
+        } else {
+            exponent++;
+            dropped = true;
+        }
+    }
+    if (pos < end && *pos == '.') {
+        real = true;
+        for (pos++; pos < end && isdigit((unsigned char) *pos); pos++) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*pos - '0');
+                digits++;
+                exponent--;
+            } else {
+                dropped = true;
+            }
+        }
+    }
+    if (pos < end && digits > 0 && (*pos == 'e' || *pos == 'E')) {
+        real = true;
+        pos++;
+        exponent_negative = pos < end && *pos == '-';
+        if (pos < end && (*pos == '-' || *pos == '+')) {
+            pos++;
+        }
+        scale = 0;
+        stop = pos;
+        for (; pos < end && isdigit((unsigned char) *pos); pos++) {
+            if (scale < 10000) {
+                scale = scale * 10 + (*pos - '0');
+            }
+        }
+        if (pos == stop) {
+            dropped = true;
+        }
+        exponent += exponent_negative ? -scale : scale;
+    }
+
+    if (pos == end && digits > 0 && !dropped) {
+        if (!real && digits <= 18) {
+            target->type = TOK_LONG;
+            target->as.i64 = negative ? -(int64_t) mantissa : (int64_t) mantissa;
+            return true;
+        }
+        if (real && mantissa <= EXACT_MANTISSA && exponent >= -EXACT_POWER && exponent <= EXACT_POWER) {
+            target->type = TOK_DOUBLE;
+            target->as.f64 = (exponent < 0) ? mantissa / powers_of_ten[-exponent] : mantissa * powers_of_ten[exponent];
+            if (negative) {
+                target->as.f64 = -target->as.f64;
+            }
+            return true;
+        }
+    }
+
+    /* The map isn't NUL terminated, so the slow path gets a copy */
+    if (end - start == 0 || end - start >= MAX_NUMBER_LENGTH) {
+        return false;
+    }
+    memcpy(buffer, start, end - start);
+    buffer[end - start] = '\0';
+
+    target->type = TOK_LONG;
+    target->as.i64 = strtol(buffer, &stop, 10);
+    if (*stop == '\0') {
+        return true;
+    }
+
+    target->type = TOK_DOUBLE;
+    target->as.f64 = strtod(buffer, &stop);
+    return stop != buffer && *stop == '\0';
+}
+
+static void grow_chunk(CsvJob* job, CsvChunk* chunk)
+{
+    uint32_t i;
+
+    chunk->row_capacity = (chunk->row_capacity == 0) ? INITIAL_CHUNK_ROWS : chunk->row_capacity * CSV_GROWTH_FACTOR;
+
+    /* NOTE: both union members are 8 bytes, so one realloc fits either type */
+    for (i = 0; i < job->width; i++) {
+        if (job->used[i]) {
+            chunk->fields[i].as.i64 = realloc(chunk->fields[i].as.i64, sizeof(int64_t) * chunk->row_capacity);
+            if (chunk->fields[i].as.i64 == NULL) {
+                fprintf(stderr, "Failed to grow CSV chunk.\n");
+                exit(5);
+            }
+        }
+    }
+    for (i = 0; i < job->n_outputs; i++) {
+        chunk->results[i].as.i64 = realloc(chunk->results[i].as.i64, sizeof(int64_t) * chunk->row_capacity);
+        if (chunk->results[i].as.i64 == NULL) {
+            fprintf(stderr, "Failed to grow CSV chunk.\n");
+            exit(5);
+        }
+    }
+}
+
+static void reserve_text(CsvChunk* chunk, uint64_t extra)
+{
+    if (chunk->size + extra <= chunk->capacity) {
+        return;
+    }
+
+    if (chunk->capacity == 0) {
+        chunk->capacity = CSV_CHUNK_BYTES * 2;
+    }
+    while (chunk->size + extra > chunk->capacity) {
+        chunk->capacity *= CSV_GROWTH_FACTOR;
+    }
+    if ((chunk->text = realloc(chunk->text, chunk->capacity)) == NULL) {
+        fprintf(stderr, "Failed to allocate CSV output.\n");
+        exit(5);
+    }
+}
+
+/* A header field as an identifier, see 'identifier_name()' */
+static char* column_name(char* pos, char* end)
+{
+    while (pos < end && isspace((unsigned char) *pos)) {
+        pos++;
+    }
+    while (end > pos && isspace((unsigned char) end[-1])) {
+        end--;
+    }
+    if (end - pos >= 2 && *pos == '"' && end[-1] == '"') {
+        pos++;
+        end--;
+    }
+
+    return identifier_name(pos, end - pos);
+}
+
+/* The text of each output, quoted */
+static void write_names(char* source, uint32_t n_outputs, FILE* out)
+{
+    char** names;
+    char* pos;
+    uint32_t k;
+
+    names = split_outputs(source, n_outputs);
+    for (k = 0; k < n_outputs; k++) {
+        fputs(",\"", out);
+        for (pos = names[k]; *pos != '\0'; pos++) {
+            if (*pos == '"') {
+                fputc('"', out);
+            }
+            fputc(*pos, out);
+        }
+        fputc('"', out);
+        free(names[k]);
+    }
+    fputc('\n', out);
+    free(names);
+}
+
+/* Only for error messages, it counts every line up to 'pos' */
+static uint64_t line_number(CsvJob* job, char* pos)
+{
+    uint64_t lines;
+    char* at;
+
+    lines = 1;
+    for (at = job->map; at < pos; at++) {
+        lines += *at == '\n';
+    }
+
+    return lines;
+}
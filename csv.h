@@ -0,0 +1,32 @@
+#ifndef CALC_CSV_H
+#define CALC_CSV_H
+
+#include <stdio.h>
+
+#include "token.h"
+
+/*
+    Evaluates a program once per row of a CSV file and writes the file back out
+    with one more column per output. The header names the columns, and every
+    character of a name that can't be in an identifier reads as '_', so
+    'unit price' is 'unit_price'. Fields can be quoted, but not over several
+    lines.
+
+    The file is mapped rather than read, and cut into chunks of CSV_CHUNK_BYTES
+    that start on a row. Each worker thread splits its chunk's rows, parses
+    only the fields the program reads, evaluates them a column tile at a time
+    and formats its rows. Chunks are written out in file order, and only a
+    batch of CSV_BATCH_CHUNKS per thread is in memory at once.
+
+    A first pass over the chunks only parses the fields the program reads to
+    find their types: a column is TOK_LONG if all of its fields in the file are
+    integers, TOK_DOUBLE otherwise, and the program is compiled once for them.
+*/
+
+#define CSV_CHUNK_BYTES (1 << 20)
+#define CSV_BATCH_CHUNKS 2
+
+/* 'source' is the expression text, its outputs name the new columns */
+void run_csv(TokenStack* program, char* source, char* path, FILE* out);
+
+#endif
@@ -0,0 +1,816 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "emit.h"
+#include "fail.h"
+
+#define MAX_EMIT_PARAMS 64
+
+/* One per instruction, for the subexpression it ends, whose span is in 'Emitter.spans' */
+typedef struct {
+    TokenType type;
+} EmitNode;
+
+typedef struct {
+    TokenStack* program;
+    OperandSpan* spans;
+    EmitNode* nodes;
+    FILE* out;
+
+    /* The instruction each TOK_STORE slot holds the value of */
+    uint64_t* stored;
+
+    char* params[MAX_EMIT_PARAMS];
+    TokenType param_types[MAX_EMIT_PARAMS];
+    uint32_t n_params;
+} Emitter;
+
+/* Shared by every exported function, so they can go in the same file */
+static char* helpers[] = {
+    "#ifndef CALC_EMIT_HELPERS",
+    "#define CALC_EMIT_HELPERS",
+    "",
+    "/* Exact integer powers, 1 where calc would need a big integer or a fraction */",
+    "static inline int calc_pow_i64(int64_t base, int64_t exponent, int64_t* out)",
+    "{",
+    "    int64_t result = 1;",
+    "    int64_t square = base;",
+    "",
+    "    if (exponent < 0) {",
+    "        if (base != 1 && base != -1) {",
+    "            return 1;",
+    "        }",
+    "        *out = (exponent & 1) ? base : 1;",
+    "        return 0;",
+    "    }",
+    "    while (exponent > 0) {",
+    "        if ((exponent & 1) && __builtin_mul_overflow(result, square, &result)) {",
+    "            return 1;",
+    "        }",
+    "        exponent >>= 1;",
+    "        if (exponent > 0 && __builtin_mul_overflow(square, square, &square)) {",
+    "            return 1;",
+    "        }",
+    "    }",
+    "    *out = result;",
+    "    return 0;",
+    "}",
+    "",
+    "/* b^e mod m in [0, |m|), 1 for a zero modulus or a negative exponent */",
+    "static inline int calc_powmod_i64(int64_t b, int64_t e, int64_t m, int64_t* out)",
+    "{",
+    "    uint64_t modulus = (m < 0) ? 0 - (uint64_t) m : (uint64_t) m;",
+    "    uint64_t square = (b < 0) ? 0 - (uint64_t) b : (uint64_t) b;",
+    "    uint64_t result = 1;",
+    "",
+    "    if (m == 0 || e < 0) {",
+    "        return 1;",
+    "    }",
+    "    square %= modulus;",
+    "    if (b < 0 && square != 0) {",
+    "        square = modulus - square;",
+    "    }",
+    "    while (e > 0) {",
+    "        if (e & 1) {",
+    "            result = (unsigned __int128) result * square % modulus;",
+    "        }",
+    "        e >>= 1;",
+    "        square = (unsigned __int128) square * square % modulus;",
+    "    }",
+    "    *out = result % modulus;",
+    "    return 0;",
+    "}",
+    "",
+    "#endif",
+    NULL
+};
+
+/* Names a parameter can't take, temporaries and '_out' start with an underscore */
+static char* keywords[] = {
+    "auto", "break", "case", "char", "const", "continue", "default", "do", "double",
+    "else", "enum", "extern", "float", "for", "goto", "if", "inline", "int", "long",
+    "register", "restrict", "return", "short", "signed", "sizeof", "static", "struct",
+    "switch", "typedef", "union", "unsigned", "void", "volatile", "while",
+    "int64_t", "INT64_C", "INT64_MIN", "pow", "NAN", "HUGE_VAL", "calc_pow_i64", "calc_powmod_i64",
+    NULL
+};
+
+static void type_program(Emitter* e, Env* env, uint32_t n_outputs);
+static bool has_temporary(Emitter* e, uint64_t ip);
+static void emit_node(Emitter* e, uint64_t ip, int indent);
+static void emit_statement(Emitter* e, uint64_t ip, int indent);
+static void print_ref(Emitter* e, uint64_t ip, TokenType as);
+static bool same_value(Emitter* e, uint64_t a, uint64_t b);
+static uint64_t resolve(Emitter* e, uint64_t ip);
+static bool is_safe_divisor(Emitter* e, uint64_t ip);
+static bool is_zero(Emitter* e, uint64_t ip);
+static void print_literal(FILE* out, Token* tok, TokenType as);
+static void print_indent(FILE* out, int indent);
+static char* c_type(TokenType type);
+static void check_identifier(char* name);
+
+void emit_c(TokenStack* program, Env* env, char* name, char* source, FILE* out)
+{
+    Emitter e;
+    Token* expected;
+    Token* value;
+    TokenType type;
+    uint64_t* outputs;
+    uint32_t n_outputs;
+    Failure failure;
+    bool testable;
+    bool failed;
+    bool gives_up;
+    uint64_t ip;
+    uint32_t i;
+    uint32_t k;
+
+    check_identifier(name);
+
+    e.program = program;
+    e.out = out;
+    e.n_params = 0;
+    n_outputs = count_outputs(program);
+    e.nodes = calloc(program->size + 1, sizeof(EmitNode));
+    e.stored = calloc(program->size + 1, sizeof(uint64_t));
+    outputs = malloc(sizeof(uint64_t) * n_outputs);
+    expected = malloc(sizeof(Token) * n_outputs);
+    if (e.nodes == NULL || e.stored == NULL || outputs == NULL || expected == NULL) {
+        fprintf(stderr, "Failed to allocate C export.\n");
+        exit(5);
+    }
+
+    type_program(&e, env, n_outputs);
+
+    /* A tuple writes one '_outK' per output, a single value just '_out' */
+    for (k = 0; k < n_outputs; k++) {
+        outputs[k] = (n_outputs > 1) ? find_operand_end(e.spans, program->size - 1, k) : program->size - 1;
+    }
+
+    /* Run first, an error in the interpreter like a division by zero is something the C has to leave to calc */
+    testable = true;
+    for (i = 0; i < e.n_params; i++) {
+        testable = testable && lookup_variable(env, e.params[i]) != NULL;
+    }
+    failed = false;
+    if (testable) {
+        catch_failures(&failure);
+        if (setjmp(failure.jump) == 0) {
+            eval_outputs(program, env, expected);
+        } else {
+            failed = true;
+        }
+        release_failures(&failure);
+    }
+
+    fprintf(out, "/* calc --emit-c %s \"%s\" */\n", name, source);
+    fprintf(out, "#include <stdint.h>\n#include <math.h>\n\n");
+    for (i = 0; helpers[i] != NULL; i++) {
+        fprintf(out, "%s\n", helpers[i]);
+    }
+
+    fprintf(out, "\nstatic inline int %s(", name);
+    for (i = 0; i < e.n_params; i++) {
+        fprintf(out, "%s %s, ", c_type(e.param_types[i]), e.params[i]);
+    }
+    for (k = 0; k < n_outputs; k++) {
+        fprintf(out, "%s* _out", c_type(e.nodes[outputs[k]].type));
+        if (n_outputs > 1) {
+            fprintf(out, "%u", k);
+        }
+        fprintf(out, (k + 1 < n_outputs) ? ", " : ")\n{\n");
+    }
+
+    /* Everything that isn't a constant, a parameter or a jump gets a temporary */
+    for (ip = 0; ip < program->size; ip++) {
+        if (has_temporary(&e, ip)) {
+            fprintf(out, "    %s _v%lu;\n", c_type(e.nodes[ip].type), ip);
+        }
+    }
+    fprintf(out, "\n");
+
+    emit_node(&e, program->size - 1, 1);
+
+    for (k = 0; k < n_outputs; k++) {
+        fprintf(out, "    *_out");
+        if (n_outputs > 1) {
+            fprintf(out, "%u", k);
+        }
+        fprintf(out, " = ");
+        print_ref(&e, outputs[k], e.nodes[outputs[k]].type);
+        fprintf(out, ";\n");
+    }
+    fprintf(out, "    return 0;\n}\n");
+
+    if (testable) {
+        fprintf(out, "\n#ifdef CALC_EMIT_TEST\n#include <stdio.h>\n#include <string.h>\n\n");
+        fprintf(out, "int main(void)\n{\n");
+
+        gives_up = failed;
+        for (k = 0; k < n_outputs; k++) {
+            type = e.nodes[outputs[k]].type;
+            fprintf(out, "    %s got%u = 0;\n    %s expected%u = ", c_type(type), k, c_type(type), k);
+            if (failed || expected[k].type == TOK_BIGINT) {
+                fprintf(out, "0;\n");
+                gives_up = true;
+            } else {
+                print_literal(out, &expected[k], type);
+                fprintf(out, ";\n");
+            }
+        }
+        fprintf(out, "    int calc_status = %d;\n", gives_up ? 1 : 0);
+
+        fprintf(out, "    int status = %s(", name);
+        for (i = 0; i < e.n_params; i++) {
+            value = lookup_variable(env, e.params[i]);
+            print_literal(out, value, e.param_types[i]);
+            fprintf(out, ", ");
+        }
+        for (k = 0; k < n_outputs; k++) {
+            fprintf(out, "&got%u%s", k, (k + 1 < n_outputs) ? ", " : ");\n");
+        }
+
+        /* Bit for bit, except that any NaN is as good as any other. Giving up is always allowed. */
+        for (k = 0; k < n_outputs; k++) {
+            type = e.nodes[outputs[k]].type;
+            fprintf(out, "\n    if (status == 0 && (calc_status != 0 || (memcmp(&got%u, &expected%u, sizeof(got%u)) != 0",
+                k, k, k);
+            if (type != TOK_LONG) {
+                fprintf(out, "\n        && !(isnan(got%u) && isnan(expected%u))", k, k);
+            }
+            fprintf(out, "))) {\n");
+            fprintf(out, "        printf(\"%s: FAILED, got %s, calc gives %s\\n\", %sgot%u, %sexpected%u);\n", name,
+                (type == TOK_LONG) ? "%lld" : "%.17g", (type == TOK_LONG) ? "%lld" : "%.17g",
+                (type == TOK_LONG) ? "(long long) " : "", k, (type == TOK_LONG) ? "(long long) " : "", k);
+            fprintf(out, "        return 1;\n    }\n");
+        }
+        fprintf(out, "    printf(status == 0 ? \"%s: ok\\n\" : \"%s: left to calc\\n\");\n", name, name);
+        fprintf(out, "    return 0;\n}\n#endif\n");
+
+        for (k = 0; k < n_outputs && !failed; k++) {
+            scrub_token(&expected[k]);
+        }
+    }
+
+    free(expected);
+    free(outputs);
+    free(e.spans);
+    free(e.nodes);
+    free(e.stored);
+}
+
+/* Works out the span of every instruction, then its type the way the Token arithmetic would */
+static void type_program(Emitter* e, Env* env, uint32_t n_outputs)
+{
+    TokenStack* program;
+    EmitNode* node;
+    Token* tok;
+    Token* value;
+    uint64_t left;
+    uint64_t ip;
+    TokenType a;
+    TokenType b;
+    TokenType c;
+    uint32_t i;
+    int arity;
+
+    program = e->program;
+    if ((e->spans = find_operand_spans(program, &left)) == NULL) {
+        fprintf(stderr, "Malformed program.\n");
+        exit(24);
+    }
+
+    for (ip = 0; ip < program->size; ip++) {
+        tok = &program->base[ip];
+        node = &e->nodes[ip];
+
+        arity = e->spans[ip].arity;
+        if (arity > 3 && tok->type != TOK_TUPLE && tok->type != TOK_MAKE_ARRAY) {
+            fprintf(stderr, "Malformed program.\n");
+            exit(24);
+        }
+
+        /* Operand types, last one first */
+        a = (arity > 0) ? e->nodes[find_operand_end(e->spans, ip, 0)].type : TOK_EOF;
+        b = (arity > 1) ? e->nodes[find_operand_end(e->spans, ip, 1)].type : TOK_EOF;
+        c = (arity > 2) ? e->nodes[find_operand_end(e->spans, ip, 2)].type : TOK_EOF;
+
+        switch (tok->type) {
+            case TOK_LONG:
+            case TOK_DOUBLE: {
+                node->type = tok->type;
+                break;
+            }
+            case TOK_BIGINT: {
+                fprintf(stderr, "Constants over 64 bits can't be exported to C.\n");
+                exit(34);
+            }
+            case TOK_ARRAY:
+            case TOK_MAKE_ARRAY:
+            case TOK_DOT:
+            case TOK_STRING:
+            case TOK_SHORT_STRING:
+            case TOK_LEN:
+            case TOK_SUBSTR:
+            case TOK_STR:
+            case TOK_NUM: {
+                fprintf(stderr, "Only numbers can be exported to C.\n");
+                exit(34);
+            }
+            case TOK_IDENTIFIER: {
+                check_identifier(tok->as.string);
+                for (i = 0; i < e->n_params; i++) {
+                    if (strcmp(e->params[i], tok->as.string) == 0) {
+                        break;
+                    }
+                }
+                if (i == e->n_params) {
+                    if (e->n_params == MAX_EMIT_PARAMS) {
+                        fprintf(stderr, "Too many variables to export to C.\n");
+                        exit(34);
+                    }
+                    value = lookup_variable(env, tok->as.string);
+                    if (value != NULL && !IS_NUMBER(value)) {
+                        fprintf(stderr, "Only numbers can be exported to C.\n");
+                        exit(34);
+                    }
+                    e->params[i] = tok->as.string;
+                    e->param_types[i] = (value != NULL && value->type == TOK_LONG) ? TOK_LONG : TOK_DOUBLE;
+                    e->n_params++;
+                }
+                node->type = e->param_types[i];
+                break;
+            }
+            case TOK_SIN:
+            case TOK_COS:
+            case TOK_TAN: {
+                node->type = TOK_DOUBLE;
+                break;
+            }
+            case TOK_POWMOD:
+            case TOK_MOD: {
+                node->type = TOK_LONG;
+                break;
+            }
+            case TOK_FMA: {
+                node->type = (a == TOK_LONG && b == TOK_LONG && c == TOK_LONG) ? TOK_LONG : TOK_DOUBLE;
+                break;
+            }
+            case TOK_THEN:
+            case TOK_ELSE:
+            case TOK_SHORT_AND:
+            case TOK_SHORT_OR: {
+                node->type = a;
+                break;
+            }
+            case TOK_RAND:
+            case TOK_UNIFORM:
+            case TOK_NORMAL: {
+                /* The function would have to carry calc's generator and its stream along */
+                fprintf(stderr, "Random numbers can't be exported to C.\n");
+                exit(34);
+            }
+            case TOK_IF: {
+                node->type = (b == c) ? b : TOK_DOUBLE;
+                break;
+            }
+            case TOK_STORE: {
+                /* Both the store and its loads are just another name for the operand */
+                e->stored[tok->as.i64] = find_operand_end(e->spans, ip, 0);
+                node->type = a;
+                break;
+            }
+            case TOK_LOAD: {
+                node->type = e->nodes[e->stored[tok->as.i64]].type;
+                break;
+            }
+            case TOK_TUPLE: {
+                node->type = TOK_EOF;
+                break;
+            }
+            default: {
+                if (!IS_OPERATOR(tok->type)) {
+                    fprintf(stderr, "Only arithmetic, comparisons, if() and builtins can be exported to C.\n");
+                    exit(34);
+                }
+                node->type = (IS_ARITHMETIC(tok->type) && (a == TOK_DOUBLE || b == TOK_DOUBLE)) ? TOK_DOUBLE : TOK_LONG;
+                break;
+            }
+        }
+    }
+
+    if (left != 1 || (n_outputs > 1 && program->base[program->size - 1].type != TOK_TUPLE)) {
+        fprintf(stderr, "Malformed program.\n");
+        exit(24);
+    }
+}
+
+static void emit_node(Emitter* e, uint64_t ip, int indent)
+{
+    Token* tok;
+    uint64_t a;
+    uint64_t b;
+    int k;
+
+    tok = &e->program->base[ip];
+
+    switch (tok->type) {
+        case TOK_IF: {
+            /* 'c THEN a ELSE b IF', the jumps are the identity on 'c' and 'a' */
+            a = find_operand_end(e->spans, find_operand_end(e->spans, ip, 0), 0);
+            emit_node(e, a, indent);
+            print_indent(e->out, indent);
+            fprintf(e->out, "if (");
+            print_ref(e, a, TOK_EOF);
+            fprintf(e->out, ") {\n");
+
+            a = find_operand_end(e->spans, find_operand_end(e->spans, ip, 1), 0);
+            emit_node(e, a, indent + 1);
+            print_indent(e->out, indent + 1);
+            fprintf(e->out, "_v%lu = ", ip);
+            print_ref(e, a, e->nodes[ip].type);
+            fprintf(e->out, ";\n");
+
+            print_indent(e->out, indent);
+            fprintf(e->out, "} else {\n");
+
+            b = find_operand_end(e->spans, ip, 2);
+            emit_node(e, b, indent + 1);
+            print_indent(e->out, indent + 1);
+            fprintf(e->out, "_v%lu = ", ip);
+            print_ref(e, b, e->nodes[ip].type);
+            fprintf(e->out, ";\n");
+
+            print_indent(e->out, indent);
+            fprintf(e->out, "}\n");
+            break;
+        }
+        case TOK_AND:
+        case TOK_OR: {
+            /* 'a SHORT_AND b AND', 'b' only runs when 'a' didn't decide */
+            a = find_operand_end(e->spans, find_operand_end(e->spans, ip, 0), 0);
+            emit_node(e, a, indent);
+            print_indent(e->out, indent);
+            fprintf(e->out, "_v%lu = ", ip);
+            print_ref(e, a, TOK_EOF);
+            fprintf(e->out, " != 0;\n");
+
+            print_indent(e->out, indent);
+            fprintf(e->out, "if (%s_v%lu) {\n", (tok->type == TOK_AND) ? "" : "!", ip);
+
+            b = find_operand_end(e->spans, ip, 1);
+            emit_node(e, b, indent + 1);
+            print_indent(e->out, indent + 1);
+            fprintf(e->out, "_v%lu = ", ip);
+            print_ref(e, b, TOK_EOF);
+            fprintf(e->out, " != 0;\n");
+
+            print_indent(e->out, indent);
+            fprintf(e->out, "}\n");
+            break;
+        }
+        default: {
+            for (k = 0; k < e->spans[ip].arity; k++) {
+                emit_node(e, find_operand_end(e->spans, ip, k), indent);
+            }
+            if (has_temporary(e, ip)) {
+                emit_statement(e, ip, indent);
+            }
+            break;
+        }
+    }
+}
+
+/* Jumps, stores and the tuple only pass values along */
+static bool has_temporary(Emitter* e, uint64_t ip)
+{
+    TokenType type;
+
+    type = e->program->base[ip].type;
+    return e->spans[ip].arity > 0 && !IS_JUMP(type) && type != TOK_STORE && type != TOK_TUPLE;
+}
+
+/* The instruction at 'ip' once its operands are in place */
+static void emit_statement(Emitter* e, uint64_t ip, int indent)
+{
+    FILE* out;
+    TokenType type;
+    TokenType as;
+    uint64_t a;
+    uint64_t b;
+    uint64_t c;
+    char* op;
+
+    out = e->out;
+    type = e->program->base[ip].type;
+    a = find_operand_end(e->spans, ip, 0);
+    b = (e->spans[ip].arity > 1) ? find_operand_end(e->spans, ip, 1) : 0;
+    c = (e->spans[ip].arity > 2) ? find_operand_end(e->spans, ip, 2) : 0;
+
+    print_indent(out, indent);
+
+    /* calc stops there, so does the function */
+    if ((type == TOK_MOD || (type == TOK_DIV && e->nodes[ip].type == TOK_LONG)) && is_zero(e, b)) {
+        fprintf(out, "return 1;\n");
+        return;
+    }
+
+    switch (type) {
+        case TOK_SIN:
+        case TOK_COS:
+        case TOK_TAN: {
+            fprintf(out, "_v%lu = %s(", ip, (type == TOK_SIN) ? "sin" : (type == TOK_COS) ? "cos" : "tan");
+            print_ref(e, a, TOK_DOUBLE);
+            fprintf(out, ");\n");
+            break;
+        }
+        case TOK_POWMOD: {
+            /* Doubles are truncated, like in 'powmod_tokens()' */
+            fprintf(out, "if (calc_powmod_i64(");
+            print_ref(e, a, TOK_LONG);
+            fprintf(out, ", ");
+            print_ref(e, b, TOK_LONG);
+            fprintf(out, ", ");
+            print_ref(e, c, TOK_LONG);
+            fprintf(out, ", &_v%lu)) {\n", ip);
+            print_indent(out, indent + 1);
+            fprintf(out, "return 1;\n");
+            print_indent(out, indent);
+            fprintf(out, "}\n");
+            break;
+        }
+        case TOK_FMA: {
+            if (e->nodes[ip].type == TOK_DOUBLE) {
+                fprintf(out, "_v%lu = fma(", ip);
+                print_ref(e, a, TOK_DOUBLE);
+                fprintf(out, ", ");
+                print_ref(e, b, TOK_DOUBLE);
+                fprintf(out, ", ");
+                print_ref(e, c, TOK_DOUBLE);
+                fprintf(out, ");\n");
+                break;
+            }
+
+            fprintf(out, "if (__builtin_mul_overflow(");
+            print_ref(e, a, TOK_LONG);
+            fprintf(out, ", ");
+            print_ref(e, b, TOK_LONG);
+            fprintf(out, ", &_v%lu) || __builtin_add_overflow(_v%lu, ", ip, ip);
+            print_ref(e, c, TOK_LONG);
+            fprintf(out, ", &_v%lu)) {\n", ip);
+            print_indent(out, indent + 1);
+            fprintf(out, "return 1;\n");
+            print_indent(out, indent);
+            fprintf(out, "}\n");
+            break;
+        }
+        case TOK_MOD: {
+            /* Like 'mod_tokens()', doubles are truncated and 'x % -1' never traps */
+            if (is_safe_divisor(e, b)) {
+                fprintf(out, "_v%lu = ", ip);
+                print_ref(e, a, TOK_LONG);
+                fprintf(out, " %% ");
+                print_ref(e, b, TOK_LONG);
+                fprintf(out, ";\n");
+                break;
+            }
+
+            fprintf(out, "if (");
+            print_ref(e, b, TOK_LONG);
+            fprintf(out, " == 0) {\n");
+            print_indent(out, indent + 1);
+            fprintf(out, "return 1;\n");
+            print_indent(out, indent);
+            fprintf(out, "}\n");
+            print_indent(out, indent);
+            fprintf(out, "_v%lu = (", ip);
+            print_ref(e, b, TOK_LONG);
+            fprintf(out, " == -1) ? 0 : ");
+            print_ref(e, a, TOK_LONG);
+            fprintf(out, " %% ");
+            print_ref(e, b, TOK_LONG);
+            fprintf(out, ";\n");
+            break;
+        }
+        default: {
+            as = (IS_ARITHMETIC(type)) ? e->nodes[ip].type
+                : (e->nodes[a].type == TOK_LONG && e->nodes[b].type == TOK_LONG) ? TOK_LONG : TOK_DOUBLE;
+
+            if (as == TOK_DOUBLE || IS_COMPARISON(type)) {
+                op = (type == TOK_ADD) ? "+" : (type == TOK_SUB) ? "-" : (type == TOK_MUL) ? "*" : (type == TOK_DIV) ? "/"
+                    : (type == TOK_LT) ? "<" : (type == TOK_LE) ? "<=" : (type == TOK_GT) ? ">" : (type == TOK_GE) ? ">="
+                    : (type == TOK_EQ) ? "==" : "!=";
+
+                fprintf(out, "_v%lu = ", ip);
+
+                /* The answer is known, and spelling it out as 'n < n' makes compilers complain */
+                if (IS_COMPARISON(type) && as == TOK_LONG && same_value(e, a, b)) {
+                    fprintf(out, "%d;\n", type == TOK_LE || type == TOK_GE || type == TOK_EQ);
+                    break;
+                }
+
+                if (type == TOK_EXP) {
+                    fprintf(out, "pow(");
+                    print_ref(e, a, as);
+                    fprintf(out, ", ");
+                    print_ref(e, b, as);
+                    fprintf(out, ");\n");
+                } else {
+                    print_ref(e, a, as);
+                    fprintf(out, " %s ", op);
+                    print_ref(e, b, as);
+                    fprintf(out, ";\n");
+                }
+                break;
+            }
+
+            /* Integers, where calc would move on to a big integer or stop the function gives up */
+            if (type == TOK_DIV && is_safe_divisor(e, b)) {
+                fprintf(out, "_v%lu = ", ip);
+                print_ref(e, a, as);
+                fprintf(out, " / ");
+                print_ref(e, b, as);
+                fprintf(out, ";\n");
+                break;
+            }
+            if (type == TOK_DIV) {
+                fprintf(out, "if (");
+                print_ref(e, b, as);
+                fprintf(out, " == 0 || (");
+                print_ref(e, b, as);
+                fprintf(out, " == -1 && ");
+                print_ref(e, a, as);
+                fprintf(out, " == INT64_MIN)) {\n");
+            } else {
+                fprintf(out, "if (%s(", (type == TOK_ADD) ? "__builtin_add_overflow" : (type == TOK_SUB)
+                    ? "__builtin_sub_overflow" : (type == TOK_MUL) ? "__builtin_mul_overflow" : "calc_pow_i64");
+                print_ref(e, a, as);
+                fprintf(out, ", ");
+                print_ref(e, b, as);
+                fprintf(out, ", &_v%lu)) {\n", ip);
+            }
+            print_indent(out, indent + 1);
+            fprintf(out, "return 1;\n");
+            print_indent(out, indent);
+            fprintf(out, "}\n");
+
+            if (type == TOK_DIV) {
+                print_indent(out, indent);
+                fprintf(out, "_v%lu = ", ip);
+                print_ref(e, a, as);
+                fprintf(out, " / ");
+                print_ref(e, b, as);
+                fprintf(out, ";\n");
+            }
+            break;
+        }
+    }
+}
+
+/* The value of the instruction at 'ip', converted to 'as' unless that is TOK_EOF */
+static void print_ref(Emitter* e, uint64_t ip, TokenType as)
+{
+    Token* tok;
+    EmitNode* node;
+
+    tok = &e->program->base[ip];
+    node = &e->nodes[ip];
+
+    if (IS_JUMP(tok->type) || tok->type == TOK_STORE || tok->type == TOK_LOAD) {
+        print_ref(e, resolve(e, ip), as);
+        return;
+    }
+    if (e->spans[ip].arity == 0 && tok->type != TOK_IDENTIFIER) {
+        print_literal(e->out, tok, (as == TOK_EOF) ? node->type : as);
+        return;
+    }
+
+    if (as != TOK_EOF && as != node->type) {
+        fprintf(e->out, "(%s) ", c_type(as));
+    }
+    if (e->spans[ip].arity == 0) {
+        fprintf(e->out, "%s", tok->as.string);
+    } else {
+        fprintf(e->out, "_v%lu", ip);
+    }
+}
+
+/* Do both refer to the same temporary or parameter */
+static bool same_value(Emitter* e, uint64_t a, uint64_t b)
+{
+    Token* ta;
+    Token* tb;
+
+    a = resolve(e, a);
+    b = resolve(e, b);
+    ta = &e->program->base[a];
+    tb = &e->program->base[b];
+
+    return a == b || (ta->type == TOK_IDENTIFIER && tb->type == TOK_IDENTIFIER && strcmp(ta->as.string, tb->as.string) == 0);
+}
+
+/* The instruction that actually computes the value at 'ip' */
+static uint64_t resolve(Emitter* e, uint64_t ip)
+{
+    Token* tok;
+
+    tok = &e->program->base[ip];
+    if (IS_JUMP(tok->type) || tok->type == TOK_STORE) {
+        return resolve(e, find_operand_end(e->spans, ip, 0));
+    }
+    if (tok->type == TOK_LOAD) {
+        return resolve(e, e->stored[tok->as.i64]);
+    }
+
+    return ip;
+}
+
+/* A constant integer divisor other than 0 and -1 can never trap */
+static bool is_safe_divisor(Emitter* e, uint64_t ip)
+{
+    Token* tok;
+
+    tok = &e->program->base[ip];
+    return e->spans[ip].arity == 0 && IS_NUMBER(tok) && !is_zero(e, ip)
+        && ((tok->type == TOK_LONG) ? tok->as.i64 : (int64_t) tok->as.f64) != -1;
+}
+
+/* Once truncated, like a divisor of '%' */
+static bool is_zero(Emitter* e, uint64_t ip)
+{
+    Token* tok;
+
+    tok = &e->program->base[ip];
+    return e->spans[ip].arity == 0 && IS_NUMBER(tok)
+        && ((tok->type == TOK_LONG) ? tok->as.i64 : (int64_t) tok->as.f64) == 0;
+}
+
+static void print_literal(FILE* out, Token* tok, TokenType as)
+{
+    char buffer[64];
+    int64_t integer;
+    double value;
+
+    if (as == TOK_LONG) {
+        integer = (tok->type == TOK_LONG) ? tok->as.i64 : (int64_t) tok->as.f64;
+        if (integer == INT64_MIN) {
+            fprintf(out, "INT64_MIN");
+        } else {
+            fprintf(out, "INT64_C(%ld)", integer);
+        }
+        return;
+    }
+
+    value = token_to_double(tok);
+    if (value != value) {
+        fprintf(out, "NAN");
+    } else if (value == HUGE_VAL || value == -HUGE_VAL) {
+        fprintf(out, (value > 0) ? "HUGE_VAL" : "(-HUGE_VAL)");
+    } else {
+        /* 17 digits always read back as the same double */
+        sprintf(buffer, "%.17g", value);
+        if (strpbrk(buffer, ".e") == NULL) {
+            strcat(buffer, ".0");
+        }
+        fprintf(out, (value < 0 || (value == 0 && 1 / value < 0)) ? "(%s)" : "%s", buffer);
+    }
+}
+
+static void print_indent(FILE* out, int indent)
+{
+    int i;
+
+    for (i = 0; i < indent; i++) {
+        fprintf(out, "    ");
+    }
+}
+
+static char* c_type(TokenType type)
+{
+    return (type == TOK_LONG) ? "int64_t" : "double";
+}
+
+static void check_identifier(char* name)
+{
+    uint32_t i;
+
+    for (i = 0; name[i] != '\0'; i++) {
+        if (!(isalpha((unsigned char) name[i]) || name[i] == '_' || (i > 0 && isdigit((unsigned char) name[i])))) {
+            break;
+        }
+    }
+    if (i == 0 || name[i] != '\0' || name[0] == '_') {
+        fprintf(stderr, "'%s' is not a C identifier calc can export.\n", name);
+        exit(34);
+    }
+
+    for (i = 0; keywords[i] != NULL; i++) {
+        if (strcmp(keywords[i], name) == 0) {
+            fprintf(stderr, "'%s' is a C keyword.\n", name);
+            exit(34);
+        }
+    }
+}
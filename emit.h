@@ -0,0 +1,38 @@
+#ifndef CALC_EMIT_H
+#define CALC_EMIT_H
+
+#include <stdio.h>
+
+#include "token.h"
+#include "eval.h"
+
+/*
+    Ahead of time export of a program as C, for 'calc --emit-c name'. The
+    output is a single
+
+        static inline int name(double x, int64_t n, double* _out)
+
+    with one parameter per variable in order of first appearance, an int64_t
+    for those bound to an integer with '--var' and a double for the rest. A
+    program with several comma separated outputs writes '_out0', '_out1' and
+    so on instead, and what they share is computed once, see cse.h.
+
+    Types are fixed when the function is written, with the same rules as
+    'add_tokens()' and friends: integers stay integers and are checked for
+    overflow, a double on either side makes a double, '%' truncates. Where
+    calc would move on to big integers or stop with an error the function
+    returns 1 instead of 0: an overflow, a division by zero, a negative power
+    of an integer. An 'if()' whose branches differ in type gives a double.
+
+    Solvers, integrals, aggregates, recursive calls and constants that need
+    more than 64 bits can't be exported. The code needs GCC or Clang for the
+    '__builtin_*_overflow()' checks.
+
+    When every variable is bound, a 'main()' behind CALC_EMIT_TEST checks the
+    function against what the interpreter gives for those values. Where the
+    interpreter fails, say on a division by zero, the function has to return 1.
+*/
+
+void emit_c(TokenStack* program, Env* env, char* name, char* source, FILE* out);
+
+#endif
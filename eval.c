@@ -0,0 +1,748 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "eval.h"
+#include "aggregate.h"
+#include "solve.h"
+#include "integrate.h"
+#include "function.h"
+#include "array.h"
+#include "text.h"
+#include "budget.h"
+#include "rng.h"
+#include "builtin.h"
+#include "profile.h"
+#include "fail.h"
+
+#define INITIAL_ENV_CAPACITY 8
+#define ENV_GROWTH_FACTOR 2
+
+/* Keeps the frames of 'run_program()' small, see 'run_caught()' */
+#ifdef __GNUC__
+#define EVAL_NOINLINE __attribute__((noinline))
+#else
+#define EVAL_NOINLINE
+#endif
+
+static TokenStack* run_program(TokenStack* program, Env* env);
+static void run_instructions(TokenStack* program, Env* env, TokenStack* value_stack, TokenStack** slots)
+    EVAL_NOINLINE;
+static void run_caught(TokenStack* program, Env* env, TokenStack* value_stack, TokenStack** slots) EVAL_NOINLINE;
+static Token call_native(Native* native, TokenStack* value_stack);
+
+Env* alloc_env(Env* parent)
+{
+    Env* output;
+
+    if ((output = malloc(sizeof(Env))) == NULL) {
+        fprintf(stderr, "Failed to allocate environment.\n");
+        exit(5);
+    }
+
+    if ((output->bindings = malloc(sizeof(Binding) * INITIAL_ENV_CAPACITY)) == NULL) {
+        fprintf(stderr, "Failed to allocate environment.\n");
+        free(output);
+        exit(5);
+    }
+
+    output->size = 0;
+    output->capacity = INITIAL_ENV_CAPACITY;
+    output->parent = parent;
+    output->depth = (parent != NULL) ? parent->depth + 1 : 0;
+    output->budget = (parent != NULL) ? parent->budget : NULL;
+    output->rng = (parent != NULL) ? parent->rng : NULL;
+
+    return output;
+}
+
+void free_env(Env* target)
+{
+    uint32_t i;
+
+    for (i = 0; i < target->size; i++) {
+        free(target->bindings[i].name);
+        scrub_token(&target->bindings[i].value);
+    }
+    free(target->bindings);
+    free(target);
+}
+
+void bind_variable(Env* env, char* name, Token* value)
+{
+    uint32_t i;
+
+    /* Rebinding in the same scope overwrites */
+    for (i = 0; i < env->size; i++) {
+        if (strcmp(env->bindings[i].name, name) == 0) {
+            scrub_token(&env->bindings[i].value);
+            env->bindings[i].value = copy_token(value);
+            return;
+        }
+    }
+
+    if (env->size == env->capacity) {
+        env->capacity *= ENV_GROWTH_FACTOR;
+        if ((env->bindings = realloc(env->bindings, sizeof(Binding) * env->capacity)) == NULL) {
+            fprintf(stderr, "Failed to grow environment.\n");
+            exit(5);
+        }
+    }
+
+    if ((env->bindings[env->size].name = malloc(strlen(name) + 1)) == NULL) {
+        fprintf(stderr, "Failed to allocate binding.\n");
+        exit(5);
+    }
+    strcpy(env->bindings[env->size].name, name);
+    env->bindings[env->size].value = copy_token(value);
+    env->size += 1;
+}
+
+Token* lookup_variable(Env* env, char* name)
+{
+    uint32_t i;
+
+    for (; env != NULL; env = env->parent) {
+        for (i = 0; i < env->size; i++) {
+            if (strcmp(env->bindings[i].name, name) == 0) {
+                return &env->bindings[i].value;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void parse_binding(char* spec, Env* env)
+{
+    Token value;
+    char* eq;
+    char* end;
+
+    if ((eq = strchr(spec, '=')) == NULL || eq == spec) {
+        fprintf(stderr, "Bad binding '%s', expected name=value.\n", spec);
+        exit(28);
+    }
+
+    value.type = TOK_LONG;
+    value.as.i64 = strtol(eq + 1, &end, 10);
+    if (end == eq + 1 || *end != '\0') {
+        value.type = TOK_DOUBLE;
+        value.as.f64 = strtod(eq + 1, &end);
+        if (end == eq + 1 || *end != '\0') {
+            fprintf(stderr, "Bad value in binding '%s'.\n", spec);
+            exit(28);
+        }
+    }
+
+    *eq = '\0';
+    bind_variable(env, spec, &value);
+    *eq = '=';
+}
+
+TokenStack* bind_constants(TokenStack* program, Env* env, char** keep, uint32_t n_keep)
+{
+    TokenStack* output;
+    Token* value;
+    Token* tok;
+    char** inner;
+    uint64_t ip;
+    uint32_t i;
+
+    output = copy_token_stack(program);
+
+    for (ip = 0; ip < output->size; ip++) {
+        tok = &output->base[ip];
+
+        if (tok->type == TOK_IDENTIFIER) {
+            for (i = 0; i < n_keep; i++) {
+                if (strcmp(keep[i], tok->as.string) == 0) {
+                    break;
+                }
+            }
+            if (i == n_keep && (value = lookup_variable(env, tok->as.string)) != NULL) {
+                scrub_token(tok);
+                *tok = copy_token(value);
+            }
+        } else if (IS_HIGHER_ORDER(tok->type)) {
+            /* The lambda's own parameter shadows anything in 'env' */
+            if ((inner = malloc(sizeof(char*) * (n_keep + 1))) == NULL) {
+                fprintf(stderr, "Failed to allocate scope.\n");
+                exit(5);
+            }
+            for (i = 0; i < n_keep; i++) {
+                inner[i] = keep[i];
+            }
+            inner[n_keep] = tok->as.lambda->param;
+
+            program = tok->as.lambda->body;
+            tok->as.lambda->body = bind_constants(program, env, inner, n_keep + 1);
+            free_token_stack(program);
+            free(inner);
+        }
+    }
+
+    return output;
+}
+
+Token eval_program(TokenStack* program, Env* env)
+{
+    TokenStack* value_stack;
+    Token result;
+
+    /* Only the first output of a tuple */
+    value_stack = run_program(program, env);
+    result = value_stack->base[0];
+    while (value_stack->size > 1) {
+        value_stack->size--;
+        scrub_token(&value_stack->base[value_stack->size]);
+    }
+    value_stack->size = 0;
+    free_token_stack(value_stack);
+
+    return result;
+}
+
+void eval_outputs(TokenStack* program, Env* env, Token* outputs)
+{
+    TokenStack* value_stack;
+    uint64_t i;
+
+    value_stack = run_program(program, env);
+    for (i = 0; i < value_stack->size; i++) {
+        outputs[i] = value_stack->base[i];
+    }
+    value_stack->size = 0;
+    free_token_stack(value_stack);
+}
+
+/* Runs 'program' on 'value_stack', '*slots' is made on the first TOK_STORE */
+static void run_instructions(TokenStack* program, Env* env, TokenStack* value_stack, TokenStack** slots)
+{
+    Token* value;
+    Token t1;
+    Token t2;
+    Token t3;
+    Token result;
+    Call* call;
+    Env* frame;
+    Budget* budget;
+    RngStream* rng;
+    RngStream own_rng;
+    ProfileRun run;
+    double started;
+    double nested;
+    bool timed;
+    uint64_t ip;
+    uint64_t at;
+    uint32_t i;
+
+    budget = (env != NULL) ? env->budget : NULL;
+
+    /* Without a stream of its own a run starts over on stream 0, the calls it makes carry on from there */
+    own_rng.stream = 0;
+    own_rng.draws = 0;
+    rng = (env != NULL && env->rng != NULL) ? env->rng : &own_rng;
+
+    start_profile_run(&run, program);
+    started = 0.0;
+    nested = 0.0;
+
+    for (ip = 0; ip < program->size; ip++) {
+        if (budget != NULL && !SPEND_INSTRUCTION(budget)) {
+            break;
+        }
+
+        /* Jumps move 'ip', the time goes to the instruction that started. Calls are always timed, recursion skews a sample. */
+        at = ip;
+        timed = run.counts != NULL && (run.counts[at]++ % PROFILE_SAMPLE_INTERVAL == 0
+            || program->base[at].type == TOK_CALL || IS_HIGHER_ORDER(program->base[at].type));
+        if (timed) {
+            started = profile_clock();
+            nested = nested_profile_seconds();
+        }
+
+        switch (program->base[ip].type) {
+            case TOK_STRING:
+            case TOK_SHORT_STRING:
+            case TOK_DOUBLE:
+            case TOK_LONG:
+            case TOK_BIGINT:
+            case TOK_ARRAY: {
+                /* The value stack owns its tokens, operands get scrubbed once used */
+                result = copy_token(&program->base[ip]);
+                push_token_stack(value_stack, &result);
+                break;
+            }
+
+            case TOK_ADD: {
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                result = add_tokens(&t1, &t2);
+                scrub_token(&t1);
+                scrub_token(&t2);
+                if (budget != NULL) {
+                    check_size(budget, &result);
+                }
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_SUB: {
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                result = sub_tokens(&t1, &t2);
+                scrub_token(&t1);
+                scrub_token(&t2);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_MUL: {
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                result = mul_tokens(&t1, &t2);
+                scrub_token(&t1);
+                scrub_token(&t2);
+                if (budget != NULL) {
+                    check_size(budget, &result);
+                }
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_DIV: {
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                result = div_tokens(&t1, &t2);
+                scrub_token(&t1);
+                scrub_token(&t2);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_MOD: {
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                result = mod_tokens(&t1, &t2);
+                scrub_token(&t1);
+                scrub_token(&t2);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_EXP: {
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                /* Too big to even start on, the loop stops before anything reads the result */
+                if (budget != NULL && !affordable_power(&t1, &t2)) {
+                    exceed_budget(budget, "bytes");
+                    result.type = TOK_EOF;
+                    result.as.string = NULL;
+                } else {
+                    result = exp_tokens(&t1, &t2);
+                }
+                scrub_token(&t1);
+                scrub_token(&t2);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_SIN: {
+                t1 = pop_token_stack(value_stack);
+
+                result = sin_token(&t1);
+                scrub_token(&t1);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_COS: {
+                t1 = pop_token_stack(value_stack);
+
+                result = cos_token(&t1);
+                scrub_token(&t1);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_TAN: {
+                t1 = pop_token_stack(value_stack);
+
+                result = tan_token(&t1);
+                scrub_token(&t1);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_LT:
+            case TOK_LE:
+            case TOK_GT:
+            case TOK_GE:
+            case TOK_EQ:
+            case TOK_NE: {
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                result = compare_tokens(program->base[ip].type, &t1, &t2);
+                scrub_token(&t1);
+                scrub_token(&t2);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_THEN: {
+                t1 = pop_token_stack(value_stack);
+                if (!token_is_true(&t1)) {
+                    /* Onto the 'else', the branch after it is the one to run */
+                    ip += program->base[ip].as.i64;
+                }
+                scrub_token(&t1);
+                break;
+            }
+            case TOK_ELSE: {
+                /* Onto the 'if', which has nothing left to do */
+                ip += program->base[ip].as.i64;
+                break;
+            }
+            case TOK_IF: {
+                break;
+            }
+            case TOK_SHORT_AND:
+            case TOK_SHORT_OR: {
+                t1 = pop_token_stack(value_stack);
+                if (token_is_true(&t1) == (program->base[ip].type == TOK_SHORT_OR)) {
+                    /* Decided already, so the '&&' or '||' is skipped too */
+                    result.type = TOK_LONG;
+                    result.as.i64 = program->base[ip].type == TOK_SHORT_OR;
+                    push_token_stack(value_stack, &result);
+                    ip += program->base[ip].as.i64;
+                }
+                scrub_token(&t1);
+                break;
+            }
+            case TOK_AND:
+            case TOK_OR: {
+                /* Only the right operand is left by now, see 'TOK_SHORT_AND' */
+                t1 = pop_token_stack(value_stack);
+
+                result.type = TOK_LONG;
+                result.as.i64 = token_is_true(&t1);
+                scrub_token(&t1);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_LEN:
+            case TOK_STR:
+            case TOK_NUM: {
+                t1 = pop_token_stack(value_stack);
+
+                switch (program->base[ip].type) {
+                    case TOK_LEN: {
+                        result = len_token(&t1);
+                        break;
+                    }
+                    case TOK_STR: {
+                        result = str_token(&t1);
+                        break;
+                    }
+                    default: {
+                        result = num_token(&t1);
+                        break;
+                    }
+                }
+                scrub_token(&t1);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_RAND: {
+                result = draw_token(TOK_RAND, rng, NULL, NULL);
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_UNIFORM:
+            case TOK_NORMAL: {
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                result = draw_token(program->base[ip].type, rng, &t1, &t2);
+                scrub_token(&t1);
+                scrub_token(&t2);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_NATIVE: {
+                result = call_native(program->base[ip].as.native, value_stack);
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_SUBSTR:
+            case TOK_POWMOD:
+            case TOK_FMA: {
+                t3 = pop_token_stack(value_stack);
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                if (program->base[ip].type == TOK_SUBSTR) {
+                    result = substr_tokens(&t1, &t2, &t3);
+                } else {
+                    result = (program->base[ip].type == TOK_POWMOD) ? powmod_tokens(&t1, &t2, &t3) : fma_tokens(&t1, &t2, &t3);
+                }
+                scrub_token(&t1);
+                scrub_token(&t2);
+                scrub_token(&t3);
+                if (budget != NULL) {
+                    check_size(budget, &result);
+                }
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_DOT: {
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                result = dot_tokens(&t1, &t2);
+                scrub_token(&t1);
+                scrub_token(&t2);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_MAKE_ARRAY: {
+                /* The elements are the top of the stack, in order */
+                value_stack->size -= program->base[ip].as.i64;
+                result = make_array(value_stack->base + value_stack->size, program->base[ip].as.i64);
+                for (i = 0; i < program->base[ip].as.i64; i++) {
+                    scrub_token(&value_stack->base[value_stack->size + i]);
+                }
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_AGG_SUM:
+            case TOK_AGG_MEAN:
+            case TOK_AGG_MIN:
+            case TOK_AGG_MAX:
+            case TOK_AGG_COUNT:
+            case TOK_AGG_VAR: {
+                t1 = pop_token_stack(value_stack);
+
+                result = aggregate_token(program->base[ip].type, &t1);
+                scrub_token(&t1);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_SOLVE: {
+                t1 = pop_token_stack(value_stack);
+
+                result = solve_lambda(program->base[ip].as.lambda, env, &t1);
+                scrub_token(&t1);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_MINIMIZE: {
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                result = minimize_lambda(program->base[ip].as.lambda, env, &t1, &t2);
+                scrub_token(&t1);
+                scrub_token(&t2);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_INTEGRATE: {
+                t2 = pop_token_stack(value_stack);
+                t1 = pop_token_stack(value_stack);
+
+                result = integrate_lambda(program->base[ip].as.lambda, env, &t1, &t2);
+                scrub_token(&t1);
+                scrub_token(&t2);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_CALL: {
+                /* Only calls that could not be inlined get here, see 'link_program()' */
+                call = program->base[ip].as.call;
+                frame = alloc_env(env);
+                frame->rng = rng;
+                if (budget != NULL && limit_config.max_depth > 0 && frame->depth > limit_config.max_depth) {
+                    /* The arguments stay on the stack, it is about to be emptied */
+                    free_env(frame);
+                    exceed_budget(budget, "depth");
+                    break;
+                }
+                if (frame->depth > MAX_CALL_DEPTH) {
+                    free_env(frame);
+                    fail(32, "Calls to '%s' nest too deep.", call->name);
+                }
+
+                for (i = call->arity; i > 0; i--) {
+                    t1 = pop_token_stack(value_stack);
+                    bind_variable(frame, call->target->params[i - 1], &t1);
+                    scrub_token(&t1);
+                }
+
+                result = eval_program(call->target->body, frame);
+                free_env(frame);
+
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_IDENTIFIER: {
+                if ((value = lookup_variable(env, program->base[ip].as.string)) == NULL) {
+                    fail(23, "Unbound variable '%s'.", program->base[ip].as.string);
+                }
+
+                result = copy_token(value);
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_STORE: {
+                if (*slots == NULL) {
+                    *slots = alloc_token_stack();
+                }
+
+                result.type = TOK_EOF;
+                result.as.string = NULL;
+                while ((*slots)->size <= (uint64_t) program->base[ip].as.i64) {
+                    push_token_stack(*slots, &result);
+                }
+
+                value = &(*slots)->base[program->base[ip].as.i64];
+                scrub_token(value);
+                *value = copy_token(&STACK_TOP(value_stack));
+                break;
+            }
+            case TOK_LOAD: {
+                result = copy_token(&(*slots)->base[program->base[ip].as.i64]);
+                push_token_stack(value_stack, &result);
+                break;
+            }
+            case TOK_TUPLE: {
+                /* The outputs are already on the stack, in order */
+                break;
+            }
+            default : {
+                fprintf(stderr, "Unimplemented instruction.\n");
+                exit(420);
+            }
+        }
+
+        if (timed) {
+            run.seconds[at] += profile_clock() - started - (nested_profile_seconds() - nested);
+            run.samples[at]++;
+        }
+    }
+
+    finish_profile_run(&run, program);
+}
+
+/* Leaves every output of 'program' on the returned stack */
+static TokenStack* run_program(TokenStack* program, Env* env)
+{
+    TokenStack* value_stack;
+    TokenStack* slots;
+    Budget* budget;
+    Token result;
+    uint64_t n;
+
+    value_stack = alloc_token_stack();
+    slots = NULL;
+    budget = (env != NULL) ? env->budget : NULL;
+
+    if (budget != NULL && caught_failure() != NULL) {
+        run_caught(program, env, value_stack, &slots);
+    } else {
+        run_instructions(program, env, value_stack, &slots);
+    }
+
+    /* What is left would be meaningless, but the caller still gets a value per output */
+    if (budget != NULL && budget->exceeded != NULL) {
+        while (value_stack->size > 0) {
+            value_stack->size--;
+            scrub_token(&value_stack->base[value_stack->size]);
+        }
+        result.type = TOK_EOF;
+        result.as.string = NULL;
+        for (n = count_outputs(program); n > 0; n--) {
+            push_token_stack(value_stack, &result);
+        }
+    }
+
+    if (slots != NULL) {
+        while (slots->size > 0) {
+            slots->size--;
+            scrub_token(&slots->base[slots->size]);
+        }
+        free_token_stack(slots);
+    }
+
+    return value_stack;
+}
+
+/*
+    When failures are caught, one ends the run the way running out of budget
+    does, so that every frame on the way out still frees its stacks. The
+    'setjmp()' has a function of its own because it makes the frame of the
+    one calling it larger, and recursion has one of those per call.
+*/
+static void run_caught(TokenStack* program, Env* env, TokenStack* value_stack, TokenStack** slots)
+{
+    Failure* failure;
+
+    if ((failure = malloc(sizeof(Failure))) == NULL) {
+        fprintf(stderr, "Failed to allocate failure.\n");
+        exit(5);
+    }
+
+    catch_failures(failure);
+    if (setjmp(failure->jump) == 0) {
+        run_instructions(program, env, value_stack, slots);
+    } else {
+        fail_budget(env->budget, failure->message);
+    }
+    release_failures(failure);
+
+    free(failure);
+}
+
+/* Pops the arguments of 'native', which only takes numbers, and calls it */
+static Token call_native(Native* native, TokenStack* value_stack)
+{
+    double args[MAX_NATIVE_ARITY];
+    Token arg;
+    Token result;
+    bool numbers;
+    uint32_t i;
+
+    numbers = true;
+    for (i = native->arity; i > 0; i--) {
+        arg = pop_token_stack(value_stack);
+        numbers = numbers && IS_NUMBER((&arg));
+        args[i - 1] = numbers ? token_to_double(&arg) : 0.0;
+        scrub_token(&arg);
+    }
+
+    if (!numbers) {
+        fail(12, "'%s' unimplemented.", native->name);
+    }
+
+    result.type = TOK_DOUBLE;
+    result.as.f64 = native->scalar(args);
+
+    return result;
+}
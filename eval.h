@@ -0,0 +1,54 @@
+#ifndef CALC_EVAL_H
+#define CALC_EVAL_H
+
+#include <stdint.h>
+
+#include "token.h"
+
+/* Variable bindings, looked up innermost scope first */
+typedef struct {
+    char* name;
+    Token value;
+} Binding;
+
+typedef struct Env {
+    Binding* bindings;
+    uint32_t size;
+    uint32_t capacity;
+
+    struct Env* parent;
+
+    /* Number of scopes above this one */
+    uint32_t depth;
+
+    /* Shared with every scope below, NULL for no limits, see budget.h */
+    struct Budget* budget;
+
+    /* Where rand() and friends draw from, shared with every scope below, see rng.h */
+    struct RngStream* rng;
+} Env;
+
+Env* alloc_env(Env* parent);
+void free_env(Env* target);
+void bind_variable(Env* env, char* name, Token* value);
+Token* lookup_variable(Env* env, char* name);
+
+/* Binds a 'name=value' command line argument */
+void parse_binding(char* spec, Env* env);
+
+/*
+    A copy of 'program' with every variable bound in 'env' replaced by its value,
+    except for the names in 'keep'. Lambda bodies are rewritten as well.
+*/
+TokenStack* bind_constants(TokenStack* program, Env* env, char** keep, uint32_t n_keep);
+
+/*
+    Runs an RPN program on a value stack and returns the value it leaves behind.
+    When the budget of 'env' runs out every output is a TOK_EOF instead.
+*/
+Token eval_program(TokenStack* program, Env* env);
+
+/* Every output of a tuple, 'outputs' has room for 'count_outputs(program)' */
+void eval_outputs(TokenStack* program, Env* env, Token* outputs);
+
+#endif
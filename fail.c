@@ -0,0 +1,85 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "fail.h"
+
+static pthread_key_t caught_key;
+static pthread_once_t caught_once = PTHREAD_ONCE_INIT;
+
+static void make_key();
+
+void fail(int code, char* format, ...)
+{
+    Failure* failure;
+    va_list args;
+
+    pthread_once(&caught_once, make_key);
+    failure = pthread_getspecific(caught_key);
+
+    va_start(args, format);
+    if (failure == NULL) {
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+        va_end(args);
+        exit(code);
+    }
+    vsnprintf(failure->message, FAILURE_MESSAGE_MAX, format, args);
+    va_end(args);
+    failure->code = code;
+
+    longjmp(failure->jump, 1);
+}
+
+void catch_failures(Failure* failure)
+{
+    pthread_once(&caught_once, make_key);
+    failure->message[0] = '\0';
+    failure->code = 0;
+    failure->outer = pthread_getspecific(caught_key);
+    pthread_setspecific(caught_key, failure);
+}
+
+void release_failures(Failure* failure)
+{
+    pthread_setspecific(caught_key, failure->outer);
+}
+
+Failure* caught_failure()
+{
+    pthread_once(&caught_once, make_key);
+    return pthread_getspecific(caught_key);
+}
+
+void pass_failure(Failure* failure)
+{
+    release_failures(failure);
+    fail(failure->code, "%s", failure->message);
+}
+
+Failure* hold_failures()
+{
+    Failure* held;
+
+    pthread_once(&caught_once, make_key);
+    held = pthread_getspecific(caught_key);
+    pthread_setspecific(caught_key, NULL);
+
+    return held;
+}
+
+void resume_failures(Failure* held)
+{
+    pthread_setspecific(caught_key, held);
+}
+
+static void make_key()
+{
+    if (pthread_key_create(&caught_key, NULL) != 0) {
+        fprintf(stderr, "Failed to create a thread key.\n");
+        exit(26);
+    }
+}
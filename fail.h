@@ -0,0 +1,68 @@
+#ifndef CALC_FAIL_H
+#define CALC_FAIL_H
+
+#include <setjmp.h>
+
+/*
+    Errors in evaluating a value, like a division by zero or an operator on
+    the wrong types, go through 'fail()', which prints the message and exits
+    with 'code'.
+
+    Unless the thread has caught them: between 'catch_failures()' and
+    'release_failures()' 'fail()' keeps the message in the Failure and jumps
+    back to where 'setjmp(failure.jump)' was called, so that a --model cell
+    can end up undefined and the session carries on. Whatever the evaluation
+    had allocated by then is not freed, so what holds on to much catches them
+    as well and passes them on with 'pass_failure()'. 'eval_program()' under
+    a budget instead stops like it would on an exhausted one, keeping the
+    message in the budget (see 'fail_budget()'), and frees its stacks.
+    A pool of worker threads doesn't inherit it, a failure anywhere in the
+    pool is fatal.
+
+        Failure failure;
+
+        catch_failures(&failure);
+        if (setjmp(failure.jump) == 0) {
+            value = eval_program(program, env);
+        } else {
+            ... failure.message ...
+        }
+        release_failures(&failure);
+*/
+
+#define FAILURE_MESSAGE_MAX 256
+
+#ifdef __GNUC__
+#define FAIL_NORETURN __attribute__((noreturn))
+#else
+#define FAIL_NORETURN
+#endif
+
+typedef struct Failure {
+    jmp_buf jump;
+    char message[FAILURE_MESSAGE_MAX];
+    int code;
+
+    /* What was caught before, back in place on release */
+    struct Failure* outer;
+} Failure;
+
+void fail(int code, char* format, ...) FAIL_NORETURN;
+
+void catch_failures(Failure* failure);
+void release_failures(Failure* failure);
+
+/* The innermost Failure caught on this thread, NULL if failures are fatal */
+Failure* caught_failure();
+
+/*
+    For code that has to free something on the way past: releases 'failure'
+    and fails again with its message, to the Failure caught before it
+*/
+void pass_failure(Failure* failure) FAIL_NORETURN;
+
+/* Makes failures fatal on this thread until 'resume_failures()', for 'parallel_for()' */
+Failure* hold_failures();
+void resume_failures(Failure* held);
+
+#endif
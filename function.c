@@ -0,0 +1,573 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "function.h"
+#include "eval.h"
+#include "poly.h"
+#include "cse.h"
+#include "budget.h"
+
+#define INITIAL_FUNCTION_CAPACITY 8
+#define FUNCTION_GROWTH_FACTOR 2
+
+static Function** functions = NULL;
+static uint32_t n_functions = 0;
+static uint32_t capacity = 0;
+static uint32_t epoch = 0;
+
+static Function* find_function(char* name, uint32_t arity);
+static void resolve_calls(TokenStack* program);
+static bool reaches(TokenStack* program, Function* target);
+static bool draws(TokenStack* program);
+static void link_function(Function* fn);
+static TokenStack* inline_calls(TokenStack* program);
+static bool can_inline(TokenStack* out, Call* call, uint64_t* starts);
+static bool is_cheap(TokenStack* program, uint64_t start, uint64_t end);
+/* No builtin that loops or calls in [start, end), and nothing impure, a copy of that would be a different value */
+static bool is_cheap(TokenStack* program, uint64_t start, uint64_t end)
+{
+    uint64_t ip;
+    TokenType type;
+
+    for (ip = start; ip < end; ip++) {
+        type = program->base[ip].type;
+        if (IS_HIGHER_ORDER(type) || IS_AGGREGATE(type) || is_impure(&program->base[ip]) || type == TOK_CALL) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void count_uses(TokenStack* body, char* name, uint32_t* outside, uint32_t* inside, bool in_lambda);
+static void splice_body(TokenStack* out, TokenStack* body, char** params, uint32_t n_params,
+    TokenStack* args, uint64_t* starts, uint64_t* ends);
+static void push_folded(TokenStack* out, Token* tok);
+static void fold_branch(TokenStack* out);
+
+void define_function(Call* call, char** params, TokenStack* body)
+{
+    Function* fn;
+    uint32_t i;
+    uint32_t j;
+
+    if (find_function(call->name, call->arity) != NULL) {
+        fprintf(stderr, "Function '%s' with %u arguments is already defined.\n", call->name, call->arity);
+        exit(32);
+    }
+    for (i = 0; i < call->arity; i++) {
+        for (j = 0; j < i; j++) {
+            if (strcmp(params[i], params[j]) == 0) {
+                fprintf(stderr, "Parameter '%s' of '%s' appears twice.\n", params[i], call->name);
+                exit(32);
+            }
+        }
+    }
+
+    if (n_functions == capacity) {
+        capacity = (capacity == 0) ? INITIAL_FUNCTION_CAPACITY : capacity * FUNCTION_GROWTH_FACTOR;
+        if ((functions = realloc(functions, sizeof(Function*) * capacity)) == NULL) {
+            fprintf(stderr, "Failed to grow function table.\n");
+            exit(5);
+        }
+    }
+
+    if ((fn = malloc(sizeof(Function))) == NULL || (fn->name = malloc(strlen(call->name) + 1)) == NULL) {
+        fprintf(stderr, "Failed to allocate function.\n");
+        exit(5);
+    }
+    strcpy(fn->name, call->name);
+    fn->params = params;
+    fn->n_params = call->arity;
+    fn->body = body;
+    fn->recursive = false;
+    fn->linked = false;
+    fn->impure = false;
+    fn->mark = 0;
+
+    functions[n_functions++] = fn;
+}
+
+TokenStack* link_program(TokenStack* program)
+{
+    TokenStack* inlined;
+    TokenStack* output;
+    TokenStack* body;
+    uint32_t i;
+
+    for (i = 0; i < n_functions; i++) {
+        resolve_calls(functions[i]->body);
+    }
+    resolve_calls(program);
+
+    for (i = 0; i < n_functions; i++) {
+        epoch++;
+        functions[i]->recursive = reaches(functions[i]->body, functions[i]);
+    }
+
+    /* Before inlining, which asks 'is_impure()' about the calls that stay */
+    for (i = 0; i < n_functions; i++) {
+        epoch++;
+        functions[i]->mark = epoch;
+        functions[i]->impure = draws(functions[i]->body);
+    }
+
+    for (i = 0; i < n_functions; i++) {
+        link_function(functions[i]);
+    }
+
+    /* Only once nothing is left to inline, what remains of a body runs in a frame */
+    for (i = 0; i < n_functions; i++) {
+        body = functions[i]->body;
+        functions[i]->body = optimize_polynomials(body);
+        free_token_stack(body);
+    }
+
+    inlined = inline_calls(program);
+    output = optimize_polynomials(inlined);
+    free_token_stack(inlined);
+
+    /* After inlining, slots are numbered per program and a body would bring its own */
+    for (i = 0; i < n_functions; i++) {
+        body = functions[i]->body;
+        functions[i]->body = share_subexpressions(body);
+        free_token_stack(body);
+    }
+
+    inlined = output;
+    output = share_subexpressions(inlined);
+    free_token_stack(inlined);
+
+    return output;
+}
+
+void free_functions()
+{
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 0; i < n_functions; i++) {
+        for (j = 0; j < functions[i]->n_params; j++) {
+            free(functions[i]->params[j]);
+        }
+        free(functions[i]->params);
+        free(functions[i]->name);
+        free_token_stack(functions[i]->body);
+        free(functions[i]);
+    }
+
+    free(functions);
+    functions = NULL;
+    n_functions = 0;
+    capacity = 0;
+}
+
+static Function* find_function(char* name, uint32_t arity)
+{
+    uint32_t i;
+
+    for (i = 0; i < n_functions; i++) {
+        if (functions[i]->n_params == arity && strcmp(functions[i]->name, name) == 0) {
+            return functions[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void resolve_calls(TokenStack* program)
+{
+    Token* tok;
+    uint64_t ip;
+
+    for (ip = 0; ip < program->size; ip++) {
+        tok = &program->base[ip];
+
+        if (tok->type == TOK_CALL) {
+            if ((tok->as.call->target = find_function(tok->as.call->name, tok->as.call->arity)) == NULL) {
+                fprintf(stderr, "Unknown function '%s' with %u arguments.\n", tok->as.call->name, tok->as.call->arity);
+                exit(32);
+            }
+        } else if (IS_HIGHER_ORDER(tok->type)) {
+            resolve_calls(tok->as.lambda->body);
+        }
+    }
+}
+
+/* Can 'program' end up calling 'target', marking the functions it looks through */
+static bool reaches(TokenStack* program, Function* target)
+{
+    Function* callee;
+    Token* tok;
+    uint64_t ip;
+
+    for (ip = 0; ip < program->size; ip++) {
+        tok = &program->base[ip];
+
+        if (tok->type == TOK_CALL) {
+            callee = tok->as.call->target;
+            if (callee == target) {
+                return true;
+            }
+            if (callee->mark != epoch) {
+                callee->mark = epoch;
+                if (reaches(callee->body, target)) {
+                    return true;
+                }
+            }
+        } else if (IS_HIGHER_ORDER(tok->type) && reaches(tok->as.lambda->body, target)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Is anything in 'program' impure, looking through the functions it calls, marking them like 'reaches()' */
+static bool draws(TokenStack* program)
+{
+    Function* callee;
+    Token* tok;
+    uint64_t ip;
+
+    for (ip = 0; ip < program->size; ip++) {
+        tok = &program->base[ip];
+
+        if (tok->type == TOK_CALL) {
+            callee = tok->as.call->target;
+            if (callee->mark != epoch) {
+                callee->mark = epoch;
+                if (draws(callee->body)) {
+                    return true;
+                }
+            }
+        } else if (is_impure(tok)) {
+            return true;
+        } else if (IS_HIGHER_ORDER(tok->type) && draws(tok->as.lambda->body)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void link_function(Function* fn)
+{
+    TokenStack* body;
+
+    /* Set first, a recursive function gets here again through its own body */
+    if (fn->linked) {
+        return;
+    }
+    fn->linked = true;
+
+    body = inline_calls(fn->body);
+    free_token_stack(fn->body);
+    fn->body = body;
+}
+
+static TokenStack* inline_calls(TokenStack* program)
+{
+    TokenStack* output;
+    TokenStack* body;
+    Function* fn;
+    Token tok;
+    uint64_t* starts;
+    uint64_t* ends;
+    uint64_t ip;
+    uint32_t i;
+
+    output = alloc_token_stack();
+
+    for (ip = 0; ip < program->size; ip++) {
+        tok = program->base[ip];
+
+        if (tok.type == TOK_CALL) {
+            fn = tok.as.call->target;
+            link_function(fn);
+
+            starts = malloc(sizeof(uint64_t) * (fn->n_params + 1));
+            ends = malloc(sizeof(uint64_t) * (fn->n_params + 1));
+            if (starts == NULL || ends == NULL) {
+                fprintf(stderr, "Failed to allocate call.\n");
+                exit(5);
+            }
+
+            if (can_inline(output, tok.as.call, starts)) {
+                for (i = 0; i < fn->n_params; i++) {
+                    ends[i] = (i + 1 < fn->n_params) ? starts[i + 1] : output->size;
+                }
+                splice_body(output, fn->body, fn->params, fn->n_params, output, starts, ends);
+            } else {
+                tok = copy_token(&tok);
+                push_token_stack(output, &tok);
+            }
+
+            free(starts);
+            free(ends);
+        } else if (IS_HIGHER_ORDER(tok.type)) {
+            tok = copy_token(&tok);
+            body = tok.as.lambda->body;
+            tok.as.lambda->body = inline_calls(body);
+            free_token_stack(body);
+            push_token_stack(output, &tok);
+        } else {
+            tok = copy_token(&tok);
+            push_folded(output, &tok);
+        }
+    }
+
+    link_jumps(output);
+
+    return output;
+}
+
+/*
+    The arguments are the last values on 'out', 'starts' gets where each begins.
+    An argument is copied in wherever its parameter is used, so one that is used
+    more than once has to be cheap to repeat: plain arithmetic, and no more extra
+    instructions than a body we would inline anyway. Inside a lambda it has to be
+    a constant, so that the lambda's own variable can't capture anything.
+*/
+static bool can_inline(TokenStack* out, Call* call, uint64_t* starts)
+{
+    Function* fn;
+    uint64_t end;
+    uint64_t length;
+    uint32_t outside;
+    uint32_t inside;
+    uint32_t i;
+
+    fn = call->target;
+    if (fn->recursive || fn->body->size > INLINE_BODY_LIMIT) {
+        return false;
+    }
+
+    end = out->size;
+    for (i = fn->n_params; i > 0; i--) {
+        starts[i - 1] = find_operand_start(out, end - 1);
+        end = starts[i - 1];
+    }
+
+    for (i = 0; i < fn->n_params; i++) {
+        length = ((i + 1 < fn->n_params) ? starts[i + 1] : out->size) - starts[i];
+
+        outside = 0;
+        inside = 0;
+        count_uses(fn->body, fn->params[i], &outside, &inside, false);
+
+        if (inside > 0 && !(length == 1 && IS_NUMBER((&out->base[starts[i]])))) {
+            return false;
+        }
+        if (outside > 1 && (length > 1 || is_impure(&out->base[starts[i]]))
+            && ((outside - 1) * length > INLINE_BODY_LIMIT || !is_cheap(out, starts[i], starts[i] + length))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void count_uses(TokenStack* body, char* name, uint32_t* outside, uint32_t* inside, bool in_lambda)
+{
+    Token* tok;
+    uint64_t ip;
+
+    for (ip = 0; ip < body->size; ip++) {
+        tok = &body->base[ip];
+
+        if (tok->type == TOK_IDENTIFIER && strcmp(tok->as.string, name) == 0) {
+            if (in_lambda) {
+                *inside += 1;
+            } else {
+                *outside += 1;
+            }
+        } else if (IS_HIGHER_ORDER(tok->type) && strcmp(tok->as.lambda->param, name) != 0) {
+            count_uses(tok->as.lambda->body, name, outside, inside, true);
+        }
+    }
+}
+
+/*
+    Replaces the arguments at the end of 'out' with a copy of 'body', reading them
+    from 'args' first. Lambda bodies are handled by recursing with 'out' as a new
+    stack and 'args' pointing at the original.
+*/
+static void splice_body(TokenStack* out, TokenStack* body, char** params, uint32_t n_params,
+    TokenStack* args, uint64_t* starts, uint64_t* ends)
+{
+    TokenStack* saved;
+    TokenStack* inner;
+    char** shadowed;
+    Token tok;
+    uint64_t first;
+    uint64_t ip;
+    uint64_t j;
+    uint32_t i;
+
+    /* Copy the arguments out of the way before the tokens after 'first' are dropped */
+    saved = NULL;
+    first = out->size;
+    if (out == args) {
+        saved = alloc_token_stack();
+        for (i = 0; i < n_params; i++) {
+            for (j = starts[i]; j < ends[i]; j++) {
+                push_token_stack(saved, &args->base[j]);
+            }
+        }
+
+        first = (n_params > 0) ? starts[0] : out->size;
+        for (i = 0; i < n_params; i++) {
+            ends[i] -= first;
+            starts[i] -= first;
+        }
+        out->size = first;
+        args = saved;
+    }
+
+    for (ip = 0; ip < body->size; ip++) {
+        tok = body->base[ip];
+
+        if (tok.type == TOK_IDENTIFIER) {
+            for (i = 0; i < n_params; i++) {
+                if (params[i] != NULL && strcmp(params[i], tok.as.string) == 0) {
+                    break;
+                }
+            }
+            if (i < n_params) {
+                for (j = starts[i]; j < ends[i]; j++) {
+                    tok = copy_token(&args->base[j]);
+                    push_folded(out, &tok);
+                }
+                continue;
+            }
+        }
+
+        if (IS_HIGHER_ORDER(tok.type)) {
+            /* The lambda's variable hides a parameter of the same name */
+            if ((shadowed = malloc(sizeof(char*) * (n_params + 1))) == NULL) {
+                fprintf(stderr, "Failed to allocate scope.\n");
+                exit(5);
+            }
+            for (i = 0; i < n_params; i++) {
+                shadowed[i] = (params[i] != NULL && strcmp(params[i], tok.as.lambda->param) == 0) ? NULL : params[i];
+            }
+
+            tok = copy_token(&tok);
+            inner = alloc_token_stack();
+            splice_body(inner, tok.as.lambda->body, shadowed, n_params, args, starts, ends);
+            free_token_stack(tok.as.lambda->body);
+            tok.as.lambda->body = inner;
+            free(shadowed);
+
+            push_token_stack(out, &tok);
+            continue;
+        }
+
+        tok = copy_token(&tok);
+        push_folded(out, &tok);
+    }
+
+    if (saved != NULL) {
+        /* The arguments were moved into 'saved', so they go with it */
+        free_token_stack(saved);
+    }
+}
+
+/* Pushes 'tok', evaluating it right away if it is an operator on constants */
+static void push_folded(TokenStack* out, Token* tok)
+{
+    TokenStack view;
+    Token* divisor;
+    Token result;
+    int arity;
+    int i;
+
+    push_token_stack(out, tok);
+
+    if (tok->type == TOK_IF) {
+        fold_branch(out);
+        return;
+    }
+
+    /* '&&' and '||' only see their right operand when run, see 'link_jumps()' */
+    if ((!IS_OPERATOR(tok->type) && tok->type != TOK_SIN && tok->type != TOK_COS && tok->type != TOK_TAN
+        && tok->type != TOK_POWMOD && tok->type != TOK_FMA && (tok->type != TOK_NATIVE || is_impure(tok)))
+        || tok->type == TOK_AND || tok->type == TOK_OR) {
+        return;
+    }
+
+    arity = get_arity(tok);
+    if (out->size < (uint64_t) arity + 1) {
+        return;
+    }
+    for (i = 1; i <= arity; i++) {
+        if (!IS_NUMBER((&out->base[out->size - 1 - i]))) {
+            return;
+        }
+    }
+
+    /* Leave a division by zero to blow up at run time, if that part ever runs */
+    divisor = (arity > 0) ? &out->base[out->size - 2] : NULL;
+    if ((tok->type == TOK_DIV && divisor->type == TOK_LONG && divisor->as.i64 == 0)
+        || ((tok->type == TOK_MOD || tok->type == TOK_POWMOD) && fabs(token_to_double(divisor)) < 1.0)
+        || (tok->type == TOK_POWMOD && token_to_double(&out->base[out->size - 3]) < 0.0)) {
+        return;
+    }
+
+    /* Folding has no budget, a power over the limit is left for one that does */
+    if (tok->type == TOK_EXP && !affordable_power(&out->base[out->size - 3], divisor)) {
+        return;
+    }
+
+    view.base = &out->base[out->size - arity - 1];
+    view.size = arity + 1;
+    view.capacity = arity + 1;
+    result = eval_program(&view, NULL);
+
+    for (i = 0; i <= arity; i++) {
+        scrub_token(&out->base[out->size - 1 - i]);
+    }
+    out->size -= arity + 1;
+    push_token_stack(out, &result);
+}
+
+/* An 'if()' on top of 'out' with a constant condition keeps only the branch it takes */
+static void fold_branch(TokenStack* out)
+{
+    Token* cond;
+    uint64_t b_start;
+    uint64_t a_start;
+    uint64_t c_start;
+    uint64_t keep_start;
+    uint64_t keep_end;
+    uint64_t ip;
+
+    /* Seen without jumping 'c then', 'a else' and 'b' are the three operands */
+    b_start = find_operand_start(out, out->size - 2);
+    a_start = find_operand_start(out, b_start - 1);
+    c_start = find_operand_start(out, a_start - 1);
+
+    cond = &out->base[c_start];
+    if (a_start - c_start != 2 || !IS_NUMBER(cond)) {
+        return;
+    }
+
+    if (token_is_true(cond)) {
+        keep_start = a_start;
+        keep_end = b_start - 1;
+    } else {
+        keep_start = b_start;
+        keep_end = out->size - 1;
+    }
+
+    for (ip = c_start; ip < out->size; ip++) {
+        if (ip < keep_start || ip >= keep_end) {
+            scrub_token(&out->base[ip]);
+        }
+    }
+    memmove(&out->base[c_start], &out->base[keep_start], sizeof(Token) * (keep_end - keep_start));
+    out->size = c_start + (keep_end - keep_start);
+}
@@ -0,0 +1,51 @@
+#ifndef CALC_FUNCTION_H
+#define CALC_FUNCTION_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "token.h"
+
+/*
+    User defined functions, written as 'f(x, y) = body;' in front of the
+    expression. Variables in a body that are not parameters are looked up
+    wherever the function is called from.
+
+    'link_program()' resolves every call once the whole input is parsed. Calls
+    to small functions that never call themselves, directly or not, are inlined:
+    the body is spliced into the caller with the arguments in place of the
+    parameters, folding constants as it goes, so 'f(2, y)' leaves behind a body
+    specialized on x = 2. Any other call stays a TOK_CALL and 'eval_program()'
+    runs it in a frame of its own. Polynomials are put in Horner form, see
+    poly.h, and repeated subexpressions are computed once last, see cse.h.
+*/
+
+/* Largest body, in instructions, that gets inlined */
+#define INLINE_BODY_LIMIT 64
+
+/* Deepest chain of frames before giving up on a runaway recursion */
+#define MAX_CALL_DEPTH 10000
+
+typedef struct Function {
+    char* name;
+    char** params;
+    uint32_t n_params;
+    TokenStack* body;
+
+    bool recursive;
+    bool linked;
+
+    /* Draws or calls an impure native somewhere, directly or through the functions it calls */
+    bool impure;
+    uint32_t mark;
+} Function;
+
+/* Takes ownership of 'params' and 'body', 'call' is the left hand side */
+void define_function(Call* call, char** params, TokenStack* body);
+
+/* A linked copy of 'program' */
+TokenStack* link_program(TokenStack* program);
+
+void free_functions();
+
+#endif
@@ -0,0 +1,351 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "integrate.h"
+#include "column.h"
+#include "parallel.h"
+#include "fail.h"
+
+#define GK_POINTS 15
+
+/* Points per task before a batch is worth spreading over threads */
+#define PARALLEL_POINTS 4096
+
+/* MIN() and MAX() are C99 */
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+IntegrateConfig integrate_config = {1.0e-10, 2000};
+
+typedef struct {
+    double a;
+    double b;
+    double result;
+    double error;
+} Interval;
+
+typedef struct {
+    ColumnProgram* compiled;
+    Column* x;
+    Column* fx;
+    uint64_t count;
+    uint64_t chunk;
+} NodeJob;
+
+/* QUADPACK qk15, Kronrod abscissae in [0, 1) with the Gauss points at odd indices */
+static const double xgk[8] = {
+    0.991455371120812639206854697526329,
+    0.949107912342758524526189684047851,
+    0.864864423359769072789712788640926,
+    0.741531185599394439863864773280788,
+    0.586087235467691130294144845693013,
+    0.405845151377397166906606412076961,
+    0.207784955007898467600689403773245,
+    0.000000000000000000000000000000000
+};
+
+static const double wgk[8] = {
+    0.022935322010529224963732008058970,
+    0.063092092629978553290700663189204,
+    0.104790010322250183839876322541518,
+    0.140653259715525918745189590510238,
+    0.169004726639267902826583426598550,
+    0.190350578064785409913256402421014,
+    0.204432940075298892414161999234649,
+    0.209482141084727828012999174891714
+};
+
+static const double wg[4] = {
+    0.129484966168869693270611432679082,
+    0.279705391489276667901467771423780,
+    0.381830050505118944950369775488975,
+    0.417959183673469387755102040816327
+};
+
+static void eval_nodes(ColumnProgram* compiled, Interval* intervals, uint32_t n, Column* x, Column* fx);
+static void eval_node_chunk(void* ctx, uint64_t index);
+static void apply_rule(Interval* iv, double* f);
+static void heap_push(Interval* heap, uint32_t* size, Interval* item);
+static Interval heap_pop(Interval* heap, uint32_t* size);
+
+Token integrate_lambda(Lambda* f, Env* env, Token* lo, Token* hi)
+{
+    TokenStack* body;
+    ColumnProgram* compiled;
+    Column x;
+    Column fx;
+    Interval* heap;
+    Interval batch[2 * INTEGRATE_BATCH];
+    Failure failure;
+    bool caught;
+    uint32_t size;
+    uint32_t n;
+    uint32_t i;
+    double result;
+    double error;
+    double mid;
+    Token output;
+
+    output.type = TOK_DOUBLE;
+    output.as.f64 = 0.0;
+
+    if (token_to_double(lo) == token_to_double(hi)) {
+        return output;
+    }
+
+    /* Compile once, the only column left in the body is the parameter */
+    body = bind_constants(f->body, env, &f->param, 1);
+    if (has_free_variables(body, &f->param, 1)) {
+        free_token_stack(body);
+        fail(23, "'integrate' body uses an unbound variable.");
+    }
+
+    x.name = f->param;
+    x.type = TOK_DOUBLE;
+    compiled = compile_columns(body, &x, 1);
+
+    x.as.f64 = malloc(sizeof(double) * 2 * INTEGRATE_BATCH * GK_POINTS);
+    fx.as.f64 = malloc(sizeof(double) * 2 * INTEGRATE_BATCH * GK_POINTS);
+    heap = malloc(sizeof(Interval) * (integrate_config.max_intervals + 2 * INTEGRATE_BATCH + 1));
+    if (x.as.f64 == NULL || fx.as.f64 == NULL || heap == NULL) {
+        fprintf(stderr, "Failed to allocate quadrature buffers.\n");
+        exit(5);
+    }
+    fx.name = NULL;
+    fx.type = compiled->results[0];
+
+    /* A failure in the integrand, like an integer division by zero, frees the buffers on its way past */
+    caught = caught_failure() != NULL;
+    if (caught) {
+        catch_failures(&failure);
+        if (setjmp(failure.jump) != 0) {
+            free(x.as.f64);
+            free(fx.as.f64);
+            free(heap);
+            free_column_program(compiled);
+            free_token_stack(body);
+            pass_failure(&failure);
+        }
+    }
+
+    batch[0].a = token_to_double(lo);
+    batch[0].b = token_to_double(hi);
+    eval_nodes(compiled, batch, 1, &x, &fx);
+
+    size = 0;
+    heap_push(heap, &size, &batch[0]);
+    result = batch[0].result;
+    error = batch[0].error;
+
+    while (error > integrate_config.tolerance * MAX(1.0, fabs(result))) {
+        if (size + INTEGRATE_BATCH > integrate_config.max_intervals) {
+            fprintf(stderr, "'integrate' stopped at %u intervals, error estimate %g.\n", size, error);
+            break;
+        }
+
+        /* Bisect the worst intervals */
+        n = 0;
+        while (n < 2 * INTEGRATE_BATCH && size > 0) {
+            batch[n] = heap_pop(heap, &size);
+            result -= batch[n].result;
+            error -= batch[n].error;
+
+            mid = 0.5 * (batch[n].a + batch[n].b);
+            batch[n + 1].a = mid;
+            batch[n + 1].b = batch[n].b;
+            batch[n].b = mid;
+            n += 2;
+        }
+
+        eval_nodes(compiled, batch, n, &x, &fx);
+
+        for (i = 0; i < n; i++) {
+            result += batch[i].result;
+            error += batch[i].error;
+            heap_push(heap, &size, &batch[i]);
+        }
+
+        /* Re-add from scratch now and then, so rounding in the running sums can't stall us */
+        if (error <= integrate_config.tolerance * MAX(1.0, fabs(result))) {
+            result = 0.0;
+            error = 0.0;
+            for (i = 0; i < size; i++) {
+                result += heap[i].result;
+                error += heap[i].error;
+            }
+        }
+    }
+
+    output.as.f64 = result;
+
+    if (caught) {
+        release_failures(&failure);
+    }
+    free(x.as.f64);
+    free(fx.as.f64);
+    free(heap);
+    free_column_program(compiled);
+    free_token_stack(body);
+
+    return output;
+}
+
+/* Fills in 'result' and 'error' for 'n' intervals with one column evaluation */
+static void eval_nodes(ColumnProgram* compiled, Interval* intervals, uint32_t n, Column* x, Column* fx)
+{
+    NodeJob job;
+    double center;
+    double half;
+    double f[GK_POINTS];
+    uint32_t i;
+    uint32_t j;
+
+    for (i = 0; i < n; i++) {
+        center = 0.5 * (intervals[i].a + intervals[i].b);
+        half = 0.5 * (intervals[i].b - intervals[i].a);
+
+        for (j = 0; j < 7; j++) {
+            x->as.f64[i * GK_POINTS + 2 * j] = center - half * xgk[j];
+            x->as.f64[i * GK_POINTS + 2 * j + 1] = center + half * xgk[j];
+        }
+        x->as.f64[i * GK_POINTS + 14] = center;
+    }
+
+    job.compiled = compiled;
+    job.x = x;
+    job.fx = fx;
+    job.count = (uint64_t) n * GK_POINTS;
+
+    /* Row by row integrands are expensive enough to share out in smaller pieces */
+    job.chunk = compiled->per_row ? GK_POINTS : PARALLEL_POINTS;
+    parallel_for((job.count + job.chunk - 1) / job.chunk, eval_node_chunk, &job);
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < GK_POINTS; j++) {
+            f[j] = (fx->type == TOK_LONG) ? fx->as.i64[i * GK_POINTS + j] : fx->as.f64[i * GK_POINTS + j];
+        }
+        apply_rule(&intervals[i], f);
+    }
+}
+
+static void eval_node_chunk(void* ctx, uint64_t index)
+{
+    NodeJob* job;
+    Column x;
+    Column fx;
+    uint64_t begin;
+    uint64_t count;
+
+    job = ctx;
+    begin = index * job->chunk;
+    count = job->count - begin;
+    if (count > job->chunk) {
+        count = job->chunk;
+    }
+
+    x = *job->x;
+    x.as.f64 += begin;
+    fx = *job->fx;
+    fx.as.i64 += begin;
+
+    eval_columns(job->compiled, &x, begin, count, &fx);
+}
+
+/*
+    QK15 on one interval. 'f' holds f(c - h*xgk[j]), f(c + h*xgk[j]) pairs for
+    j = 0..6 followed by f(c).
+*/
+static void apply_rule(Interval* iv, double* f)
+{
+    double half;
+    double resg;
+    double resk;
+    double resabs;
+    double resasc;
+    double mean;
+    double err;
+    uint32_t j;
+
+    half = 0.5 * (iv->b - iv->a);
+
+    resg = f[14] * wg[3];
+    resk = f[14] * wgk[7];
+    resabs = fabs(resk);
+
+    for (j = 0; j < 7; j++) {
+        resk += wgk[j] * (f[2 * j] + f[2 * j + 1]);
+        resabs += wgk[j] * (fabs(f[2 * j]) + fabs(f[2 * j + 1]));
+        if (j % 2 == 1) {
+            resg += wg[j / 2] * (f[2 * j] + f[2 * j + 1]);
+        }
+    }
+
+    mean = resk * 0.5;
+    resasc = wgk[7] * fabs(f[14] - mean);
+    for (j = 0; j < 7; j++) {
+        resasc += wgk[j] * (fabs(f[2 * j] - mean) + fabs(f[2 * j + 1] - mean));
+    }
+
+    resasc *= fabs(half);
+    resabs *= fabs(half);
+    err = fabs((resk - resg) * half);
+
+    if (resasc != 0.0 && err != 0.0) {
+        err = resasc * MIN(1.0, pow(200.0 * err / resasc, 1.5));
+    }
+    if (resabs > 2.2250738585072014e-308 / (50.0 * 2.220446049250313e-16)) {
+        err = MAX(50.0 * 2.220446049250313e-16 * resabs, err);
+    }
+
+    iv->result = resk * half;
+    iv->error = err;
+}
+
+/* Max heap on 'error' */
+static void heap_push(Interval* heap, uint32_t* size, Interval* item)
+{
+    uint32_t i;
+    uint32_t parent;
+
+    i = (*size)++;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (heap[parent].error >= item->error) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = *item;
+}
+
+static Interval heap_pop(Interval* heap, uint32_t* size)
+{
+    Interval top;
+    Interval last;
+    uint32_t i;
+    uint32_t child;
+
+    top = heap[0];
+    last = heap[--(*size)];
+
+    i = 0;
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= *size) {
+            break;
+        }
+        if (child + 1 < *size && heap[child + 1].error > heap[child].error) {
+            child++;
+        }
+        if (last.error >= heap[child].error) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+
+    return top;
+}
@@ -0,0 +1,34 @@
+#ifndef CALC_INTEGRATE_H
+#define CALC_INTEGRATE_H
+
+#include <stdint.h>
+
+#include "token.h"
+#include "eval.h"
+
+/*
+    integrate(expr, x, a, b) with globally adaptive 15 point Gauss-Kronrod
+    quadrature (QUADPACK's QK15 rule and error estimate).
+
+    Each round bisects the INTEGRATE_BATCH intervals with the largest error
+    estimates, and evaluates all 2 * 15 * INTEGRATE_BATCH new nodes as a single
+    column through the vectorized evaluator, split over threads when that is
+    worth it. Variables other than x are folded into the expression as constants
+    once, up front.
+
+    Stops when the summed error estimate is within 'tolerance' relative to the
+    result (or absolute below 1), or after 'max_intervals' intervals.
+*/
+
+#define INTEGRATE_BATCH 32
+
+typedef struct {
+    double tolerance;
+    uint32_t max_intervals;
+} IntegrateConfig;
+
+extern IntegrateConfig integrate_config;
+
+Token integrate_lambda(Lambda* f, Env* env, Token* lo, Token* hi);
+
+#endif
@@ -0,0 +1,798 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "model.h"
+#include "scanner.h"
+#include "parser.h"
+#include "parallel.h"
+#include "bigint.h"
+#include "array.h"
+#include "text.h"
+#include "budget.h"
+#include "fail.h"
+#include "rng.h"
+
+#define INITIAL_MODEL_CELLS 64
+#define INITIAL_MODEL_SLOTS 128
+#define INITIAL_LIST_CAPACITY 4
+#define MODEL_GROWTH_FACTOR 2
+
+typedef struct {
+    Model* model;
+    uint32_t* batch;
+} LevelJob;
+
+static uint32_t find_cell(Model* model, char* name, uint32_t length);
+static uint32_t hash_name(char* name, uint32_t length);
+static void grow_slots(Model* model);
+static bool is_plain_name(char* name, uint32_t length);
+static TokenStack* compile_formula(char* source);
+static void collect_references(Model* model, TokenStack* program, char** bound, uint32_t n_bound, CellList* refs);
+static bool reaches(Model* model, uint32_t from, uint32_t target);
+static void set_level(Model* model, uint32_t index, uint32_t level);
+static void grow_levels(Model* model, uint32_t level);
+static void schedule(Model* model, uint32_t index);
+static void eval_level(void* ctx, uint64_t index);
+static void eval_cell(Model* model, Cell* cell);
+static bool same_value(Token* a, Token* b);
+static void print_cell(Cell* cell, FILE* out);
+static void push_list(CellList* list, uint32_t item);
+static void remove_list(CellList* list, uint32_t item);
+static bool read_line(FILE* in, char** line, uint32_t* capacity);
+
+Model* alloc_model()
+{
+    Model* output;
+
+    if ((output = malloc(sizeof(Model))) == NULL) {
+        fprintf(stderr, "Failed to allocate model.\n");
+        exit(5);
+    }
+
+    output->size = 0;
+    output->capacity = INITIAL_MODEL_CELLS;
+    output->n_slots = INITIAL_MODEL_SLOTS;
+    output->cells = malloc(sizeof(Cell) * output->capacity);
+    output->slots = calloc(output->n_slots, sizeof(uint32_t));
+    if (output->cells == NULL || output->slots == NULL) {
+        fprintf(stderr, "Failed to allocate model.\n");
+        exit(5);
+    }
+
+    output->pending.items = NULL;
+    output->pending.size = 0;
+    output->pending.capacity = 0;
+    output->levels = NULL;
+    output->n_levels = 0;
+    output->epoch = 0;
+
+    return output;
+}
+
+void free_model(Model* target)
+{
+    uint32_t i;
+    Cell* cell;
+
+    for (i = 0; i < target->size; i++) {
+        cell = &target->cells[i];
+        free(cell->name);
+        if (cell->program != NULL) {
+            free_token_stack(cell->program);
+            free_env(cell->env);
+            free(cell->deps);
+        }
+        free(cell->dependents.items);
+        scrub_token(&cell->value);
+    }
+    for (i = 0; i < target->n_levels; i++) {
+        free(target->levels[i].items);
+    }
+
+    free(target->levels);
+    free(target->pending.items);
+    free(target->slots);
+    free(target->cells);
+    free(target);
+}
+
+bool define_cell(Model* model, char* line)
+{
+    TokenStack* program;
+    CellList refs;
+    Cell* cell;
+    Token zero;
+    char* name;
+    char* eq;
+    uint32_t length;
+    uint32_t index;
+    uint32_t level;
+    uint32_t i;
+
+    name = line;
+    while (isspace(*name)) {
+        name++;
+    }
+    length = 0;
+    while (isalnum(name[length]) || name[length] == '_') {
+        length++;
+    }
+    eq = name + length;
+    while (isspace(*eq)) {
+        eq++;
+    }
+
+    if (length == 0 || isdigit(*name) || *eq != '=' || !is_plain_name(name, length)) {
+        fprintf(stderr, "Bad definition '%s', expected name = expr.\n", line);
+        exit(31);
+    }
+
+    if ((program = compile_formula(eq + 1)) == NULL) {
+        return false;
+    }
+    index = find_cell(model, name, length);
+
+    refs.items = NULL;
+    refs.size = 0;
+    refs.capacity = 0;
+    collect_references(model, program, NULL, 0, &refs);
+
+    /* 'find_cell()' may have moved the cells */
+    cell = &model->cells[index];
+
+    for (i = 0; i < refs.size; i++) {
+        if (reaches(model, refs.items[i], index)) {
+            fprintf(stderr, "'%s' would depend on itself.\n", cell->name);
+            free(refs.items);
+            free_token_stack(program);
+            return false;
+        }
+    }
+
+    /* Unhook the old formula */
+    if (cell->program != NULL) {
+        for (i = 0; i < cell->n_deps; i++) {
+            remove_list(&model->cells[cell->deps[i]].dependents, index);
+        }
+        free_token_stack(cell->program);
+        free_env(cell->env);
+        free(cell->deps);
+    }
+
+    cell->program = program;
+    cell->deps = refs.items;
+    cell->n_deps = refs.size;
+    cell->env = alloc_env(NULL);
+
+    zero.type = TOK_LONG;
+    zero.as.i64 = 0;
+    level = 0;
+    for (i = 0; i < cell->n_deps; i++) {
+        push_list(&model->cells[cell->deps[i]].dependents, index);
+        bind_variable(cell->env, model->cells[cell->deps[i]].name, &zero);
+        if (model->cells[cell->deps[i]].level + 1 > level) {
+            level = model->cells[cell->deps[i]].level + 1;
+        }
+    }
+
+    set_level(model, index, level);
+    schedule(model, index);
+
+    return true;
+}
+
+void recompute_model(Model* model, CellList* changed)
+{
+    LevelJob job;
+    CellList* bucket;
+    Cell* cell;
+    uint32_t remaining;
+    uint32_t level;
+    uint32_t i;
+    uint32_t j;
+
+    /* Levels are only settled once all the definitions are in */
+    remaining = 0;
+    level = 0xFFFFFFFF;
+    for (i = 0; i < model->pending.size; i++) {
+        cell = &model->cells[model->pending.items[i]];
+        push_list(&model->levels[cell->level], model->pending.items[i]);
+        if (cell->level < level) {
+            level = cell->level;
+        }
+        remaining++;
+    }
+    model->pending.size = 0;
+
+    job.model = model;
+    for (; remaining > 0; level++) {
+        bucket = &model->levels[level];
+        if (bucket->size == 0) {
+            continue;
+        }
+
+        job.batch = bucket->items;
+        if (bucket->size >= MODEL_PARALLEL_CELLS) {
+            parallel_for(bucket->size, eval_level, &job);
+        } else {
+            for (i = 0; i < bucket->size; i++) {
+                eval_level(&job, i);
+            }
+        }
+
+        /* Dependents always sit on a higher level, so this never touches 'bucket' */
+        for (i = 0; i < bucket->size; i++) {
+            cell = &model->cells[bucket->items[i]];
+            cell->queued = false;
+            if (!cell->changed) {
+                continue;
+            }
+
+            if (cell->program != NULL) {
+                push_list(changed, bucket->items[i]);
+            }
+            for (j = 0; j < cell->dependents.size; j++) {
+                if (!model->cells[cell->dependents.items[j]].queued) {
+                    model->cells[cell->dependents.items[j]].queued = true;
+                    push_list(&model->levels[model->cells[cell->dependents.items[j]].level],
+                        cell->dependents.items[j]);
+                    remaining++;
+                }
+            }
+        }
+
+        remaining -= bucket->size;
+        bucket->size = 0;
+    }
+}
+
+void run_model(char* path, FILE* in, FILE* out)
+{
+    Model* model;
+    CellList changed;
+    FILE* file;
+    char* line;
+    char* pos;
+    uint32_t capacity;
+    uint32_t index;
+    uint32_t length;
+    uint32_t i;
+
+    if ((file = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "Failed to open model '%s'.\n", path);
+        exit(31);
+    }
+
+    model = alloc_model();
+    changed.items = NULL;
+    changed.size = 0;
+    changed.capacity = 0;
+
+    capacity = MODEL_LINE_LENGTH;
+    if ((line = malloc(capacity)) == NULL) {
+        fprintf(stderr, "Failed to allocate model line.\n");
+        exit(5);
+    }
+
+    while (read_line(file, &line, &capacity)) {
+        pos = line;
+        while (isspace(*pos)) {
+            pos++;
+        }
+        if (*pos == '\0' || *pos == '#') {
+            continue;
+        }
+
+        if (!define_cell(model, line)) {
+            exit(31);
+        }
+    }
+    fclose(file);
+
+    recompute_model(model, &changed);
+    for (i = 0; i < model->size; i++) {
+        if (model->cells[i].program != NULL) {
+            print_cell(&model->cells[i], out);
+        }
+    }
+    fflush(out);
+
+    while (read_line(in, &line, &capacity)) {
+        pos = line;
+        while (isspace(*pos)) {
+            pos++;
+        }
+        if (*pos == '\0' || *pos == '#') {
+            continue;
+        }
+
+        if (strchr(pos, '=') == NULL) {
+            length = 0;
+            while (pos[length] != '\0' && !isspace(pos[length])) {
+                length++;
+            }
+            index = find_cell(model, pos, length);
+            print_cell(&model->cells[index], out);
+        } else if (define_cell(model, pos)) {
+            changed.size = 0;
+            recompute_model(model, &changed);
+            for (i = 0; i < changed.size; i++) {
+                print_cell(&model->cells[changed.items[i]], out);
+            }
+        }
+        fflush(out);
+    }
+
+    free(line);
+    free(changed.items);
+    free_model(model);
+}
+
+/* Index of the cell called 'name', adding an undefined one if there is none */
+static uint32_t find_cell(Model* model, char* name, uint32_t length)
+{
+    uint32_t slot;
+    uint32_t index;
+    Cell* cell;
+
+    slot = hash_name(name, length) & (model->n_slots - 1);
+    while (model->slots[slot] != 0) {
+        cell = &model->cells[model->slots[slot] - 1];
+        if (strncmp(cell->name, name, length) == 0 && cell->name[length] == '\0') {
+            return model->slots[slot] - 1;
+        }
+        slot = (slot + 1) & (model->n_slots - 1);
+    }
+
+    if (model->size == model->capacity) {
+        model->capacity *= MODEL_GROWTH_FACTOR;
+        if ((model->cells = realloc(model->cells, sizeof(Cell) * model->capacity)) == NULL) {
+            fprintf(stderr, "Failed to grow model.\n");
+            exit(5);
+        }
+    }
+
+    index = model->size++;
+    cell = &model->cells[index];
+    if ((cell->name = malloc(length + 1)) == NULL) {
+        fprintf(stderr, "Failed to allocate cell.\n");
+        exit(5);
+    }
+    memcpy(cell->name, name, length);
+    cell->name[length] = '\0';
+
+    cell->program = NULL;
+    cell->env = NULL;
+    cell->deps = NULL;
+    cell->n_deps = 0;
+    cell->dependents.items = NULL;
+    cell->dependents.size = 0;
+    cell->dependents.capacity = 0;
+    cell->level = 0;
+    cell->mark = 0;
+    cell->value.type = TOK_LONG;
+    cell->value.as.i64 = 0;
+    cell->valid = false;
+    cell->queued = false;
+    cell->changed = false;
+
+    model->slots[slot] = index + 1;
+    if (model->size * 2 > model->n_slots) {
+        grow_slots(model);
+    }
+
+    return index;
+}
+
+/* FNV-1a */
+static uint32_t hash_name(char* name, uint32_t length)
+{
+    uint32_t hash;
+    uint32_t i;
+
+    hash = 2166136261u;
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static void grow_slots(Model* model)
+{
+    uint32_t slot;
+    uint32_t i;
+
+    free(model->slots);
+    model->n_slots *= MODEL_GROWTH_FACTOR;
+    if ((model->slots = calloc(model->n_slots, sizeof(uint32_t))) == NULL) {
+        fprintf(stderr, "Failed to grow model.\n");
+        exit(5);
+    }
+
+    for (i = 0; i < model->size; i++) {
+        slot = hash_name(model->cells[i].name, strlen(model->cells[i].name)) & (model->n_slots - 1);
+        while (model->slots[slot] != 0) {
+            slot = (slot + 1) & (model->n_slots - 1);
+        }
+        model->slots[slot] = i + 1;
+    }
+}
+
+/* Not one of the scanner's reserved words */
+static bool is_plain_name(char* name, uint32_t length)
+{
+    Token tok;
+    char saved;
+
+    saved = name[length];
+    name[length] = '\0';
+
+    init_scanner(name);
+    next_token(&tok);
+    cleanup_scanner();
+
+    name[length] = saved;
+    scrub_token(&tok);
+
+    return tok.type == TOK_IDENTIFIER;
+}
+
+/*
+    Runs the formula through the usual scanner and parser and keeps its own copy,
+    NULL if it is over the limits.
+*/
+static TokenStack* compile_formula(char* source)
+{
+    TokenStack* output;
+    Budget budget;
+
+    init_scanner(source);
+    init_parser();
+    start_budget(&budget);
+    if (!parse_expr(&budget)) {
+        fprintf(stderr, "'%s' exceeded the %s limit.\n", source, budget.exceeded);
+        cleanup_parser();
+        cleanup_scanner();
+        return NULL;
+    }
+
+    output = copy_token_stack(get_output_stack());
+    if (count_outputs(output) > 1) {
+        fprintf(stderr, "A cell holds a single value, not '%s'.\n", source);
+        exit(31);
+    }
+
+    cleanup_parser();
+    cleanup_scanner();
+
+    return output;
+}
+
+/* Every cell the program reads, once each, ignoring lambda parameters */
+static void collect_references(Model* model, TokenStack* program, char** bound, uint32_t n_bound, CellList* refs)
+{
+    char** inner;
+    uint32_t index;
+    uint64_t ip;
+    uint32_t i;
+    Token* tok;
+
+    for (ip = 0; ip < program->size; ip++) {
+        tok = &program->base[ip];
+
+        if (tok->type == TOK_IDENTIFIER) {
+            for (i = 0; i < n_bound; i++) {
+                if (strcmp(bound[i], tok->as.string) == 0) {
+                    break;
+                }
+            }
+            if (i < n_bound) {
+                continue;
+            }
+
+            index = find_cell(model, tok->as.string, strlen(tok->as.string));
+            for (i = 0; i < refs->size; i++) {
+                if (refs->items[i] == index) {
+                    break;
+                }
+            }
+            if (i == refs->size) {
+                push_list(refs, index);
+            }
+        } else if (IS_HIGHER_ORDER(tok->type)) {
+            if ((inner = malloc(sizeof(char*) * (n_bound + 1))) == NULL) {
+                fprintf(stderr, "Failed to allocate scope.\n");
+                exit(5);
+            }
+            for (i = 0; i < n_bound; i++) {
+                inner[i] = bound[i];
+            }
+            inner[n_bound] = tok->as.lambda->param;
+
+            collect_references(model, tok->as.lambda->body, inner, n_bound + 1, refs);
+            free(inner);
+        }
+    }
+}
+
+/* Whether 'target' is 'from' or something 'from' reads, directly or not */
+static bool reaches(Model* model, uint32_t from, uint32_t target)
+{
+    CellList stack;
+    Cell* cell;
+    uint32_t i;
+    bool found;
+
+    model->epoch++;
+    stack.items = NULL;
+    stack.size = 0;
+    stack.capacity = 0;
+    push_list(&stack, from);
+    model->cells[from].mark = model->epoch;
+
+    found = false;
+    while (stack.size > 0 && !found) {
+        cell = &model->cells[stack.items[--stack.size]];
+        if (cell == &model->cells[target]) {
+            found = true;
+            break;
+        }
+
+        for (i = 0; i < cell->n_deps; i++) {
+            if (model->cells[cell->deps[i]].mark != model->epoch) {
+                model->cells[cell->deps[i]].mark = model->epoch;
+                push_list(&stack, cell->deps[i]);
+            }
+        }
+    }
+
+    free(stack.items);
+
+    return found;
+}
+
+/*
+    Gives a freshly defined cell its exact level, then pushes up whatever depends
+    on it. Dependents are never pulled down: a level that is higher than it has to
+    be is still a valid order, and lowering it means looking at all of its inputs.
+*/
+static void set_level(Model* model, uint32_t index, uint32_t level)
+{
+    CellList stack;
+    Cell* cell;
+    Cell* next;
+    uint32_t i;
+
+    model->cells[index].level = level;
+    grow_levels(model, level);
+
+    stack.items = NULL;
+    stack.size = 0;
+    stack.capacity = 0;
+    push_list(&stack, index);
+
+    while (stack.size > 0) {
+        cell = &model->cells[stack.items[--stack.size]];
+        for (i = 0; i < cell->dependents.size; i++) {
+            next = &model->cells[cell->dependents.items[i]];
+            if (next->level <= cell->level) {
+                next->level = cell->level + 1;
+                grow_levels(model, next->level);
+                push_list(&stack, cell->dependents.items[i]);
+            }
+        }
+    }
+
+    free(stack.items);
+}
+
+static void grow_levels(Model* model, uint32_t level)
+{
+    uint32_t count;
+
+    if (level < model->n_levels) {
+        return;
+    }
+
+    count = (model->n_levels == 0) ? INITIAL_MODEL_CELLS : model->n_levels;
+    while (count <= level) {
+        count *= MODEL_GROWTH_FACTOR;
+    }
+
+    if ((model->levels = realloc(model->levels, sizeof(CellList) * count)) == NULL) {
+        fprintf(stderr, "Failed to grow model.\n");
+        exit(5);
+    }
+    for (; model->n_levels < count; model->n_levels++) {
+        model->levels[model->n_levels].items = NULL;
+        model->levels[model->n_levels].size = 0;
+        model->levels[model->n_levels].capacity = 0;
+    }
+}
+
+static void schedule(Model* model, uint32_t index)
+{
+    if (!model->cells[index].queued) {
+        model->cells[index].queued = true;
+        push_list(&model->pending, index);
+    }
+}
+
+static void eval_level(void* ctx, uint64_t index)
+{
+    LevelJob* job;
+
+    job = ctx;
+    eval_cell(job->model, &job->model->cells[job->batch[index]]);
+}
+
+static void eval_cell(Model* model, Cell* cell)
+{
+    Token value;
+    Budget budget;
+    RngStream rng;
+    Failure failure;
+    Cell* dep;
+    bool valid;
+    uint32_t i;
+
+    valid = cell->program != NULL;
+    for (i = 0; i < cell->n_deps && valid; i++) {
+        dep = &model->cells[cell->deps[i]];
+        if (!dep->valid) {
+            valid = false;
+            break;
+        }
+        scrub_token(&cell->env->bindings[i].value);
+        cell->env->bindings[i].value = copy_token(&dep->value);
+    }
+
+    if (!valid) {
+        cell->changed = cell->valid;
+        cell->valid = false;
+        return;
+    }
+
+    /* Every evaluation gets a budget of its own, and every cell a stream for rand() */
+    start_budget(&budget);
+    rng.stream = cell - model->cells;
+    rng.draws = 0;
+    cell->env->budget = &budget;
+    cell->env->rng = &rng;
+
+    /* A division by zero and the like only takes this cell down */
+    catch_failures(&failure);
+    if (setjmp(failure.jump) == 0) {
+        value = eval_program(cell->program, cell->env);
+    }
+    release_failures(&failure);
+    cell->env->budget = NULL;
+    cell->env->rng = NULL;
+
+    if (failure.message[0] != '\0' || budget.failed[0] != '\0') {
+        fprintf(stderr, "'%s': %s\n", cell->name, (budget.failed[0] != '\0') ? budget.failed : failure.message);
+        if (failure.message[0] == '\0') {
+            scrub_token(&value);
+        }
+        cell->changed = cell->valid;
+        cell->valid = false;
+        return;
+    }
+    if (budget.exceeded != NULL) {
+        fprintf(stderr, "'%s' exceeded the %s limit.\n", cell->name, budget.exceeded);
+        scrub_token(&value);
+        cell->changed = cell->valid;
+        cell->valid = false;
+        return;
+    }
+
+    cell->changed = !cell->valid || !same_value(&value, &cell->value);
+    cell->valid = true;
+
+    scrub_token(&cell->value);
+    cell->value = value;
+}
+
+static bool same_value(Token* a, Token* b)
+{
+    if (a->type != b->type) {
+        return false;
+    }
+
+    switch (a->type) {
+        case TOK_LONG: {
+            return a->as.i64 == b->as.i64;
+        }
+        case TOK_BIGINT: {
+            return big_compare(a->as.big, b->as.big) == 0;
+        }
+        case TOK_ARRAY: {
+            return array_equal(a->as.array, b->as.array);
+        }
+        case TOK_STRING:
+        case TOK_SHORT_STRING: {
+            return compare_strings(a, b) == 0;
+        }
+        default: {
+            return a->as.f64 == b->as.f64;
+        }
+    }
+}
+
+static void print_cell(Cell* cell, FILE* out)
+{
+    char* text;
+
+    if (!cell->valid) {
+        fprintf(out, "%s = undefined\n", cell->name);
+    } else if (cell->value.type == TOK_LONG) {
+        fprintf(out, "%s = %ld\n", cell->name, cell->value.as.i64);
+    } else if (cell->value.type == TOK_BIGINT) {
+        text = big_to_string(cell->value.as.big);
+        fprintf(out, "%s = %s\n", cell->name, text);
+        free(text);
+    } else if (IS_STRING((&cell->value))) {
+        fprintf(out, "%s = %s\n", cell->name, string_bytes(&cell->value));
+    } else if (cell->value.type == TOK_ARRAY) {
+        text = array_to_string(cell->value.as.array);
+        fprintf(out, "%s = %s\n", cell->name, text);
+        free(text);
+    } else {
+        fprintf(out, "%s = %f\n", cell->name, cell->value.as.f64);
+    }
+}
+
+static void push_list(CellList* list, uint32_t item)
+{
+    if (list->size == list->capacity) {
+        list->capacity = (list->capacity == 0) ? INITIAL_LIST_CAPACITY : list->capacity * MODEL_GROWTH_FACTOR;
+        if ((list->items = realloc(list->items, sizeof(uint32_t) * list->capacity)) == NULL) {
+            fprintf(stderr, "Failed to grow cell list.\n");
+            exit(5);
+        }
+    }
+
+    list->items[list->size++] = item;
+}
+
+static void remove_list(CellList* list, uint32_t item)
+{
+    uint32_t i;
+
+    for (i = 0; i < list->size; i++) {
+        if (list->items[i] == item) {
+            list->items[i] = list->items[--list->size];
+            return;
+        }
+    }
+}
+
+/* Reads the next line into '*line' without its '\n', growing it to fit, false at the end of 'in' */
+static bool read_line(FILE* in, char** line, uint32_t* capacity)
+{
+    size_t length;
+
+    if (fgets(*line, *capacity, in) == NULL) {
+        return false;
+    }
+
+    length = strlen(*line);
+    while (length == *capacity - 1 && (*line)[length - 1] != '\n') {
+        *capacity *= MODEL_GROWTH_FACTOR;
+        if ((*line = realloc(*line, *capacity)) == NULL) {
+            fprintf(stderr, "Failed to grow model line.\n");
+            exit(5);
+        }
+        if (fgets(*line + length, *capacity - length, in) == NULL) {
+            break;
+        }
+        length += strlen(*line + length);
+    }
+    (*line)[strcspn(*line, "\n")] = '\0';
+
+    return true;
+}
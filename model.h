@@ -0,0 +1,93 @@
+#ifndef CALC_MODEL_H
+#define CALC_MODEL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "token.h"
+#include "eval.h"
+
+/*
+    A spreadsheet of named formulas, one 'name = expr' per line. Formulas can
+    reference each other by name in any order, as long as there are no cycles.
+
+    Every cell keeps the cells it reads and the cells that read it, plus a level
+    that is always greater than the level of anything it reads. Changing a cell
+    only recomputes what depends on it, one level at a time in increasing order,
+    so all the cells of a level can be evaluated at once. A cell whose value did
+    not change does not wake up its dependents.
+*/
+
+/* Starting size of the line buffer, which grows to fit longer lines */
+#define MODEL_LINE_LENGTH 4096
+
+/* Smallest level worth handing to the thread pool */
+#define MODEL_PARALLEL_CELLS 64
+
+typedef struct {
+    uint32_t* items;
+    uint32_t size;
+    uint32_t capacity;
+} CellList;
+
+typedef struct {
+    char* name;
+
+    /* NULL while the cell is only referenced, never defined */
+    TokenStack* program;
+
+    /* Binding i is the current value of 'deps[i]' */
+    Env* env;
+    uint32_t* deps;
+    uint32_t n_deps;
+    CellList dependents;
+
+    uint32_t level;
+    uint32_t mark;
+
+    /* 'valid' is false when the cell, or something it reads, is undefined */
+    Token value;
+    bool valid;
+    bool queued;
+    bool changed;
+} Cell;
+
+typedef struct {
+    Cell* cells;
+    uint32_t size;
+    uint32_t capacity;
+
+    /* Open addressing, cell index + 1 with 0 for an empty slot */
+    uint32_t* slots;
+    uint32_t n_slots;
+
+    /* Cells waiting to be recomputed, by level */
+    CellList pending;
+    CellList* levels;
+    uint32_t n_levels;
+
+    uint32_t epoch;
+} Model;
+
+Model* alloc_model();
+void free_model(Model* target);
+
+/*
+    Parses a 'name = expr' line and (re)defines the cell, scheduling it to be
+    recomputed. Returns false, leaving the model untouched, if it would create
+    a cycle or the formula is over the limits in budget.h.
+*/
+bool define_cell(Model* model, char* line);
+
+/* Recomputes everything scheduled since the last call, 'changed' lists what moved */
+void recompute_model(Model* model, CellList* changed);
+
+/*
+    Loads the model in 'path' and prints every cell, then reads 'name = expr'
+    updates from 'in' and prints the cells each one changed. A bare name
+    prints that cell.
+*/
+void run_model(char* path, FILE* in, FILE* out);
+
+#endif
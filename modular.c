@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "modular.h"
+#include "fail.h"
+
+/* GCC's 128 bit integer, '__extension__' keeps -pedantic quiet about it */
+__extension__ typedef unsigned __int128 uint128_t;
+
+static uint64_t redc(Montgomery* ctx, uint128_t t);
+static uint64_t mulmod(uint64_t a, uint64_t b, uint64_t modulus);
+
+void init_montgomery(Montgomery* ctx, uint64_t modulus)
+{
+    uint64_t inverse;
+    int i;
+
+    /* Newton's iteration doubles the correct low bits, an odd x is its own inverse mod 8 */
+    inverse = modulus;
+    for (i = 0; i < 5; i++) {
+        inverse *= 2 - modulus * inverse;
+    }
+
+    ctx->modulus = modulus;
+    ctx->inverse = inverse;
+    ctx->one = (0 - modulus) % modulus;
+    ctx->r2 = (uint128_t) ctx->one * ctx->one % modulus;
+}
+
+uint64_t montgomery_pow(Montgomery* ctx, uint64_t base, uint64_t exponent)
+{
+    uint64_t result;
+    uint64_t square;
+
+    result = ctx->one;
+    square = redc(ctx, (uint128_t) (base % ctx->modulus) * ctx->r2);
+
+    while (exponent > 0) {
+        if (exponent & 1) {
+            result = redc(ctx, (uint128_t) result * square);
+        }
+        exponent >>= 1;
+        square = redc(ctx, (uint128_t) square * square);
+    }
+
+    return redc(ctx, result);
+}
+
+int64_t powmod_i64(Montgomery* ctx, int64_t base, int64_t exponent, int64_t modulus)
+{
+    uint64_t m;
+    uint64_t b;
+    uint64_t result;
+    uint64_t e;
+
+    if (modulus == 0) {
+        fail(9, "Division by zero.");
+    }
+    if (exponent < 0) {
+        fail(9, "powmod() needs an exponent of at least 0.");
+    }
+
+    /* Unsigned negation, so that INT64_MIN works too */
+    m = (modulus < 0) ? 0 - (uint64_t) modulus : (uint64_t) modulus;
+    b = (base < 0) ? 0 - (uint64_t) base : (uint64_t) base;
+    b %= m;
+    if (base < 0 && b != 0) {
+        b = m - b;
+    }
+    e = exponent;
+
+    if (m == 1) {
+        return 0;
+    }
+
+    if (m & 1) {
+        if (ctx->modulus != m) {
+            init_montgomery(ctx, m);
+        }
+        return montgomery_pow(ctx, b, e);
+    }
+
+    result = 1;
+    while (e > 0) {
+        if (e & 1) {
+            result = mulmod(result, b, m);
+        }
+        e >>= 1;
+        b = mulmod(b, b, m);
+    }
+
+    return result;
+}
+
+/* t * 2^-64 mod modulus, for any t < modulus * 2^64 */
+static uint64_t redc(Montgomery* ctx, uint128_t t)
+{
+    uint64_t high;
+    uint64_t q;
+    uint64_t qm_high;
+
+    /* t - q * modulus has 64 low zero bits, so only the high halves matter */
+    q = (uint64_t) t * ctx->inverse;
+    high = t >> 64;
+    qm_high = ((uint128_t) q * ctx->modulus) >> 64;
+
+    return (high < qm_high) ? high - qm_high + ctx->modulus : high - qm_high;
+}
+
+static uint64_t mulmod(uint64_t a, uint64_t b, uint64_t modulus)
+{
+    return (uint128_t) a * b % modulus;
+}
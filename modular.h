@@ -0,0 +1,36 @@
+#ifndef CALC_MODULAR_H
+#define CALC_MODULAR_H
+
+#include <stdint.h>
+
+/*
+    Modular exponentiation on 64 bit integers, behind the 'powmod(b, e, m)'
+    builtin. Odd moduli work in Montgomery form so that every step of the
+    square and multiply ladder is two multiplications and no division, even
+    moduli fall back to a 128 bit product and a '%'.
+
+    Results are always in [0, |m|), whatever the sign of the base.
+*/
+
+typedef struct Montgomery {
+    uint64_t modulus;
+
+    /* modulus^-1 mod 2^64 */
+    uint64_t inverse;
+
+    /* 2^64 and 2^128 mod modulus, i.e. 1 and R in Montgomery form */
+    uint64_t one;
+    uint64_t r2;
+} Montgomery;
+
+/* 'modulus' must be odd */
+void init_montgomery(Montgomery* ctx, uint64_t modulus);
+uint64_t montgomery_pow(Montgomery* ctx, uint64_t base, uint64_t exponent);
+
+/*
+    'ctx' is a cache that is only set up again when 'modulus' changes, start it
+    zeroed. Exits on a zero modulus or a negative exponent.
+*/
+int64_t powmod_i64(Montgomery* ctx, int64_t base, int64_t exponent, int64_t modulus);
+
+#endif
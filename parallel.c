@@ -0,0 +1,143 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "parallel.h"
+#include "fail.h"
+#include "profile.h"
+
+#define MAX_THREADS 256
+
+typedef struct {
+    ParallelTask task;
+    void* ctx;
+    uint64_t count;
+    uint64_t first;
+    uint64_t stride;
+} Worker;
+
+static void* run_worker(void* arg);
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set while a pool is running, nested calls run inline instead of spawning more */
+static bool pool_busy = false;
+
+uint32_t get_thread_count()
+{
+    static uint32_t thread_count = 0;
+    char* env;
+    long n;
+
+    if (thread_count != 0) {
+        return thread_count;
+    }
+
+    n = 0;
+    if ((env = getenv("CALC_THREADS")) != NULL) {
+        n = atol(env);
+    }
+    if (n <= 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (n <= 0) {
+        n = 1;
+    }
+    if (n > MAX_THREADS) {
+        n = MAX_THREADS;
+    }
+
+    thread_count = n;
+    return thread_count;
+}
+
+void parallel_for(uint64_t count, ParallelTask task, void* ctx)
+{
+    pthread_t threads[MAX_THREADS];
+    Worker workers[MAX_THREADS];
+    Failure* held;
+    ProfileNesting nesting;
+    uint32_t n;
+    uint32_t i;
+
+    n = get_thread_count();
+    if (n > count) {
+        n = count;
+    }
+
+    parallel_lock();
+    if (pool_busy) {
+        n = (count > 0) ? 1 : 0;
+    } else if (n > 1) {
+        pool_busy = true;
+    }
+    parallel_unlock();
+
+    for (i = 0; i < n; i++) {
+        workers[i].task = task;
+        workers[i].ctx = ctx;
+        workers[i].count = count;
+        workers[i].first = i;
+        workers[i].stride = n;
+    }
+
+    /* Not worth a thread, the caller does the work */
+    if (n <= 1) {
+        if (n == 1) {
+            run_worker(&workers[0]);
+        }
+        return;
+    }
+
+    /* Nothing could catch a failure halfway through the pool, see 'hold_failures()' */
+    held = hold_failures();
+    enter_profile_nesting(&nesting);
+
+    /* Thread 0 is the caller itself */
+    for (i = 1; i < n; i++) {
+        if (pthread_create(&threads[i], NULL, run_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to start worker thread.\n");
+            exit(26);
+        }
+    }
+
+    run_worker(&workers[0]);
+
+    for (i = 1; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    parallel_lock();
+    pool_busy = false;
+    parallel_unlock();
+
+    leave_profile_nesting(&nesting);
+    resume_failures(held);
+}
+
+void parallel_lock()
+{
+    pthread_mutex_lock(&shared_lock);
+}
+
+void parallel_unlock()
+{
+    pthread_mutex_unlock(&shared_lock);
+}
+
+static void* run_worker(void* arg)
+{
+    Worker* worker;
+    uint64_t index;
+
+    worker = arg;
+    for (index = worker->first; index < worker->count; index += worker->stride) {
+        worker->task(worker->ctx, index);
+    }
+
+    return NULL;
+}
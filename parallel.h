@@ -0,0 +1,23 @@
+#ifndef CALC_PARALLEL_H
+#define CALC_PARALLEL_H
+
+#include <stdint.h>
+
+/*
+    Runs 'task(ctx, index)' for every index in [0, count) on a pool of threads.
+    Indices are dealt out round robin, so which thread runs which index is fixed
+    for a given thread count. Tasks must only write to memory owned by their index.
+    The thread count comes from $CALC_THREADS, or the number of online cores.
+    Calls made while a pool is already running just run on the calling thread.
+*/
+
+typedef void (*ParallelTask)(void* ctx, uint64_t index);
+
+uint32_t get_thread_count();
+void parallel_for(uint64_t count, ParallelTask task, void* ctx);
+
+/* One global lock, for the odd counter that tasks share */
+void parallel_lock();
+void parallel_unlock();
+
+#endif
@@ -1,25 +1,76 @@
 #include <stdlib.h>
 #include <stdio.h>
-#include <assert.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <limits.h>
 
 #include "scanner.h"
 #include "token.h"
 #include "parser.h"
+#include "ast.h"
+#include "function.h"
+#include "array.h"
+#include "budget.h"
+#include "builtin.h"
+
+/* Deepest nesting of parentheses, calls and pending operators */
+#define MAX_NESTING_DEPTH 1024
+
+/* Errors reported before giving up on the rest of the input */
+#define MAX_SYNTAX_ERRORS 8
+
+/* Characters of source shown on either side of an error */
+#define ERROR_CONTEXT 40
+
+/* 'parse_binary()' takes every operator */
+#define ANY_PRECEDENCE INT_MIN
 
-TokenStack* operator_stack = NULL;
 TokenStack* output_stack = NULL;
+static Ast ast;
 
-Token t = DEFAULT_TOKEN;
+uint32_t parse_list(uint32_t* first);
+uint32_t parse_binary(int min_precedence);
+uint32_t parse_unary();
+uint32_t parse_primary();
+uint32_t parse_arguments(TokenType closer, uint32_t* first);
+uint32_t error_node(uint32_t position);
+static bool gives_string(uint32_t node);
+void parse_definition(uint32_t lhs);
+static void advance();
+static void scan_lookahead();
+static bool enter();
+static void stop(char* what);
+static void synchronize();
+void syntax_error(uint32_t position, char* format, ...);
+void lower_nodes(uint32_t start, uint32_t end);
+void emit_operator(Token* tok);
+void emit_call(Token* name, uint32_t arity);
+void emit_jump(TokenType type);
+void emit_array(uint32_t n);
+
+/* The token being looked at, and one more to tell a variable apart from a call */
+static Token t = DEFAULT_TOKEN;
+static Token lookahead = DEFAULT_TOKEN;
+static uint32_t t_position = 0;
+static uint32_t lookahead_position = 0;
+
+static Budget* parse_budget = NULL;
+static uint32_t nesting = 0;
+static uint32_t n_errors = 0;
+
+/* Out of budget, 't' reads as TOK_EOF from here on so every loop winds down */
+static bool stopped = false;
 
 void init_parser()
 {
-    operator_stack = alloc_token_stack();
     output_stack = alloc_token_stack();
+    init_ast(&ast);
 }
 
 void cleanup_parser()
 {
-    free_token_stack(operator_stack);
+    free_ast(&ast);
 
     /* 
         NOTE: Remember to scrub all the tokens on the output stack to be safe.
@@ -29,88 +80,772 @@ void cleanup_parser()
     free_token_stack(output_stack);
 }
 
-void parse_expr()
+/*
+    A Pratt parser: 'parse_binary()' takes operators for as long as they bind
+    at least as tight as its caller's, going by 'get_precedence()' and
+    'get_associativity()', and every construct becomes a node of 'ast'. The
+    input is a list of definitions 'f(x, y) = body;' and then comma separated
+    outputs, each lowered to RPN as soon as it is parsed. Syntax errors are
+    reported where they are and parsing carries on, so one run shows them all,
+    but nothing is lowered once there has been one.
+*/
+bool parse_expr(Budget* budget)
 {
-    /*
-        TODO: functions get pushed straight onto the operator stack
-        https://en.wikipedia.org/wiki/Shunting_yard_algorithm
-    */
-    Token temp;
+    Token tuple;
+    TokenStack* linked;
+    uint32_t first;
+    uint32_t count;
 
-    next_token(&t);
+    /* Checked up front, so an oversized input is never scanned past the limit */
+    if (budget != NULL && limit_config.max_input > 0
+        && input_left(limit_config.max_input + 1) > limit_config.max_input) {
+        return exceed_budget(budget, "input");
+    }
+
+    parse_budget = budget;
+    nesting = 0;
+    n_errors = 0;
+    stopped = false;
+    reset_ast(&ast);
 
+    scan_lookahead();
+    advance();
+
+    count = 0;
     while (t.type != TOK_EOF) {
-        if (t.type == TOK_LONG || t.type == TOK_DOUBLE) {
-
-            push_token_stack(output_stack, &t);
-        
-        } else if (t.type == TOK_IDENTIFIER || IS_FUNCTION(t.type)) {
-
-            push_token_stack(operator_stack, &t);
-
-        } else if (IS_OPERATOR(t.type)) {
-            /* TODO... */
-            while ((operator_stack->size > 0 && STACK_TOP(operator_stack).type != TOK_LPAR)
-                && (get_precedence(&STACK_TOP(operator_stack)) > get_precedence(&t) 
-                    || (get_precedence(&STACK_TOP(operator_stack)) == get_precedence(&t) 
-                        && get_associativity(&t) == ASS_LEFT)
-                    )
-            ) {
-                temp = pop_token_stack(operator_stack);
-                push_token_stack(output_stack, &temp);
+        count = parse_list(&first);
+
+        if (t.type == TOK_ASSIGN) {
+            if (count > 1) {
+                syntax_error(ast.nodes[first].position, "Expected 'f(x, y) = ...' on the left of '='");
             }
+            parse_definition(first);
+            count = 0;
+            reset_ast(&ast);
+        } else if (t.type == TOK_SEMICOLON) {
+            syntax_error(t_position, "Only a definition 'f(x, y) = ...' can come before ';'");
+            advance();
+            count = 0;
+            reset_ast(&ast);
+        } else {
+            break;
+        }
+    }
 
-            push_token_stack(operator_stack, &t);
+    if (stopped) {
+        reset_ast(&ast);
+        return false;
+    }
+    if (n_errors > 0) {
+        exit(32);
+    }
+    if (count == 0) {
+        fprintf(stderr, "Nothing to evaluate.\n");
+        exit(32);
+    }
+
+    lower_nodes(0, ast.size);
+    reset_ast(&ast);
+    if (count > 1) {
+        tuple.type = TOK_TUPLE;
+        tuple.as.i64 = count;
+        push_token_stack(output_stack, &tuple);
+    }
+
+    linked = link_program(output_stack);
+    free_token_stack(output_stack);
+    output_stack = linked;
 
-        } else if (t.type == TOK_COMMA) {
-            /* Unecessary until we implement functions... */
-            while (operator_stack->size > 0 && STACK_TOP(operator_stack).type != TOK_LPAR) {
-                temp = pop_token_stack(operator_stack);
-                push_token_stack(output_stack, &temp);
+    return true;
+}
+
+/* Comma separated expressions, returns how many with the root of the first in 'first' */
+uint32_t parse_list(uint32_t* first)
+{
+    uint32_t root;
+    uint32_t count;
+
+    count = 0;
+    while (true) {
+        root = parse_binary(ANY_PRECEDENCE);
+        if (count == 0) {
+            *first = root;
+        }
+        count++;
+
+        if (t.type == TOK_COMMA) {
+            advance();
+        } else if (t.type == TOK_EOF || t.type == TOK_SEMICOLON || t.type == TOK_ASSIGN) {
+            return count;
+        } else {
+            if (t.type == TOK_RPAR || t.type == TOK_RBRACKET) {
+                syntax_error(t_position, "Unbalanced '%s'", tok_to_string[t.type]);
+            } else {
+                syntax_error(t_position, "Expected an operator or ','");
+            }
+            synchronize();
+            if (t.type != TOK_COMMA) {
+                return count;
             }
-        } else if (t.type == TOK_LPAR) {
-            
-            push_token_stack(operator_stack, &t);
-        
-        } else if (t.type == TOK_RPAR) {
-            
-            while (operator_stack->base[operator_stack->size - 1].type != TOK_LPAR) {
-                /* NOTE: asserting non-empty happens in 'pop_token_stack()' */
-                temp = pop_token_stack(operator_stack);
-                push_token_stack(output_stack, &temp);
+            advance();
+        }
+    }
+}
+
+/* Everything up to the first operator that binds looser than 'min_precedence' */
+uint32_t parse_binary(int min_precedence)
+{
+    Token op;
+    uint32_t left;
+    uint32_t right;
+    uint32_t position;
+    int precedence;
+
+    if (!enter()) {
+        return error_node(t_position);
+    }
+
+    left = parse_unary();
+    while (IS_OPERATOR(t.type) && get_precedence(&t) >= min_precedence) {
+        op = t;
+        position = t_position;
+        precedence = get_precedence(&op);
+        advance();
+
+        /* The left operand is complete, the right one may get skipped */
+        if (op.type == TOK_AND || op.type == TOK_OR) {
+            ast.nodes[left].jump = (op.type == TOK_AND) ? TOK_SHORT_AND : TOK_SHORT_OR;
+        }
+
+        right = parse_binary((get_associativity(&op) == ASS_LEFT) ? precedence + 1 : precedence);
+        ast.nodes[left].next_sibling = right;
+        left = add_node(&ast, NODE_BINARY, &op, position, left, 2);
+    }
+
+    nesting--;
+    return left;
+}
+
+/* Unary minus takes in '^' and nothing looser, so '-x^2' is '-(x^2)' and '-x*y' is '(-x)*y' */
+uint32_t parse_unary()
+{
+    Token minus;
+    Token power;
+    Node* operand;
+    uint32_t root;
+    uint32_t position;
+
+    if (t.type != TOK_SUB) {
+        return parse_primary();
+    }
+
+    minus = t;
+    position = t_position;
+    advance();
+
+    power.type = TOK_EXP;
+    root = parse_binary(get_precedence(&power));
+
+    /* A literal just changes sign, the scanner never gives a negative one */
+    operand = &ast.nodes[root];
+    if (operand->kind == NODE_VALUE && operand->token.type == TOK_LONG && operand->token.as.i64 != INT64_MIN) {
+        operand->token.as.i64 = -operand->token.as.i64;
+        operand->position = position;
+        return root;
+    }
+    if (operand->kind == NODE_VALUE && operand->token.type == TOK_DOUBLE) {
+        operand->token.as.f64 = -operand->token.as.f64;
+        operand->position = position;
+        return root;
+    }
+
+    /* Lowered to '* -1', which would report a multiplication nobody wrote */
+    if (gives_string(root)) {
+        syntax_error(position, "Cannot negate a string");
+    }
+
+    return add_node(&ast, NODE_NEGATE, &minus, position, root, 1);
+}
+
+/* Whether the subtree at 'node' is sure to be a string, unless it fails first */
+static bool gives_string(uint32_t node)
+{
+    Node* n;
+    uint32_t child;
+
+    n = &ast.nodes[node];
+    switch (n->kind) {
+        case NODE_VALUE: {
+            return IS_STRING((&n->token));
+        }
+        case NODE_BUILTIN: {
+            return n->token.type == TOK_STR || n->token.type == TOK_SUBSTR;
+        }
+        case NODE_BINARY: {
+            if (n->token.type != TOK_ADD) {
+                return false;
             }
-            assert(operator_stack->size > 0);
-            assert(operator_stack->base[operator_stack->size - 1].type = TOK_LPAR);
-            pop_token_stack(operator_stack);
-
-            /*
-                TODO: if there is a function on top of the operator stack, then
-                push it into the output queue...
-            */
-
-            if (operator_stack->size > 0 && IS_FUNCTION(STACK_TOP(operator_stack).type)) {
-                temp = pop_token_stack(operator_stack);
-                push_token_stack(output_stack, &temp);
+            for (child = n->first_child; child != NO_NODE; child = ast.nodes[child].next_sibling) {
+                if (gives_string(child)) {
+                    return true;
+                }
             }
+            return false;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+uint32_t parse_primary()
+{
+    Token name;
+    Native* native;
+    char* spelling;
+    uint32_t position;
+    uint32_t first;
+    uint32_t count;
+    uint32_t expected;
+    uint32_t root;
+
+    position = t_position;
+
+    if (t.type == TOK_LONG || t.type == TOK_DOUBLE || t.type == TOK_BIGINT || IS_STRING((&t))) {
+        name = t;
+        advance();
+        return add_node(&ast, NODE_VALUE, &name, position, NO_NODE, 0);
+    }
+
+    if (t.type == TOK_IDENTIFIER && lookahead.type != TOK_LPAR) {
+        name = t;
+        advance();
+        return add_node(&ast, NODE_VARIABLE, &name, position, NO_NODE, 0);
+    }
+
+    if (t.type == TOK_IDENTIFIER) {
+        name = t;
+        advance();
+        count = parse_arguments(TOK_RPAR, &first);
+        return add_node(&ast, NODE_CALL, &name, position, first, count);
+    }
+
+    if (IS_FUNCTION(t.type)) {
+        name = t;
+        spelling = (name.type == TOK_NATIVE) ? name.as.native->name : tok_to_string[name.type];
+        advance();
+        if (t.type != TOK_LPAR) {
+            syntax_error(t_position, "Expected '(' after '%s'", spelling);
+            return error_node(position);
+        }
+        count = parse_arguments(TOK_RPAR, &first);
+
+        /* solve() and friends take the expression and variable on top of their plain arguments */
+        expected = get_arity(&name) + (IS_HIGHER_ORDER(name.type) ? 2 : 0);
+
+        /* A native can share the name of a builtin with another arity, like 'min(a, b)' */
+        if (count != expected && name.type != TOK_NATIVE && lookup_name(spelling, &native) != TOK_IDENTIFIER
+            && native != NULL && native->arity == count) {
+            name.type = TOK_NATIVE;
+            name.as.native = native;
+            expected = count;
+        }
+        if (count != expected) {
+            syntax_error(position, "%s() takes %u argument%s", spelling, expected, (expected == 1) ? "" : "s");
+            return error_node(position);
+        }
+
+        /* 'if(c, a, b)' branches once 'c' and then 'a' are done */
+        if (name.type == TOK_IF) {
+            ast.nodes[first].jump = TOK_THEN;
+            ast.nodes[ast.nodes[first].next_sibling].jump = TOK_ELSE;
+        }
+
+        return add_node(&ast, NODE_BUILTIN, &name, position, first, count);
+    }
+
+    if (t.type == TOK_LPAR) {
+        advance();
+        root = parse_binary(ANY_PRECEDENCE);
+        if (t.type == TOK_RPAR) {
+            advance();
+        } else if (t.type == TOK_EOF) {
+            syntax_error(position, "Unclosed '('");
         } else {
+            syntax_error(t_position, "Expected ')'");
+        }
+        return root;
+    }
 
-                printf("I'm confused :( '%d'\n", t.type);
-                exit(69);
-        
+    if (t.type == TOK_LBRACKET) {
+        count = parse_arguments(TOK_RBRACKET, &first);
+        name.type = TOK_MAKE_ARRAY;
+        name.as.i64 = count;
+        return add_node(&ast, NODE_ARRAY, &name, position, first, count);
+    }
+
+    syntax_error(position, "Expected a value");
+
+    /* A stray operator is skipped, whatever comes after it may still make sense */
+    if (IS_OPERATOR(t.type)) {
+        while (IS_OPERATOR(t.type)) {
+            advance();
         }
+        if (t.type != TOK_EOF && t.type != TOK_RPAR && t.type != TOK_RBRACKET && t.type != TOK_COMMA
+            && t.type != TOK_SEMICOLON && t.type != TOK_ASSIGN) {
+            return parse_primary();
+        }
+    }
+
+    return error_node(position);
+}
+
+/* From the '(' or '[' through 'closer', returns how many with the first root in 'first' */
+uint32_t parse_arguments(TokenType closer, uint32_t* first)
+{
+    uint32_t position;
+    uint32_t root;
+    uint32_t last;
+    uint32_t count;
 
-        next_token(&t);
+    position = t_position;
+    advance();
+
+    *first = NO_NODE;
+    if (t.type == closer) {
+        advance();
+        return 0;
     }
 
-    while (operator_stack->size != 0) {
-        assert(operator_stack->base[operator_stack->size - 1].type != TOK_LPAR);
+    count = 0;
+    last = NO_NODE;
+    while (true) {
+        root = parse_binary(ANY_PRECEDENCE);
+        if (last == NO_NODE) {
+            *first = root;
+        } else {
+            ast.nodes[last].next_sibling = root;
+        }
+        last = root;
+        count++;
 
-        temp = pop_token_stack(operator_stack);
-        push_token_stack(output_stack, &temp);
+        if (t.type == TOK_COMMA) {
+            advance();
+            continue;
+        }
+
+        if (t.type == closer) {
+            advance();
+        } else if (t.type == TOK_EOF) {
+            syntax_error(position, "Unclosed '%s'", tok_to_string[(closer == TOK_RPAR) ? TOK_LPAR : TOK_LBRACKET]);
+        } else {
+            syntax_error(t_position, "Expected ',' or '%s'", tok_to_string[closer]);
+        }
+        return count;
     }
 }
 
+uint32_t error_node(uint32_t position)
+{
+    Token none;
+
+    none.type = TOK_EOF;
+    return add_node(&ast, NODE_ERROR, &none, position, NO_NODE, 0);
+}
+
+/* 'lhs' has to look like 'f(x, y)', what follows the '=' up to a ';' is its body */
+void parse_definition(uint32_t lhs)
+{
+    Call* call;
+    char** params;
+    Node* param;
+    uint32_t position;
+    uint32_t body;
+    uint32_t count;
+    uint32_t i;
+
+    position = t_position;
+    advance();
+    body = ast.size;
+    count = parse_list(&i);
+
+    if (t.type == TOK_SEMICOLON) {
+        advance();
+    } else if (t.type != TOK_EOF) {
+        syntax_error(t_position, "Expected ';' after the body of a definition");
+        synchronize();
+        return;
+    }
+
+    if (ast.nodes[lhs].kind != NODE_CALL) {
+        syntax_error(position, "Expected 'f(x, y) = ...' on the left of '='");
+        return;
+    }
+    for (i = ast.nodes[lhs].first_child; i != NO_NODE; i = ast.nodes[i].next_sibling) {
+        if (ast.nodes[i].kind != NODE_VARIABLE) {
+            syntax_error(ast.nodes[i].position, "Parameters of '%s' must be plain names", ast.nodes[lhs].token.as.string);
+            return;
+        }
+    }
+    if (count > 1) {
+        syntax_error(position, "'%s' can only return a single value", ast.nodes[lhs].token.as.string);
+        return;
+    }
+    if (n_errors > 0 || stopped) {
+        return;
+    }
+
+    if ((call = malloc(sizeof(Call))) == NULL
+        || (params = malloc(sizeof(char*) * (ast.nodes[lhs].n_children + 1))) == NULL) {
+        fprintf(stderr, "Failed to allocate definition.\n");
+        exit(5);
+    }
+    call->name = ast.nodes[lhs].token.as.string;
+    call->arity = ast.nodes[lhs].n_children;
+    call->target = NULL;
+    ast.nodes[lhs].token.type = TOK_EOF;
+
+    /* The names now belong to the definition */
+    count = 0;
+    for (i = ast.nodes[lhs].first_child; i != NO_NODE; i = ast.nodes[i].next_sibling) {
+        param = &ast.nodes[i];
+        params[count++] = param->token.as.string;
+        param->token.type = TOK_EOF;
+    }
+
+    lower_nodes(body, ast.size);
+    define_function(call, params, output_stack);
+    output_stack = alloc_token_stack();
+
+    free(call->name);
+    free(call);
+}
+
+/* Moves on to the next token, skipping and reporting characters the scanner doesn't know */
+static void advance()
+{
+    t = lookahead;
+    t_position = lookahead_position;
+    if (stopped) {
+        t.type = TOK_EOF;
+        return;
+    }
+
+    scan_lookahead();
+
+    if (parse_budget != NULL && t.type != TOK_EOF && !spend_token(parse_budget)) {
+        stop("tokens");
+    }
+}
+
+/* The next token into 'lookahead', reporting any character that doesn't start one */
+static void scan_lookahead()
+{
+    next_token(&lookahead);
+    lookahead_position = token_position();
+    while (lookahead.type == TOK_EOF && get_source()[lookahead_position] != '\0') {
+        syntax_error(lookahead_position, "Unexpected '%c'", get_source()[lookahead_position]);
+        next_token(&lookahead);
+        lookahead_position = token_position();
+    }
+}
+
+/* One more level of nesting, false once past the limits */
+static bool enter()
+{
+    nesting++;
+
+    if (parse_budget != NULL && limit_config.max_depth > 0 && nesting > limit_config.max_depth) {
+        stop("depth");
+    }
+    if (nesting > MAX_NESTING_DEPTH) {
+        syntax_error(t_position, "Nesting too deep");
+        exit(32);
+    }
+
+    if (stopped) {
+        nesting--;
+        return false;
+    }
+    return true;
+}
+
+static void stop(char* what)
+{
+    if (!stopped) {
+        exceed_budget(parse_budget, what);
+        stopped = true;
+    }
+
+    scrub_token(&t);
+    scrub_token(&lookahead);
+    t.type = TOK_EOF;
+    lookahead.type = TOK_EOF;
+}
+
+/* Skips to the next ',', ';' or '=' outside of any parentheses */
+static void synchronize()
+{
+    uint32_t depth;
+
+    depth = 0;
+    while (t.type != TOK_EOF && (depth > 0 || (t.type != TOK_COMMA && t.type != TOK_SEMICOLON && t.type != TOK_ASSIGN))) {
+        if (t.type == TOK_LPAR || t.type == TOK_LBRACKET) {
+            depth++;
+        } else if ((t.type == TOK_RPAR || t.type == TOK_RBRACKET) && depth > 0) {
+            depth--;
+        }
+        scrub_token(&t);
+        advance();
+    }
+}
+
+/* Reports where it went wrong with the line underneath, gives up after MAX_SYNTAX_ERRORS */
+void syntax_error(uint32_t position, char* format, ...)
+{
+    va_list args;
+    char* source;
+    uint32_t line;
+    uint32_t line_start;
+    uint32_t start;
+    uint32_t i;
+
+    if (stopped) {
+        return;
+    }
+
+    source = get_source();
+    line = 1;
+    line_start = 0;
+    for (i = 0; i < position; i++) {
+        if (source[i] == '\n') {
+            line++;
+            line_start = i + 1;
+        }
+    }
+
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    if (strchr(source, '\n') != NULL) {
+        fprintf(stderr, " at line %u, column %u.\n", line, position - line_start + 1);
+    } else {
+        fprintf(stderr, " at column %u.\n", position - line_start + 1);
+    }
+
+    start = (position - line_start > ERROR_CONTEXT) ? position - ERROR_CONTEXT : line_start;
+    fputs("    ", stderr);
+    for (i = start; source[i] != '\0' && source[i] != '\n' && i < position + ERROR_CONTEXT; i++) {
+        fputc(source[i], stderr);
+    }
+    fputs("\n    ", stderr);
+    for (i = start; i < position; i++) {
+        fputc((source[i] == '\t') ? '\t' : ' ', stderr);
+    }
+    fputs("^\n", stderr);
+
+    if (++n_errors == MAX_SYNTAX_ERRORS) {
+        fprintf(stderr, "Too many errors.\n");
+        exit(32);
+    }
+}
+
+/* The nodes in [start, end) are already in RPN order, only jumps and unary minus add tokens */
+void lower_nodes(uint32_t start, uint32_t end)
+{
+    Token extra;
+    Node* node;
+    uint32_t i;
+
+    for (i = start; i < end; i++) {
+        node = &ast.nodes[i];
+
+        switch (node->kind) {
+            case NODE_VALUE:
+            case NODE_VARIABLE: {
+                push_token_stack(output_stack, &node->token);
+                break;
+            }
+            case NODE_NEGATE: {
+                extra.type = TOK_LONG;
+                extra.as.i64 = -1;
+                push_token_stack(output_stack, &extra);
+                extra.type = TOK_MUL;
+                emit_operator(&extra);
+                break;
+            }
+            case NODE_BINARY:
+            case NODE_BUILTIN: {
+                emit_operator(&node->token);
+                break;
+            }
+            case NODE_CALL: {
+                emit_call(&node->token, node->n_children);
+                break;
+            }
+            case NODE_ARRAY: {
+                emit_array(node->n_children);
+                break;
+            }
+            case NODE_ERROR: {
+                /* Never lowered, see 'parse_expr()' */
+                break;
+            }
+        }
+
+        /* The program owns the token now */
+        node->token.type = TOK_EOF;
+
+        if (node->jump != TOK_EOF) {
+            emit_jump(node->jump);
+        }
+    }
+}
+
+void emit_operator(Token* tok)
+{
+    if (IS_HIGHER_ORDER(tok->type)) {
+        lift_lambda(output_stack, tok);
+    }
+
+    push_token_stack(output_stack, tok);
+}
+
+/* Where it lands is filled in by 'link_jumps()' */
+void emit_jump(TokenType type)
+{
+    Token jump;
+
+    jump.type = type;
+    jump.as.i64 = 0;
+    push_token_stack(output_stack, &jump);
+}
+
+/* An array of constants is a constant too, anything else gets built when it runs */
+void emit_array(uint32_t n)
+{
+    Token array;
+    uint32_t i;
+
+    for (i = 1; i <= n && i <= output_stack->size; i++) {
+        if (!IS_NUMBER((&output_stack->base[output_stack->size - i]))) {
+            break;
+        }
+    }
+
+    if (i <= n) {
+        array.type = TOK_MAKE_ARRAY;
+        array.as.i64 = n;
+        push_token_stack(output_stack, &array);
+        return;
+    }
+
+    array = make_array(output_stack->base + output_stack->size - n, n);
+    for (i = 0; i < n; i++) {
+        output_stack->size--;
+        scrub_token(&output_stack->base[output_stack->size]);
+    }
+    push_token_stack(output_stack, &array);
+}
+
+/* 'name' is the identifier in front of the parentheses, it becomes the call */
+void emit_call(Token* name, uint32_t arity)
+{
+    Call* call;
+
+    if ((call = malloc(sizeof(Call))) == NULL) {
+        fprintf(stderr, "Failed to allocate call.\n");
+        exit(5);
+    }
+    call->name = name->as.string;
+    call->arity = arity;
+    call->target = NULL;
+
+    name->type = TOK_CALL;
+    name->as.call = call;
+    push_token_stack(output_stack, name);
+}
+
+
 TokenStack* get_output_stack()
 {
     return output_stack;
-}
\ No newline at end of file
+}
+/*
+    The text of each comma separated output of 'source', after any definitions,
+    trimmed. Outputs past the text's own are empty.
+*/
+char** split_outputs(char* source, uint32_t count)
+{
+    char** names;
+    char* pos;
+    char* start;
+    char* end;
+    uint32_t depth;
+    uint32_t i;
+    bool quoted;
+
+    if ((names = calloc(count + 1, sizeof(char*))) == NULL) {
+        fprintf(stderr, "Failed to allocate output names.\n");
+        exit(5);
+    }
+
+    /* Definitions end in a ';' outside of any parentheses */
+    depth = 0;
+    quoted = false;
+    start = source;
+    for (pos = source; *pos != '\0'; pos++) {
+        if (*pos == '"') {
+            quoted = !quoted;
+        } else if (!quoted && (*pos == '(' || *pos == '[')) {
+            depth++;
+        } else if (!quoted && (*pos == ')' || *pos == ']') && depth > 0) {
+            depth--;
+        } else if (!quoted && depth == 0 && *pos == ';') {
+            start = pos + 1;
+        }
+    }
+
+    depth = 0;
+    quoted = false;
+    i = 0;
+    for (pos = start; i < count; pos++) {
+        if (*pos == '\0' || (!quoted && depth == 0 && *pos == ',')) {
+            end = pos;
+            while (end > start && isspace((unsigned char) end[-1])) {
+                end--;
+            }
+            while (start < end && isspace((unsigned char) *start)) {
+                start++;
+            }
+
+            if ((names[i] = malloc(end - start + 1)) == NULL) {
+                fprintf(stderr, "Failed to allocate output names.\n");
+                exit(5);
+            }
+            memcpy(names[i], start, end - start);
+            names[i][end - start] = '\0';
+            i++;
+
+            if (*pos == '\0') {
+                break;
+            }
+            start = pos + 1;
+        } else if (*pos == '"') {
+            quoted = !quoted;
+        } else if (!quoted && (*pos == '(' || *pos == '[')) {
+            depth++;
+        } else if (!quoted && (*pos == ')' || *pos == ']') && depth > 0) {
+            depth--;
+        }
+    }
+
+    for (; i < count; i++) {
+        if ((names[i] = calloc(1, 1)) == NULL) {
+            fprintf(stderr, "Failed to allocate output names.\n");
+            exit(5);
+        }
+    }
+
+    return names;
+}
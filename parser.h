@@ -1,11 +1,22 @@
 #ifndef CALC_PARSER_H
 #define CALC_PARSER_H
 
+#include <stdbool.h>
+
 #include "token.h"
+#include "budget.h"
 
 void init_parser();
 void cleanup_parser();
-void parse_expr();
+/*
+    Parses and links everything 'init_scanner()' was given. Returns false if it
+    ran out of 'budget' first, NULL means no limits. Either way the caller
+    still calls 'cleanup_parser()'.
+*/
+bool parse_expr(Budget* budget);
 TokenStack* get_output_stack();
 
+/* The source text of each of the 'count' outputs, malloc'd, for naming result columns */
+char** split_outputs(char* source, uint32_t count);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,607 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "poly.h"
+
+/* 'TOK_EOF' stands for the subexpression of the program ending at 'node' */
+typedef struct Coeff {
+    TokenType type;
+    Token number;
+    uint64_t node;
+    struct Coeff* left;
+    struct Coeff* right;
+} Coeff;
+
+/* One per instruction, for the subexpression it ends, whose span is in 'Pass.spans' */
+typedef struct {
+    /*
+        A polynomial in 'x' has 'degree + 1' coefficients, NULL where a power has
+        no term. Anything else is a coefficient of its own, 'self', of degree 0.
+    */
+    bool poly;
+    uint32_t degree;
+    Coeff** coeffs;
+    Coeff* self;
+
+    /* Of the instructions that built the polynomial, see 'weight()' */
+    uint32_t cost;
+} Node;
+
+typedef struct {
+    TokenStack* program;
+    char* x;
+    OperandSpan* spans;
+    Node* nodes;
+
+    Coeff** pool;
+    uint64_t n_pool;
+    uint64_t pool_capacity;
+
+    bool rewritten;
+} Pass;
+
+static TokenStack* rewrite_variable(TokenStack* program, char* x);
+static void analyze(Pass* p, uint64_t ip);
+static bool add_polys(Pass* p, Node* out, Node* a, Node* b, TokenType op);
+static bool mul_polys(Pass* p, Node* out, Node* a, Node* b);
+static bool pow_poly(Pass* p, Node* out, Node* a, int64_t n);
+static Coeff* alloc_coeff(Pass* p, TokenType type);
+static Coeff* number_coeff(Pass* p, TokenType type, int64_t value);
+static Coeff* binary_coeff(Pass* p, TokenType op, Coeff* a, Coeff* b);
+static bool is_atom(Pass* p, Coeff* c);
+static uint32_t count_terms(Node* n);
+static void emit(Pass* p, TokenStack* out, uint64_t ip);
+static void emit_operands(Pass* p, TokenStack* out, uint64_t end, int n);
+static void emit_coeff(Pass* p, TokenStack* out, Coeff* c);
+static void emit_power(Pass* p, TokenStack* out, uint32_t gap);
+static void emit_op(TokenStack* out, TokenType type);
+static uint32_t horner_cost(Node* n);
+static uint32_t coeff_cost(Coeff* c);
+static uint32_t weight(TokenType type);
+
+TokenStack* optimize_polynomials(TokenStack* program)
+{
+    TokenStack* output;
+    TokenStack* next;
+    TokenStack* body;
+    char* names[MAX_POLY_VARIABLES];
+    uint32_t n_names;
+    bool worth_trying;
+    bool impure;
+    uint64_t ip;
+    uint32_t i;
+    Token* tok;
+
+    output = copy_token_stack(program);
+
+    /* Nothing to gain without a multiplication or a power, expanding would copy anything impure */
+    n_names = 0;
+    worth_trying = false;
+    impure = false;
+    for (ip = 0; ip < program->size; ip++) {
+        tok = &program->base[ip];
+
+        if (tok->type == TOK_MUL || tok->type == TOK_EXP) {
+            worth_trying = true;
+        } else if (is_impure(tok)) {
+            impure = true;
+        } else if (tok->type == TOK_IDENTIFIER && n_names < MAX_POLY_VARIABLES) {
+            for (i = 0; i < n_names; i++) {
+                if (strcmp(names[i], tok->as.string) == 0) {
+                    break;
+                }
+            }
+            if (i == n_names) {
+                names[n_names++] = tok->as.string;
+            }
+        }
+    }
+
+    for (i = 0; i < n_names && worth_trying && !impure; i++) {
+        if ((next = rewrite_variable(output, names[i])) != NULL) {
+            free_token_stack(output);
+            output = next;
+        }
+    }
+
+    for (ip = 0; ip < output->size; ip++) {
+        tok = &output->base[ip];
+
+        if (IS_HIGHER_ORDER(tok->type) && tok->as.lambda != NULL) {
+            body = tok->as.lambda->body;
+            tok->as.lambda->body = optimize_polynomials(body);
+            free_token_stack(body);
+        }
+    }
+
+    link_jumps(output);
+
+    return output;
+}
+
+/* NULL when nothing in 'program' is worth rewriting as a polynomial in 'x' */
+static TokenStack* rewrite_variable(TokenStack* program, char* x)
+{
+    TokenStack* output;
+    Pass p;
+    uint64_t left;
+    uint64_t ip;
+
+    p.program = program;
+    p.x = x;
+    p.pool = NULL;
+    p.n_pool = 0;
+    p.pool_capacity = 0;
+    p.rewritten = false;
+
+    /* Where each subexpression starts is all it takes, nothing to do if the program isn't whole */
+    if ((p.spans = find_operand_spans(program, &left)) == NULL || left != 1) {
+        free(p.spans);
+        return NULL;
+    }
+
+    if ((p.nodes = calloc(program->size + 1, sizeof(Node))) == NULL) {
+        fprintf(stderr, "Failed to allocate polynomial pass.\n");
+        exit(5);
+    }
+
+    for (ip = 0; ip < program->size; ip++) {
+        analyze(&p, ip);
+    }
+
+    output = alloc_token_stack();
+    emit(&p, output, program->size - 1);
+
+    if (!p.rewritten) {
+        free_token_stack(output);
+        output = NULL;
+    }
+
+    for (ip = 0; ip < program->size; ip++) {
+        if (p.nodes[ip].poly) {
+            free(p.nodes[ip].coeffs);
+        }
+    }
+    while (p.n_pool > 0) {
+        p.n_pool--;
+        if (p.pool[p.n_pool]->type != TOK_EOF && !IS_OPERATOR(p.pool[p.n_pool]->type)) {
+            scrub_token(&p.pool[p.n_pool]->number);
+        }
+        free(p.pool[p.n_pool]);
+    }
+    free(p.pool);
+    free(p.spans);
+    free(p.nodes);
+
+    return output;
+}
+
+static void analyze(Pass* p, uint64_t ip)
+{
+    Node* node;
+    Node* a;
+    Node* b;
+    Token* tok;
+    Token* exponent;
+    bool done;
+
+    node = &p->nodes[ip];
+    tok = &p->program->base[ip];
+    done = false;
+
+    if (tok->type == TOK_IDENTIFIER && strcmp(tok->as.string, p->x) == 0) {
+        if ((node->coeffs = malloc(sizeof(Coeff*) * 2)) == NULL) {
+            fprintf(stderr, "Failed to allocate polynomial.\n");
+            exit(5);
+        }
+        node->poly = true;
+        node->degree = 1;
+        node->coeffs[0] = NULL;
+        node->coeffs[1] = number_coeff(p, TOK_LONG, 1);
+        node->cost = 0;
+        done = true;
+    } else if (IS_ARITHMETIC(tok->type) && tok->type != TOK_DIV && tok->type != TOK_MOD) {
+        b = &p->nodes[ip - 1];
+        a = &p->nodes[p->spans[ip - 1].start - 1];
+
+        if (tok->type == TOK_EXP) {
+            exponent = &p->program->base[ip - 1];
+            done = a->poly && !b->poly && exponent->type == TOK_LONG && pow_poly(p, node, a, exponent->as.i64);
+        } else if (a->poly || b->poly) {
+            done = (tok->type == TOK_MUL) ? mul_polys(p, node, a, b) : add_polys(p, node, a, b, tok->type);
+        }
+
+        if (done) {
+            node->cost = (a->poly ? a->cost : 0) + (b->poly ? b->cost : 0) + weight(tok->type);
+        }
+    }
+
+    if (!done) {
+        node->poly = false;
+        node->degree = 0;
+        node->coeffs = &node->self;
+        node->cost = 0;
+
+        if (p->spans[ip].arity == 0 && IS_NUMBER(tok)) {
+            node->self = alloc_coeff(p, tok->type);
+            node->self->number = copy_token(tok);
+        } else {
+            node->self = alloc_coeff(p, TOK_EOF);
+            node->self->node = ip;
+        }
+    }
+}
+
+static bool add_polys(Pass* p, Node* out, Node* a, Node* b, TokenType op)
+{
+    Coeff* ca;
+    Coeff* cb;
+    uint32_t i;
+
+    out->degree = (a->degree > b->degree) ? a->degree : b->degree;
+    if ((out->coeffs = malloc(sizeof(Coeff*) * (out->degree + 1))) == NULL) {
+        fprintf(stderr, "Failed to allocate polynomial.\n");
+        exit(5);
+    }
+    out->poly = true;
+
+    for (i = 0; i <= out->degree; i++) {
+        ca = (i <= a->degree) ? a->coeffs[i] : NULL;
+        cb = (i <= b->degree) ? b->coeffs[i] : NULL;
+
+        if (cb == NULL) {
+            out->coeffs[i] = ca;
+        } else if (ca == NULL) {
+            out->coeffs[i] = (op == TOK_SUB) ? binary_coeff(p, TOK_SUB, number_coeff(p, TOK_LONG, 0), cb) : cb;
+        } else {
+            out->coeffs[i] = binary_coeff(p, op, ca, cb);
+        }
+    }
+
+    return true;
+}
+
+/* Every coefficient that ends up in more than one product has to be cheap to repeat */
+static bool mul_polys(Pass* p, Node* out, Node* a, Node* b)
+{
+    Coeff* term;
+    uint32_t terms_a;
+    uint32_t terms_b;
+    uint32_t i;
+    uint32_t j;
+
+    if (a->degree + b->degree > MAX_POLY_DEGREE) {
+        return false;
+    }
+
+    terms_a = count_terms(a);
+    terms_b = count_terms(b);
+    for (i = 0; i <= a->degree; i++) {
+        if (a->coeffs[i] != NULL && terms_b > 1 && !is_atom(p, a->coeffs[i])) {
+            return false;
+        }
+    }
+    for (j = 0; j <= b->degree; j++) {
+        if (b->coeffs[j] != NULL && terms_a > 1 && !is_atom(p, b->coeffs[j])) {
+            return false;
+        }
+    }
+
+    out->degree = a->degree + b->degree;
+    if ((out->coeffs = calloc(out->degree + 1, sizeof(Coeff*))) == NULL) {
+        fprintf(stderr, "Failed to allocate polynomial.\n");
+        exit(5);
+    }
+    out->poly = true;
+
+    for (i = 0; i <= a->degree; i++) {
+        for (j = 0; j <= b->degree; j++) {
+            if (a->coeffs[i] == NULL || b->coeffs[j] == NULL) {
+                continue;
+            }
+
+            term = binary_coeff(p, TOK_MUL, a->coeffs[i], b->coeffs[j]);
+            out->coeffs[i + j] = (out->coeffs[i + j] == NULL) ? term : binary_coeff(p, TOK_ADD, out->coeffs[i + j], term);
+        }
+    }
+
+    return true;
+}
+
+static bool pow_poly(Pass* p, Node* out, Node* a, int64_t n)
+{
+    Node acc;
+    Node next;
+    uint32_t i;
+
+    /* x^0 is 1 or 1.0 depending on x, which a coefficient can't tell */
+    if (n < 1 || (int64_t) a->degree * n > MAX_POLY_DEGREE) {
+        return false;
+    }
+
+    /* (c*x^k)^n is c^n*x^(k*n), 'c' only shows up once */
+    if (count_terms(a) == 1 || n == 1) {
+        out->degree = a->degree * n;
+        if ((out->coeffs = calloc(out->degree + 1, sizeof(Coeff*))) == NULL) {
+            fprintf(stderr, "Failed to allocate polynomial.\n");
+            exit(5);
+        }
+        out->poly = true;
+        for (i = 0; i <= a->degree; i++) {
+            if (a->coeffs[i] != NULL) {
+                out->coeffs[i * n] = binary_coeff(p, TOK_EXP, a->coeffs[i], number_coeff(p, TOK_LONG, n));
+            }
+        }
+        return true;
+    }
+
+    acc = *a;
+    acc.coeffs = NULL;
+    for (i = 1; i < n; i++) {
+        if (!mul_polys(p, &next, (i == 1) ? a : &acc, a)) {
+            free(acc.coeffs);
+            return false;
+        }
+        free(acc.coeffs);
+        acc = next;
+    }
+
+    out->poly = true;
+    out->degree = acc.degree;
+    out->coeffs = acc.coeffs;
+    return true;
+}
+
+static Coeff* alloc_coeff(Pass* p, TokenType type)
+{
+    Coeff* output;
+
+    if (p->n_pool == p->pool_capacity) {
+        p->pool_capacity = (p->pool_capacity == 0) ? 64 : p->pool_capacity * 2;
+        if ((p->pool = realloc(p->pool, sizeof(Coeff*) * p->pool_capacity)) == NULL) {
+            fprintf(stderr, "Failed to allocate polynomial.\n");
+            exit(5);
+        }
+    }
+    if ((output = malloc(sizeof(Coeff))) == NULL) {
+        fprintf(stderr, "Failed to allocate polynomial.\n");
+        exit(5);
+    }
+
+    output->type = type;
+    output->number.type = type;
+    output->number.as.string = NULL;
+    output->node = 0;
+    output->left = NULL;
+    output->right = NULL;
+    p->pool[p->n_pool++] = output;
+
+    return output;
+}
+
+static Coeff* number_coeff(Pass* p, TokenType type, int64_t value)
+{
+    Coeff* output;
+
+    output = alloc_coeff(p, type);
+    output->number.as.i64 = value;
+
+    return output;
+}
+
+/* Folds right away when both sides are numbers, '1 * a' is just 'a' for any number */
+static Coeff* binary_coeff(Pass* p, TokenType op, Coeff* a, Coeff* b)
+{
+    Coeff* output;
+    Token result;
+
+    if (op == TOK_MUL && a->type == TOK_LONG && a->number.as.i64 == 1) {
+        return b;
+    }
+    if ((op == TOK_MUL || op == TOK_EXP) && b->type == TOK_LONG && b->number.as.i64 == 1) {
+        return a;
+    }
+
+    if (IS_NUMBER((&a->number)) && IS_NUMBER((&b->number))) {
+        switch (op) {
+            case TOK_ADD: {
+                result = add_tokens(&a->number, &b->number);
+                break;
+            }
+            case TOK_SUB: {
+                result = sub_tokens(&a->number, &b->number);
+                break;
+            }
+            case TOK_MUL: {
+                result = mul_tokens(&a->number, &b->number);
+                break;
+            }
+            default: {
+                result = exp_tokens(&a->number, &b->number);
+                break;
+            }
+        }
+
+        output = alloc_coeff(p, result.type);
+        output->number = result;
+        return output;
+    }
+
+    output = alloc_coeff(p, op);
+    output->left = a;
+    output->right = b;
+
+    return output;
+}
+
+static bool is_atom(Pass* p, Coeff* c)
+{
+    return IS_NUMBER((&c->number)) || (c->type == TOK_EOF && p->spans[c->node].arity == 0);
+}
+
+static uint32_t count_terms(Node* n)
+{
+    uint32_t count;
+    uint32_t i;
+
+    count = 0;
+    for (i = 0; i <= n->degree; i++) {
+        count += n->coeffs[i] != NULL;
+    }
+
+    return count;
+}
+
+static void emit(Pass* p, TokenStack* out, uint64_t ip)
+{
+    Node* node;
+    Token tok;
+    int32_t i;
+    int32_t j;
+    bool leading_one;
+
+    node = &p->nodes[ip];
+
+    if (!node->poly || horner_cost(node) >= node->cost) {
+        emit_operands(p, out, ip - 1, p->spans[ip].arity);
+        tok = copy_token(&p->program->base[ip]);
+        push_token_stack(out, &tok);
+        return;
+    }
+
+    p->rewritten = true;
+
+    /* A leading 1 just starts out as a power of x */
+    i = node->degree;
+    leading_one = node->coeffs[i]->type == TOK_LONG && node->coeffs[i]->number.as.i64 == 1;
+    if (!leading_one) {
+        emit_coeff(p, out, node->coeffs[i]);
+    }
+
+    while (i > 0) {
+        for (j = i - 1; j >= 0 && node->coeffs[j] == NULL; j--) {
+        }
+
+        emit_power(p, out, (j >= 0) ? i - j : i);
+        if (j >= 0) {
+            emit_coeff(p, out, node->coeffs[j]);
+            emit_op(out, leading_one ? TOK_ADD : TOK_FMA);
+        } else if (!leading_one) {
+            emit_op(out, TOK_MUL);
+        }
+
+        leading_one = false;
+        i = (j >= 0) ? j : 0;
+    }
+}
+
+/* The 'n' operands of an instruction, the last one ends at 'end' */
+static void emit_operands(Pass* p, TokenStack* out, uint64_t end, int n)
+{
+    if (n == 0) {
+        return;
+    }
+
+    emit_operands(p, out, p->spans[end].start - 1, n - 1);
+    emit(p, out, end);
+}
+
+static void emit_coeff(Pass* p, TokenStack* out, Coeff* c)
+{
+    Token tok;
+
+    if (c->type == TOK_EOF) {
+        emit(p, out, c->node);
+    } else if (IS_OPERATOR(c->type)) {
+        emit_coeff(p, out, c->left);
+        emit_coeff(p, out, c->right);
+        emit_op(out, c->type);
+    } else {
+        tok = copy_token(&c->number);
+        push_token_stack(out, &tok);
+    }
+}
+
+static void emit_power(Pass* p, TokenStack* out, uint32_t gap)
+{
+    Token tok;
+
+    tok.type = TOK_IDENTIFIER;
+    tok.as.string = p->x;
+    tok = copy_token(&tok);
+    push_token_stack(out, &tok);
+
+    if (gap == 2 || gap == 3) {
+        tok = copy_token(&tok);
+        push_token_stack(out, &tok);
+        emit_op(out, TOK_MUL);
+    }
+    if (gap == 3) {
+        tok = copy_token(&tok);
+        push_token_stack(out, &tok);
+        emit_op(out, TOK_MUL);
+    } else if (gap > 3) {
+        tok.type = TOK_LONG;
+        tok.as.i64 = gap;
+        push_token_stack(out, &tok);
+        emit_op(out, TOK_EXP);
+    }
+}
+
+static void emit_op(TokenStack* out, TokenType type)
+{
+    Token tok;
+
+    tok.type = type;
+    tok.as.string = NULL;
+    push_token_stack(out, &tok);
+}
+
+/* Mirrors the instructions 'emit()' would write */
+static uint32_t horner_cost(Node* n)
+{
+    uint32_t cost;
+    int32_t gap;
+    int32_t i;
+    int32_t j;
+    bool leading_one;
+
+    cost = 0;
+    for (i = 0; i <= (int32_t) n->degree; i++) {
+        if (n->coeffs[i] != NULL) {
+            cost += coeff_cost(n->coeffs[i]);
+        }
+    }
+
+    i = n->degree;
+    leading_one = n->coeffs[i]->type == TOK_LONG && n->coeffs[i]->number.as.i64 == 1;
+    while (i > 0) {
+        for (j = i - 1; j >= 0 && n->coeffs[j] == NULL; j--) {
+        }
+
+        gap = (j >= 0) ? i - j : i;
+        cost += (gap > 3) ? weight(TOK_EXP) : gap - 1;
+        cost += (j >= 0 || !leading_one) ? 1 : 0;
+
+        leading_one = false;
+        i = (j >= 0) ? j : 0;
+    }
+
+    return cost;
+}
+
+static uint32_t coeff_cost(Coeff* c)
+{
+    if (IS_OPERATOR(c->type)) {
+        return coeff_cost(c->left) + coeff_cost(c->right) + weight(c->type);
+    }
+
+    return 0;
+}
+
+/* What an instruction costs next to a multiplication, '^' squares in a loop or calls pow() */
+static uint32_t weight(TokenType type)
+{
+    return (type == TOK_EXP) ? 3 : 1;
+}
@@ -0,0 +1,30 @@
+#ifndef CALC_POLY_H
+#define CALC_POLY_H
+
+#include "token.h"
+
+/*
+    Rewrites polynomials in a single variable into Horner form on fused
+    multiply-adds, so 'a*x^3 + b*x^2 + c*x + d' runs as
+
+        fma(fma(fma(a, x, b), x, c), x, d)
+
+    instead of three powers, three multiplications and three additions. Gaps
+    in the powers become a single power, 'x^10 + 1' stays as it is.
+
+    Every variable of the program gets a turn at being 'x'. Coefficients can
+    be any expression, but only numbers and plain variables are ever repeated,
+    so a product of two polynomials is only expanded when the coefficients
+    that get repeated are among those. A subexpression is only rewritten when
+    that makes it cheaper, counting a '^' as three instructions.
+
+    Integer results are exact either way, doubles can round differently.
+*/
+
+#define MAX_POLY_DEGREE 32
+#define MAX_POLY_VARIABLES 8
+
+/* A rewritten copy of 'program', lambdas included */
+TokenStack* optimize_polynomials(TokenStack* program);
+
+#endif
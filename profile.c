@@ -0,0 +1,653 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "profile.h"
+#include "parallel.h"
+#include "builtin.h"
+#include "text.h"
+
+/* Everything that ran of one distinct program, 'program' is a copy */
+typedef struct {
+    uint64_t fingerprint;
+    TokenStack* program;
+    OperandSpan* spans;
+
+    uint64_t* counts;
+    uint64_t* samples;
+    double* seconds;
+} Profile;
+
+/* One line of the report */
+typedef struct {
+    char* name;
+    uint64_t runs;
+    double seconds;
+    uint32_t profile;
+    uint64_t ip;
+} Hotspot;
+
+/* A subexpression printed back, cut short with "..." past PROFILE_LABEL_MAX */
+typedef struct {
+    char text[PROFILE_LABEL_MAX + 4];
+    uint32_t length;
+    bool full;
+} Label;
+
+/* Per thread, for 'nested_profile_seconds()' */
+typedef struct {
+    double seconds;
+    uint32_t depth;
+} Nesting;
+
+ProfileConfig profile_config = {false, 10};
+
+static Profile* profiles = NULL;
+static uint32_t n_profiles = 0;
+static uint32_t profiles_capacity = 0;
+
+static pthread_key_t nesting_key;
+static pthread_once_t nesting_once = PTHREAD_ONCE_INIT;
+
+static Nesting* get_nesting();
+static void make_key();
+static uint64_t fingerprint(TokenStack* program);
+static double own_seconds(Profile* p, uint64_t ip);
+static char* op_name(Token* tok);
+static bool is_subexpression(Token* tok);
+static void render(Label* label, TokenStack* program, OperandSpan* spans, uint64_t ip);
+static void render_operands(Label* label, TokenStack* program, OperandSpan* spans, uint64_t ip, int first, int arity);
+static void append(Label* label, char* text);
+static int by_seconds(const void* a, const void* b);
+
+void start_profile_run(ProfileRun* run, TokenStack* program)
+{
+    run->counts = NULL;
+    run->samples = NULL;
+    run->seconds = NULL;
+    if (!profile_config.enabled) {
+        return;
+    }
+
+    /* Bookkeeping included, so it isn't put down to the instruction that started the run */
+    enter_profile_nesting(&run->nesting);
+
+    run->counts = calloc(program->size + 1, sizeof(uint64_t));
+    run->samples = calloc(program->size + 1, sizeof(uint64_t));
+    run->seconds = calloc(program->size + 1, sizeof(double));
+    if (run->counts == NULL || run->samples == NULL || run->seconds == NULL) {
+        fprintf(stderr, "Failed to allocate profile.\n");
+        exit(5);
+    }
+}
+
+void finish_profile_run(ProfileRun* run, TokenStack* program)
+{
+    Profile* p;
+    uint64_t hash;
+    uint64_t left;
+    uint64_t ip;
+    uint32_t i;
+
+    if (run->counts == NULL) {
+        return;
+    }
+
+    hash = fingerprint(program);
+
+    parallel_lock();
+    for (i = 0; i < n_profiles; i++) {
+        if (profiles[i].fingerprint == hash && profiles[i].program->size == program->size) {
+            break;
+        }
+    }
+    if (i == n_profiles) {
+        if (n_profiles == profiles_capacity) {
+            profiles_capacity = (profiles_capacity == 0) ? 8 : profiles_capacity * 2;
+            if ((profiles = realloc(profiles, sizeof(Profile) * profiles_capacity)) == NULL) {
+                fprintf(stderr, "Failed to allocate profile.\n");
+                exit(5);
+            }
+        }
+        p = &profiles[n_profiles++];
+        p->fingerprint = hash;
+        p->program = copy_token_stack(program);
+        p->spans = find_operand_spans(p->program, &left);
+        p->counts = calloc(program->size + 1, sizeof(uint64_t));
+        p->samples = calloc(program->size + 1, sizeof(uint64_t));
+        p->seconds = calloc(program->size + 1, sizeof(double));
+        if (p->spans == NULL || p->counts == NULL || p->samples == NULL || p->seconds == NULL) {
+            fprintf(stderr, "Failed to allocate profile.\n");
+            exit(5);
+        }
+    }
+
+    p = &profiles[i];
+    for (ip = 0; ip < program->size; ip++) {
+        p->counts[ip] += run->counts[ip];
+        p->samples[ip] += run->samples[ip];
+        p->seconds[ip] += run->seconds[ip];
+    }
+    parallel_unlock();
+
+    free(run->counts);
+    free(run->samples);
+    free(run->seconds);
+    run->counts = NULL;
+
+    leave_profile_nesting(&run->nesting);
+}
+
+double profile_clock()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+/* Only a nested stretch reads the clock, a run on its own costs nothing more */
+void enter_profile_nesting(ProfileNesting* nesting)
+{
+    Nesting* n;
+
+    if (!profile_config.enabled) {
+        return;
+    }
+
+    n = get_nesting();
+    nesting->nested = n->depth > 0;
+    nesting->outer = n->seconds;
+    nesting->started = nesting->nested ? profile_clock() : 0.0;
+    n->depth++;
+}
+
+/* Whatever ran nested in this stretch is part of it, so its time replaces theirs */
+void leave_profile_nesting(ProfileNesting* nesting)
+{
+    Nesting* n;
+
+    if (!profile_config.enabled) {
+        return;
+    }
+
+    n = get_nesting();
+    n->depth--;
+    if (nesting->nested) {
+        n->seconds = nesting->outer + (profile_clock() - nesting->started);
+    }
+}
+
+double nested_profile_seconds()
+{
+    return get_nesting()->seconds;
+}
+
+void print_profile(FILE* out)
+{
+    Hotspot* ops;
+    Hotspot* spots;
+    Profile* p;
+    Label label;
+    uint32_t n_ops;
+    uint64_t n_spots;
+    uint64_t capacity;
+    uint64_t runs;
+    uint64_t ip;
+    uint64_t start;
+    double seconds;
+    double total;
+    char* name;
+    uint32_t i;
+    uint32_t k;
+
+    capacity = 1;
+    for (i = 0; i < n_profiles; i++) {
+        capacity += profiles[i].program->size;
+    }
+    ops = malloc(sizeof(Hotspot) * capacity);
+    spots = malloc(sizeof(Hotspot) * capacity);
+    if (ops == NULL || spots == NULL) {
+        fprintf(stderr, "Failed to allocate profile report.\n");
+        exit(5);
+    }
+
+    /* Own time by kind of instruction, then inclusive time of every subexpression */
+    n_ops = 0;
+    n_spots = 0;
+    total = 0.0;
+    runs = 0;
+    for (i = 0; i < n_profiles; i++) {
+        p = &profiles[i];
+
+        for (ip = 0; ip < p->program->size; ip++) {
+            seconds = own_seconds(p, ip);
+            runs += p->counts[ip];
+            total += seconds;
+
+            name = op_name(&p->program->base[ip]);
+            for (k = 0; k < n_ops; k++) {
+                if (strcmp(ops[k].name, name) == 0) {
+                    break;
+                }
+            }
+            if (k == n_ops) {
+                ops[k].name = name;
+                ops[k].runs = 0;
+                ops[k].seconds = 0.0;
+                n_ops++;
+            }
+            ops[k].runs += p->counts[ip];
+            ops[k].seconds += seconds;
+
+            if (!is_subexpression(&p->program->base[ip])) {
+                continue;
+            }
+            spots[n_spots].profile = i;
+            spots[n_spots].ip = ip;
+            spots[n_spots].runs = p->counts[ip];
+            spots[n_spots].seconds = 0.0;
+            for (start = p->spans[ip].start; start <= ip; start++) {
+                spots[n_spots].seconds += own_seconds(p, start);
+            }
+            n_spots++;
+        }
+    }
+
+    qsort(ops, n_ops, sizeof(Hotspot), by_seconds);
+    qsort(spots, n_spots, sizeof(Hotspot), by_seconds);
+
+    fprintf(out, "profile: %u program%s, %lu instructions run, %.6f s estimated\n",
+        n_profiles, (n_profiles == 1) ? "" : "s", runs, total);
+    fprintf(out, "%-12s %14s %12s %10s\n", "instruction", "runs", "seconds", "ns/run");
+    for (k = 0; k < n_ops; k++) {
+        fprintf(out, "%-12s %14lu %12.6f %10.1f\n", ops[k].name, ops[k].runs, ops[k].seconds,
+            (ops[k].runs > 0) ? ops[k].seconds * 1.0e9 / ops[k].runs : 0.0);
+    }
+
+    /* Everything under them in their program, what a call runs is a program of its own */
+    fprintf(out, "hottest subexpressions:\n");
+    for (k = 0; k < n_spots && k < profile_config.top; k++) {
+        label.length = 0;
+        label.full = false;
+        label.text[0] = '\0';
+        render(&label, profiles[spots[k].profile].program, profiles[spots[k].profile].spans, spots[k].ip);
+
+        fprintf(out, "%12.6f s %14lu  %s\n", spots[k].seconds, spots[k].runs, label.text);
+    }
+
+    free(ops);
+    free(spots);
+}
+
+void write_folded_profile(FILE* out)
+{
+    Profile* p;
+    Label label;
+    uint64_t* parents;
+    uint64_t* stack;
+    uint64_t* path;
+    uint64_t sp;
+    uint64_t depth;
+    uint64_t ip;
+    uint64_t up;
+    uint64_t nanoseconds;
+    uint32_t i;
+    uint32_t c;
+    int arity;
+    int k;
+
+    for (i = 0; i < n_profiles; i++) {
+        p = &profiles[i];
+
+        parents = malloc(sizeof(uint64_t) * (p->program->size + 1));
+        stack = malloc(sizeof(uint64_t) * (p->program->size + 1));
+        path = malloc(sizeof(uint64_t) * (p->program->size + 1));
+        if (parents == NULL || stack == NULL || path == NULL) {
+            fprintf(stderr, "Failed to allocate profile stacks.\n");
+            exit(5);
+        }
+
+        /* The instruction that consumes each value, the roots point at themselves */
+        sp = 0;
+        for (ip = 0; ip < p->program->size; ip++) {
+            parents[ip] = ip;
+            arity = get_arity(&p->program->base[ip]);
+            for (k = 0; k < arity && sp > 0; k++) {
+                parents[stack[--sp]] = ip;
+            }
+            stack[sp++] = ip;
+        }
+
+        for (ip = 0; ip < p->program->size; ip++) {
+            nanoseconds = (uint64_t) (own_seconds(p, ip) * 1.0e9 + 0.5);
+            if (nanoseconds == 0) {
+                continue;
+            }
+
+            /* Jumps and stores pass their operand through, they aren't a frame of their own */
+            depth = 0;
+            path[depth++] = ip;
+            for (up = ip; parents[up] != up; ) {
+                up = parents[up];
+                if (is_subexpression(&p->program->base[up])) {
+                    path[depth++] = up;
+                }
+            }
+
+            /* Frames can't have a ';' in them, a string constant might */
+            while (depth > 0) {
+                depth--;
+                label.length = 0;
+                label.full = false;
+                label.text[0] = '\0';
+                if (is_subexpression(&p->program->base[path[depth]]) || get_arity(&p->program->base[path[depth]]) == 0) {
+                    render(&label, p->program, p->spans, path[depth]);
+                } else {
+                    append(&label, op_name(&p->program->base[path[depth]]));
+                }
+
+                for (c = 0; c < label.length; c++) {
+                    if (label.text[c] == ';') {
+                        label.text[c] = ',';
+                    }
+                }
+                fprintf(out, "%s%c", label.text, (depth > 0) ? ';' : ' ');
+            }
+            fprintf(out, "%lu\n", nanoseconds);
+        }
+
+        free(parents);
+        free(stack);
+        free(path);
+    }
+}
+
+void free_profiles()
+{
+    uint32_t i;
+
+    for (i = 0; i < n_profiles; i++) {
+        free_token_stack(profiles[i].program);
+        free(profiles[i].spans);
+        free(profiles[i].counts);
+        free(profiles[i].samples);
+        free(profiles[i].seconds);
+    }
+    free(profiles);
+
+    profiles = NULL;
+    n_profiles = 0;
+    profiles_capacity = 0;
+
+    /* Other threads free theirs as they exit */
+    if (profile_config.enabled) {
+        free(get_nesting());
+        pthread_setspecific(nesting_key, NULL);
+    }
+}
+
+static Nesting* get_nesting()
+{
+    Nesting* n;
+
+    pthread_once(&nesting_once, make_key);
+    if ((n = pthread_getspecific(nesting_key)) == NULL) {
+        if ((n = calloc(1, sizeof(Nesting))) == NULL) {
+            fprintf(stderr, "Failed to allocate profile.\n");
+            exit(5);
+        }
+        pthread_setspecific(nesting_key, n);
+    }
+
+    return n;
+}
+
+static void make_key()
+{
+    if (pthread_key_create(&nesting_key, free) != 0) {
+        fprintf(stderr, "Failed to create a thread key.\n");
+        exit(26);
+    }
+}
+
+/* FNV-1a over the instructions and whatever tells two of a type apart */
+static uint64_t fingerprint(TokenStack* program)
+{
+    uint64_t hash;
+    unsigned char* bytes;
+    size_t length;
+    size_t i;
+    uint64_t ip;
+    Token* tok;
+
+    hash = 14695981039346656037UL;
+    for (ip = 0; ip < program->size; ip++) {
+        tok = &program->base[ip];
+
+        bytes = NULL;
+        length = 0;
+        if (tok->type == TOK_IDENTIFIER) {
+            bytes = (unsigned char*) tok->as.string;
+            length = strlen(tok->as.string);
+        } else if (IS_STRING(tok)) {
+            bytes = (unsigned char*) string_bytes(tok);
+            length = string_length(tok);
+        } else if (IS_HIGHER_ORDER(tok->type) && tok->as.lambda != NULL) {
+            bytes = (unsigned char*) tok->as.lambda->param;
+            length = strlen(tok->as.lambda->param);
+            hash = (hash ^ tok->as.lambda->body->size) * 1099511628211UL;
+        } else if (tok->type == TOK_CALL) {
+            bytes = (unsigned char*) tok->as.call->name;
+            length = strlen(tok->as.call->name);
+        } else if (tok->type == TOK_NATIVE) {
+            bytes = (unsigned char*) tok->as.native->name;
+            length = strlen(tok->as.native->name);
+        } else if (tok->type == TOK_LONG || tok->type == TOK_DOUBLE || IS_JUMP(tok->type) || tok->type == TOK_STORE
+            || tok->type == TOK_LOAD || tok->type == TOK_TUPLE || tok->type == TOK_MAKE_ARRAY) {
+            bytes = (unsigned char*) &tok->as;
+            length = sizeof(int64_t);
+        }
+
+        hash = (hash ^ tok->type) * 1099511628211UL;
+        for (i = 0; i < length; i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211UL;
+        }
+    }
+
+    return hash;
+}
+
+/* Sampled average times how often it ran */
+static double own_seconds(Profile* p, uint64_t ip)
+{
+    return (p->samples[ip] > 0) ? p->seconds[ip] / p->samples[ip] * p->counts[ip] : 0.0;
+}
+
+static char* op_name(Token* tok)
+{
+    if (tok->type == TOK_NATIVE) {
+        return tok->as.native->name;
+    }
+    if (tok->type == TOK_LONG || tok->type == TOK_DOUBLE || tok->type == TOK_BIGINT) {
+        return "number";
+    }
+    if (IS_STRING(tok)) {
+        return "string";
+    }
+    if (tok->type == TOK_ARRAY) {
+        return "array";
+    }
+    if (tok->type == TOK_IDENTIFIER) {
+        return "variable";
+    }
+
+    return tok_to_string[tok->type];
+}
+
+/* Worth a line of its own, constants, variables and the bookkeeping around them aren't */
+static bool is_subexpression(Token* tok)
+{
+    return get_arity(tok) > 0 && !IS_JUMP(tok->type) && tok->type != TOK_STORE;
+}
+
+/* The subexpression ending at 'ip', written out the way it could have been typed */
+static void render(Label* label, TokenStack* program, OperandSpan* spans, uint64_t ip)
+{
+    Token* tok;
+    OperandSpan* body;
+    char number[32];
+    uint64_t left;
+    uint64_t i;
+
+    if (label->full) {
+        return;
+    }
+
+    tok = &program->base[ip];
+    switch (tok->type) {
+        case TOK_LONG: {
+            sprintf(number, "%ld", tok->as.i64);
+            append(label, number);
+            break;
+        }
+        case TOK_DOUBLE: {
+            sprintf(number, "%g", tok->as.f64);
+            append(label, number);
+            break;
+        }
+        case TOK_BIGINT: {
+            append(label, "<bigint>");
+            break;
+        }
+        case TOK_ARRAY: {
+            append(label, "[...]");
+            break;
+        }
+        case TOK_STRING:
+        case TOK_SHORT_STRING: {
+            append(label, "\"");
+            for (i = 0; i < string_length(tok) && i < sizeof(number) - 1; i++) {
+                number[i] = string_bytes(tok)[i];
+            }
+            number[i] = '\0';
+            append(label, number);
+            append(label, (i < string_length(tok)) ? "...\"" : "\"");
+            break;
+        }
+        case TOK_IDENTIFIER: {
+            append(label, tok->as.string);
+            break;
+        }
+        case TOK_THEN:
+        case TOK_ELSE:
+        case TOK_SHORT_AND:
+        case TOK_SHORT_OR:
+        case TOK_STORE: {
+            render(label, program, spans, ip - 1);
+            break;
+        }
+        case TOK_LOAD: {
+            for (i = ip; i > 0; i--) {
+                if (program->base[i - 1].type == TOK_STORE && program->base[i - 1].as.i64 == tok->as.i64) {
+                    render(label, program, spans, i - 2);
+                    break;
+                }
+            }
+            break;
+        }
+        case TOK_TUPLE: {
+            render_operands(label, program, spans, ip, 0, get_arity(tok));
+            break;
+        }
+        case TOK_MAKE_ARRAY: {
+            append(label, "[");
+            render_operands(label, program, spans, ip, 0, get_arity(tok));
+            append(label, "]");
+            break;
+        }
+        case TOK_SOLVE:
+        case TOK_MINIMIZE:
+        case TOK_INTEGRATE: {
+            append(label, tok_to_string[tok->type]);
+            append(label, "(");
+            body = find_operand_spans(tok->as.lambda->body, &left);
+            render(label, tok->as.lambda->body, body, tok->as.lambda->body->size - 1);
+            free(body);
+            append(label, ", ");
+            append(label, tok->as.lambda->param);
+            append(label, ", ");
+            render_operands(label, program, spans, ip, 0, get_arity(tok));
+            append(label, ")");
+            break;
+        }
+        default: {
+            if (IS_OPERATOR(tok->type)) {
+                append(label, "(");
+                render(label, program, spans, find_operand_end(spans, ip, 0));
+                append(label, " ");
+                append(label, tok_to_string[tok->type]);
+                append(label, " ");
+                render(label, program, spans, find_operand_end(spans, ip, 1));
+                append(label, ")");
+            } else {
+                append(label, (tok->type == TOK_CALL) ? tok->as.call->name : op_name(tok));
+                append(label, "(");
+                render_operands(label, program, spans, ip, 0, get_arity(tok));
+                append(label, ")");
+            }
+            break;
+        }
+    }
+}
+
+static void render_operands(Label* label, TokenStack* program, OperandSpan* spans, uint64_t ip, int first, int arity)
+{
+    int k;
+
+    for (k = first; k < arity; k++) {
+        if (k > first) {
+            append(label, ", ");
+        }
+        render(label, program, spans, find_operand_end(spans, ip, k));
+    }
+}
+
+static void append(Label* label, char* text)
+{
+    size_t length;
+
+    if (label->full) {
+        return;
+    }
+
+    length = strlen(text);
+    if (label->length + length > PROFILE_LABEL_MAX) {
+        length = PROFILE_LABEL_MAX - label->length;
+        label->full = true;
+    }
+
+    memcpy(label->text + label->length, text, length);
+    label->length += length;
+    if (label->full) {
+        memcpy(label->text + label->length, "...", 3);
+        label->length += 3;
+    }
+    label->text[label->length] = '\0';
+}
+
+static int by_seconds(const void* a, const void* b)
+{
+    double x;
+    double y;
+
+    x = ((Hotspot*) a)->seconds;
+    y = ((Hotspot*) b)->seconds;
+
+    return (x < y) ? 1 : (x > y) ? -1 : 0;
+}
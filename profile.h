@@ -0,0 +1,86 @@
+#ifndef CALC_PROFILE_H
+#define CALC_PROFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "token.h"
+
+/*
+    Opt-in profiler for the evaluators, '--profile'. Every run of a program,
+    by 'eval_program()' or a call of 'eval_columns()', counts how often each
+    instruction runs (in rows, so a tile of 256 rows counts 256) and times a
+    sample of them with the monotonic clock: one in PROFILE_SAMPLE_INTERVAL
+    executions of each instruction in 'eval_program()' (every call), every
+    instruction of every tile in the column evaluator. The time of an instruction is its
+    sampled average times its count.
+
+    Runs are merged into one profile per distinct program under the parallel
+    lock, so a batch spread over worker threads adds up to a single report.
+    Programs are told apart by their content, which lets the bodies of
+    inlined lambdas and the per chunk copies of a program share one profile.
+
+    The report has the time of each kind of instruction and the top N
+    subexpressions by inclusive time, each printed back as an expression.
+    '--profile-folded' writes every instruction's own time as a stack from
+    its program's root down to it, in the folded format flamegraph.pl reads.
+    The programs that calls and solve(), minimize() and integrate() run show
+    up as programs of their own, so the time of those instructions leaves
+    them out: a run started while an instruction is being timed tells the
+    thread how long it took, see 'nested_profile_seconds()'. What is left is
+    the instruction's own work, like binding arguments or Newton's steps.
+*/
+
+#define PROFILE_SAMPLE_INTERVAL 16
+#define PROFILE_LABEL_MAX 60
+
+typedef struct {
+    bool enabled;
+
+    /* Subexpressions in the report */
+    uint32_t top;
+} ProfileConfig;
+
+extern ProfileConfig profile_config;
+
+/*
+    A stretch of work that may run inside an instruction being timed, every
+    run is one. 'parallel_for()' makes its pool one as well, since runs on
+    other threads can't tell the caller how long they took.
+*/
+typedef struct {
+    /* 'nested_profile_seconds()' when it started */
+    double outer;
+    double started;
+
+    /* Inside another run, so there is someone to tell */
+    bool nested;
+} ProfileNesting;
+
+/* Counters of one run, 'counts' is NULL when profiling is off */
+typedef struct {
+    uint64_t* counts;
+    uint64_t* samples;
+    double* seconds;
+    ProfileNesting nesting;
+} ProfileRun;
+
+void start_profile_run(ProfileRun* run, TokenStack* program);
+
+/* Adds the run to the profile of 'program' and frees its counters */
+void finish_profile_run(ProfileRun* run, TokenStack* program);
+
+double profile_clock();
+
+void enter_profile_nesting(ProfileNesting* nesting);
+void leave_profile_nesting(ProfileNesting* nesting);
+
+/* Seconds this thread spent in nested runs so far, an instruction leaves out the difference */
+double nested_profile_seconds();
+
+void print_profile(FILE* out);
+void write_folded_profile(FILE* out);
+void free_profiles();
+
+#endif
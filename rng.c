@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "rng.h"
+#include "fail.h"
+
+#define PHILOX_M0 0xD2511F53UL
+#define PHILOX_M1 0xCD9E8D57UL
+#define PHILOX_W0 0x9E3779B9UL
+#define PHILOX_W1 0xBB67AE85UL
+#define PHILOX_ROUNDS 10
+
+/* 2^-53, one step of a double in [0, 1) */
+#define UNIT_53 1.1102230246251565e-16
+#define TWO_PI 6.283185307179586
+
+RngConfig rng_config = {0};
+
+static void philox(uint32_t* out, uint64_t stream, uint64_t draw);
+
+double draw_uniform(uint64_t stream, uint64_t draw)
+{
+    uint32_t x[4];
+
+    philox(x, stream, draw);
+
+    return (double) ((((uint64_t) x[1] << 32) | x[0]) >> 11) * UNIT_53;
+}
+
+double draw_normal(uint64_t stream, uint64_t draw)
+{
+    uint32_t x[4];
+    double u1;
+    double u2;
+
+    philox(x, stream, draw);
+
+    /* (0, 1], so the log is finite */
+    u1 = (double) (((((uint64_t) x[1] << 32) | x[0]) >> 11) + 1) * UNIT_53;
+    u2 = (double) ((((uint64_t) x[3] << 32) | x[2]) >> 11) * UNIT_53;
+
+    return sqrt(-2.0 * log(u1)) * cos(TWO_PI * u2);
+}
+
+double next_uniform(RngStream* rng)
+{
+    return draw_uniform(rng->stream, rng->draws++);
+}
+
+double next_normal(RngStream* rng)
+{
+    return draw_normal(rng->stream, rng->draws++);
+}
+
+Token draw_token(TokenType type, RngStream* rng, Token* t1, Token* t2)
+{
+    Token output;
+    double a;
+    double b;
+
+    output.type = TOK_DOUBLE;
+    if (type == TOK_RAND) {
+        output.as.f64 = next_uniform(rng);
+        return output;
+    }
+
+    if (!IS_NUMBER(t1) || !IS_NUMBER(t2)) {
+        fail(12, "'%s' unimplemented.", tok_to_string[type]);
+    }
+    a = token_to_double(t1);
+    b = token_to_double(t2);
+
+    if (type == TOK_UNIFORM) {
+        output.as.f64 = a + (b - a) * next_uniform(rng);
+    } else {
+        output.as.f64 = a + b * next_normal(rng);
+    }
+
+    return output;
+}
+
+void vec_uniform(double* out, uint64_t first, uint64_t draw, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = draw_uniform(first + i, draw);
+    }
+}
+
+void vec_normal(double* out, uint64_t first, uint64_t draw, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = draw_normal(first + i, draw);
+    }
+}
+
+/* The counter is the draw and the stream, the key is the seed */
+static void philox(uint32_t* out, uint64_t stream, uint64_t draw)
+{
+    uint32_t c0;
+    uint32_t c1;
+    uint32_t c2;
+    uint32_t c3;
+    uint32_t k0;
+    uint32_t k1;
+    uint64_t p0;
+    uint64_t p1;
+    int round;
+
+    c0 = (uint32_t) draw;
+    c1 = (uint32_t) (draw >> 32);
+    c2 = (uint32_t) stream;
+    c3 = (uint32_t) (stream >> 32);
+    k0 = (uint32_t) rng_config.seed;
+    k1 = (uint32_t) (rng_config.seed >> 32);
+
+    for (round = 0; round < PHILOX_ROUNDS; round++) {
+        p0 = (uint64_t) PHILOX_M0 * c0;
+        p1 = (uint64_t) PHILOX_M1 * c2;
+
+        c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+        c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t) p1;
+        c3 = (uint32_t) p0;
+
+        k0 += (uint32_t) PHILOX_W0;
+        k1 += (uint32_t) PHILOX_W1;
+    }
+
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
@@ -0,0 +1,49 @@
+#ifndef CALC_RNG_H
+#define CALC_RNG_H
+
+#include <stdint.h>
+
+#include "token.h"
+
+/*
+    rand(), uniform(lo, hi) and normal(mu, sigma), drawn from Philox4x32-10, a
+    counter based generator (Salmon et al., "Parallel random numbers: as easy as
+    1, 2, 3"). A draw is a pure function of the seed, the stream and the
+    number of the draw within the stream, so nothing is shared between threads
+    and the same seed gives the same numbers however the work is split.
+
+    The column evaluator uses the row as the stream and numbers the draws of a
+    row in program order. 'eval_program()' numbers them in the order they run,
+    on the stream of its environment.
+
+    A uniform draw takes the top 53 bits of one 64 bit half, a normal draw
+    feeds both halves to Box-Muller.
+*/
+
+typedef struct {
+    uint64_t seed;
+} RngConfig;
+
+extern RngConfig rng_config;
+
+typedef struct RngStream {
+    uint64_t stream;
+    uint64_t draws;
+} RngStream;
+
+/* In [0, 1) */
+double draw_uniform(uint64_t stream, uint64_t draw);
+double draw_normal(uint64_t stream, uint64_t draw);
+
+/* The next draw of 'rng' */
+double next_uniform(RngStream* rng);
+double next_normal(RngStream* rng);
+
+/* rand(), uniform() or normal() on 'rng', 't1' and 't2' are only read by the last two */
+Token draw_token(TokenType type, RngStream* rng, Token* t1, Token* t2);
+
+/* Draw 'draw' of the streams 'first' to 'first + n - 1' */
+void vec_uniform(double* out, uint64_t first, uint64_t draw, uint64_t n);
+void vec_normal(double* out, uint64_t first, uint64_t draw, uint64_t n);
+
+#endif
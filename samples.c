@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "samples.h"
+#include "column.h"
+#include "parallel.h"
+
+typedef struct {
+    /* One block of SAMPLES_CHUNK_ROWS values per output */
+    int64_t* buffer;
+    Column* results;
+
+    /* Per output, over the 'rows' samples of this chunk */
+    double* mean;
+    double* m2;
+    uint64_t rows;
+} SamplesChunk;
+
+typedef struct {
+    ColumnProgram* compiled;
+    uint64_t total;
+    uint64_t first_chunk;
+    SamplesChunk* chunks;
+} SamplesJob;
+
+static void eval_chunk(void* ctx, uint64_t index);
+
+void run_samples(TokenStack* program, Env* env, uint64_t count, FILE* out)
+{
+    SamplesJob job;
+    SamplesChunk* chunk;
+    TokenStack* bound;
+    double* mean;
+    double* m2;
+    double delta;
+    double variance;
+    double half;
+    uint64_t n;
+    uint64_t chunk_count;
+    uint64_t batch;
+    uint64_t first;
+    uint64_t i;
+    uint32_t n_outputs;
+    uint32_t k;
+
+    for (i = 0; i < program->size; i++) {
+        if (IS_AGGREGATE(program->base[i].type)) {
+            fprintf(stderr, "Aggregates are not supported with --samples.\n");
+            exit(27);
+        }
+    }
+
+    bound = bind_constants(program, env, NULL, 0);
+    if (has_free_variables(bound, NULL, 0)) {
+        fprintf(stderr, "Every variable needs a value with --var for --samples.\n");
+        exit(23);
+    }
+    if (count < 2) {
+        fprintf(stderr, "--samples needs at least 2 samples.\n");
+        exit(27);
+    }
+
+    job.compiled = compile_columns(bound, NULL, 0);
+    job.total = count;
+    n_outputs = job.compiled->n_outputs;
+
+    mean = calloc(n_outputs, sizeof(double));
+    m2 = calloc(n_outputs, sizeof(double));
+    chunk_count = (count + SAMPLES_CHUNK_ROWS - 1) / SAMPLES_CHUNK_ROWS;
+    batch = get_thread_count() * SAMPLES_BATCH_CHUNKS;
+
+    if (mean == NULL || m2 == NULL || (job.chunks = calloc(batch, sizeof(SamplesChunk))) == NULL) {
+        fprintf(stderr, "Failed to allocate sample chunks.\n");
+        exit(5);
+    }
+
+    /* Chan et al.'s pairwise update, one chunk at a time in sample order */
+    n = 0;
+    for (first = 0; first < chunk_count; first += batch) {
+        if (first + batch > chunk_count) {
+            batch = chunk_count - first;
+        }
+
+        job.first_chunk = first;
+        parallel_for(batch, eval_chunk, &job);
+
+        for (i = 0; i < batch; i++) {
+            chunk = &job.chunks[i];
+            for (k = 0; k < n_outputs; k++) {
+                delta = chunk->mean[k] - mean[k];
+                mean[k] += delta * chunk->rows / (n + chunk->rows);
+                m2[k] += chunk->m2[k] + delta * delta * n * chunk->rows / (n + chunk->rows);
+            }
+            n += chunk->rows;
+        }
+    }
+
+    for (k = 0; k < n_outputs; k++) {
+        variance = m2[k] / (n - 1);
+        half = SAMPLES_Z95 * sqrt(variance / n);
+        fprintf(out, "mean %.9g, variance %.9g, 95%% interval [%.9g, %.9g]\n",
+            mean[k], variance, mean[k] - half, mean[k] + half);
+    }
+
+    batch = get_thread_count() * SAMPLES_BATCH_CHUNKS;
+    for (i = 0; i < batch; i++) {
+        free(job.chunks[i].buffer);
+        free(job.chunks[i].results);
+        free(job.chunks[i].mean);
+        free(job.chunks[i].m2);
+    }
+    free(job.chunks);
+    free(mean);
+    free(m2);
+    free_column_program(job.compiled);
+    free_token_stack(bound);
+}
+
+static void eval_chunk(void* ctx, uint64_t index)
+{
+    SamplesJob* job;
+    SamplesChunk* chunk;
+    Column* col;
+    uint64_t begin;
+    uint64_t count;
+    uint64_t i;
+    double sum;
+    double x;
+    uint32_t n_outputs;
+    uint32_t k;
+
+    job = ctx;
+    chunk = &job->chunks[index];
+
+    begin = (job->first_chunk + index) * SAMPLES_CHUNK_ROWS;
+    count = job->total - begin;
+    if (count > SAMPLES_CHUNK_ROWS) {
+        count = SAMPLES_CHUNK_ROWS;
+    }
+
+    /* Buffers are kept between batches, every chunk but the last is full size */
+    n_outputs = job->compiled->n_outputs;
+    if (chunk->buffer == NULL) {
+        chunk->buffer = malloc(sizeof(int64_t) * SAMPLES_CHUNK_ROWS * n_outputs);
+        chunk->results = malloc(sizeof(Column) * n_outputs);
+        chunk->mean = malloc(sizeof(double) * n_outputs);
+        chunk->m2 = malloc(sizeof(double) * n_outputs);
+        if (chunk->buffer == NULL || chunk->results == NULL || chunk->mean == NULL || chunk->m2 == NULL) {
+            fprintf(stderr, "Failed to allocate sample chunk.\n");
+            exit(5);
+        }
+    }
+    for (k = 0; k < n_outputs; k++) {
+        chunk->results[k].name = NULL;
+        chunk->results[k].type = job->compiled->results[k];
+        chunk->results[k].as.i64 = chunk->buffer + SAMPLES_CHUNK_ROWS * k;
+    }
+
+    /* No inputs, sample 'begin + i' is row 'begin + i' and draws from its stream */
+    eval_columns(job->compiled, NULL, begin, count, chunk->results);
+
+    /* Two passes over the chunk, the mean first and then the squared deviations from it */
+    for (k = 0; k < n_outputs; k++) {
+        col = &chunk->results[k];
+
+        sum = 0.0;
+        for (i = 0; i < count; i++) {
+            sum += (col->type == TOK_LONG) ? (double) col->as.i64[i] : col->as.f64[i];
+        }
+        chunk->mean[k] = sum / count;
+
+        sum = 0.0;
+        for (i = 0; i < count; i++) {
+            x = ((col->type == TOK_LONG) ? (double) col->as.i64[i] : col->as.f64[i]) - chunk->mean[k];
+            sum += x * x;
+        }
+        chunk->m2[k] = sum;
+    }
+    chunk->rows = count;
+}
@@ -0,0 +1,31 @@
+#ifndef CALC_SAMPLES_H
+#define CALC_SAMPLES_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "token.h"
+#include "eval.h"
+
+/*
+    Monte Carlo estimates, '--samples n' evaluates the program n times with
+    fresh draws of rand() and friends each time, sample i using stream i (see
+    rng.h), and reports the mean, the sample variance and a 95% confidence
+    interval for the mean of every output.
+
+    Samples are evaluated SAMPLES_CHUNK_ROWS at a time through the column
+    evaluator on the worker threads. Each chunk keeps its own mean and sum of
+    squared deviations, and the chunks are merged in order on the main thread,
+    so the result doesn't depend on the thread count.
+*/
+
+#define SAMPLES_CHUNK_ROWS 65536
+#define SAMPLES_BATCH_CHUNKS 2
+
+/* Half width of a 95% interval in standard errors */
+#define SAMPLES_Z95 1.959963984540054
+
+/* Variables are bound from 'env' first, anything left unbound is an error */
+void run_samples(TokenStack* program, Env* env, uint64_t count, FILE* out);
+
+#endif
@@ -7,18 +7,18 @@
 
 #include "scanner.h"
 #include "token.h"
+#include "bigint.h"
+#include "text.h"
+#include "builtin.h"
 
 #define CUR_CHAR source[index]
-#define INITIAL_STRING_SIZE 64
 #define STRING_GROWTH_RATE 2
-#define MAX_ID_LENGTH 32
 
 void skip_whitespace();
 void next_char();
 void scan_number(Token* target);
 void scan_string(Token* target);
 void scan_identifier(Token* target);
-TokenType check_reserved(char* lexeme);
 
 /*
     NOTE: src should be appended with its own '\0' 
@@ -27,16 +27,19 @@ TokenType check_reserved(char* lexeme);
 
 char* source = NULL;
 uint32_t index = 0;
+uint32_t token_start = 0;
 
 void init_scanner(char* src)
 {
     source = src;
     index = 0;
+    token_start = 0;
 }
 
 void next_token(Token* target)
 {
     skip_whitespace();
+    token_start = index;
 
     if (CUR_CHAR == '\0') {
         target->type = TOK_EOF;
@@ -93,10 +96,71 @@ void next_token(Token* target)
                 target->type = TOK_RPAR;
                 break;
             }
+            case '[': {
+                target->type = TOK_LBRACKET;
+                break;
+            }
+            case ']': {
+                target->type = TOK_RBRACKET;
+                break;
+            }
             case ',': {
                 target->type = TOK_COMMA;
                 break;
             }
+            case '=': {
+                target->type = TOK_ASSIGN;
+                if (source[index + 1] == '=') {
+                    target->type = TOK_EQ;
+                    next_char();
+                }
+                break;
+            }
+            case '<': {
+                target->type = TOK_LT;
+                if (source[index + 1] == '=') {
+                    target->type = TOK_LE;
+                    next_char();
+                }
+                break;
+            }
+            case '>': {
+                target->type = TOK_GT;
+                if (source[index + 1] == '=') {
+                    target->type = TOK_GE;
+                    next_char();
+                }
+                break;
+            }
+            case '!': {
+                /* Only as part of '!=', a lone '!' ends the input like any other stray character */
+                target->type = TOK_EOF;
+                if (source[index + 1] == '=') {
+                    target->type = TOK_NE;
+                    next_char();
+                }
+                break;
+            }
+            case '&': {
+                target->type = TOK_EOF;
+                if (source[index + 1] == '&') {
+                    target->type = TOK_AND;
+                    next_char();
+                }
+                break;
+            }
+            case '|': {
+                target->type = TOK_EOF;
+                if (source[index + 1] == '|') {
+                    target->type = TOK_OR;
+                    next_char();
+                }
+                break;
+            }
+            case ';': {
+                target->type = TOK_SEMICOLON;
+                break;
+            }
             default: {
                 target->type = TOK_EOF;
                 break;
@@ -118,10 +182,22 @@ void scan_number(Token* target)
     /*
         i64 max is 19 digits, as for f64...
         https://stackoverflow.com/questions/1701055/what-is-the-maximum-length-in-chars-needed-to-represent-any-double-value
+        Longer integers become a TOK_BIGINT, so the buffer has to fit the whole literal.
     */
-    char buffer[32] = {0};
-    
-    char* idx = buffer;
+    char* buffer;
+    char* idx;
+    uint32_t length;
+    BigInt* big;
+
+    length = 0;
+    while (isdigit(source[index + length]) || source[index + length] == '.') {
+        length++;
+    }
+    if ((buffer = malloc(length + 1)) == NULL) {
+        fprintf(stderr, "Failed to alloc space for number.\n");
+        exit(1);
+    }
+    idx = buffer;
 
     while (CUR_CHAR != '\0' && isdigit(CUR_CHAR)) {
         *idx = CUR_CHAR;
@@ -147,9 +223,23 @@ void scan_number(Token* target)
     } else {
         *idx = '\0';
 
-        target->type = TOK_LONG;
-        target->as.i64 = atol(buffer);
+        /* 18 digits always fit */
+        if (idx - buffer < 19) {
+            target->type = TOK_LONG;
+            target->as.i64 = atol(buffer);
+        } else {
+            big = big_from_string(buffer);
+            if (big_to_i64(big, &target->as.i64)) {
+                target->type = TOK_LONG;
+                free_big(big);
+            } else {
+                target->type = TOK_BIGINT;
+                target->as.big = big;
+            }
+        }
     }
+
+    free(buffer);
 }
 
 void scan_string(Token* target)
@@ -158,60 +248,81 @@ void scan_string(Token* target)
         NOTE: next_token() calls next_char() prior to this function, 
         so that the first character we have to handle here is not the '"'.
     */
-    char* str_val;
-    char* cur_pos;
+    uint32_t length;
 
-    if ((str_val = malloc(INITIAL_STRING_SIZE + 1)) == NULL) {
-        fprintf(stderr, "Failed to alloc space for string.\n");
-        exit(1);
+    length = 0;
+    while (source[index + length] != '\0' && source[index + length] != '"') {
+        length++;
     }
 
-    /* TODO: strings currently don't resize if longer than 64 characters */
-    cur_pos = str_val;
-
-    while (CUR_CHAR != '\0' && CUR_CHAR != '"') {
-        *cur_pos = CUR_CHAR;
-        cur_pos++;
-        next_char();
+    if (source[index + length] != '"') {
+        fprintf(stderr, "Unterminated string.\n");
+        exit(32);
     }
-    *cur_pos = '\0';
-    next_char();
 
-    target->type = TOK_STRING;
-    target->as.string = str_val;
+    *target = make_string(source + index, length);
+
+    index += length;
+    next_char();
 }
 
 void scan_identifier(Token* target)
 {
-    char lexeme[MAX_ID_LENGTH + 1];
-    uint8_t i;
-
-    /* TODO: should probably throw an error if ID_LENGTH is exceeded */
-    i = 0;
-    while (CUR_CHAR != '\0' && i < MAX_ID_LENGTH) {
-        if (isalnum(CUR_CHAR) || CUR_CHAR == '_') {
-            lexeme[i] = CUR_CHAR;
-        } else {
-            break;
-        }
-        i += 1;
+    char* lexeme;
+    Native* native;
+    uint32_t length;
+
+    /* As long as it goes, CSV and Arrow column names can be long */
+    length = 0;
+    while (isalnum(source[index + length]) || source[index + length] == '_') {
+        length++;
+    }
 
-        /* You numbskull, don't forget to call next character at the end of the loop */
-        next_char();
+    lexeme = malloc(length + 1);
+    if (lexeme == NULL) {
+        fprintf(stderr, "Identifier allocation failed...");
+        exit(11);
     }
-    lexeme[i] = '\0';
+    memcpy(lexeme, source + index, length);
+    lexeme[length] = '\0';
 
-    target->type = check_reserved(lexeme);
+    index += length;
+
+    target->type = lookup_name(lexeme, &native);
+    if (target->type == TOK_NATIVE) {
+        target->as.native = native;
+        free(lexeme);
+        return;
+    }
     if (target->type != TOK_IDENTIFIER) {
+        target->as.string = NULL;
+        free(lexeme);
         return;
     }
 
-    target->as.string = malloc(strlen(lexeme) + 1);
-    if (target->as.string == NULL) {
-        fprintf(stderr, "Identifier allocation failed...");
-        exit(11);
+    target->as.string = lexeme;
+}
+
+uint32_t token_position()
+{
+    return token_start;
+}
+
+char* get_source()
+{
+    return source;
+}
+
+uint64_t input_left(uint64_t limit)
+{
+    uint64_t length;
+
+    length = 0;
+    while (length < limit && source[index + length] != '\0') {
+        length++;
     }
-    strncpy(target->as.string, lexeme, strlen(lexeme));
+
+    return length;
 }
 
 void cleanup_scanner()
@@ -236,31 +347,3 @@ void next_char()
         index += 1;
     }
 }
-
-typedef struct {
-    TokenType type;
-    char* id;
-} ReservedPair;
-
-ReservedPair reserved[] = {
-    {TOK_SIN, "sin"},
-    {TOK_COS, "cos"},
-    {TOK_TAN, "tan"},
-};
-
-
-/* Yes, this is linear search & no I'm not ashamed... */
-TokenType check_reserved(char* lexeme) {
-    uint32_t reserved_length;
-    uint32_t idx;
-    
-    reserved_length = sizeof(reserved) / sizeof(reserved[0]);
-
-    for (idx = 0; idx < reserved_length; idx++) {
-        if (strcmp(reserved[idx].id, lexeme) == 0) {
-            return reserved[idx].type;
-        }
-    }
-
-    return TOK_IDENTIFIER;
-}
\ No newline at end of file
@@ -5,6 +5,14 @@
 
 void init_scanner(char* src);
 void next_token(Token* target);
+
+/* Where the token 'next_token()' returned last starts, as an offset into the source */
+uint32_t token_position();
+char* get_source();
+
+/* Bytes not scanned yet, counting no further than 'limit' */
+uint64_t input_left(uint64_t limit);
+
 void cleanup_scanner();
 
 #endif
\ No newline at end of file
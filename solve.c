@@ -0,0 +1,436 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <stdbool.h>
+
+#include "solve.h"
+#include "autodiff.h"
+#include "parallel.h"
+#include "budget.h"
+#include "fail.h"
+
+#define BRACKET_GROWTH 1.6
+
+/* 2 - golden ratio, and a floor so that a minimum at 0 still terminates */
+#define CGOLD 0.3819660112501051
+#define ZEPS 1.0e-10
+
+SolverConfig solver_config = {1.0e-12, 100};
+SolverStats solver_stats = {0, 0, 0, 0, 0.0};
+
+/* Per call counters, merged into 'solver_stats' under the lock at the end */
+typedef struct {
+    Lambda* f;
+    Env* scope;
+    SolverStats stats;
+} Problem;
+
+static double eval_at(Problem* p, double x, double* dfdx);
+static bool find_bracket(Problem* p, double x0, double* a, double* b, double* fa, double* fb);
+static double brent_root(Problem* p, double a, double b, double fa, double fb, double tol);
+static bool has_iterations(Problem* p);
+static void finish(Problem* p);
+static bool is_finite(double x);
+
+Token solve_lambda(Lambda* f, Env* env, Token* x0)
+{
+    Problem p;
+    Token output;
+    double x;
+    double fx;
+    double dfdx;
+    double step;
+    double a;
+    double b;
+    double fa;
+    double fb;
+    Failure failure;
+    bool caught;
+    bool newton;
+    bool converged;
+
+    p.f = f;
+    p.scope = alloc_env(env);
+    p.stats.calls = 1;
+    p.stats.iterations = 0;
+    p.stats.evaluations = 0;
+    p.stats.fallbacks = 0;
+    p.stats.max_residual = 0.0;
+
+    /* Like 'integrate_lambda()', the scope is freed when a failure goes past */
+    caught = caught_failure() != NULL;
+    if (caught) {
+        catch_failures(&failure);
+        if (setjmp(failure.jump) != 0) {
+            free_env(p.scope);
+            pass_failure(&failure);
+        }
+    }
+
+    x = token_to_double(x0);
+    newton = can_differentiate(f->body);
+    converged = false;
+
+    /*
+        The iteration cap covers the whole call, Newton gets at most half of it
+        so that the bracket search and Brent have the rest. A body that can't
+        be differentiated goes to them straight away.
+    */
+    while (newton && p.stats.iterations < (solver_config.max_iterations + 1) / 2) {
+        p.stats.iterations++;
+
+        fx = eval_at(&p, x, &dfdx);
+        if (fx == 0.0) {
+            converged = true;
+            break;
+        }
+        if (dfdx == 0.0 || !is_finite(dfdx) || !is_finite(fx)) {
+            break;
+        }
+
+        step = fx / dfdx;
+        x -= step;
+        if (!is_finite(x)) {
+            break;
+        }
+
+        if (fabs(step) <= solver_config.tolerance * (1.0 + fabs(x))) {
+            converged = true;
+            break;
+        }
+    }
+
+    /* With the budget gone the answer no longer matters, see 'eval_at()' */
+    if (!converged && (p.scope->budget == NULL || p.scope->budget->exceeded == NULL)) {
+        p.stats.fallbacks++;
+
+        x = token_to_double(x0);
+        if (!find_bracket(&p, x, &a, &b, &fa, &fb)) {
+            if (caught) {
+                release_failures(&failure);
+            }
+            free_env(p.scope);
+            if (!has_iterations(&p)) {
+                fail(30, "'solve' found no root near %f in %u iterations.", token_to_double(x0),
+                    solver_config.max_iterations);
+            }
+            fail(30, "'solve' found no root near %f.", token_to_double(x0));
+        }
+        x = brent_root(&p, a, b, fa, fb, solver_config.tolerance * (1.0 + fabs(x)));
+    }
+
+    fx = fabs(eval_at(&p, x, NULL));
+    if (fx > p.stats.max_residual) {
+        p.stats.max_residual = fx;
+    }
+
+    if (caught) {
+        release_failures(&failure);
+    }
+    finish(&p);
+
+    output.type = TOK_DOUBLE;
+    output.as.f64 = x;
+
+    return output;
+}
+
+Token minimize_lambda(Lambda* f, Env* env, Token* lo, Token* hi)
+{
+    Problem p;
+    Token output;
+    double a, b, d, e, etemp;
+    double fu, fv, fw, fx;
+    double pp, q, r, tol, tol1, tol2;
+    double u, v, w, x, xm;
+    Failure failure;
+    bool caught;
+
+    p.f = f;
+    p.scope = alloc_env(env);
+    p.stats.calls = 1;
+    p.stats.iterations = 0;
+    p.stats.evaluations = 0;
+    p.stats.fallbacks = 0;
+    p.stats.max_residual = 0.0;
+
+    caught = caught_failure() != NULL;
+    if (caught) {
+        catch_failures(&failure);
+        if (setjmp(failure.jump) != 0) {
+            free_env(p.scope);
+            pass_failure(&failure);
+        }
+    }
+
+    a = token_to_double(lo);
+    b = token_to_double(hi);
+    if (a > b) {
+        x = a;
+        a = b;
+        b = x;
+    }
+
+    /* Parabolic interpolation can't do better than sqrt(epsilon) */
+    tol = solver_config.tolerance;
+    if (tol < sqrt(DBL_EPSILON)) {
+        tol = sqrt(DBL_EPSILON);
+    }
+
+    /* Brent's method, as in Numerical Recipes */
+    x = w = v = a + CGOLD * (b - a);
+    fx = fw = fv = eval_at(&p, x, NULL);
+    d = e = 0.0;
+
+    while (has_iterations(&p)) {
+        p.stats.iterations++;
+
+        xm = 0.5 * (a + b);
+        tol1 = tol * fabs(x) + ZEPS;
+        tol2 = 2.0 * tol1;
+
+        if (fabs(x - xm) <= tol2 - 0.5 * (b - a)) {
+            break;
+        }
+
+        if (fabs(e) > tol1) {
+            r = (x - w) * (fx - fv);
+            q = (x - v) * (fx - fw);
+            pp = (x - v) * q - (x - w) * r;
+            q = 2.0 * (q - r);
+            if (q > 0.0) {
+                pp = -pp;
+            }
+            q = fabs(q);
+            etemp = e;
+            e = d;
+
+            if (fabs(pp) >= fabs(0.5 * q * etemp) || pp <= q * (a - x) || pp >= q * (b - x)) {
+                /* Golden section step */
+                e = (x >= xm) ? a - x : b - x;
+                d = CGOLD * e;
+            } else {
+                /* Parabolic step */
+                d = pp / q;
+                u = x + d;
+                if (u - a < tol2 || b - u < tol2) {
+                    d = (xm - x >= 0.0) ? tol1 : -tol1;
+                }
+            }
+        } else {
+            e = (x >= xm) ? a - x : b - x;
+            d = CGOLD * e;
+        }
+
+        u = (fabs(d) >= tol1) ? x + d : x + ((d >= 0.0) ? tol1 : -tol1);
+        fu = eval_at(&p, u, NULL);
+
+        if (fu <= fx) {
+            if (u >= x) {
+                a = x;
+            } else {
+                b = x;
+            }
+            v = w;
+            w = x;
+            x = u;
+            fv = fw;
+            fw = fx;
+            fx = fu;
+        } else {
+            if (u < x) {
+                a = u;
+            } else {
+                b = u;
+            }
+            if (fu <= fw || w == x) {
+                v = w;
+                w = u;
+                fv = fw;
+                fw = fu;
+            } else if (fu <= fv || v == x || v == w) {
+                v = u;
+                fv = fu;
+            }
+        }
+    }
+
+    if (caught) {
+        release_failures(&failure);
+    }
+    finish(&p);
+
+    output.type = TOK_DOUBLE;
+    output.as.f64 = x;
+
+    return output;
+}
+
+void print_solver_stats(FILE* out)
+{
+    fprintf(out, "solver: %lu calls, %lu iterations, %lu evaluations, %lu newton fallbacks, max residual %g\n",
+        solver_stats.calls, solver_stats.iterations, solver_stats.evaluations,
+        solver_stats.fallbacks, solver_stats.max_residual);
+}
+
+/* f(x), and f'(x) as well if 'dfdx' isn't NULL */
+static double eval_at(Problem* p, double x, double* dfdx)
+{
+    Token arg;
+    Token value;
+    double result;
+
+    arg.type = TOK_DOUBLE;
+    arg.as.f64 = x;
+    bind_variable(p->scope, p->f->param, &arg);
+
+    if (dfdx != NULL) {
+        eval_gradient(p->f->body, p->scope, &p->f->param, 1, &value, dfdx);
+    } else {
+        value = eval_program(p->f->body, p->scope);
+    }
+
+    p->stats.evaluations++;
+
+    /* Out of budget, 'eval_program()' stops early and so does every later call */
+    result = (value.type == TOK_EOF) ? 0.0 / 0.0 : token_to_double(&value);
+    scrub_token(&value);
+
+    return result;
+}
+
+/* Grows an interval around x0 until f changes sign across it, each step is an iteration */
+static bool find_bracket(Problem* p, double x0, double* a, double* b, double* fa, double* fb)
+{
+    double h;
+
+    h = (x0 == 0.0) ? 1.0e-3 : 1.0e-3 * fabs(x0);
+    *a = x0 - h;
+    *b = x0 + h;
+    *fa = eval_at(p, *a, NULL);
+    *fb = eval_at(p, *b, NULL);
+
+    for (;;) {
+        if ((*fa < 0.0 && *fb > 0.0) || (*fa > 0.0 && *fb < 0.0) || *fa == 0.0 || *fb == 0.0) {
+            return true;
+        }
+        if (!has_iterations(p)) {
+            return false;
+        }
+        p->stats.iterations++;
+
+        /* Walk away from whichever end is further from zero */
+        if (fabs(*fa) < fabs(*fb)) {
+            *a += BRACKET_GROWTH * (*a - *b);
+            *fa = eval_at(p, *a, NULL);
+        } else {
+            *b += BRACKET_GROWTH * (*b - *a);
+            *fb = eval_at(p, *b, NULL);
+        }
+    }
+}
+
+/* Brent's root finder, 'a' and 'b' must bracket a root */
+static double brent_root(Problem* p, double a, double b, double fa, double fb, double tol)
+{
+    double c, d, e, fc;
+    double pp, q, r, s, tol1, xm, min1, min2;
+
+    if (fa == 0.0) {
+        return a;
+    }
+
+    c = b;
+    fc = fb;
+    d = e = b - a;
+
+    while (has_iterations(p)) {
+        p->stats.iterations++;
+
+        if ((fb > 0.0 && fc > 0.0) || (fb < 0.0 && fc < 0.0)) {
+            c = a;
+            fc = fa;
+            d = e = b - a;
+        }
+        if (fabs(fc) < fabs(fb)) {
+            a = b;
+            b = c;
+            c = a;
+            fa = fb;
+            fb = fc;
+            fc = fa;
+        }
+
+        tol1 = 2.0 * DBL_EPSILON * fabs(b) + 0.5 * tol;
+        xm = 0.5 * (c - b);
+        if (fabs(xm) <= tol1 || fb == 0.0) {
+            return b;
+        }
+
+        if (fabs(e) >= tol1 && fabs(fa) > fabs(fb)) {
+            /* Inverse quadratic interpolation, or secant if only two points */
+            s = fb / fa;
+            if (a == c) {
+                pp = 2.0 * xm * s;
+                q = 1.0 - s;
+            } else {
+                q = fa / fc;
+                r = fb / fc;
+                pp = s * (2.0 * xm * q * (q - r) - (b - a) * (r - 1.0));
+                q = (q - 1.0) * (r - 1.0) * (s - 1.0);
+            }
+            if (pp > 0.0) {
+                q = -q;
+            }
+            pp = fabs(pp);
+
+            min1 = 3.0 * xm * q - fabs(tol1 * q);
+            min2 = fabs(e * q);
+            if (2.0 * pp < ((min1 < min2) ? min1 : min2)) {
+                e = d;
+                d = pp / q;
+            } else {
+                d = xm;
+                e = d;
+            }
+        } else {
+            /* Bisection */
+            d = xm;
+            e = d;
+        }
+
+        a = b;
+        fa = fb;
+        b += (fabs(d) > tol1) ? d : ((xm >= 0.0) ? tol1 : -tol1);
+        fb = eval_at(p, b, NULL);
+    }
+
+    return b;
+}
+
+static bool has_iterations(Problem* p)
+{
+    return p->stats.iterations < solver_config.max_iterations;
+}
+
+static void finish(Problem* p)
+{
+    free_env(p->scope);
+
+    parallel_lock();
+    solver_stats.calls += p->stats.calls;
+    solver_stats.iterations += p->stats.iterations;
+    solver_stats.evaluations += p->stats.evaluations;
+    solver_stats.fallbacks += p->stats.fallbacks;
+    if (p->stats.max_residual > solver_stats.max_residual) {
+        solver_stats.max_residual = p->stats.max_residual;
+    }
+    parallel_unlock();
+}
+
+static bool is_finite(double x)
+{
+    /* inf - inf and nan - nan are both nan */
+    return x - x == 0.0;
+}
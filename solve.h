@@ -0,0 +1,53 @@
+#ifndef CALC_SOLVE_H
+#define CALC_SOLVE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "token.h"
+#include "eval.h"
+
+/*
+    solve(expr, x, x0) finds a root of expr near x0. Newton's method runs first,
+    with the derivative from forward mode AD rather than finite differences.
+    If Newton stalls (zero or non-finite derivative, or no convergence within
+    half the iteration cap), or expr can't be differentiated at all (see
+    'can_differentiate()'), a bracket is grown around x0 and Brent's method
+    finishes. Every Newton step, bracket step and Brent step counts against
+    the one cap, 'max_iterations' is for the whole call.
+
+    minimize(expr, x, lo, hi) returns the x in [lo, hi] minimizing expr, using
+    Brent's method: parabolic interpolation with golden section steps as the
+    fallback whenever the parabola misbehaves.
+
+    The expression is compiled once by the parser, each iteration just runs it.
+*/
+
+typedef struct {
+    /* Relative tolerance on x */
+    double tolerance;
+
+    /* Over a whole solve() or minimize() call */
+    uint32_t max_iterations;
+} SolverConfig;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t iterations;
+    uint64_t evaluations;
+
+    /* Times Newton gave up and Brent took over */
+    uint64_t fallbacks;
+
+    /* Largest |expr| left at a root */
+    double max_residual;
+} SolverStats;
+
+extern SolverConfig solver_config;
+extern SolverStats solver_stats;
+
+Token solve_lambda(Lambda* f, Env* env, Token* x0);
+Token minimize_lambda(Lambda* f, Env* env, Token* lo, Token* hi);
+void print_solver_stats(FILE* out);
+
+#endif
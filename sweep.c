@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include "sweep.h"
+#include "column.h"
+#include "parallel.h"
+
+typedef struct {
+    char* text;
+    uint64_t size;
+    uint64_t capacity;
+
+    /* One block of SWEEP_CHUNK_ROWS values per output, then per axis */
+    int64_t* buffer;
+    Column* results;
+
+    /* What binary output writes, 'size' values, interleaved when there are several outputs */
+    int64_t* packed;
+} Chunk;
+
+typedef struct {
+    ColumnProgram* compiled;
+    SweepAxis* axes;
+    uint32_t n_axes;
+    uint64_t total;
+    uint64_t first_chunk;
+    bool binary;
+    Chunk* chunks;
+} SweepJob;
+
+static void eval_chunk(void* ctx, uint64_t index);
+static void append_value(Chunk* chunk, Column* col, uint64_t row, char end);
+static bool is_integer(char* text);
+
+void parse_sweep_axis(char* spec, SweepAxis* axis)
+{
+    char* eq;
+    char* parts[3];
+    char* pos;
+    uint32_t n;
+    double lo;
+    double hi;
+    double step;
+    double count;
+
+    if ((eq = strchr(spec, '=')) == NULL) {
+        fprintf(stderr, "Bad sweep '%s', expected name=lo:hi:step.\n", spec);
+        exit(27);
+    }
+
+    *eq = '\0';
+    axis->name = spec;
+
+    n = 0;
+    pos = eq + 1;
+    parts[n++] = pos;
+    while ((pos = strchr(pos, ':')) != NULL && n < 3) {
+        *pos = '\0';
+        pos++;
+        parts[n++] = pos;
+    }
+
+    if (n != 3) {
+        fprintf(stderr, "Bad sweep '%s', expected name=lo:hi:step.\n", spec);
+        exit(27);
+    }
+
+    lo = atof(parts[0]);
+    hi = atof(parts[1]);
+    step = atof(parts[2]);
+
+    /* 'x - x' is only 0 for finite values, which also catches nan */
+    if (lo - lo != 0.0 || hi - hi != 0.0 || step - step != 0.0 || !(step > 0.0)) {
+        fprintf(stderr, "Bad sweep '%s', the bounds must be finite and the step above 0.\n", spec);
+        exit(27);
+    }
+    if (hi < lo) {
+        fprintf(stderr, "Sweep '%s' never reaches its upper bound.\n", spec);
+        exit(27);
+    }
+
+    /* Integers past 2^62 are left to doubles, so that 'hi - lo' can't overflow */
+    if (is_integer(parts[0]) && is_integer(parts[1]) && is_integer(parts[2])
+        && fabs(lo) < SWEEP_MAX_POINTS && fabs(hi) < SWEEP_MAX_POINTS && step < SWEEP_MAX_POINTS) {
+        axis->type = TOK_LONG;
+        axis->lo.i64 = atol(parts[0]);
+        axis->step.i64 = atol(parts[2]);
+        count = (double) ((atol(parts[1]) - axis->lo.i64) / axis->step.i64) + 1.0;
+    } else {
+        axis->type = TOK_DOUBLE;
+        axis->lo.f64 = lo;
+        axis->step.f64 = step;
+
+        /* A little slack so that '0:1:0.1' includes 1 */
+        count = floor((hi - lo) / step + 1e-9) + 1.0;
+    }
+
+    /* Also false when 'hi - lo' overflowed to inf */
+    if (!(count <= SWEEP_MAX_POINTS)) {
+        fprintf(stderr, "Sweep '%s' has too many points.\n", spec);
+        exit(27);
+    }
+    axis->count = (uint64_t) count;
+}
+
+void run_sweep(TokenStack* program, SweepAxis* axes, uint32_t n_axes, bool binary, FILE* out)
+{
+    SweepJob job;
+    Column columns[MAX_SWEEP_AXES];
+    uint64_t chunk_count;
+    uint64_t batch;
+    uint64_t first;
+    uint64_t i;
+    uint32_t a;
+
+    for (i = 0; i < program->size; i++) {
+        if (IS_AGGREGATE(program->base[i].type)) {
+            fprintf(stderr, "Aggregates are not supported with --sweep.\n");
+            exit(27);
+        }
+    }
+
+    /* Only the names and types matter for compiling */
+    for (a = 0; a < n_axes; a++) {
+        columns[a].name = axes[a].name;
+        columns[a].type = axes[a].type;
+        columns[a].as.i64 = NULL;
+    }
+
+    job.compiled = compile_columns(program, columns, n_axes);
+    job.axes = axes;
+    job.n_axes = n_axes;
+    job.binary = binary;
+
+    job.total = 1;
+    for (a = 0; a < n_axes; a++) {
+        if (axes[a].count > SWEEP_MAX_POINTS / job.total) {
+            fprintf(stderr, "The sweep has more than %.0f points.\n", (double) SWEEP_MAX_POINTS);
+            exit(27);
+        }
+        job.total *= axes[a].count;
+    }
+
+    chunk_count = (job.total + SWEEP_CHUNK_ROWS - 1) / SWEEP_CHUNK_ROWS;
+    batch = get_thread_count() * SWEEP_BATCH_CHUNKS;
+
+    if ((job.chunks = calloc(batch, sizeof(Chunk))) == NULL) {
+        fprintf(stderr, "Failed to allocate sweep chunks.\n");
+        exit(5);
+    }
+
+    for (first = 0; first < chunk_count; first += batch) {
+        if (first + batch > chunk_count) {
+            batch = chunk_count - first;
+        }
+
+        job.first_chunk = first;
+        parallel_for(batch, eval_chunk, &job);
+
+        /* Writing stays on this thread so the output is in grid order */
+        for (i = 0; i < batch; i++) {
+            if (binary) {
+                fwrite(job.chunks[i].packed, sizeof(int64_t), job.chunks[i].size, out);
+            } else {
+                fwrite(job.chunks[i].text, 1, job.chunks[i].size, out);
+            }
+        }
+    }
+
+    batch = get_thread_count() * SWEEP_BATCH_CHUNKS;
+    for (i = 0; i < batch; i++) {
+        free(job.chunks[i].text);
+        free(job.chunks[i].buffer);
+        free(job.chunks[i].results);
+    }
+    free(job.chunks);
+    free_column_program(job.compiled);
+}
+
+static void eval_chunk(void* ctx, uint64_t index)
+{
+    SweepJob* job;
+    Chunk* chunk;
+    Column columns[MAX_SWEEP_AXES];
+    uint64_t begin;
+    uint64_t count;
+    uint64_t stride;
+    uint64_t row;
+    uint64_t i;
+    uint32_t n_outputs;
+    uint32_t blocks;
+    uint32_t a;
+    uint32_t k;
+
+    job = ctx;
+    chunk = &job->chunks[index];
+
+    begin = (job->first_chunk + index) * SWEEP_CHUNK_ROWS;
+    count = job->total - begin;
+    if (count > SWEEP_CHUNK_ROWS) {
+        count = SWEEP_CHUNK_ROWS;
+    }
+
+    /* Buffers are kept between batches, every chunk but the last is full size */
+    n_outputs = job->compiled->n_outputs;
+    blocks = n_outputs + job->n_axes + ((job->binary && n_outputs > 1) ? n_outputs : 0);
+    if (chunk->buffer == NULL) {
+        chunk->buffer = malloc(sizeof(int64_t) * SWEEP_CHUNK_ROWS * blocks);
+        chunk->results = malloc(sizeof(Column) * n_outputs);
+        if (chunk->buffer == NULL || chunk->results == NULL) {
+            fprintf(stderr, "Failed to allocate sweep chunk.\n");
+            exit(5);
+        }
+    }
+    for (k = 0; k < n_outputs; k++) {
+        chunk->results[k].name = NULL;
+        chunk->results[k].type = job->compiled->results[k];
+        chunk->results[k].as.i64 = chunk->buffer + SWEEP_CHUNK_ROWS * k;
+    }
+
+    /* Generate the coordinates of this chunk, each axis repeats every 'stride' points */
+    stride = 1;
+    for (a = job->n_axes; a-- > 0;) {
+        columns[a].name = job->axes[a].name;
+        columns[a].type = job->axes[a].type;
+        columns[a].as.i64 = chunk->buffer + SWEEP_CHUNK_ROWS * (n_outputs + a);
+
+        for (i = 0; i < count; i++) {
+            row = ((begin + i) / stride) % job->axes[a].count;
+            if (columns[a].type == TOK_LONG) {
+                columns[a].as.i64[i] = job->axes[a].lo.i64 + row * job->axes[a].step.i64;
+            } else {
+                columns[a].as.f64[i] = job->axes[a].lo.f64 + row * job->axes[a].step.f64;
+            }
+        }
+
+        stride *= job->axes[a].count;
+    }
+
+    eval_columns(job->compiled, columns, begin, count, chunk->results);
+
+    if (job->binary) {
+        /* Point by point, the outputs of a point next to each other */
+        chunk->packed = chunk->buffer;
+        if (n_outputs > 1) {
+            chunk->packed = chunk->buffer + SWEEP_CHUNK_ROWS * (n_outputs + job->n_axes);
+            for (i = 0; i < count; i++) {
+                for (k = 0; k < n_outputs; k++) {
+                    chunk->packed[i * n_outputs + k] = chunk->results[k].as.i64[i];
+                }
+            }
+        }
+        chunk->size = count * n_outputs;
+        return;
+    }
+
+    chunk->size = 0;
+    for (i = 0; i < count; i++) {
+        for (a = 0; a < job->n_axes; a++) {
+            append_value(chunk, &columns[a], i, ' ');
+        }
+        for (k = 0; k < n_outputs; k++) {
+            append_value(chunk, &chunk->results[k], i, (k + 1 < n_outputs) ? ' ' : '\n');
+        }
+    }
+}
+
+static void append_value(Chunk* chunk, Column* col, uint64_t row, char end)
+{
+    int written;
+
+    if (chunk->size + MAX_FORMATTED_NUMBER > chunk->capacity) {
+        chunk->capacity = (chunk->capacity == 0) ? SWEEP_CHUNK_ROWS * 32 : chunk->capacity * 2;
+        if ((chunk->text = realloc(chunk->text, chunk->capacity)) == NULL) {
+            fprintf(stderr, "Failed to allocate sweep output.\n");
+            exit(5);
+        }
+    }
+
+    /* Same formats as 'print_token()' */
+    if (col->type == TOK_LONG) {
+        written = sprintf(chunk->text + chunk->size, "%ld%c", col->as.i64[row], end);
+    } else {
+        written = sprintf(chunk->text + chunk->size, "%f%c", col->as.f64[row], end);
+    }
+
+    chunk->size += written;
+}
+
+static bool is_integer(char* text)
+{
+    if (*text == '-' || *text == '+') {
+        text++;
+    }
+    if (*text == '\0') {
+        return false;
+    }
+
+    while (*text != '\0') {
+        if (*text < '0' || *text > '9') {
+            return false;
+        }
+        text++;
+    }
+
+    return true;
+}
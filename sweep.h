@@ -0,0 +1,48 @@
+#ifndef CALC_SWEEP_H
+#define CALC_SWEEP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "token.h"
+
+/*
+    Tabulates a program over a grid, one axis per '--sweep name=lo:hi:step'.
+    The last axis varies fastest. An axis whose bounds and step are all integers
+    is a TOK_LONG column, otherwise it is TOK_DOUBLE. Bounds must be finite,
+    'lo <= hi', the step above 0, and the grid at most SWEEP_MAX_POINTS.
+
+    The grid is cut into chunks of SWEEP_CHUNK_ROWS points which are generated,
+    evaluated and formatted on the worker threads, then written out in order.
+    Only a batch of chunks per thread is ever held in memory.
+*/
+
+#define SWEEP_CHUNK_ROWS 16384
+#define SWEEP_BATCH_CHUNKS 4
+#define MAX_SWEEP_AXES 8
+#define SWEEP_MAX_POINTS ((uint64_t) 1 << 62)
+
+typedef struct {
+    char* name;
+    TokenType type;
+
+    union {
+        int64_t i64;
+        double f64;
+    } lo, step;
+
+    uint64_t count;
+} SweepAxis;
+
+void parse_sweep_axis(char* spec, SweepAxis* axis);
+
+/*
+    Text output is one line per point with the coordinates followed by the value,
+    binary output is just the raw values (int64 or double, native byte order).
+    A program with several outputs gives all of them in order, on the same line
+    or one after the other.
+*/
+void run_sweep(TokenStack* program, SweepAxis* axes, uint32_t n_axes, bool binary, FILE* out);
+
+#endif
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "table.h"
+
+#define INITIAL_TEXT_SIZE 4096
+#define INITIAL_TABLE_ROWS 1024
+#define TABLE_GROWTH_FACTOR 2
+
+static char* read_all(FILE* in);
+static char* skip_blanks(char* pos);
+static void grow_columns(Table* table, uint64_t capacity);
+static void widen_column(Column* col, uint64_t rows);
+
+Table* read_table(FILE* in)
+{
+    Table* output;
+    char* text;
+    char* pos;
+    char* end;
+    char* start;
+    uint64_t capacity;
+    uint32_t col;
+    int64_t l;
+    double d;
+
+    if ((output = malloc(sizeof(Table))) == NULL) {
+        fprintf(stderr, "Failed to allocate table.\n");
+        exit(5);
+    }
+    output->columns = NULL;
+    output->width = 0;
+    output->rows = 0;
+
+    text = read_all(in);
+
+    /* Header */
+    pos = skip_blanks(text);
+    while (*pos != '\0' && *pos != '\n') {
+        start = pos;
+        while (*pos != '\0' && !isspace(*pos)) {
+            pos++;
+        }
+
+        output->columns = realloc(output->columns, sizeof(Column) * (output->width + 1));
+        if (output->columns == NULL || (output->columns[output->width].name = malloc(pos - start + 1)) == NULL) {
+            fprintf(stderr, "Failed to allocate table header.\n");
+            exit(5);
+        }
+        memcpy(output->columns[output->width].name, start, pos - start);
+        output->columns[output->width].name[pos - start] = '\0';
+        output->columns[output->width].type = TOK_LONG;
+        output->columns[output->width].as.i64 = NULL;
+        output->width += 1;
+
+        pos = skip_blanks(pos);
+    }
+
+    if (output->width == 0) {
+        fprintf(stderr, "Table has no header.\n");
+        exit(25);
+    }
+
+    capacity = INITIAL_TABLE_ROWS;
+    grow_columns(output, capacity);
+
+    /* Rows */
+    while (*pos != '\0') {
+        pos++;
+        pos = skip_blanks(pos);
+        if (*pos == '\n' || *pos == '\0') {
+            continue;
+        }
+
+        if (output->rows == capacity) {
+            capacity *= TABLE_GROWTH_FACTOR;
+            grow_columns(output, capacity);
+        }
+
+        for (col = 0; col < output->width; col++) {
+            l = strtol(pos, &end, 10);
+            if (end != pos && (*end == '\0' || isspace(*end)) && output->columns[col].type == TOK_LONG) {
+                output->columns[col].as.i64[output->rows] = l;
+            } else {
+                d = strtod(pos, &end);
+                if (end == pos) {
+                    fprintf(stderr, "Bad value in row %lu, column '%s'.\n",
+                        output->rows + 1, output->columns[col].name);
+                    exit(25);
+                }
+                if (output->columns[col].type == TOK_LONG) {
+                    widen_column(&output->columns[col], output->rows);
+                }
+                output->columns[col].as.f64[output->rows] = d;
+            }
+
+            pos = skip_blanks(end);
+            if (col + 1 < output->width && (*pos == '\n' || *pos == '\0')) {
+                fprintf(stderr, "Row %lu is missing values.\n", output->rows + 1);
+                exit(25);
+            }
+        }
+
+        if (*pos != '\n' && *pos != '\0') {
+            fprintf(stderr, "Row %lu has too many values.\n", output->rows + 1);
+            exit(25);
+        }
+
+        output->rows += 1;
+    }
+
+    free(text);
+
+    return output;
+}
+
+void free_table(Table* target)
+{
+    uint32_t i;
+
+    for (i = 0; i < target->width; i++) {
+        free(target->columns[i].name);
+        free(target->columns[i].as.i64);
+    }
+    free(target->columns);
+    free(target);
+}
+
+static char* read_all(FILE* in)
+{
+    char* text;
+    uint64_t size;
+    uint64_t capacity;
+    size_t got;
+
+    capacity = INITIAL_TEXT_SIZE;
+    size = 0;
+    if ((text = malloc(capacity + 1)) == NULL) {
+        fprintf(stderr, "Failed to allocate input buffer.\n");
+        exit(5);
+    }
+
+    while ((got = fread(text + size, 1, capacity - size, in)) > 0) {
+        size += got;
+        if (size == capacity) {
+            capacity *= TABLE_GROWTH_FACTOR;
+            if ((text = realloc(text, capacity + 1)) == NULL) {
+                fprintf(stderr, "Failed to allocate input buffer.\n");
+                exit(5);
+            }
+        }
+    }
+    text[size] = '\0';
+
+    return text;
+}
+
+/* Skips whitespace, but stops at newlines since they end a row */
+static char* skip_blanks(char* pos)
+{
+    while (*pos != '\0' && *pos != '\n' && isspace(*pos)) {
+        pos++;
+    }
+
+    return pos;
+}
+
+static void grow_columns(Table* table, uint64_t capacity)
+{
+    uint32_t i;
+
+    /* NOTE: both union members are 8 bytes, so one realloc fits either type */
+    for (i = 0; i < table->width; i++) {
+        table->columns[i].as.i64 = realloc(table->columns[i].as.i64, sizeof(int64_t) * capacity);
+        if (table->columns[i].as.i64 == NULL) {
+            fprintf(stderr, "Failed to grow table.\n");
+            exit(5);
+        }
+    }
+}
+
+static void widen_column(Column* col, uint64_t rows)
+{
+    uint64_t i;
+
+    /* In place, a long and a double are the same size */
+    for (i = 0; i < rows; i++) {
+        col->as.f64[i] = col->as.i64[i];
+    }
+    col->type = TOK_DOUBLE;
+}
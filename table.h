@@ -0,0 +1,23 @@
+#ifndef CALC_TABLE_H
+#define CALC_TABLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "column.h"
+
+/*
+    A set of equally long named columns. The text format is a header line of
+    whitespace separated names followed by one line of numbers per row. A column
+    is TOK_LONG if every value in it is an integer, TOK_DOUBLE otherwise.
+*/
+typedef struct {
+    Column* columns;
+    uint32_t width;
+    uint64_t rows;
+} Table;
+
+Table* read_table(FILE* in);
+void free_table(Table* target);
+
+#endif
@@ -1,139 +1,430 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
 
 #include "token.h"
 #include "scanner.h"
 #include "parser.h"
+#include "column.h"
+#include "table.h"
+#include "aggregate.h"
+#include "sweep.h"
+#include "eval.h"
+#include "autodiff.h"
+#include "solve.h"
+#include "integrate.h"
+#include "model.h"
+#include "function.h"
+#include "emit.h"
+#include "budget.h"
+#include "csv.h"
+#include "columnar.h"
+#include "arrow.h"
+#include "rng.h"
+#include "samples.h"
+#include "profile.h"
+#include "accuracy.h"
+
+#define MAX_GRADIENT_VARIABLES 64
+
+typedef enum {
+    GRAD_NONE,
+    GRAD_FORWARD,
+    GRAD_REVERSE
+} GradientMode;
+
+void usage();
+void out_of_budget(Budget* budget);
+void eval_rows(TokenStack* program);
+void print_gradient(TokenStack* program, Env* env, GradientMode mode);
+void report_profile(char* folded_path);
 
 int main(int argc, char* argv[]) {
     TokenStack* output_stack;
-    TokenStack* value_stack;
-    Token t1;
-    Token t2;
-    Token result;
-    uint64_t ip;
+    Token* outputs;
+    uint32_t n_outputs;
+    uint32_t i;
     char* buffer;
+    SweepAxis axes[MAX_SWEEP_AXES];
+    uint32_t n_axes;
+    bool rows;
+    bool binary;
+    bool solver_report;
+    bool model;
+    bool f32;
+    char* emit_name;
+    char* csv_path;
+    char* out_path;
+    char* folded_path;
+    MappedTable* mapped;
+    uint64_t samples;
+    FILE* out;
+    GradientMode grad;
+    Budget budget;
+    RngStream rng;
+    Env* env;
+    int arg;
 
-    if (argc != 2) {
-        fprintf(stderr, "USAGE: calc \"<expression>\"\n");
-        exit(22);
+    /* Not in the usage, a check of the vector kernels against libm */
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "--check-vmath") == 0) {
+        return check_vmath(stdout, (argc == 3) ? strtoul(argv[2], NULL, 10) : ACCURACY_POINTS) ? 0 : 1;
+    }
+
+    rows = false;
+    binary = false;
+    solver_report = false;
+    model = false;
+    f32 = false;
+    emit_name = NULL;
+    csv_path = NULL;
+    out_path = NULL;
+    folded_path = NULL;
+    mapped = NULL;
+    samples = 0;
+    grad = GRAD_NONE;
+    n_axes = 0;
+    env = alloc_env(NULL);
+
+    /* One stream for the whole evaluation, call frames and solvers draw from it too */
+    rng.stream = 0;
+    rng.draws = 0;
+    env->rng = &rng;
+
+    for (arg = 1; arg < argc - 1; arg++) {
+        if (strcmp(argv[arg], "--rows") == 0) {
+            rows = true;
+        } else if (strcmp(argv[arg], "--model") == 0) {
+            model = true;
+        } else if (strcmp(argv[arg], "--csv") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            csv_path = argv[arg];
+        } else if (strcmp(argv[arg], "--raw") == 0 && arg + 1 < argc - 1
+            && (mapped == NULL || mapped->format == FORMAT_RAW)) {
+            arg++;
+            if (mapped == NULL) {
+                mapped = alloc_mapped_table(FORMAT_RAW);
+            }
+            map_raw_column(mapped, argv[arg]);
+        } else if (strcmp(argv[arg], "--arrow") == 0 && arg + 1 < argc - 1 && mapped == NULL) {
+            arg++;
+            mapped = alloc_mapped_table(FORMAT_ARROW);
+            read_arrow(mapped, argv[arg]);
+        } else if (strcmp(argv[arg], "--out") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            out_path = argv[arg];
+        } else if (strcmp(argv[arg], "--samples") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            samples = strtoul(argv[arg], NULL, 10);
+        } else if (strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            rng_config.seed = strtoul(argv[arg], NULL, 10);
+        } else if (strcmp(argv[arg], "--f32") == 0) {
+            f32 = true;
+        } else if (strcmp(argv[arg], "--binary") == 0) {
+            binary = true;
+        } else if (strcmp(argv[arg], "--emit-c") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            emit_name = argv[arg];
+        } else if (strcmp(argv[arg], "--grad") == 0) {
+            grad = GRAD_FORWARD;
+        } else if (strcmp(argv[arg], "--grad-reverse") == 0) {
+            grad = GRAD_REVERSE;
+        } else if (strcmp(argv[arg], "--tol") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            solver_config.tolerance = atof(argv[arg]);
+        } else if (strcmp(argv[arg], "--max-iter") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            solver_config.max_iterations = atol(argv[arg]);
+        } else if (strcmp(argv[arg], "--int-tol") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            integrate_config.tolerance = atof(argv[arg]);
+        } else if (strcmp(argv[arg], "--int-max-intervals") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            integrate_config.max_intervals = atol(argv[arg]);
+        } else if (strcmp(argv[arg], "--max-input") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            limit_config.max_input = atol(argv[arg]);
+        } else if (strcmp(argv[arg], "--max-tokens") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            limit_config.max_tokens = atol(argv[arg]);
+        } else if (strcmp(argv[arg], "--max-depth") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            limit_config.max_depth = atol(argv[arg]);
+        } else if (strcmp(argv[arg], "--max-instructions") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            limit_config.max_instructions = atol(argv[arg]);
+        } else if (strcmp(argv[arg], "--max-bytes") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            limit_config.max_bytes = atol(argv[arg]);
+        } else if (strcmp(argv[arg], "--timeout") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            limit_config.max_seconds = atof(argv[arg]);
+        } else if (strcmp(argv[arg], "--profile") == 0) {
+            profile_config.enabled = true;
+        } else if (strcmp(argv[arg], "--profile-top") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            profile_config.enabled = true;
+            profile_config.top = atol(argv[arg]);
+        } else if (strcmp(argv[arg], "--profile-folded") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            profile_config.enabled = true;
+            folded_path = argv[arg];
+        } else if (strcmp(argv[arg], "--solver-stats") == 0) {
+            solver_report = true;
+        } else if (strcmp(argv[arg], "--var") == 0 && arg + 1 < argc - 1) {
+            arg++;
+            parse_binding(argv[arg], env);
+        } else if (strcmp(argv[arg], "--sweep") == 0 && arg + 1 < argc - 1 && n_axes < MAX_SWEEP_AXES) {
+            arg++;
+            parse_sweep_axis(argv[arg], &axes[n_axes]);
+            n_axes++;
+        } else {
+            usage();
+        }
+    }
+
+    if (argc < 2 || (rows && n_axes > 0) || (binary && n_axes == 0) || (grad != GRAD_NONE && (rows || n_axes > 0))
+        || (model && (rows || n_axes > 0 || grad != GRAD_NONE))
+        || (emit_name != NULL && (rows || n_axes > 0 || grad != GRAD_NONE || model))
+        || (csv_path != NULL && (rows || n_axes > 0 || grad != GRAD_NONE || model || emit_name != NULL))
+        || (mapped != NULL && (rows || n_axes > 0 || grad != GRAD_NONE || model || emit_name != NULL || csv_path != NULL))
+        || (samples > 0 && (rows || n_axes > 0 || grad != GRAD_NONE || model || emit_name != NULL || csv_path != NULL
+            || mapped != NULL))
+        || (out_path != NULL && csv_path == NULL && mapped == NULL)
+        || (f32 && mapped == NULL)) {
+        usage();
+    }
+
+    /* The last argument is the model file, not an expression */
+    if (model) {
+        run_model(argv[argc - 1], stdin, stdout);
+        report_profile(folded_path);
+        free_env(env);
+        return 0;
     }
 
     /* char* buffer = "3.1415 * 5.3 ^ 2"; */
-    buffer = argv[1];
+    buffer = argv[argc - 1];
 
     init_scanner(buffer);
     
+    /* One budget for parsing and evaluating */
+    start_budget(&budget);
     init_parser();
-    parse_expr();
+    if (!parse_expr(&budget)) {
+        out_of_budget(&budget);
+    }
 
     output_stack = get_output_stack();
-    value_stack = alloc_token_stack();
-
-    /* Evaluate output stack here... */
-    for (ip = 0; ip < output_stack->size; ip++) {
-        switch (output_stack->base[ip].type) {
-            /* TODO: Can do TOK_STRING here as well someday... */
-            case TOK_DOUBLE:
-            case TOK_LONG: {
-                push_token_stack(value_stack, &output_stack->base[ip]);
-                break;
+
+    if (rows || n_axes > 0 || csv_path != NULL || mapped != NULL) {
+        if (rows) {
+            eval_rows(output_stack);
+        } else if (csv_path != NULL || mapped != NULL) {
+            out = stdout;
+            if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+                fprintf(stderr, "Failed to open '%s'.\n", out_path);
+                exit(25);
             }
+            if (csv_path != NULL) {
+                run_csv(output_stack, buffer, csv_path, out);
+            } else {
+                run_columnar(output_stack, buffer, mapped, f32, out);
+                free_mapped_table(mapped);
+            }
+            if (out != stdout) {
+                fclose(out);
+            }
+        } else {
+            run_sweep(output_stack, axes, n_axes, binary, stdout);
+        }
 
-            case TOK_ADD: {
-                t2 = pop_token_stack(value_stack);
-                t1 = pop_token_stack(value_stack);
+        if (solver_report) {
+            print_solver_stats(stderr);
+        }
+        report_profile(folded_path);
 
-                result = add_tokens(&t1, &t2);
-                
-                push_token_stack(value_stack, &result);
-                break;
-            }
-            case TOK_SUB: {
-                t2 = pop_token_stack(value_stack);
-                t1 = pop_token_stack(value_stack);
+        free_env(env);
+        cleanup_parser();
+        cleanup_scanner();
+        free_functions();
+        return 0;
+    }
 
-                result = sub_tokens(&t1, &t2);
+    if (samples > 0) {
+        run_samples(output_stack, env, samples, stdout);
+    } else if (emit_name != NULL) {
+        emit_c(output_stack, env, emit_name, buffer, stdout);
+    } else if (grad != GRAD_NONE) {
+        print_gradient(output_stack, env, grad);
+    } else {
+        /* One line per output */
+        n_outputs = count_outputs(output_stack);
+        if ((outputs = malloc(sizeof(Token) * n_outputs)) == NULL) {
+            fprintf(stderr, "Failed to allocate outputs.\n");
+            exit(5);
+        }
 
-                push_token_stack(value_stack, &result);
-                break;
-            }
-            case TOK_MUL: {
-                t2 = pop_token_stack(value_stack);
-                t1 = pop_token_stack(value_stack);
+        env->budget = &budget;
+        eval_outputs(output_stack, env, outputs);
+        if (budget.exceeded != NULL) {
+            out_of_budget(&budget);
+        }
+        for (i = 0; i < n_outputs; i++) {
+            print_token(&outputs[i]);
+            scrub_token(&outputs[i]);
+        }
+        free(outputs);
+    }
 
-                result = mul_tokens(&t1, &t2);
+    if (solver_report) {
+        print_solver_stats(stderr);
+    }
+    report_profile(folded_path);
 
-                push_token_stack(value_stack, &result);
-                break;
-            }
-            case TOK_DIV: {
-                t2 = pop_token_stack(value_stack);
-                t1 = pop_token_stack(value_stack);
+    output_stack = NULL; /* Not really necessary, but prevents further misuse */
+    free_env(env);
 
-                result = div_tokens(&t1, &t2);
+    /* 'cleanup_parser()' frees the output stack */
+    cleanup_parser();
+    cleanup_scanner();
+    free_functions();
 
-                push_token_stack(value_stack, &result);
-                break;
-            }
-            case TOK_MOD: {
-                t2 = pop_token_stack(value_stack);
-                t1 = pop_token_stack(value_stack);
+    return 0;
+}
 
-                result = mod_tokens(&t1, &t2);
+void usage()
+{
+    fprintf(stderr, "USAGE: calc \"<expression>\"\n");
+    fprintf(stderr, "       calc --rows \"<expression>\" < table\n");
+    fprintf(stderr, "       calc [--binary] --sweep x=lo:hi:step [--sweep ...] \"<expression>\"\n");
+    fprintf(stderr, "       calc --csv <in.csv> [--out <out.csv>] \"<expression>\"\n");
+    fprintf(stderr, "       calc [--f32] (--raw name:i64=<file> | --raw name:f64=<file> | --raw name:f32=<file> ...)\n");
+    fprintf(stderr, "            [--out <file>] \"<expression>\"\n");
+    fprintf(stderr, "       calc [--f32] --arrow <in.arrow> [--out <out.arrow>] \"<expression>\"\n");
+    fprintf(stderr, "       calc --model <file> < updates\n");
+    fprintf(stderr, "       calc [--grad | --grad-reverse] [--var x=value ...] \"<expression>\"\n");
+    fprintf(stderr, "       calc --emit-c <name> [--var x=value ...] \"<expression>\" > name.h\n");
+    fprintf(stderr, "       calc --samples <n> [--var x=value ...] \"<expression>\"\n");
+    fprintf(stderr, "rand(), uniform() and normal() take --seed <n>\n");
+    fprintf(stderr, "solve() and minimize() take --tol <relative>, --max-iter <n> and --solver-stats\n");
+    fprintf(stderr, "integrate() takes --int-tol <relative> and --int-max-intervals <n>\n");
+    fprintf(stderr, "--profile, --profile-top <n> and --profile-folded <file> report where the time went\n");
+    fprintf(stderr, "limits: --max-input <bytes>, --max-tokens <n>, --max-depth <n>, --max-instructions <n>,\n");
+    fprintf(stderr, "        --max-bytes <per value> and --timeout <seconds>\n");
+    exit(22);
+}
 
-                push_token_stack(value_stack, &result);
-                break;
-            }
-            case TOK_EXP: {
-                t2 = pop_token_stack(value_stack);
-                t1 = pop_token_stack(value_stack);
+/* The report goes to stderr next to the results, the stacks to their own file */
+void report_profile(char* folded_path)
+{
+    FILE* folded;
+
+    if (!profile_config.enabled) {
+        return;
+    }
 
-                result = exp_tokens(&t1, &t2);
+    print_profile(stderr);
+    if (folded_path != NULL) {
+        if ((folded = fopen(folded_path, "w")) == NULL) {
+            fprintf(stderr, "Failed to open '%s'.\n", folded_path);
+            exit(25);
+        }
+        write_folded_profile(folded);
+        fclose(folded);
+    }
+    free_profiles();
+}
 
-                push_token_stack(value_stack, &result);
-                break;
-            }
-            case TOK_SIN: {
-                t1 = pop_token_stack(value_stack);
+void out_of_budget(Budget* budget)
+{
+    fprintf(stderr, "Exceeded the %s limit.\n", budget->exceeded);
+    exit(35);
+}
 
-                result = sin_token(&t1);
+/*
+    Evaluates 'program' once per row of the table on stdin, a column tile at a time.
+    Aggregates are folded into constants first, and if no column is referenced
+    outside of them the program only produces a single value.
+*/
+void eval_rows(TokenStack* program)
+{
+    Table* table;
+    TokenStack* resolved;
+    ColumnProgram* compiled;
+    Column* results;
+    uint64_t rows;
+    uint64_t row;
+    uint32_t k;
 
-                push_token_stack(value_stack, &result);
-                break;
-            }
-            case TOK_COS: {
-                t1 = pop_token_stack(value_stack);
+    table = read_table(stdin);
+    resolved = resolve_aggregates(program, table->columns, table->width, table->rows);
+    compiled = compile_columns(resolved, table->columns, table->width);
 
-                result = cos_token(&t1);
+    rows = (has_free_variables(resolved, NULL, 0) || has_impure(resolved)) ? table->rows : 1;
 
-                push_token_stack(value_stack, &result);
-                break;
-            }
-            case TOK_TAN: {
-                t1 = pop_token_stack(value_stack);
+    if ((results = malloc(sizeof(Column) * compiled->n_outputs)) == NULL) {
+        fprintf(stderr, "Failed to allocate result column.\n");
+        exit(5);
+    }
+    for (k = 0; k < compiled->n_outputs; k++) {
+        results[k].name = NULL;
+        results[k].type = compiled->results[k];
+        if ((results[k].as.i64 = malloc(sizeof(int64_t) * (rows + 1))) == NULL) {
+            fprintf(stderr, "Failed to allocate result column.\n");
+            exit(5);
+        }
+    }
 
-                result = tan_token(&t1);
+    eval_columns(compiled, table->columns, 0, rows, results);
 
-                push_token_stack(value_stack, &result);
-                break;
-            }
-            default : {
-                fprintf(stderr, "Unimplemented instruction.\n");
-                exit(420);
+    /* Same formats as 'print_token()', the outputs of a row on one line */
+    for (row = 0; row < rows; row++) {
+        for (k = 0; k < compiled->n_outputs; k++) {
+            if (results[k].type == TOK_LONG) {
+                printf("%ld", results[k].as.i64[row]);
+            } else {
+                printf("%f", results[k].as.f64[row]);
             }
+            putchar((k + 1 < compiled->n_outputs) ? ' ' : '\n');
         }
     }
 
-    print_token(&value_stack->base[0]);
+    for (k = 0; k < compiled->n_outputs; k++) {
+        free(results[k].as.i64);
+    }
+    free(results);
+    free_column_program(compiled);
+    free_token_stack(resolved);
+    free_table(table);
+}
 
-    output_stack = NULL; /* Not really necessary, but prevents further misuse */
-    free_token_stack(value_stack);
+/* Prints the value followed by the partial derivative for every bound variable */
+void print_gradient(TokenStack* program, Env* env, GradientMode mode)
+{
+    char* names[MAX_GRADIENT_VARIABLES];
+    double partials[MAX_GRADIENT_VARIABLES];
+    uint32_t n;
+    uint32_t i;
+    Token value;
 
-    /* 'cleanup_parser()' frees the output stack */
-    cleanup_parser();
-    cleanup_scanner();
+    if (count_outputs(program) > 1) {
+        fprintf(stderr, "Only a single output can be differentiated.\n");
+        exit(29);
+    }
 
-    return 0;
-}
\ No newline at end of file
+    n = collect_variables(program, env, names, MAX_GRADIENT_VARIABLES);
+
+    if (mode == GRAD_FORWARD) {
+        eval_gradient(program, env, names, n, &value, partials);
+    } else {
+        eval_gradient_reverse(program, env, names, n, &value, partials);
+    }
+
+    print_token(&value);
+    for (i = 0; i < n; i++) {
+        printf("d/d%s = %f\n", names[i], partials[i]);
+    }
+}
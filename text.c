@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "text.h"
+#include "bigint.h"
+#include "array.h"
+#include "fail.h"
+
+static Text* alloc_text(uint64_t capacity);
+static Token wrap_text(Text* target);
+static int64_t clamp_index(Token* tok, uint64_t limit);
+
+Text* retain_text(Text* target)
+{
+    __sync_add_and_fetch(&target->refs, 1);
+    return target;
+}
+
+void release_text(Text* target)
+{
+    if (target == NULL) {
+        return;
+    }
+
+    if (__sync_sub_and_fetch(&target->refs, 1) == 0) {
+        free(target->bytes);
+        free(target);
+    }
+}
+
+Token make_string(char* bytes, uint64_t length)
+{
+    Token output;
+    Text* text;
+
+    if (length <= SHORT_STRING_MAX) {
+        output.type = TOK_SHORT_STRING;
+        memcpy(output.as.small, bytes, length);
+        output.as.small[length] = '\0';
+        return output;
+    }
+
+    text = alloc_text(length + 1);
+    memcpy(text->bytes, bytes, length);
+    text->bytes[length] = '\0';
+    text->length = length;
+
+    return wrap_text(text);
+}
+
+uint64_t string_length(Token* tok)
+{
+    return (tok->type == TOK_STRING) ? tok->as.text->length : strlen(tok->as.small);
+}
+
+char* string_bytes(Token* tok)
+{
+    return (tok->type == TOK_STRING) ? tok->as.text->bytes : tok->as.small;
+}
+
+int compare_strings(Token* t1, Token* t2)
+{
+    uint64_t a;
+    uint64_t b;
+    int order;
+
+    a = string_length(t1);
+    b = string_length(t2);
+
+    order = memcmp(string_bytes(t1), string_bytes(t2), (a < b) ? a : b);
+    if (order != 0) {
+        return order;
+    }
+
+    return (a > b) - (a < b);
+}
+
+/*
+    Nobody else can see a Text whose only reference is 't1', and the caller
+    scrubs 't1' right after, so the result can take it over.
+*/
+Token concat_strings(Token* t1, Token* t2)
+{
+    Token output;
+    Text* target;
+    char* grown;
+    uint64_t a;
+    uint64_t b;
+
+    if (!IS_STRING(t1) || !IS_STRING(t2)) {
+        fail(9, "Only a string can be added to a string, see str().");
+    }
+
+    a = string_length(t1);
+    b = string_length(t2);
+
+    if (a + b <= SHORT_STRING_MAX) {
+        output.type = TOK_SHORT_STRING;
+        memcpy(output.as.small, string_bytes(t1), a);
+        memcpy(output.as.small + a, string_bytes(t2), b + 1);
+        return output;
+    }
+
+    if (t1->type == TOK_STRING && t1->as.text->refs == 1) {
+        target = retain_text(t1->as.text);
+        if (a + b + 1 > target->capacity) {
+            while (a + b + 1 > target->capacity) {
+                target->capacity *= TEXT_GROWTH_FACTOR;
+            }
+            if ((grown = realloc(target->bytes, target->capacity)) == NULL) {
+                fprintf(stderr, "Failed to grow string.\n");
+                exit(5);
+            }
+            target->bytes = grown;
+        }
+    } else {
+        target = alloc_text(a + b + 1);
+        memcpy(target->bytes, string_bytes(t1), a);
+    }
+
+    memcpy(target->bytes + a, string_bytes(t2), b + 1);
+    target->length = a + b;
+
+    return wrap_text(target);
+}
+
+Token len_token(Token* t1)
+{
+    Token output;
+
+    if (!IS_STRING(t1)) {
+        fail(9, "len() takes a string.");
+    }
+
+    output.type = TOK_LONG;
+    output.as.i64 = string_length(t1);
+
+    return output;
+}
+
+Token substr_tokens(Token* t1, Token* t2, Token* t3)
+{
+    int64_t start;
+    int64_t count;
+    uint64_t length;
+
+    if (!IS_STRING(t1)) {
+        fail(9, "substr() takes a string.");
+    }
+
+    length = string_length(t1);
+    start = clamp_index(t2, length);
+    count = clamp_index(t3, length - start);
+
+    return make_string(string_bytes(t1) + start, count);
+}
+
+Token str_token(Token* t1)
+{
+    Token output;
+    char buffer[MAX_FORMATTED_NUMBER];
+    char* text;
+
+    switch (t1->type) {
+        case TOK_STRING:
+        case TOK_SHORT_STRING: {
+            return copy_token(t1);
+        }
+        case TOK_LONG: {
+            sprintf(buffer, "%ld", t1->as.i64);
+            return make_string(buffer, strlen(buffer));
+        }
+        case TOK_DOUBLE: {
+            sprintf(buffer, "%f", t1->as.f64);
+            return make_string(buffer, strlen(buffer));
+        }
+        case TOK_BIGINT:
+        case TOK_ARRAY: {
+            text = (t1->type == TOK_BIGINT) ? big_to_string(t1->as.big) : array_to_string(t1->as.array);
+            output = make_string(text, strlen(text));
+            free(text);
+            return output;
+        }
+        default: {
+            fail(9, "str() takes a number.");
+        }
+    }
+}
+
+/* Digits with at most one '.', like 'scan_number()', and an optional sign */
+Token num_token(Token* t1)
+{
+    Token output;
+    BigInt* big;
+    char* bytes;
+    char* digits;
+    char* end;
+    char* copy;
+    bool negative;
+    bool real;
+
+    if (!IS_STRING(t1)) {
+        fail(9, "num() takes a string.");
+    }
+
+    bytes = string_bytes(t1);
+    while (isspace((unsigned char) *bytes)) {
+        bytes++;
+    }
+
+    digits = bytes;
+    negative = *digits == '-';
+    if (*digits == '-' || *digits == '+') {
+        digits++;
+    }
+
+    real = false;
+    for (end = digits; isdigit((unsigned char) *end) || (*end == '.' && !real); end++) {
+        real = real || *end == '.';
+    }
+    if (end == digits || (real && end == digits + 1) || strspn(end, " \t\n\r") != strlen(end)) {
+        fail(9, "'%s' is not a number.", string_bytes(t1));
+    }
+
+    if (real) {
+        output.type = TOK_DOUBLE;
+        output.as.f64 = atof(bytes);
+        return output;
+    }
+
+    if ((copy = malloc(end - digits + 1)) == NULL) {
+        fprintf(stderr, "Failed to alloc space for number.\n");
+        exit(5);
+    }
+    memcpy(copy, digits, end - digits);
+    copy[end - digits] = '\0';
+
+    big = big_from_string(copy);
+    free(copy);
+    big->negative = negative && big->size > 0;
+    if (big_to_i64(big, &output.as.i64)) {
+        output.type = TOK_LONG;
+        free_big(big);
+    } else {
+        output.type = TOK_BIGINT;
+        output.as.big = big;
+    }
+
+    return output;
+}
+
+static Text* alloc_text(uint64_t capacity)
+{
+    Text* output;
+
+    if ((output = malloc(sizeof(Text))) == NULL || (output->bytes = malloc(capacity)) == NULL) {
+        fprintf(stderr, "Failed to allocate string.\n");
+        exit(5);
+    }
+
+    output->refs = 1;
+    output->length = 0;
+    output->capacity = capacity;
+
+    return output;
+}
+
+static Token wrap_text(Text* target)
+{
+    Token output;
+
+    output.type = TOK_STRING;
+    output.as.text = target;
+
+    return output;
+}
+
+/* A position or count in [0, limit] */
+static int64_t clamp_index(Token* tok, uint64_t limit)
+{
+    double value;
+
+    value = token_to_double(tok);
+    if (value != value || value < 0) {
+        return 0;
+    }
+
+    return (value > limit) ? (int64_t) limit : (int64_t) value;
+}
@@ -0,0 +1,61 @@
+#ifndef CALC_TEXT_H
+#define CALC_TEXT_H
+
+#include <stdint.h>
+
+#include "token.h"
+
+/*
+    String values. Up to SHORT_STRING_MAX bytes are a TOK_SHORT_STRING held in
+    the token itself, so labels and names never touch the heap. Anything
+    longer is a TOK_STRING pointing at a reference counted Text, which
+    'copy_token()' shares rather than copies.
+
+    '+' concatenates. The result of a concatenation is allocated at its final
+    length, and a left operand that holds the only reference to its Text is
+    appended to in place, growing by TEXT_GROWTH_FACTOR. A chain like
+    '"x = " + str(x) + ", y = " + str(y)' therefore stays linear and only
+    reallocates a logarithmic number of times.
+
+    Both kinds are NUL terminated and compare bytewise like 'memcmp()', so
+    '==' and '<' work on any pair of strings.
+*/
+
+#define TEXT_GROWTH_FACTOR 2
+
+typedef struct Text {
+    uint32_t refs;
+    uint64_t length;
+    uint64_t capacity;
+    char* bytes;
+} Text;
+
+Text* retain_text(Text* target);
+void release_text(Text* target);
+
+/* A string of the first 'length' bytes at 'bytes', short when it fits */
+Token make_string(char* bytes, uint64_t length);
+
+uint64_t string_length(Token* tok);
+
+/* NUL terminated, good for as long as 'tok' is */
+char* string_bytes(Token* tok);
+
+/* Negative, zero or positive like 'memcmp()', shorter first on a tie */
+int compare_strings(Token* t1, Token* t2);
+
+Token concat_strings(Token* t1, Token* t2);
+
+/* len(s), in bytes */
+Token len_token(Token* t1);
+
+/* substr(s, start, count), both clamped to the string, doubles truncated */
+Token substr_tokens(Token* t1, Token* t2, Token* t3);
+
+/* str(x), formatted the way calc prints 'x' */
+Token str_token(Token* t1);
+
+/* num(s), read the way calc reads a number, exits if 's' isn't one */
+Token num_token(Token* t1);
+
+#endif
@@ -2,18 +2,65 @@
 #include <stdio.h>
 #include <assert.h>
 #include <math.h>
+#include <string.h>
 
 #include "token.h"
+#include "bigint.h"
+#include "modular.h"
+#include "array.h"
+#include "text.h"
+#include "builtin.h"
+#include "function.h"
+#include "fail.h"
 
 #define INITIAL_STACK_CAPACITY 64
 #define STACK_GROWTH_FACTOR 2
 
+static Token big_arith(TokenType op, Token* t1, Token* t2);
+static Token pow_integers(Token* t1, Token* t2);
+static BigInt* to_big(Token* tok);
+static Token from_big(BigInt* value);
+
 char* tok_to_string[] = {
     "EOF",
 
     "sin",
     "cos",
     "tan",
+    "powmod",
+    "fma",
+    "dot",
+    "len",
+    "substr",
+    "str",
+    "num",
+    "rand",
+    "uniform",
+    "normal",
+    "native",
+    "if",
+
+    "sum",
+    "mean",
+    "min",
+    "max",
+    "count",
+    "var",
+
+    "solve",
+    "minimize",
+    "integrate",
+
+    "call",
+    "tuple",
+    "array",
+
+    "then",
+    "else",
+    "short_and",
+    "short_or",
+    "store",
+    "load",
 
     "+",
     "-",
@@ -21,11 +68,27 @@ char* tok_to_string[] = {
     "/",
     "%",
     "^",
+    "<",
+    "<=",
+    ">",
+    ">=",
+    "==",
+    "!=",
+    "&&",
+    "||",
 
     "(",
     ")",
+    "[",
+    "]",
     ",",
+    "=",
+    ";",
 
+    NULL,
+    NULL,
+    NULL,
+    NULL,
     NULL,
     NULL,
     NULL,
@@ -37,6 +100,8 @@ char* tok_to_string[] = {
 
 void print_token(Token* tok)
 {
+    char* text;
+
     /* Can never be too safe... */
     assert(sizeof(tok_to_string) / sizeof(tok_to_string[0]) == TOK_COUNT + 1);
 
@@ -47,11 +112,15 @@ void print_token(Token* tok)
     }
 
     switch (tok->type) {
-        case TOK_IDENTIFIER:
-        case TOK_STRING: {
+        case TOK_IDENTIFIER: {
             printf("%s\n", tok->as.string);
             break;
         }
+        case TOK_STRING:
+        case TOK_SHORT_STRING: {
+            printf("%s\n", string_bytes(tok));
+            break;
+        }
         case TOK_LONG: {
             printf("%ld\n", tok->as.i64);
             break;
@@ -60,6 +129,18 @@ void print_token(Token* tok)
             printf("%f\n", tok->as.f64);
             break;
         }
+        case TOK_BIGINT: {
+            text = big_to_string(tok->as.big);
+            printf("%s\n", text);
+            free(text);
+            break;
+        }
+        case TOK_ARRAY: {
+            text = array_to_string(tok->as.array);
+            printf("%s\n", text);
+            free(text);
+            break;
+        }
         default: {
             printf("Printing unimplemented.\n");
             break;
@@ -84,6 +165,22 @@ int get_precedence(Token* tok)
             return 4;
         }
 
+        case TOK_LT:
+        case TOK_LE:
+        case TOK_GT:
+        case TOK_GE:
+        case TOK_EQ:
+        case TOK_NE: {
+            return 1;
+        }
+
+        case TOK_AND: {
+            return 0;
+        }
+        case TOK_OR: {
+            return -1;
+        }
+
         default :{
             fprintf(stderr, "Precedence not set for token '%d'.\n", tok->type);
             exit(8);
@@ -98,7 +195,15 @@ int get_associativity(Token* tok)
         case TOK_SUB:
         case TOK_MUL:
         case TOK_DIV:
-        case TOK_MOD: {
+        case TOK_MOD:
+        case TOK_LT:
+        case TOK_LE:
+        case TOK_GT:
+        case TOK_GE:
+        case TOK_EQ:
+        case TOK_NE:
+        case TOK_AND:
+        case TOK_OR: {
             return ASS_LEFT;
         }
 
@@ -113,15 +218,93 @@ int get_associativity(Token* tok)
     }
 }
 
+/* How many values an instruction pops off the value stack */
+int get_arity(Token* tok)
+{
+    if (IS_OPERATOR(tok->type)) {
+        return 2;
+    }
+
+    /* Not counting the expression and variable, see 'lift_lambda()' */
+    if (tok->type == TOK_SOLVE) {
+        return 1;
+    }
+    if (tok->type == TOK_MINIMIZE || tok->type == TOK_INTEGRATE) {
+        return 2;
+    }
+
+    if (tok->type == TOK_POWMOD || tok->type == TOK_FMA || tok->type == TOK_IF || tok->type == TOK_SUBSTR) {
+        return 3;
+    }
+    if (tok->type == TOK_DOT || tok->type == TOK_UNIFORM || tok->type == TOK_NORMAL) {
+        return 2;
+    }
+    if (tok->type == TOK_RAND) {
+        return 0;
+    }
+    if (tok->type == TOK_NATIVE) {
+        return tok->as.native->arity;
+    }
+
+    /* As seen without jumping, see 'link_jumps()' */
+    if (IS_JUMP(tok->type)) {
+        return 1;
+    }
+
+    if (IS_FUNCTION(tok->type)) {
+        return 1;
+    }
+
+    if (tok->type == TOK_CALL) {
+        return tok->as.call->arity;
+    }
+    if (tok->type == TOK_TUPLE || tok->type == TOK_MAKE_ARRAY) {
+        return tok->as.i64;
+    }
+    if (tok->type == TOK_STORE) {
+        return 1;
+    }
+
+    return 0;
+}
+
 void scrub_token(Token* tok)
 {
     /* In case other tokens require custom free logic */
     switch (tok->type) {
-        case TOK_IDENTIFIER:
-        case TOK_STRING: {
+        case TOK_IDENTIFIER: {
             free(tok->as.string);   
             break;
         }
+        case TOK_STRING: {
+            release_text(tok->as.text);
+            break;
+        }
+        case TOK_SOLVE:
+        case TOK_MINIMIZE:
+        case TOK_INTEGRATE: {
+            if (tok->as.lambda != NULL) {
+                free(tok->as.lambda->param);
+                free_token_stack(tok->as.lambda->body);
+                free(tok->as.lambda);
+            }
+            break;
+        }
+        case TOK_BIGINT: {
+            free_big(tok->as.big);
+            break;
+        }
+        case TOK_ARRAY: {
+            release_array(tok->as.array);
+            break;
+        }
+        case TOK_CALL: {
+            if (tok->as.call != NULL) {
+                free(tok->as.call->name);
+                free(tok->as.call);
+            }
+            break;
+        }
         default: {
             break;
         }
@@ -131,6 +314,69 @@ void scrub_token(Token* tok)
     tok->as.string = NULL;
 }
 
+/* Tokens that own memory get their own copy of it */
+Token copy_token(Token* tok)
+{
+    Token output;
+
+    output = *tok;
+
+    switch (tok->type) {
+        case TOK_STRING: {
+            output.as.text = retain_text(tok->as.text);
+            break;
+        }
+        case TOK_IDENTIFIER: {
+            if ((output.as.string = malloc(strlen(tok->as.string) + 1)) == NULL) {
+                fprintf(stderr, "Failed to copy token.\n");
+                exit(5);
+            }
+            strcpy(output.as.string, tok->as.string);
+            break;
+        }
+        case TOK_SOLVE:
+        case TOK_MINIMIZE:
+        case TOK_INTEGRATE: {
+            if (tok->as.lambda == NULL) {
+                break;
+            }
+            if ((output.as.lambda = malloc(sizeof(Lambda))) == NULL
+                || (output.as.lambda->param = malloc(strlen(tok->as.lambda->param) + 1)) == NULL) {
+                fprintf(stderr, "Failed to copy token.\n");
+                exit(5);
+            }
+            strcpy(output.as.lambda->param, tok->as.lambda->param);
+            output.as.lambda->body = copy_token_stack(tok->as.lambda->body);
+            break;
+        }
+        case TOK_BIGINT: {
+            output.as.big = big_copy(tok->as.big);
+            break;
+        }
+        case TOK_ARRAY: {
+            /* Shared, see 'array_binary()' for who gets to write to it */
+            output.as.array = retain_array(tok->as.array);
+            break;
+        }
+        case TOK_CALL: {
+            if ((output.as.call = malloc(sizeof(Call))) == NULL
+                || (output.as.call->name = malloc(strlen(tok->as.call->name) + 1)) == NULL) {
+                fprintf(stderr, "Failed to copy token.\n");
+                exit(5);
+            }
+            strcpy(output.as.call->name, tok->as.call->name);
+            output.as.call->arity = tok->as.call->arity;
+            output.as.call->target = tok->as.call->target;
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+
+    return output;
+}
+
 TokenStack* alloc_token_stack()
 {
     TokenStack* output;
@@ -168,9 +414,12 @@ void free_token_stack(TokenStack* target)
 void push_token_stack(TokenStack* target, Token* item)
 {
     if (target->size >= target->capacity - 1) {
-        /* TODO: resize */
         Token* new_stack;
-        new_stack = realloc(target->base, target->capacity * STACK_GROWTH_FACTOR);
+        new_stack = realloc(target->base, sizeof(Token) * target->capacity * STACK_GROWTH_FACTOR);
+        if (new_stack == NULL) {
+            fprintf(stderr, "Failed to grow token stack.\n");
+            exit(6);
+        }
         target->base = new_stack;
         target->capacity *= STACK_GROWTH_FACTOR;
     }
@@ -197,16 +446,322 @@ void print_token_stack(TokenStack* target)
     }
 }
 
+TokenStack* copy_token_stack(TokenStack* target)
+{
+    TokenStack* output;
+    Token tok;
+    uint64_t i;
+
+    output = alloc_token_stack();
+    for (i = 0; i < target->size; i++) {
+        tok = copy_token(&target->base[i]);
+        push_token_stack(output, &tok);
+    }
+
+    return output;
+}
+
+/*
+    'call' is a higher order builtin about to be appended to 'program', whose
+    first two arguments are an expression and the variable it is a function of.
+    Both are moved out of 'program' into a Lambda on the call, so that the
+    expression only ever runs when the builtin decides to run it.
+*/
+void lift_lambda(TokenStack* program, Token* call)
+{
+    Lambda* lambda;
+    uint64_t rest;
+    uint64_t var;
+    uint64_t start;
+    uint64_t i;
+    int arity;
+
+    /* Skip over the plain arguments that come after the variable */
+    rest = program->size;
+    for (arity = get_arity(call); arity > 0; arity--) {
+        if (rest == 0) {
+            break;
+        }
+        rest = find_operand_start(program, rest - 1);
+    }
+
+    if (rest < 2 || program->base[rest - 1].type != TOK_IDENTIFIER) {
+        fprintf(stderr, "'%s' expects an expression and a variable.\n", tok_to_string[call->type]);
+        exit(30);
+    }
+
+    var = rest - 1;
+    start = find_operand_start(program, var - 1);
+
+    if ((lambda = malloc(sizeof(Lambda))) == NULL) {
+        fprintf(stderr, "Failed to allocate lambda.\n");
+        exit(5);
+    }
+    lambda->param = program->base[var].as.string;
+    lambda->body = alloc_token_stack();
+    for (i = start; i < var; i++) {
+        push_token_stack(lambda->body, &program->base[i]);
+    }
+
+    /* Close the gap, the tokens moved into the lambda are owned by it now */
+    for (i = rest; i < program->size; i++) {
+        program->base[start + (i - rest)] = program->base[i];
+    }
+    program->size -= rest - start;
+
+    call->as.lambda = lambda;
+}
+
+/* Does 'program' use any variable besides the 'bound' ones, looking inside lambdas too */
+bool has_free_variables(TokenStack* program, char** bound, uint32_t n_bound)
+{
+    char** inner;
+    uint64_t ip;
+    uint32_t i;
+    bool found;
+    Token* tok;
+
+    for (ip = 0; ip < program->size; ip++) {
+        tok = &program->base[ip];
+
+        if (tok->type == TOK_IDENTIFIER) {
+            for (i = 0; i < n_bound; i++) {
+                if (strcmp(bound[i], tok->as.string) == 0) {
+                    break;
+                }
+            }
+            if (i == n_bound) {
+                return true;
+            }
+        } else if (IS_HIGHER_ORDER(tok->type)) {
+            if ((inner = malloc(sizeof(char*) * (n_bound + 1))) == NULL) {
+                fprintf(stderr, "Failed to allocate scope.\n");
+                exit(5);
+            }
+            for (i = 0; i < n_bound; i++) {
+                inner[i] = bound[i];
+            }
+            inner[n_bound] = tok->as.lambda->param;
+
+            found = has_free_variables(tok->as.lambda->body, inner, n_bound + 1);
+            free(inner);
+            if (found) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+    rand() and friends, a native that isn't pure, or a call to a function that
+    uses either: a new value every time, never to be folded, shared or copied
+*/
+bool is_impure(Token* tok)
+{
+    return IS_RANDOM(tok->type) || (tok->type == TOK_NATIVE && !tok->as.native->pure)
+        || (tok->type == TOK_CALL && tok->as.call->target != NULL && tok->as.call->target->impure);
+}
+
+/* Does 'program' have anything impure, looking inside lambdas too */
+bool has_impure(TokenStack* program)
+{
+    uint64_t ip;
+    Token* tok;
+
+    for (ip = 0; ip < program->size; ip++) {
+        tok = &program->base[ip];
+
+        if (is_impure(tok)) {
+            return true;
+        }
+        if (IS_HIGHER_ORDER(tok->type) && tok->as.lambda != NULL && has_impure(tok->as.lambda->body)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+    Index of the first instruction of the subexpression that ends at 'end',
+    i.e. the range that computes the value 'program->base[end]' leaves behind.
+*/
+uint64_t find_operand_start(TokenStack* program, uint64_t end)
+{
+    int64_t needed;
+    uint64_t ip;
+
+    needed = 1;
+    ip = end;
+
+    for (;;) {
+        needed += get_arity(&program->base[ip]) - 1;
+        if (needed == 0 || ip == 0) {
+            break;
+        }
+        ip--;
+    }
+
+    assert(needed == 0);
+
+    return ip;
+}
+
+OperandSpan* find_operand_spans(TokenStack* program, uint64_t* left)
+{
+    OperandSpan* spans;
+    uint64_t* stack;
+    uint64_t sp;
+    uint64_t ip;
+    int arity;
+
+    spans = malloc(sizeof(OperandSpan) * (program->size + 1));
+    stack = malloc(sizeof(uint64_t) * (program->size + 1));
+    if (spans == NULL || stack == NULL) {
+        fprintf(stderr, "Failed to allocate operand spans.\n");
+        exit(5);
+    }
+
+    /* Operands are contiguous, so the first one's start is where the whole subexpression starts */
+    sp = 0;
+    for (ip = 0; ip < program->size; ip++) {
+        arity = get_arity(&program->base[ip]);
+        if ((uint64_t) arity > sp) {
+            free(spans);
+            free(stack);
+            return NULL;
+        }
+
+        sp -= arity;
+        spans[ip].arity = arity;
+        spans[ip].start = (arity > 0) ? spans[stack[sp]].start : ip;
+        stack[sp++] = ip;
+    }
+
+    free(stack);
+    *left = sp;
+
+    return spans;
+}
+
+uint64_t find_operand_end(OperandSpan* spans, uint64_t ip, int k)
+{
+    uint64_t end;
+    int i;
+
+    end = ip - 1;
+    for (i = spans[ip].arity - 1; i > k; i--) {
+        end = spans[end].start - 1;
+    }
+
+    return end;
+}
+
+uint32_t count_outputs(TokenStack* program)
+{
+    if (program->size > 0 && STACK_TOP(program).type == TOK_TUPLE) {
+        return STACK_TOP(program).as.i64;
+    }
+
+    return 1;
+}
+
+void link_jumps(TokenStack* program)
+{
+    uint64_t* open;
+    uint64_t n_open;
+    uint64_t ip;
+    Token* tok;
+    TokenType expected;
+
+    if ((open = malloc(sizeof(uint64_t) * (program->size + 1))) == NULL) {
+        fprintf(stderr, "Failed to allocate jump table.\n");
+        exit(5);
+    }
+    n_open = 0;
+
+    /*
+        Branches nest like parentheses: 'c then a else b if', 'a short_and b &&'
+        and 'a short_or b ||'. A jump is relative, 'ip' lands on the instruction
+        closing its branch and carries on from there.
+    */
+    for (ip = 0; ip < program->size; ip++) {
+        tok = &program->base[ip];
+
+        switch (tok->type) {
+            case TOK_THEN:
+            case TOK_SHORT_AND:
+            case TOK_SHORT_OR: {
+                open[n_open++] = ip;
+                break;
+            }
+            case TOK_ELSE:
+            case TOK_IF:
+            case TOK_AND:
+            case TOK_OR: {
+                expected = (tok->type == TOK_ELSE) ? TOK_THEN
+                    : (tok->type == TOK_IF) ? TOK_ELSE
+                    : (tok->type == TOK_AND) ? TOK_SHORT_AND : TOK_SHORT_OR;
+
+                if (n_open == 0 || program->base[open[n_open - 1]].type != expected) {
+                    fprintf(stderr, "Unbalanced '%s'.\n", tok_to_string[tok->type]);
+                    exit(33);
+                }
+                n_open--;
+                program->base[open[n_open]].as.i64 = ip - open[n_open];
+
+                if (tok->type == TOK_ELSE) {
+                    open[n_open++] = ip;
+                }
+                break;
+            }
+            case TOK_SOLVE:
+            case TOK_MINIMIZE:
+            case TOK_INTEGRATE: {
+                if (tok->as.lambda != NULL) {
+                    link_jumps(tok->as.lambda->body);
+                }
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+
+    if (n_open != 0) {
+        fprintf(stderr, "Unbalanced '%s'.\n", tok_to_string[program->base[open[n_open - 1]].type]);
+        exit(33);
+    }
+
+    free(open);
+}
+
 Token add_tokens(Token* t1, Token* t2)
 {
     Token output;
 
+    if (t1->type == TOK_ARRAY || t2->type == TOK_ARRAY) {
+        return array_binary(TOK_ADD, t1, t2);
+    }
+    if (IS_STRING(t1) || IS_STRING(t2)) {
+        return concat_strings(t1, t2);
+    }
+
     if (IS_NUMBER(t1) && IS_NUMBER(t2)) {
 
         if (t1->type == TOK_LONG && t2->type == TOK_LONG) {
 
             output.type = TOK_LONG;
-            output.as.i64 = t1->as.i64 + t2->as.i64;
+            if (__builtin_add_overflow(t1->as.i64, t2->as.i64, &output.as.i64)) {
+                output = big_arith(TOK_ADD, t1, t2);
+            }
+
+        } else if (IS_INTEGER(t1) && IS_INTEGER(t2)) {
+
+            output = big_arith(TOK_ADD, t1, t2);
 
         } else {
 
@@ -222,6 +777,10 @@ Token add_tokens(Token* t1, Token* t2)
                     output.as.f64 += t1->as.f64;
                     break;
                 }
+                case TOK_BIGINT: {
+                    output.as.f64 += big_to_double(t1->as.big);
+                    break;
+                }
                 default: {
                     fprintf(stderr, "'Oh poop' - Vector\n");
                     exit(1);
@@ -236,6 +795,10 @@ Token add_tokens(Token* t1, Token* t2)
                     output.as.f64 += t2->as.f64;
                     break;
                 }
+                case TOK_BIGINT: {
+                    output.as.f64 += big_to_double(t2->as.big);
+                    break;
+                }
                 default: {
                     fprintf(stderr, "'Oh poop' - Vector\n");
                     exit(1);
@@ -245,8 +808,7 @@ Token add_tokens(Token* t1, Token* t2)
         }
 
     } else {
-        fprintf(stderr, "Addition unimplemented.\n");
-        exit(9);
+        fail(9, "Addition unimplemented.");
     }
 
     return output;
@@ -256,12 +818,22 @@ Token sub_tokens(Token* t1, Token* t2)
 {
     Token output;
 
+    if (t1->type == TOK_ARRAY || t2->type == TOK_ARRAY) {
+        return array_binary(TOK_SUB, t1, t2);
+    }
+
     if (IS_NUMBER(t1) && IS_NUMBER(t2)) {
 
         if (t1->type == TOK_LONG && t2->type == TOK_LONG) {
 
             output.type = TOK_LONG;
-            output.as.i64 = t1->as.i64 - t2->as.i64;
+            if (__builtin_sub_overflow(t1->as.i64, t2->as.i64, &output.as.i64)) {
+                output = big_arith(TOK_SUB, t1, t2);
+            }
+
+        } else if (IS_INTEGER(t1) && IS_INTEGER(t2)) {
+
+            output = big_arith(TOK_SUB, t1, t2);
 
         } else {
 
@@ -277,6 +849,10 @@ Token sub_tokens(Token* t1, Token* t2)
                     output.as.f64 += t1->as.f64;
                     break;
                 }
+                case TOK_BIGINT: {
+                    output.as.f64 += big_to_double(t1->as.big);
+                    break;
+                }
                 default: {
                     fprintf(stderr, "'Oh poop' - Vector\n");
                     exit(1);
@@ -291,6 +867,10 @@ Token sub_tokens(Token* t1, Token* t2)
                     output.as.f64 -= t2->as.f64;
                     break;
                 }
+                case TOK_BIGINT: {
+                    output.as.f64 -= big_to_double(t2->as.big);
+                    break;
+                }
                 default: {
                     fprintf(stderr, "'Oh poop' - Vector\n");
                     exit(1);
@@ -300,8 +880,7 @@ Token sub_tokens(Token* t1, Token* t2)
         }
 
     } else {
-        fprintf(stderr, "Subtraction unimplemented.\n");
-        exit(9);
+        fail(9, "Subtraction unimplemented.");
     }
 
     return output;
@@ -311,12 +890,22 @@ Token mul_tokens(Token* t1, Token* t2)
 {
     Token output;
 
+    if (t1->type == TOK_ARRAY || t2->type == TOK_ARRAY) {
+        return array_binary(TOK_MUL, t1, t2);
+    }
+
     if (IS_NUMBER(t1) && IS_NUMBER(t2)) {
 
         if (t1->type == TOK_LONG && t2->type == TOK_LONG) {
 
             output.type = TOK_LONG;
-            output.as.i64 = t1->as.i64 * t2->as.i64;
+            if (__builtin_mul_overflow(t1->as.i64, t2->as.i64, &output.as.i64)) {
+                output = big_arith(TOK_MUL, t1, t2);
+            }
+
+        } else if (IS_INTEGER(t1) && IS_INTEGER(t2)) {
+
+            output = big_arith(TOK_MUL, t1, t2);
 
         } else {
 
@@ -332,6 +921,10 @@ Token mul_tokens(Token* t1, Token* t2)
                     output.as.f64 += t1->as.f64;
                     break;
                 }
+                case TOK_BIGINT: {
+                    output.as.f64 += big_to_double(t1->as.big);
+                    break;
+                }
                 default: {
                     fprintf(stderr, "'Oh poop' - Vector\n");
                     exit(1);
@@ -346,6 +939,10 @@ Token mul_tokens(Token* t1, Token* t2)
                     output.as.f64 *= t2->as.f64;
                     break;
                 }
+                case TOK_BIGINT: {
+                    output.as.f64 *= big_to_double(t2->as.big);
+                    break;
+                }
                 default: {
                     fprintf(stderr, "'Oh poop' - Vector\n");
                     exit(1);
@@ -355,8 +952,7 @@ Token mul_tokens(Token* t1, Token* t2)
         }
 
     } else {
-        fprintf(stderr, "Multiplication unimplemented.\n");
-        exit(9);
+        fail(9, "Multiplication unimplemented.");
     }
 
     return output;
@@ -366,12 +962,25 @@ Token div_tokens(Token* t1, Token* t2)
 {
     Token output;
 
+    if (t1->type == TOK_ARRAY || t2->type == TOK_ARRAY) {
+        return array_binary(TOK_DIV, t1, t2);
+    }
+
     if (IS_NUMBER(t1) && IS_NUMBER(t2)) {
 
         if (t1->type == TOK_LONG && t2->type == TOK_LONG) {
 
-            output.type = TOK_LONG;
-            output.as.i64 = t1->as.i64 / t2->as.i64;
+            /* Both of these trap */
+            if (t2->as.i64 == 0 || (t2->as.i64 == -1 && t1->as.i64 == INT64_MIN)) {
+                output = big_arith(TOK_DIV, t1, t2);
+            } else {
+                output.type = TOK_LONG;
+                output.as.i64 = t1->as.i64 / t2->as.i64;
+            }
+
+        } else if (IS_INTEGER(t1) && IS_INTEGER(t2)) {
+
+            output = big_arith(TOK_DIV, t1, t2);
 
         } else {
 
@@ -387,6 +996,10 @@ Token div_tokens(Token* t1, Token* t2)
                     output.as.f64 += t1->as.f64;
                     break;
                 }
+                case TOK_BIGINT: {
+                    output.as.f64 += big_to_double(t1->as.big);
+                    break;
+                }
                 default: {
                     fprintf(stderr, "'Oh poop' - Vector\n");
                     exit(1);
@@ -401,6 +1014,10 @@ Token div_tokens(Token* t1, Token* t2)
                     output.as.f64 /= t2->as.f64;
                     break;
                 }
+                case TOK_BIGINT: {
+                    output.as.f64 /= big_to_double(t2->as.big);
+                    break;
+                }
                 default: {
                     fprintf(stderr, "'Oh poop' - Vector\n");
                     exit(1);
@@ -410,8 +1027,7 @@ Token div_tokens(Token* t1, Token* t2)
         }
 
     } else {
-        fprintf(stderr, "Division unimplemented.\n");
-        exit(9);
+        fail(9, "Division unimplemented.");
     }
 
     return output;
@@ -420,13 +1036,27 @@ Token div_tokens(Token* t1, Token* t2)
 Token mod_tokens(Token* t1, Token* t2)
 {
     Token output;
+    int64_t divisor;
+
+    if (t1->type == TOK_ARRAY || t2->type == TOK_ARRAY) {
+        return array_binary(TOK_MOD, t1, t2);
+    }
 
     if (IS_NUMBER(t1) && IS_NUMBER(t2)) {
 
         if (t1->type == TOK_LONG && t2->type == TOK_LONG) {
 
-            output.type = TOK_LONG;
-            output.as.i64 = t1->as.i64 % t2->as.i64;
+            if (t2->as.i64 == 0 || t2->as.i64 == -1) {
+                output = big_arith(TOK_MOD, t1, t2);
+            } else {
+                output.type = TOK_LONG;
+                output.as.i64 = t1->as.i64 % t2->as.i64;
+            }
+
+        } else if (t1->type == TOK_BIGINT || t2->type == TOK_BIGINT) {
+
+            /* Doubles are truncated, like below */
+            output = big_arith(TOK_MOD, t1, t2);
 
         } else {
 
@@ -449,11 +1079,11 @@ Token mod_tokens(Token* t1, Token* t2)
             }
             switch(t2->type) {
                 case TOK_LONG: {
-                    output.as.i64 %= t2->as.i64;
+                    divisor = t2->as.i64;
                     break;
                 }
                 case TOK_DOUBLE: {
-                    output.as.i64 %= (int64_t) t2->as.f64;
+                    divisor = (int64_t) t2->as.f64;
                     break;
                 }
                 default: {
@@ -462,10 +1092,15 @@ Token mod_tokens(Token* t1, Token* t2)
                 }
             }
 
+            /* A double divisor below 1 truncates to 0, and INT64_MIN % -1 traps like a division */
+            if (divisor == 0) {
+                fail(9, "Division by zero.");
+            }
+            output.as.i64 = (divisor == -1) ? 0 : output.as.i64 % divisor;
+
         }
     } else {
-        fprintf(stderr, "Modulo unimplemented.\n");
-        exit(9);
+        fail(9, "Modulo unimplemented.");
     }
 
     return output;
@@ -475,12 +1110,15 @@ Token exp_tokens(Token* t1, Token* t2)
 {
     Token output;
 
+    if (t1->type == TOK_ARRAY || t2->type == TOK_ARRAY) {
+        return array_binary(TOK_EXP, t1, t2);
+    }
+
     if (IS_NUMBER(t1) && IS_NUMBER(t2)) {
 
-        if (t1->type == TOK_LONG && t2->type == TOK_LONG) {
+        if (IS_INTEGER(t1) && IS_INTEGER(t2)) {
 
-            output.type = TOK_LONG;
-            output.as.i64 = pow(t1->as.i64, t2->as.i64);
+            output = pow_integers(t1, t2);
 
         } else {
             output.type = TOK_DOUBLE;
@@ -495,6 +1133,10 @@ Token exp_tokens(Token* t1, Token* t2)
                     output.as.f64 += t1->as.f64;
                     break;
                 }
+                case TOK_BIGINT: {
+                    output.as.f64 += big_to_double(t1->as.big);
+                    break;
+                }
                 default: {
                     fprintf(stderr, "'Oh poop' - Vector\n");
                     exit(1);
@@ -509,6 +1151,10 @@ Token exp_tokens(Token* t1, Token* t2)
                     output.as.f64 = pow(output.as.f64, t2->as.f64);
                     break;
                 }
+                case TOK_BIGINT: {
+                    output.as.f64 = pow(output.as.f64, big_to_double(t2->as.big));
+                    break;
+                }
                 default: {
                     fprintf(stderr, "'Oh poop' - Vector\n");
                     exit(1);
@@ -517,8 +1163,7 @@ Token exp_tokens(Token* t1, Token* t2)
 
         }
     } else {
-        fprintf(stderr, "Exponent unimplemented.\n");
-        exit(9);
+        fail(9, "Exponent unimplemented.");
     }
 
     return output;
@@ -528,6 +1173,10 @@ Token sin_token(Token* t1)
 {
     Token output;
 
+    if (t1->type == TOK_ARRAY) {
+        return array_unary(TOK_SIN, t1);
+    }
+
     output.type = TOK_DOUBLE;
 
     switch (t1->type) {
@@ -539,10 +1188,13 @@ Token sin_token(Token* t1)
             output.as.f64 = sin(t1->as.f64);
             break;
         }
+        case TOK_BIGINT: {
+            output.as.f64 = sin(big_to_double(t1->as.big));
+            break;
+        }
 
         default: {
-            fprintf(stderr, "'sin' unimplemented.\n");
-            exit(12);
+            fail(12, "'sin' unimplemented.");
         }
     }
 
@@ -553,6 +1205,10 @@ Token cos_token(Token* t1)
 {
     Token output;
 
+    if (t1->type == TOK_ARRAY) {
+        return array_unary(TOK_COS, t1);
+    }
+
     output.type = TOK_DOUBLE;
 
     switch (t1->type) {
@@ -564,10 +1220,13 @@ Token cos_token(Token* t1)
             output.as.f64 = cos(t1->as.f64);
             break;
         }
+        case TOK_BIGINT: {
+            output.as.f64 = cos(big_to_double(t1->as.big));
+            break;
+        }
 
         default: {
-            fprintf(stderr, "'cos' unimplemented.\n");
-            exit(13);
+            fail(13, "'cos' unimplemented.");
         }
     }
 
@@ -578,6 +1237,10 @@ Token tan_token(Token* t1)
 {
     Token output;
 
+    if (t1->type == TOK_ARRAY) {
+        return array_unary(TOK_TAN, t1);
+    }
+
     output.type = TOK_DOUBLE;
 
     switch (t1->type) {
@@ -589,12 +1252,317 @@ Token tan_token(Token* t1)
             output.as.f64 = tan(t1->as.f64);
             break;
         }
+        case TOK_BIGINT: {
+            output.as.f64 = tan(big_to_double(t1->as.big));
+            break;
+        }
+
+        default: {
+            fail(14, "'tan' unimplemented.");
+        }
+    }
+
+    return output;
+}
+
+Token powmod_tokens(Token* t1, Token* t2, Token* t3)
+{
+    Token output;
+    Montgomery ctx;
+    BigInt* base;
+    BigInt* exponent;
+    BigInt* modulus;
+
+    if (!IS_NUMBER(t1) || !IS_NUMBER(t2) || !IS_NUMBER(t3)) {
+        fail(9, "powmod() unimplemented.");
+    }
+
+    if (t1->type == TOK_LONG && t2->type == TOK_LONG && t3->type == TOK_LONG) {
+        ctx.modulus = 0;
+        output.type = TOK_LONG;
+        output.as.i64 = powmod_i64(&ctx, t1->as.i64, t2->as.i64, t3->as.i64);
+        return output;
+    }
+
+    /* Doubles are truncated, like with '%' */
+    base = to_big(t1);
+    exponent = to_big(t2);
+    modulus = to_big(t3);
+    output = from_big(big_powmod(base, exponent, modulus));
+    free_big(base);
+    free_big(exponent);
+    free_big(modulus);
+
+    return output;
+}
+
+/* Integers stay exact, only doubles get the single rounding */
+Token fma_tokens(Token* t1, Token* t2, Token* t3)
+{
+    Token output;
+    Token product;
+
+    if (t1->type == TOK_ARRAY || t2->type == TOK_ARRAY || t3->type == TOK_ARRAY) {
+        return array_fma(t1, t2, t3);
+    }
+
+    if (!IS_NUMBER(t1) || !IS_NUMBER(t2) || !IS_NUMBER(t3)) {
+        fail(9, "fma() unimplemented.");
+    }
+
+    if (t1->type == TOK_DOUBLE || t2->type == TOK_DOUBLE || t3->type == TOK_DOUBLE) {
+        output.type = TOK_DOUBLE;
+        output.as.f64 = __builtin_fma(token_to_double(t1), token_to_double(t2), token_to_double(t3));
+        return output;
+    }
+
+    product = mul_tokens(t1, t2);
+    output = add_tokens(&product, t3);
+    scrub_token(&product);
+
+    return output;
+}
+
+Token compare_tokens(TokenType op, Token* t1, Token* t2)
+{
+    Token output;
+    BigInt* a;
+    BigInt* b;
+    double x;
+    double y;
+    int order;
+
+    if ((!IS_NUMBER(t1) || !IS_NUMBER(t2)) && (!IS_STRING(t1) || !IS_STRING(t2))) {
+        fail(9, "Comparison unimplemented.");
+    }
+
+    /* Strings compare bytewise, integers exactly, a double on either side makes it a double comparison */
+    if (IS_STRING(t1)) {
+        order = compare_strings(t1, t2);
+    } else if (t1->type == TOK_LONG && t2->type == TOK_LONG) {
+        order = (t1->as.i64 > t2->as.i64) - (t1->as.i64 < t2->as.i64);
+    } else if (IS_INTEGER(t1) && IS_INTEGER(t2)) {
+        a = to_big(t1);
+        b = to_big(t2);
+        order = big_compare(a, b);
+        free_big(a);
+        free_big(b);
+    } else {
+        x = token_to_double(t1);
+        y = token_to_double(t2);
+
+        /* Everything but '!=' is false next to a NaN */
+        if (x != x || y != y) {
+            output.type = TOK_LONG;
+            output.as.i64 = op == TOK_NE;
+            return output;
+        }
+        order = (x > y) - (x < y);
+    }
+
+    output.type = TOK_LONG;
+    switch (op) {
+        case TOK_LT: {
+            output.as.i64 = order < 0;
+            break;
+        }
+        case TOK_LE: {
+            output.as.i64 = order <= 0;
+            break;
+        }
+        case TOK_GT: {
+            output.as.i64 = order > 0;
+            break;
+        }
+        case TOK_GE: {
+            output.as.i64 = order >= 0;
+            break;
+        }
+        case TOK_EQ: {
+            output.as.i64 = order == 0;
+            break;
+        }
+        case TOK_NE: {
+            output.as.i64 = order != 0;
+            break;
+        }
+        default: {
+            fail(9, "'%s' is not a comparison.", tok_to_string[op]);
+        }
+    }
+
+    return output;
+}
 
+/* Anything but zero is true, like in C */
+bool token_is_true(Token* tok)
+{
+    switch (tok->type) {
+        case TOK_LONG: {
+            return tok->as.i64 != 0;
+        }
+        case TOK_DOUBLE: {
+            return tok->as.f64 != 0.0;
+        }
+        case TOK_BIGINT: {
+            /* Never zero, that would have been a TOK_LONG */
+            return true;
+        }
+        default: {
+            fail(9, "Not a number.");
+        }
+    }
+}
+double token_to_double(Token* tok)
+{
+    switch (tok->type) {
+        case TOK_LONG: {
+            return tok->as.i64;
+        }
+        case TOK_DOUBLE: {
+            return tok->as.f64;
+        }
+        case TOK_BIGINT: {
+            return big_to_double(tok->as.big);
+        }
         default: {
-            fprintf(stderr, "'tan' unimplemented.\n");
-            exit(14);
+            fail(9, "Not a number.");
         }
     }
+}
+
+/* Exact arithmetic for when int64_t overflows, or a big integer is involved */
+static Token big_arith(TokenType op, Token* t1, Token* t2)
+{
+    BigInt* a;
+    BigInt* b;
+    BigInt* result;
+
+    /* Before anything is allocated, a failure could leave it behind */
+    if ((op == TOK_DIV || op == TOK_MOD) && t2->type == TOK_LONG && t2->as.i64 == 0) {
+        fail(9, "Division by zero.");
+    }
+
+    a = to_big(t1);
+    b = to_big(t2);
+
+    switch (op) {
+        case TOK_ADD: {
+            result = big_add(a, b);
+            break;
+        }
+        case TOK_SUB: {
+            result = big_sub(a, b);
+            break;
+        }
+        case TOK_MUL: {
+            result = big_mul(a, b);
+            break;
+        }
+        case TOK_DIV: {
+            big_divmod(a, b, &result, NULL);
+            break;
+        }
+        case TOK_MOD: {
+            big_divmod(a, b, NULL, &result);
+            break;
+        }
+        default: {
+            fail(9, "No big integer version of '%s'.", tok_to_string[op]);
+        }
+    }
+
+    free_big(a);
+    free_big(b);
+
+    return from_big(result);
+}
+
+/*
+    Repeated squaring in int64_t, starting over with big integers at the first
+    overflow. Negative exponents still go through pow().
+*/
+static Token pow_integers(Token* t1, Token* t2)
+{
+    Token output;
+    BigInt* base;
+    int64_t square;
+    int64_t exponent;
+    bool overflow;
+
+    /* 0, 1 and -1 are the only bases whose powers stay put for huge exponents */
+    if (t2->type == TOK_BIGINT || t2->as.i64 < 0) {
+        output.type = TOK_LONG;
+        if (t1->type == TOK_LONG && (t1->as.i64 == 1 || t1->as.i64 == -1)) {
+            output.as.i64 = (t2->type == TOK_BIGINT)
+                ? ((t2->as.big->limbs[0] & 1) ? t1->as.i64 : 1)
+                : ((t2->as.i64 & 1) ? t1->as.i64 : 1);
+        } else if (t2->type == TOK_LONG || t2->as.big->negative) {
+            /* Anything else to a negative power is a fraction */
+            output.type = TOK_DOUBLE;
+            output.as.f64 = pow(token_to_double(t1), token_to_double(t2));
+        } else if (t1->type == TOK_LONG && t1->as.i64 == 0) {
+            output.as.i64 = 0;
+        } else {
+            fail(9, "Exponent too large.");
+        }
+        return output;
+    }
+    exponent = t2->as.i64;
+
+    overflow = t1->type == TOK_BIGINT;
+    if (!overflow) {
+        output.type = TOK_LONG;
+        output.as.i64 = 1;
+        square = t1->as.i64;
+
+        while (exponent > 0 && !overflow) {
+            if (exponent & 1) {
+                overflow = __builtin_mul_overflow(output.as.i64, square, &output.as.i64);
+            }
+            exponent >>= 1;
+            if (exponent > 0 && !overflow) {
+                overflow = __builtin_mul_overflow(square, square, &square);
+            }
+        }
+    }
+
+    if (overflow) {
+        base = to_big(t1);
+        output = from_big(big_pow(base, t2->as.i64));
+        free_big(base);
+    }
+
+    return output;
+}
+
+static BigInt* to_big(Token* tok)
+{
+    switch (tok->type) {
+        case TOK_LONG: {
+            return big_from_i64(tok->as.i64);
+        }
+        case TOK_BIGINT: {
+            return big_copy(tok->as.big);
+        }
+        default: {
+            return big_from_double(token_to_double(tok));
+        }
+    }
+}
+
+/* Results that fit go back to being a plain TOK_LONG */
+static Token from_big(BigInt* value)
+{
+    Token output;
+
+    if (big_to_i64(value, &output.as.i64)) {
+        output.type = TOK_LONG;
+        free_big(value);
+    } else {
+        output.type = TOK_BIGINT;
+        output.as.big = value;
+    }
 
     return output;
-}
\ No newline at end of file
+}
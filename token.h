@@ -2,13 +2,25 @@
 #define CALC_TOKEN_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /* Look at me, I know how to use the preprocessor */
 #define DEFAULT_TOKEN {TOK_EOF, {NULL}}
-#define IS_OPERATOR(type) (type >= TOK_ADD && type <= TOK_EXP)
+#define SHORT_STRING_MAX 15
+/* Longest thing '%f' can print for a double, plus change */
+#define MAX_FORMATTED_NUMBER 512
+#define IS_OPERATOR(type) (type >= TOK_ADD && type <= TOK_OR)
+#define IS_ARITHMETIC(type) (type >= TOK_ADD && type <= TOK_EXP)
+#define IS_COMPARISON(type) (type >= TOK_LT && type <= TOK_NE)
+#define IS_JUMP(type) (type >= TOK_THEN && type <= TOK_SHORT_OR)
 #define STACK_TOP(s) (s->base[s->size - 1])
-#define IS_NUMBER(t) (t->type == TOK_LONG || t->type == TOK_DOUBLE)
-#define IS_FUNCTION(type) (type >= TOK_SIN && type <= TOK_TAN)
+#define IS_NUMBER(t) (t->type == TOK_LONG || t->type == TOK_DOUBLE || t->type == TOK_BIGINT)
+#define IS_INTEGER(t) (t->type == TOK_LONG || t->type == TOK_BIGINT)
+#define IS_STRING(t) (t->type == TOK_STRING || t->type == TOK_SHORT_STRING)
+#define IS_FUNCTION(type) (type >= TOK_SIN && type <= TOK_INTEGRATE)
+#define IS_AGGREGATE(type) (type >= TOK_AGG_SUM && type <= TOK_AGG_VAR)
+#define IS_HIGHER_ORDER(type) (type >= TOK_SOLVE && type <= TOK_INTEGRATE)
+#define IS_RANDOM(type) (type >= TOK_RAND && type <= TOK_NORMAL)
 
 typedef enum {
     ASS_LEFT,
@@ -24,6 +36,73 @@ typedef enum {
     TOK_COS,
     TOK_TAN,
 
+    /* powmod(b, e, m), see modular.h */
+    TOK_POWMOD,
+
+    /* fma(a, b, c) is a*b + c rounded once, see poly.h */
+    TOK_FMA,
+
+    /* dot(a, b), the sum of the products of two arrays, see array.h */
+    TOK_DOT,
+
+    /* len(s), substr(s, start, count), str(x) and num(s), see text.h */
+    TOK_LEN,
+    TOK_SUBSTR,
+    TOK_STR,
+    TOK_NUM,
+
+    /* rand(), uniform(lo, hi) and normal(mu, sigma), a new value every time, see rng.h */
+    TOK_RAND,
+    TOK_UNIFORM,
+    TOK_NORMAL,
+
+    /* A C function from the registry, 'as.native' says which, see builtin.h */
+    TOK_NATIVE,
+
+    /* if(c, a, b), where it ends up in the program is the point both branches join */
+    TOK_IF,
+
+    /* Aggregates, reduce their argument over every row */
+    TOK_AGG_SUM,
+    TOK_AGG_MEAN,
+    TOK_AGG_MIN,
+    TOK_AGG_MAX,
+    TOK_AGG_COUNT,
+    TOK_AGG_VAR,
+
+    /* Take an expression and the variable it is a function of */
+    TOK_SOLVE,
+    TOK_MINIMIZE,
+    TOK_INTEGRATE,
+
+    /* A call to a user defined function, see function.h */
+    TOK_CALL,
+
+    /* Ends a program of several comma separated outputs, 'as.i64' of them */
+    TOK_TUPLE,
+
+    /* '[a, b, c]' with elements that aren't all constants, 'as.i64' of them */
+    TOK_MAKE_ARRAY,
+
+    /*
+        Jumps, emitted by the parser so that only one branch of an 'if()' and only
+        what is needed of '&&' and '||' runs, see 'link_jumps()'. To everything
+        that reads a program front to back without jumping they look like the
+        identity on their operand.
+    */
+    TOK_THEN,
+    TOK_ELSE,
+    TOK_SHORT_AND,
+    TOK_SHORT_OR,
+
+    /*
+        A value computed more than once, see cse.h. TOK_STORE keeps a copy of
+        its operand in slot 'as.i64' and leaves it on the stack, TOK_LOAD
+        pushes the copy again.
+    */
+    TOK_STORE,
+    TOK_LOAD,
+
     /* Operators */
     TOK_ADD,
     TOK_SUB,
@@ -32,16 +111,44 @@ typedef enum {
     TOK_MOD,
     TOK_EXP,
 
+    /* Comparisons and logic give a TOK_LONG that is 0 or 1 */
+    TOK_LT,
+    TOK_LE,
+    TOK_GT,
+    TOK_GE,
+    TOK_EQ,
+    TOK_NE,
+    TOK_AND,
+    TOK_OR,
+
     /* "Punctuation" */
     TOK_LPAR,
     TOK_RPAR,
+    TOK_LBRACKET,
+    TOK_RBRACKET,
     TOK_COMMA,
+    TOK_ASSIGN,
+    TOK_SEMICOLON,
 
     /* NB: Simple to print type must go above 'TOK_STRING' */
     /* Value types */
+    /* A reference counted string, see text.h */
     TOK_STRING,
+
+    /* A string of up to SHORT_STRING_MAX bytes, kept in the token itself */
+    TOK_SHORT_STRING,
+
     TOK_LONG,
     TOK_DOUBLE,
+
+    /* A single precision column, never a Token of its own, see column.h */
+    TOK_FLOAT,
+
+    /* What a TOK_LONG turns into when it overflows, see bigint.h */
+    TOK_BIGINT,
+
+    /* A reference counted array of numbers, see array.h */
+    TOK_ARRAY,
     
     TOK_IDENTIFIER,
 
@@ -49,6 +156,13 @@ typedef enum {
     TOK_COUNT
 } TokenType;
 
+struct Lambda;
+struct Call;
+struct BigInt;
+struct Array;
+struct Text;
+struct Native;
+
 typedef struct {
     TokenType type;
 
@@ -56,6 +170,13 @@ typedef struct {
         char* string;
         int64_t i64;
         double f64;
+        struct Lambda* lambda;
+        struct Call* call;
+        struct BigInt* big;
+        struct Array* array;
+        struct Text* text;
+        struct Native* native;
+        char small[SHORT_STRING_MAX + 1];
     } as;
 } Token;
 
@@ -66,16 +187,66 @@ typedef struct {
     Token* base;
 } TokenStack;
 
+/* The expression argument of a higher order builtin, as a function of 'param' */
+typedef struct Lambda {
+    char* param;
+    TokenStack* body;
+} Lambda;
+
+/* 'target' is filled in by 'link_program()' once every function is known */
+typedef struct Call {
+    char* name;
+    uint32_t arity;
+    struct Function* target;
+} Call;
+
+/* How every token type is spelled, for messages */
+extern char* tok_to_string[];
+
 void print_token(Token* tok);
 int get_precedence(Token* tok);
 int get_associativity(Token* tok);
+int get_arity(Token* tok);
 void scrub_token(Token* tok);
+Token copy_token(Token* tok);
 
 TokenStack* alloc_token_stack();
 void free_token_stack(TokenStack* target);
 void push_token_stack(TokenStack* target, Token* item);
 Token pop_token_stack(TokenStack* target);
 void print_token_stack(TokenStack* target);
+TokenStack* copy_token_stack(TokenStack* target);
+void lift_lambda(TokenStack* program, Token* call);
+bool has_free_variables(TokenStack* program, char** bound, uint32_t n_bound);
+bool is_impure(Token* tok);
+bool has_impure(TokenStack* program);
+uint64_t find_operand_start(TokenStack* program, uint64_t end);
+
+/* The subexpression an instruction ends: where it starts and how many operands it takes */
+typedef struct {
+    uint64_t start;
+    int arity;
+} OperandSpan;
+
+/*
+    The OperandSpan of every instruction of 'program' in one pass, so that a
+    pass over the program can walk its operands without searching for them.
+    NULL if some instruction takes more operands than there are, otherwise
+    '*left' is how many values are left at the end.
+*/
+OperandSpan* find_operand_spans(TokenStack* program, uint64_t* left);
+
+/* Where the k-th operand of the instruction at 'ip' ends */
+uint64_t find_operand_end(OperandSpan* spans, uint64_t ip, int k);
+
+/* How many values 'program' leaves behind, see TOK_TUPLE */
+uint32_t count_outputs(TokenStack* program);
+
+/*
+    Points every jump in 'program' and its lambdas at the end of its branch.
+    Anything that adds or removes instructions calls this again afterwards.
+*/
+void link_jumps(TokenStack* program);
 
 Token add_tokens(Token* t1, Token* t2);
 Token sub_tokens(Token* t1, Token* t2);
@@ -86,5 +257,12 @@ Token exp_tokens(Token* t1, Token* t2);
 Token sin_token(Token* t1);
 Token cos_token(Token* t1);
 Token tan_token(Token* t1);
+Token powmod_tokens(Token* t1, Token* t2, Token* t3);
+Token fma_tokens(Token* t1, Token* t2, Token* t3);
+Token compare_tokens(TokenType op, Token* t1, Token* t2);
+bool token_is_true(Token* tok);
+
+/* Any number as a double, rounding big integers */
+double token_to_double(Token* tok);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,748 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "vmath.h"
+#include "modular.h"
+#include "fail.h"
+
+/*
+    The loops below are written to be branch free so that gcc can vectorize them.
+    On x86-64 every kernel is compiled three times (SSE2, AVX2, AVX-512) and the
+    right clone is picked at load time by the dynamic linker.
+*/
+#if defined(__GNUC__) && defined(__x86_64__) && !defined(__clang__)
+#define VMATH_DISPATCH __attribute__((target_clones("avx512f", "avx2", "default")))
+#define VMATH_FMA_DISPATCH __attribute__((target_clones("avx512f", "arch=haswell", "default")))
+#else
+#define VMATH_DISPATCH
+#define VMATH_FMA_DISPATCH
+#endif
+
+/* 1.5 * 2^52, adding and subtracting it rounds a double to the nearest integer */
+#define ROUND_MAGIC 6755399441055744.0
+
+#define INV_PIO2 6.36619772367581382433e-01
+
+/* pi/2 split into three 33 bit pieces, so 'k * PIO2_n' is exact for |k| < 2^20 */
+#define PIO2_1 1.57079632673412561417e+00
+#define PIO2_2 6.07710050630396597660e-11
+#define PIO2_3 2.02226624871116645580e-21
+
+/* fdlibm __kernel_sin / __kernel_cos minimax coefficients for [-pi/4, pi/4] */
+#define S1 -1.66666666666666324348e-01
+#define S2  8.33333333332248946124e-03
+#define S3 -1.98412698298579493134e-04
+#define S4  2.75573137070700676789e-06
+#define S5 -2.50507602534068634195e-08
+#define S6  1.58969099521155010221e-10
+
+#define C1  4.16666666666666019037e-02
+#define C2 -1.38888888888741095749e-03
+#define C3  2.48015872894767294178e-05
+#define C4 -2.75573143513906633035e-07
+#define C5  2.08757232129817482790e-09
+#define C6 -1.13596475577881948265e-11
+
+/* Cephes sinf / cosf coefficients for [-pi/4, pi/4] */
+#define S1_F32 -1.6666654611e-1f
+#define S2_F32  8.3321608736e-3f
+#define S3_F32 -1.9515295891e-4f
+
+#define C1_F32  4.166664568298827e-2f
+#define C2_F32 -1.388731625493765e-3f
+#define C3_F32  2.443315711809948e-5f
+
+/*
+    NOTE: these have to be macros rather than static functions, gcc refuses to
+    inline a default-target function into the avx2/avx512 clones.
+*/
+
+/* r = x - k*pi/2 with k the nearest integer to x*2/pi */
+#define REDUCE(x, k, r) \
+    k = ((x) * INV_PIO2 + ROUND_MAGIC) - ROUND_MAGIC; \
+    r = (x) - k * PIO2_1; \
+    r = r - k * PIO2_2; \
+    r = r - k * PIO2_3
+
+#define KERNEL_SIN(r, z, out) \
+    z = (r) * (r); \
+    out = (r) + z * (r) * (S1 + z * (S2 + z * (S3 + z * (S4 + z * (S5 + z * S6)))))
+
+/* 'hz' and 'w' are fdlibm's trick to recover the bits lost in '1 - z/2' */
+#define KERNEL_COS(r, z, hz, w, out) \
+    z = (r) * (r); \
+    hz = 0.5 * z; \
+    w = 1.0 - hz; \
+    out = w + (((1.0 - w) - hz) + z * z * (C1 + z * (C2 + z * (C3 + z * (C4 + z * (C5 + z * C6))))))
+
+/*
+    Float pieces of pi/2 lose the reduced argument near the zeros, so floats
+    are reduced in double, which is exact, and only the polynomials are float
+*/
+#define REDUCE_F32(x, k, r) \
+    REDUCE((double) (x), k, wide); \
+    r = wide
+
+#define KERNEL_SIN_F32(r, z, out) \
+    z = (r) * (r); \
+    out = (r) + z * (r) * (S1_F32 + z * (S2_F32 + z * S3_F32))
+
+#define KERNEL_COS_F32(r, z, out) \
+    z = (r) * (r); \
+    out = 1.0f - 0.5f * z + z * z * (C1_F32 + z * (C2_F32 + z * C3_F32))
+
+static int in_reduce_range(double* in, uint64_t n);
+static int in_reduce_range_f32(float* in, uint64_t n);
+
+VMATH_DISPATCH
+void vec_sin(double* out, double* in, uint64_t n)
+{
+    uint64_t i;
+    double q, r, z, hz, w, s, c, odd, sign;
+
+    if (!in_reduce_range(in, n)) {
+        for (i = 0; i < n; i++) {
+            out[i] = sin(in[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        REDUCE(in[i], q, r);
+        KERNEL_SIN(r, z, s);
+        KERNEL_COS(r, z, hz, w, c);
+
+        odd = (double) ((int32_t) q & 1);
+        sign = 1.0 - (double) ((int32_t) q & 2);
+
+        /* Exact blend, one of the two products is always zero */
+        out[i] = sign * (s * (1.0 - odd) + c * odd);
+    }
+}
+
+VMATH_DISPATCH
+void vec_cos(double* out, double* in, uint64_t n)
+{
+    uint64_t i;
+    double q, r, z, hz, w, s, c, odd, sign;
+
+    if (!in_reduce_range(in, n)) {
+        for (i = 0; i < n; i++) {
+            out[i] = cos(in[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        /* cos(x) = sin(x + pi/2), i.e. the same kernels one quadrant along */
+        REDUCE(in[i], q, r);
+        KERNEL_SIN(r, z, s);
+        KERNEL_COS(r, z, hz, w, c);
+
+        odd = (double) ((int32_t) q & 1);
+        sign = 1.0 - (double) (((int32_t) q + 1) & 2);
+
+        out[i] = sign * (c * (1.0 - odd) + s * odd);
+    }
+}
+
+VMATH_DISPATCH
+void vec_tan(double* out, double* in, uint64_t n)
+{
+    uint64_t i;
+    double q, r, z, hz, w, s, c, odd;
+
+    if (!in_reduce_range(in, n)) {
+        for (i = 0; i < n; i++) {
+            out[i] = tan(in[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        /* tan(r + k*pi/2) is tan(r) for even k and -1/tan(r) for odd k */
+        REDUCE(in[i], q, r);
+        KERNEL_SIN(r, z, s);
+        KERNEL_COS(r, z, hz, w, c);
+
+        odd = (double) ((int32_t) q & 1);
+
+        out[i] = (s * (1.0 - odd) - c * odd) / (c * (1.0 - odd) + s * odd);
+    }
+}
+
+VMATH_DISPATCH
+void vec_add_f64(double* out, double* a, double* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+/* 'avx2' alone has no FMA instructions, Haswell is the first with both */
+VMATH_FMA_DISPATCH
+void vec_fma_f64(double* out, double* a, double* b, double* c, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = __builtin_fma(a[i], b[i], c[i]);
+    }
+}
+
+VMATH_DISPATCH
+void vec_sub_f64(double* out, double* a, double* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] - b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_mul_f64(double* out, double* a, double* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] * b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_div_f64(double* out, double* a, double* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] / b[i];
+    }
+}
+
+void vec_pow_f64(double* out, double* a, double* b, uint64_t n)
+{
+    uint64_t i;
+
+    /* No vector pow, but at least we don't pay for a Token per element */
+    for (i = 0; i < n; i++) {
+        out[i] = pow(a[i], b[i]);
+    }
+}
+
+/* In unsigned arithmetic like 'vec_pow_i64()', so a lane that overflows wraps rather than being undefined */
+VMATH_DISPATCH
+void vec_add_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (int64_t) ((uint64_t) a[i] + (uint64_t) b[i]);
+    }
+}
+
+VMATH_DISPATCH
+void vec_sub_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (int64_t) ((uint64_t) a[i] - (uint64_t) b[i]);
+    }
+}
+
+VMATH_DISPATCH
+void vec_fma_i64(int64_t* out, int64_t* a, int64_t* b, int64_t* c, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (int64_t) ((uint64_t) a[i] * (uint64_t) b[i] + (uint64_t) c[i]);
+    }
+}
+
+VMATH_DISPATCH
+void vec_mul_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (int64_t) ((uint64_t) a[i] * (uint64_t) b[i]);
+    }
+}
+
+/* Both trapping cases are checked first, like 'div_tokens()' */
+void vec_div_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        if (b[i] == 0) {
+            fail(9, "Division by zero.");
+        }
+        out[i] = (b[i] == -1) ? (int64_t) (0 - (uint64_t) a[i]) : a[i] / b[i];
+    }
+}
+
+void vec_mod_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        if (b[i] == 0) {
+            fail(9, "Division by zero.");
+        }
+        out[i] = (b[i] == -1) ? 0 : a[i] % b[i];
+    }
+}
+
+void vec_pow_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+    uint64_t result;
+    uint64_t square;
+    int64_t exponent;
+
+    /*
+        Squaring in unsigned arithmetic, so a lane that overflows wraps like
+        '*' does. Only 1 and -1 may have a negative exponent, callers give
+        anything else a double result instead.
+    */
+    for (i = 0; i < n; i++) {
+        exponent = b[i];
+        if (exponent < 0) {
+            out[i] = (exponent & 1) ? a[i] : 1;
+            continue;
+        }
+
+        result = 1;
+        square = a[i];
+        while (exponent > 0) {
+            if (exponent & 1) {
+                result *= square;
+            }
+            exponent >>= 1;
+            square *= square;
+        }
+        out[i] = result;
+    }
+}
+
+void vec_powmod_i64(int64_t* out, int64_t* b, int64_t* e, int64_t* m, uint64_t n)
+{
+    Montgomery ctx;
+    uint64_t i;
+
+    /* Usually the modulus is a constant, so the context is set up once per tile */
+    ctx.modulus = 0;
+    for (i = 0; i < n; i++) {
+        out[i] = powmod_i64(&ctx, b[i], e[i], m[i]);
+    }
+}
+
+VMATH_DISPATCH
+void vec_lt_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] < b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_le_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] <= b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_eq_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] == b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_ne_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] != b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_lt_f64(int64_t* out, double* a, double* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] < b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_le_f64(int64_t* out, double* a, double* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] <= b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_eq_f64(int64_t* out, double* a, double* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] == b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_ne_f64(int64_t* out, double* a, double* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] != b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_and_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (a[i] != 0) & (b[i] != 0);
+    }
+}
+
+VMATH_DISPATCH
+void vec_or_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (a[i] != 0) | (b[i] != 0);
+    }
+}
+
+VMATH_DISPATCH
+void vec_truth_f64(int64_t* out, double* in, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = in[i] != 0.0;
+    }
+}
+
+/* Both sides are already computed, this only picks, so it stays branch free */
+VMATH_DISPATCH
+void vec_select_i64(int64_t* out, int64_t* cond, int64_t* a, int64_t* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (cond[i] != 0) ? a[i] : b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_select_f64(double* out, int64_t* cond, double* a, double* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (cond[i] != 0) ? a[i] : b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_i64_to_f64(double* out, int64_t* in, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = in[i];
+    }
+}
+
+void vec_f64_to_i64(int64_t* out, double* in, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = in[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_sin_f32(float* out, float* in, uint64_t n)
+{
+    uint64_t i;
+    double q, wide;
+    float r, z, s, c, odd, sign;
+
+    if (!in_reduce_range_f32(in, n)) {
+        for (i = 0; i < n; i++) {
+            out[i] = sin(in[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        REDUCE_F32(in[i], q, r);
+        KERNEL_SIN_F32(r, z, s);
+        KERNEL_COS_F32(r, z, c);
+
+        odd = (float) ((int32_t) q & 1);
+        sign = 1.0f - (float) ((int32_t) q & 2);
+
+        out[i] = sign * (s * (1.0f - odd) + c * odd);
+    }
+}
+
+VMATH_DISPATCH
+void vec_cos_f32(float* out, float* in, uint64_t n)
+{
+    uint64_t i;
+    double q, wide;
+    float r, z, s, c, odd, sign;
+
+    if (!in_reduce_range_f32(in, n)) {
+        for (i = 0; i < n; i++) {
+            out[i] = cos(in[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        REDUCE_F32(in[i], q, r);
+        KERNEL_SIN_F32(r, z, s);
+        KERNEL_COS_F32(r, z, c);
+
+        odd = (float) ((int32_t) q & 1);
+        sign = 1.0f - (float) (((int32_t) q + 1) & 2);
+
+        out[i] = sign * (c * (1.0f - odd) + s * odd);
+    }
+}
+
+VMATH_DISPATCH
+void vec_tan_f32(float* out, float* in, uint64_t n)
+{
+    uint64_t i;
+    double q, wide;
+    float r, z, s, c, odd;
+
+    if (!in_reduce_range_f32(in, n)) {
+        for (i = 0; i < n; i++) {
+            out[i] = tan(in[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        REDUCE_F32(in[i], q, r);
+        KERNEL_SIN_F32(r, z, s);
+        KERNEL_COS_F32(r, z, c);
+
+        odd = (float) ((int32_t) q & 1);
+
+        out[i] = (s * (1.0f - odd) - c * odd) / (c * (1.0f - odd) + s * odd);
+    }
+}
+
+VMATH_DISPATCH
+void vec_add_f32(float* out, float* a, float* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] + b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_sub_f32(float* out, float* a, float* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] - b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_mul_f32(float* out, float* a, float* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] * b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_div_f32(float* out, float* a, float* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] / b[i];
+    }
+}
+
+void vec_pow_f32(float* out, float* a, float* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = pow(a[i], b[i]);
+    }
+}
+
+VMATH_FMA_DISPATCH
+void vec_fma_f32(float* out, float* a, float* b, float* c, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = __builtin_fmaf(a[i], b[i], c[i]);
+    }
+}
+
+VMATH_DISPATCH
+void vec_lt_f32(int64_t* out, float* a, float* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] < b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_le_f32(int64_t* out, float* a, float* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] <= b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_eq_f32(int64_t* out, float* a, float* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] == b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_ne_f32(int64_t* out, float* a, float* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = a[i] != b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_truth_f32(int64_t* out, float* in, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = in[i] != 0.0f;
+    }
+}
+
+VMATH_DISPATCH
+void vec_select_f32(float* out, int64_t* cond, float* a, float* b, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = (cond[i] != 0) ? a[i] : b[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_i64_to_f32(float* out, int64_t* in, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = in[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_f32_to_f64(double* out, float* in, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = in[i];
+    }
+}
+
+VMATH_DISPATCH
+void vec_f64_to_f32(float* out, double* in, uint64_t n)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++) {
+        out[i] = in[i];
+    }
+}
+
+static int in_reduce_range(double* in, uint64_t n)
+{
+    uint64_t i;
+    uint64_t outside;
+
+    /* NOTE: nan compares false, so it lands in 'outside' as well */
+    outside = 0;
+    for (i = 0; i < n; i++) {
+        outside += !(fabs(in[i]) <= VMATH_REDUCE_LIMIT);
+    }
+
+    return outside == 0;
+}
+
+static int in_reduce_range_f32(float* in, uint64_t n)
+{
+    uint64_t i;
+    uint64_t outside;
+
+    outside = 0;
+    for (i = 0; i < n; i++) {
+        outside += !(in[i] <= VMATH_REDUCE_LIMIT && in[i] >= -VMATH_REDUCE_LIMIT);
+    }
+
+    return outside == 0;
+}
@@ -0,0 +1,104 @@
+#ifndef CALC_VMATH_H
+#define CALC_VMATH_H
+
+#include <stdint.h>
+
+/*
+    Array kernels used by the column evaluator.
+
+    sin/cos/tan use a Cody-Waite reduction by pi/2 followed by the fdlibm
+    minimax polynomials on [-pi/4, pi/4]. Inputs with |x| > VMATH_REDUCE_LIMIT
+    (or inf/nan) make the whole call fall back to libm, so results are always
+    defined. Measured against glibc over 2^24 points of [-2^20, 2^20] (see
+    accuracy.h):
+
+        sin, cos: max error 2 ulp (1 ulp for |x| < 4)
+        tan:      max error 4 ulp
+
+    Every kernel is safe to call with 'out' aliasing an input.
+*/
+
+#define VMATH_REDUCE_LIMIT 1048576.0
+
+/*
+    The _f32 kernels do the same in single precision for the column
+    evaluator's float mode, twice as many lanes per vector. sin/cos/tan
+    reduce in double and evaluate the Cephes sinf/cosf polynomials in float,
+    with the same limit. Measured on the same points against glibc's double
+    results rounded to float:
+
+        sin, cos: max error 2 ulp (float)
+        tan:      max error 4 ulp (float)
+*/
+
+void vec_sin(double* out, double* in, uint64_t n);
+void vec_cos(double* out, double* in, uint64_t n);
+void vec_tan(double* out, double* in, uint64_t n);
+
+void vec_add_f64(double* out, double* a, double* b, uint64_t n);
+void vec_sub_f64(double* out, double* a, double* b, uint64_t n);
+void vec_mul_f64(double* out, double* a, double* b, uint64_t n);
+void vec_div_f64(double* out, double* a, double* b, uint64_t n);
+void vec_pow_f64(double* out, double* a, double* b, uint64_t n);
+
+/* out[i] = a[i]*b[i] + c[i], rounded once */
+void vec_fma_f64(double* out, double* a, double* b, double* c, uint64_t n);
+
+/* These wrap on overflow */
+void vec_add_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+void vec_sub_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+void vec_mul_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+
+/* A zero divisor exits with "Division by zero.", INT64_MIN / -1 wraps */
+void vec_div_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+void vec_mod_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+
+/* b[i] must not be negative unless a[i] is 1 or -1, their powers are the only integers */
+void vec_pow_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+void vec_fma_i64(int64_t* out, int64_t* a, int64_t* b, int64_t* c, uint64_t n);
+void vec_powmod_i64(int64_t* out, int64_t* b, int64_t* e, int64_t* m, uint64_t n);
+
+/* Comparisons and logic write 0 or 1, 'a > b' is 'vec_lt(b, a)' */
+void vec_lt_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+void vec_le_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+void vec_eq_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+void vec_ne_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+void vec_lt_f64(int64_t* out, double* a, double* b, uint64_t n);
+void vec_le_f64(int64_t* out, double* a, double* b, uint64_t n);
+void vec_eq_f64(int64_t* out, double* a, double* b, uint64_t n);
+void vec_ne_f64(int64_t* out, double* a, double* b, uint64_t n);
+void vec_and_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+void vec_or_i64(int64_t* out, int64_t* a, int64_t* b, uint64_t n);
+void vec_truth_f64(int64_t* out, double* in, uint64_t n);
+
+/* out[i] = cond[i] ? a[i] : b[i] */
+void vec_select_i64(int64_t* out, int64_t* cond, int64_t* a, int64_t* b, uint64_t n);
+void vec_select_f64(double* out, int64_t* cond, double* a, double* b, uint64_t n);
+
+void vec_i64_to_f64(double* out, int64_t* in, uint64_t n);
+void vec_f64_to_i64(int64_t* out, double* in, uint64_t n);
+
+void vec_sin_f32(float* out, float* in, uint64_t n);
+void vec_cos_f32(float* out, float* in, uint64_t n);
+void vec_tan_f32(float* out, float* in, uint64_t n);
+
+void vec_add_f32(float* out, float* a, float* b, uint64_t n);
+void vec_sub_f32(float* out, float* a, float* b, uint64_t n);
+void vec_mul_f32(float* out, float* a, float* b, uint64_t n);
+void vec_div_f32(float* out, float* a, float* b, uint64_t n);
+void vec_pow_f32(float* out, float* a, float* b, uint64_t n);
+void vec_fma_f32(float* out, float* a, float* b, float* c, uint64_t n);
+
+void vec_lt_f32(int64_t* out, float* a, float* b, uint64_t n);
+void vec_le_f32(int64_t* out, float* a, float* b, uint64_t n);
+void vec_eq_f32(int64_t* out, float* a, float* b, uint64_t n);
+void vec_ne_f32(int64_t* out, float* a, float* b, uint64_t n);
+void vec_truth_f32(int64_t* out, float* in, uint64_t n);
+void vec_select_f32(float* out, int64_t* cond, float* a, float* b, uint64_t n);
+
+/* Widening and narrowing can't be done in place, the element sizes differ */
+void vec_i64_to_f32(float* out, int64_t* in, uint64_t n);
+void vec_f32_to_f64(double* out, float* in, uint64_t n);
+void vec_f64_to_f32(float* out, double* in, uint64_t n);
+
+#endif